@@ -4,14 +4,52 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <cerrno>
 #include <algorithm>
 #include <iomanip>
 #include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <unordered_map>
 #include <curl/curl.h>
+#include <zlib.h>
 
 static const size_t CHUNK_SIZE = 90ull * 1024 * 1024; // 90 MB
 
@@ -22,10 +60,104 @@ size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* out
     return total_size;
 }
 
-static long get_content_length(const std::string &path) {
-    struct stat st;
-    if (stat(path.c_str(), &st) == 0) return (long)st.st_size;
-    return -1;
+static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, std::string* headers) {
+    headers->append(buffer, size * nitems);
+    return size * nitems;
+}
+
+// value of response header `name` (lowercase) from raw header lines, or empty
+static std::string header_value(const std::string &headers, const std::string &name) {
+    std::string lower = headers;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c){ return (char)std::tolower(c); });
+    size_t p = lower.rfind("\n" + name + ":");
+    if (p == std::string::npos) return "";
+    p += name.size() + 2;
+    size_t end = headers.find_first_of("\r\n", p);
+    std::string v = headers.substr(p, end == std::string::npos ? std::string::npos : end - p);
+    v.erase(0, v.find_first_not_of(" \t"));
+    return v;
+}
+
+static bool write_all(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        data += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+// value of the string field "key" in a small JSON reply, or empty
+static std::string json_string_field(const std::string &json, const std::string &key) {
+    size_t p = json.find("\"" + key + "\"");
+    if (p == std::string::npos) return "";
+    size_t colon = json.find(":", p);
+    if (colon == std::string::npos) return "";
+    size_t q1 = json.find_first_not_of(" \t", colon + 1);
+    if (q1 == std::string::npos || json[q1] != '"') return "";
+    size_t q2 = json.find("\"", q1 + 1);
+    if (q2 == std::string::npos) return "";
+    return json.substr(q1 + 1, q2 - q1 - 1);
+}
+
+// value of the integer field "key" in a small JSON reply, or -1
+static long long json_int_field(const std::string &json, const std::string &key) {
+    size_t p = json.find("\"" + key + "\"");
+    if (p == std::string::npos) return -1;
+    size_t colon = json.find(":", p);
+    if (colon == std::string::npos) return -1;
+    const char* start = json.c_str() + colon + 1;
+    char* end = nullptr;
+    long long v = strtoll(start, &end, 10);
+    return end == start ? -1 : v;
+}
+
+// s as a JSON string literal
+static std::string json_quote(const std::string &s) {
+    std::string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += (char)c;
+        }
+    }
+    return out + "\"";
+}
+
+// pulls the string elements of the array under "key" out of a small JSON reply
+static std::vector<std::string> json_string_list(const std::string &json, const std::string &key) {
+    std::vector<std::string> out;
+    size_t k = json.find("\"" + key + "\"");
+    if (k == std::string::npos) return out;
+    size_t lb = json.find("[", k), rb = json.find("]", k);
+    if (lb == std::string::npos || rb == std::string::npos || rb < lb) return out;
+    size_t pos = lb;
+    while (true) {
+        size_t q1 = json.find("\"", pos + 1);
+        if (q1 == std::string::npos || q1 > rb) break;
+        size_t q2 = json.find("\"", q1 + 1);
+        if (q2 == std::string::npos || q2 > rb) break;
+        out.push_back(json.substr(q1 + 1, q2 - q1 - 1));
+        pos = q2;
+    }
+    return out;
+}
+
+static uint64_t fnv1a64(const std::string &s) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
 }
 
 static std::string credentials_path() {
@@ -78,12 +210,19 @@ static bool load_server_url(std::string &url_out) {
     return true;
 }
 
-static bool save_credentials(const std::string &username, const std::string &password) {
+// session token from `login`, sent as a Bearer token in place of a password;
+// per thread, since agent jobs each load their own credentials
+static thread_local std::string g_session_token;
+
+// the credentials file holds "username\npassword\n", or "username\n\ntoken\n"
+// once login has traded the password for a session token
+static bool save_credentials(const std::string &username, const std::string &password, const std::string &token = "") {
     std::string path = credentials_path();
     std::string tmp = path + ".tmp";
     std::ofstream out(tmp, std::ios::trunc);
     if (!out) return false;
     out << username << "\n" << password << "\n";
+    if (!token.empty()) out << token << "\n";
     out.close();
     if (rename(tmp.c_str(), path.c_str()) != 0) {
         unlink(tmp.c_str());
@@ -99,6 +238,7 @@ static bool load_credentials(std::string &username, std::string &password) {
     if (!in) return false;
     if (!std::getline(in, username)) return false;
     if (!std::getline(in, password)) return false;
+    if (password.empty() && !std::getline(in, g_session_token)) return false;
     return true;
 }
 
@@ -107,357 +247,3060 @@ static bool clear_credentials() {
     return unlink(path.c_str()) == 0 || errno == ENOENT;
 }
 
-// ---------------- Server endpoint builder ----------------
-static std::string g_base_url = "http://10.0.1.128:5001"; // default
+// local "YYYY-MM-DD HH:MM:SS" for a unix timestamp
+static std::string format_time(long long t) {
+    time_t tt = (time_t)t;
+    struct tm tm;
+    char buf[32];
+    if (!localtime_r(&tt, &tm) || !strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm)) return std::to_string(t);
+    return buf;
+}
 
-static std::string endpoint(const std::string &path) {
-    if (g_base_url.empty()) return path;
-    if (g_base_url.back() == '/' && path.size() && path.front() == '/') {
-        return g_base_url + path.substr(1);
-    } else if (g_base_url.back() != '/' && path.size() && path.front() != '/') {
-        return g_base_url + "/" + path;
-    } else {
-        return g_base_url + path;
+static std::string human_readable_size(long filesize) {
+    if (filesize < 0) return "unknown";
+    if (filesize < 1024) return std::to_string(filesize) + " B";
+    if (filesize < 1024 * 1024) {
+        long kb = filesize / 1024;
+        return std::to_string(kb) + " KB";
     }
+    double mb = (double)filesize / (1024.0 * 1024.0);
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2) << mb << " MB";
+    return oss.str();
 }
 
-// ---------------- Network operations ----------------
-bool create_user(const std::string &username, const std::string &password) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-    std::string url = endpoint("/api/user/create");
-    std::string json = "{\"username\":\"" + username + "\",\"password\":\"" + password + "\"}";
+// ---------------- Streaming JSON ----------------
+// Incremental (SAX-style) JSON parser: bytes are pushed in with feed() as
+// they arrive, e.g. straight from a curl write callback, and every value is
+// reported to the event callback as soon as it completes. Nothing but the
+// string or number currently being read is held, in a reused buffer.
+enum class JsonEvent { BeginObject, EndObject, BeginArray, EndArray, Key, String, Number, Literal };
 
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+class JsonParser {
+public:
+    // `text` is the decoded key or string, the raw number, or true/false/null
+    using Callback = std::function<void(JsonEvent, const std::string &text)>;
 
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    explicit JsonParser(Callback cb) : cb_(std::move(cb)) {}
 
-    CURLcode res = curl_easy_perform(curl);
-    bool ok = (res == CURLE_OK);
-    if (!ok) std::cerr << "create_user failed: " << curl_easy_strerror(res) << std::endl;
+    // false once the input is not valid JSON; see error()
+    bool feed(const char* data, size_t n) {
+        for (size_t i = 0; i < n && state_ != State::Failed; ++i) step((unsigned char)data[i]);
+        return state_ != State::Failed;
+    }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    return ok;
-}
+    // true if exactly one complete value was fed
+    bool finish() {
+        if (state_ == State::Number || state_ == State::Literal) step(' ');
+        if (state_ == State::Failed) return false;
+        if (state_ != State::Done) return fail("truncated JSON");
+        return true;
+    }
 
-// returns file_id or empty on error
-std::string init_upload(const std::string &filename, long total_size, const std::string &username, const std::string &password) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return "";
-    std::string url = endpoint("/api/upload/init");
-    std::ostringstream oss;
-    oss << "{\"filename\":\"" << filename << "\",\"total_size\":" << total_size << "}";
-    std::string json = oss.str();
+    const std::string &error() const { return error_; }
 
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+private:
+    enum class State { Value, ArrayFirst, KeyOrEnd, Key, Colon, AfterValue, String, Escape, Unicode,
+                       Number, Literal, Done, Failed };
 
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    bool fail(const char* why) {
+        if (state_ != State::Failed) error_ = why;
+        state_ = State::Failed;
+        return false;
+    }
 
-    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
-    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
+    void append_utf8(uint32_t cp) {
+        if (cp < 0x80) {
+            buf_ += (char)cp;
+        } else if (cp < 0x800) {
+            buf_ += (char)(0xC0 | (cp >> 6));
+            buf_ += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            buf_ += (char)(0xE0 | (cp >> 12));
+            buf_ += (char)(0x80 | ((cp >> 6) & 0x3F));
+            buf_ += (char)(0x80 | (cp & 0x3F));
+        } else {
+            buf_ += (char)(0xF0 | (cp >> 18));
+            buf_ += (char)(0x80 | ((cp >> 12) & 0x3F));
+            buf_ += (char)(0x80 | ((cp >> 6) & 0x3F));
+            buf_ += (char)(0x80 | (cp & 0x3F));
+        }
+    }
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    // a \u escape; surrogate pairs arrive as two escapes in a row
+    void unicode(uint32_t cp) {
+        if (cp >= 0xD800 && cp < 0xDC00) {
+            if (high_) append_utf8(0xFFFD);
+            high_ = cp;
+            return;
+        }
+        if (cp >= 0xDC00 && cp < 0xE000 && high_) {
+            append_utf8(0x10000 + ((high_ - 0xD800) << 10) + (cp - 0xDC00));
+            high_ = 0;
+            return;
+        }
+        unpaired();
+        append_utf8(cp);
+    }
 
-    CURLcode res = curl_easy_perform(curl);
-    std::string file_id;
-    if (res == CURLE_OK) {
-        size_t p = response.find("\"file_id\"");
-        if (p != std::string::npos) {
-            size_t colon = response.find(":", p);
-            if (colon != std::string::npos) {
-                size_t q1 = response.find("\"", colon);
-                if (q1 != std::string::npos) {
-                    size_t q2 = response.find("\"", q1 + 1);
-                    if (q2 != std::string::npos) file_id = response.substr(q1 + 1, q2 - q1 - 1);
-                }
+    void unpaired() {
+        if (high_) append_utf8(0xFFFD);
+        high_ = 0;
+    }
+
+    void value_done() {
+        state_ = stack_.empty() ? State::Done : State::AfterValue;
+    }
+
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?, the whole of n
+    static bool valid_number(const std::string &n) {
+        size_t i = n[0] == '-' ? 1 : 0;
+        auto digits = [&n, &i] {
+            size_t start = i;
+            while (i < n.size() && std::isdigit((unsigned char)n[i])) ++i;
+            return i > start;
+        };
+        if (i < n.size() && n[i] == '0') ++i;
+        else if (!digits()) return false;
+        if (i < n.size() && n[i] == '.' && (++i, !digits())) return false;
+        if (i < n.size() && (n[i] == 'e' || n[i] == 'E')) {
+            ++i;
+            if (i < n.size() && (n[i] == '+' || n[i] == '-')) ++i;
+            if (!digits()) return false;
+        }
+        return i == n.size();
+    }
+
+    void step(unsigned char c) {
+        switch (state_) {
+        case State::String:
+            if (c == '"') {
+                unpaired();
+                cb_(is_key_ ? JsonEvent::Key : JsonEvent::String, buf_);
+                if (is_key_) state_ = State::Colon;
+                else value_done();
+            } else if (c == '\\') {
+                state_ = State::Escape;
+            } else if (c < 0x20) {
+                fail("control character in string");
+            } else {
+                unpaired();
+                buf_ += (char)c;
+            }
+            return;
+        case State::Escape: {
+            static const char* from = "\"\\/bfnrt";
+            static const char* to = "\"\\/\b\f\n\r\t";
+            const char* p = c ? strchr(from, c) : nullptr;
+            if (c == 'u') {
+                state_ = State::Unicode;
+                hex_digits_ = 0;
+                code_ = 0;
+            } else if (p) {
+                unpaired();
+                buf_ += to[p - from];
+                state_ = State::String;
+            } else {
+                fail("bad escape in string");
             }
+            return;
         }
-        if (file_id.empty()) {
-            std::cerr << "init_upload: no file_id in response: " << response << std::endl;
+        case State::Unicode:
+            if (!std::isxdigit(c)) { fail("bad \\u escape"); return; }
+            code_ = code_ * 16 + (uint32_t)(std::isdigit(c) ? c - '0' : (std::tolower(c) - 'a' + 10));
+            if (++hex_digits_ == 4) {
+                unicode(code_);
+                state_ = State::String;
+            }
+            return;
+        case State::Number:
+            if (std::isdigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+                buf_ += (char)c;
+                return;
+            }
+            if (!valid_number(buf_)) { fail("bad number"); return; }
+            cb_(JsonEvent::Number, buf_);
+            value_done();
+            break; // c still needs handling
+        case State::Literal:
+            if (std::isalpha(c)) {
+                buf_ += (char)c;
+                return;
+            }
+            if (buf_ != "true" && buf_ != "false" && buf_ != "null") { fail("bad literal"); return; }
+            cb_(JsonEvent::Literal, buf_);
+            value_done();
+            break;
+        default:
+            break;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return;
+        switch (state_) {
+        case State::Value:
+        case State::ArrayFirst:
+            if (c == ']' && state_ == State::ArrayFirst) {
+                stack_.pop_back();
+                cb_(JsonEvent::EndArray, empty_);
+                value_done();
+            } else if (c == '{') {
+                stack_.push_back('{');
+                cb_(JsonEvent::BeginObject, empty_);
+                state_ = State::KeyOrEnd;
+            } else if (c == '[') {
+                stack_.push_back('[');
+                cb_(JsonEvent::BeginArray, empty_);
+                state_ = State::ArrayFirst;
+            } else if (c == '"') {
+                buf_.clear();
+                is_key_ = false;
+                state_ = State::String;
+            } else if (c == '-' || std::isdigit(c)) {
+                buf_.assign(1, (char)c);
+                state_ = State::Number;
+            } else if (c == 't' || c == 'f' || c == 'n') {
+                buf_.assign(1, (char)c);
+                state_ = State::Literal;
+            } else {
+                fail("expected a value");
+            }
+            return;
+        case State::KeyOrEnd:
+        case State::Key:
+            if (c == '"') {
+                buf_.clear();
+                is_key_ = true;
+                state_ = State::String;
+            } else if (c == '}' && state_ == State::KeyOrEnd) {
+                stack_.pop_back();
+                cb_(JsonEvent::EndObject, empty_);
+                value_done();
+            } else {
+                fail("expected a key");
+            }
+            return;
+        case State::Colon:
+            if (c == ':') state_ = State::Value;
+            else fail("expected ':'");
+            return;
+        case State::AfterValue:
+            if (c == ',') {
+                state_ = stack_.back() == '{' ? State::Key : State::Value;
+            } else if ((c == '}' && stack_.back() == '{') || (c == ']' && stack_.back() == '[')) {
+                stack_.pop_back();
+                cb_(c == '}' ? JsonEvent::EndObject : JsonEvent::EndArray, empty_);
+                value_done();
+            } else {
+                fail("expected ',' or a closing bracket");
+            }
+            return;
+        case State::Done:
+            fail("trailing data after JSON value");
+            return;
+        default:
+            return;
         }
-    } else {
-        std::cerr << "init_upload failed: " << curl_easy_strerror(res) << std::endl;
     }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    return file_id;
+    Callback cb_;
+    State state_ = State::Value;
+    std::vector<char> stack_;
+    std::string buf_;
+    const std::string empty_;
+    bool is_key_ = false;
+    int hex_digits_ = 0;
+    uint32_t code_ = 0;
+    uint32_t high_ = 0;
+    std::string error_;
+};
+
+static size_t json_write_cb(char* ptr, size_t size, size_t nmemb, void* arg) {
+    JsonParser* parser = (JsonParser*)arg;
+    return parser->feed(ptr, size * nmemb) ? size * nmemb : 0;
 }
 
-bool upload_chunk(const std::string &file_id, int chunk_index, int total_chunks, const std::string &file_field_name,
-                  const std::string &chunk_path, const std::string &username, const std::string &password) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-    std::string url = endpoint("/api/upload/chunk");
+// ---------------- SHA-256 ----------------
+// Plain FIPS 180-4 SHA-256; used to address chunks in the server's store.
+struct Sha256 {
+    uint32_t h[8];
+    uint64_t total = 0;
+    unsigned char buf[64];
+    size_t buf_len = 0;
 
-    curl_mime *form = curl_mime_init(curl);
+    Sha256() {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::copy(init, init + 8, h);
+    }
 
-    // file_id
-    curl_mimepart *part = curl_mime_addpart(form);
-    curl_mime_name(part, "file_id");
-    curl_mime_data(part, file_id.c_str(), CURL_ZERO_TERMINATED);
+    void block(const unsigned char* p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
 
-    // chunk_index
-    part = curl_mime_addpart(form);
-    curl_mime_name(part, "chunk_index");
-    std::string idxs = std::to_string(chunk_index);
-    curl_mime_data(part, idxs.c_str(), CURL_ZERO_TERMINATED);
+    void update(const void* data, size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        total += n;
+        if (buf_len) {
+            size_t take = std::min(n, 64 - buf_len);
+            memcpy(buf + buf_len, p, take);
+            buf_len += take; p += take; n -= take;
+            if (buf_len < 64) return;
+            block(buf);
+            buf_len = 0;
+        }
+        for (; n >= 64; p += 64, n -= 64) block(p);
+        memcpy(buf, p, n);
+        buf_len = n;
+    }
 
-    // total_chunks
-    part = curl_mime_addpart(form);
-    curl_mime_name(part, "total_chunks");
-    std::string tots = std::to_string(total_chunks);
-    curl_mime_data(part, tots.c_str(), CURL_ZERO_TERMINATED);
+    // pads and finishes; the object is spent afterwards
+    void digest(unsigned char out[32]) {
+        uint64_t bits = total * 8;
+        buf[buf_len++] = 0x80;
+        if (buf_len > 56) {
+            memset(buf + buf_len, 0, 64 - buf_len);
+            block(buf);
+            buf_len = 0;
+        }
+        memset(buf + buf_len, 0, 56 - buf_len);
+        for (int i = 0; i < 8; ++i) buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+        block(buf);
+        for (int i = 0; i < 32; ++i) out[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
 
-    // filename
-    part = curl_mime_addpart(form);
-    curl_mime_name(part, "filename");
-    curl_mime_data(part, file_field_name.c_str(), CURL_ZERO_TERMINATED);
+    std::string hex_digest() {
+        unsigned char d[32];
+        digest(d);
+        static const char* digits = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : d) {
+            out.push_back(digits[c >> 4]);
+            out.push_back(digits[c & 0xf]);
+        }
+        return out;
+    }
+};
 
-    // chunk file
-    part = curl_mime_addpart(form);
-    curl_mime_name(part, "chunk");
-    curl_mime_filedata(part, chunk_path.c_str());
+static std::string sha256_hex(const void* data, size_t n) {
+    Sha256 sha;
+    sha.update(data, n);
+    return sha.hex_digest();
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
+// ---------------- Output routing ----------------
+// The agent runs several jobs at once on its worker threads, and what a job
+// prints belongs to the client that submitted it. The agent points
+// std::cout and std::cerr at RoutedBufs, which hand whatever a job's threads
+// write to that job's JobOutput and pass every other thread's output through.
+struct JobOutput {
+    virtual ~JobOutput() = default;
+    virtual void write(int stream, const char* data, size_t n) = 0; // stream is 1 (stdout) or 2 (stderr)
+};
+static thread_local JobOutput* g_job_output = nullptr;
 
-    // Basic auth
-    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
-    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
+class RoutedBuf : public std::streambuf {
+public:
+    RoutedBuf(std::streambuf* fallback, int stream) : fallback_(fallback), stream_(stream) {}
 
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+protected:
+    int overflow(int c) override {
+        if (c == traits_type::eof()) return traits_type::not_eof(c);
+        char ch = (char)c;
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
 
-    CURLcode res = curl_easy_perform(curl);
-    bool ok = (res == CURLE_OK);
-    if (!ok) {
-        std::cerr << "upload_chunk failed: " << curl_easy_strerror(res) << std::endl;
-    } else {
-        std::cout << "Uploaded chunk " << chunk_index << " response: " << response << std::endl;
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        if (!g_job_output) return fallback_->sputn(s, n);
+        g_job_output->write(stream_, s, (size_t)n);
+        return n;
     }
 
-    curl_mime_free(form);
-    curl_easy_cleanup(curl);
-    return ok;
-}
+    int sync() override { return g_job_output ? 0 : fallback_->pubsync(); }
 
-bool upload_file(const std::string &path, const std::string &username, const std::string &password) {
-    long total_size = get_content_length(path);
-    if (total_size < 0) {
-        std::cerr << "Cannot stat file: " << path << std::endl;
-        return false;
-    }
+private:
+    std::streambuf* fallback_;
+    int stream_;
+};
 
-    int total_chunks = (int)((total_size + (long)CHUNK_SIZE - 1) / (long)CHUNK_SIZE);
-    std::string filename;
-    size_t pos = path.find_last_of("/\\");
-    if (pos == std::string::npos) filename = path;
-    else filename = path.substr(pos + 1);
+// ---------------- Hashing workers ----------------
+// Fixed set of threads running queued tasks in FIFO order; the destructor
+// finishes queued work before joining.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threads) {
+        for (unsigned i = 0; i < std::max(1u, threads); ++i) workers_.emplace_back([this] { run(); });
+    }
 
-    std::string file_id = init_upload(filename, total_size, username, password);
-    if (file_id.empty()) {
-        std::cerr << "init_upload failed" << std::endl;
-        return false;
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : workers_) t.join();
     }
 
-    std::ifstream in(path, std::ios::binary);
-    if (!in) {
-        std::cerr << "Unable to open file for reading: " << path << std::endl;
-        return false;
+    void submit(std::function<void()> task) {
+        // what the task prints goes where its submitter's output goes
+        JobOutput* out = g_job_output;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            tasks_.push_back([out, task = std::move(task)] {
+                g_job_output = out;
+                task();
+                g_job_output = nullptr;
+            });
+        }
+        cv_.notify_one();
     }
 
-    for (int i = 0; i < total_chunks; ++i) {
-        std::string tmpname = "/tmp/nt_chunk_" + file_id + "_" + std::to_string(i) + ".part";
-        std::ofstream out(tmpname, std::ios::binary);
-        if (!out) {
-            std::cerr << "Unable to create temp chunk file: " << tmpname << std::endl;
-            in.close();
-            return false;
+private:
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
         }
+    }
 
-        size_t to_read = CHUNK_SIZE;
-        long remaining = total_size - (long)i * (long)CHUNK_SIZE;
-        if ((long)to_read > remaining) to_read = (size_t)remaining;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> workers_;
+    bool stopping_ = false;
+};
 
-        std::vector<char> buffer;
-        buffer.resize(to_read);
-        in.read(buffer.data(), to_read);
-        std::streamsize actually = in.gcount();
-        out.write(buffer.data(), actually);
-        out.close();
+static unsigned hash_threads() {
+    return std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+}
 
-        bool ok = upload_chunk(file_id, i, total_chunks, filename, tmpname, username, password);
-        unlink(tmpname.c_str());
-        if (!ok) {
-            std::cerr << "Failed uploading chunk " << i << std::endl;
-            in.close();
-            return false;
-        }
-    }
+// Work done on one chunk by a worker. Fields are valid once `ready` is set;
+// `hex` is empty if the source could not be read.
+struct PendingChunk {
+    std::atomic<bool> ready{false};
+    std::string hex;
+    // a body the worker built to send instead of the source window (a
+    // deflated chunk, a bundle of files) and form fields describing it
+    std::string body;
+    std::vector<std::pair<std::string, std::string>> fields;
+};
 
-    in.close();
-    std::cout << "Upload complete for " << path << std::endl;
-    return true;
+// ---------------- Compression ----------------
+// Chunks are deflated (zlib format) at the fastest level on the hashing
+// workers. A few samples spread over the chunk are tried first so media and
+// archives cost almost nothing, and a chunk is only sent deflated if that
+// saves at least a tenth of its size. The deflated form is held in memory
+// until it is sent, so it may take at most COMPRESS_MAX_BODY; a chunk that
+// does not shrink that far goes out raw.
+static const size_t COMPRESS_SAMPLE = 64 * 1024;
+static const int COMPRESS_SAMPLES = 4;
+static const size_t COMPRESS_MAX_BODY = 16ull * 1024 * 1024;
+
+static size_t deflate_limit(curl_off_t size) {
+    return std::min((size_t)(size - size / 10), COMPRESS_MAX_BODY);
 }
 
-// ---------------- Listing / metadata ----------------
-struct FileEntry { std::string file_id; std::string filename; long size; };
+// offset of sample i in data of the given size
+static curl_off_t sample_offset(curl_off_t size, int i) {
+    curl_off_t span = std::max((curl_off_t)0, size - (curl_off_t)COMPRESS_SAMPLE);
+    return span * i / (COMPRESS_SAMPLES - 1);
+}
 
-static std::string human_readable_size(long filesize) {
-    if (filesize < 0) return "unknown";
-    if (filesize < 1024) return std::to_string(filesize) + " B";
-    if (filesize < 1024 * 1024) {
-        long kb = filesize / 1024;
-        return std::to_string(kb) + " KB";
+static bool looks_compressible(const char* data, size_t size) {
+    std::vector<Bytef> out(compressBound(COMPRESS_SAMPLE));
+    size_t raw = 0, packed = 0;
+    for (int i = 0; i < COMPRESS_SAMPLES; ++i) {
+        size_t n = std::min(COMPRESS_SAMPLE, size);
+        uLongf len = out.size();
+        const Bytef* in = (const Bytef*)data + sample_offset((curl_off_t)size, i);
+        if (compress2(out.data(), &len, in, (uLong)n, Z_BEST_SPEED) != Z_OK) return false;
+        raw += n;
+        packed += len;
     }
-    double mb = (double)filesize / (1024.0 * 1024.0);
-    std::ostringstream oss;
-    oss << std::fixed << std::setprecision(2) << mb << " MB";
-    return oss.str();
+    return packed <= deflate_limit((curl_off_t)raw);
 }
 
-// fetch /api/files and parse small JSON payload into vector<FileEntry>
-bool get_files_meta(const std::string &username, const std::string &password, std::vector<FileEntry> &out_items) {
-    out_items.clear();
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-    std::string url = endpoint("/api/files");
-    std::string response;
+static bool chunk_looks_compressible(int fd, off_t offset, curl_off_t size) {
+    // gather the samples back to back, where looks_compressible finds them
+    size_t n = (size_t)std::min((curl_off_t)COMPRESS_SAMPLE, size);
+    std::vector<char> samples(n * COMPRESS_SAMPLES);
+    for (int i = 0; i < COMPRESS_SAMPLES; ++i) {
+        if (pread(fd, samples.data() + n * i, n, offset + (off_t)sample_offset(size, i)) != (ssize_t)n) return false;
+    }
+    return looks_compressible(samples.data(), samples.size());
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
-    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+// deflates the pending input into `out`, growing it up to `limit` bytes;
+// false if the stream failed or would not fit
+static bool deflate_into(z_stream &zs, std::string &out, size_t limit, int flush) {
+    while (true) {
+        if (zs.total_out == out.size()) {
+            if (out.size() >= limit) return false;
+            out.resize(std::min(limit, std::max(out.size() * 2, (size_t)1024 * 1024)));
+        }
+        zs.next_out = (Bytef*)&out[zs.total_out];
+        zs.avail_out = (uInt)(out.size() - zs.total_out);
+        int rc = deflate(&zs, flush);
+        if (rc == Z_STREAM_END) {
+            out.resize(zs.total_out);
+            return true;
+        }
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return false;
+        if (flush == Z_NO_FLUSH && zs.avail_in == 0 && zs.avail_out > 0) return true;
+    }
+}
 
-    CURLcode res = curl_easy_perform(curl);
-    bool ok = (res == CURLE_OK);
-    if (!ok) {
-        std::cerr << "get_files_meta failed: " << curl_easy_strerror(res) << std::endl;
-        curl_easy_cleanup(curl);
-        return false;
+// Hashes the window [offset, offset + size) of fd into out.hex and, with
+// `compress`, deflates it into out.body in the same pass when that pays off.
+static void digest_chunk(int fd, off_t offset, curl_off_t size, bool compress, PendingChunk &out) {
+    Sha256 sha;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    size_t limit = deflate_limit(size);
+    bool deflating = compress && size > 0 && chunk_looks_compressible(fd, offset, size) &&
+                     deflateInit(&zs, Z_BEST_SPEED) == Z_OK;
+    bool started = deflating;
+
+    std::vector<char> buf(1024 * 1024);
+    curl_off_t done = 0;
+    bool ok = true;
+    while (done < size) {
+        size_t want = (size_t)std::min((curl_off_t)buf.size(), size - done);
+        ssize_t n = pread(fd, buf.data(), want, offset + (off_t)done);
+        if (n <= 0) { ok = false; break; }
+        sha.update(buf.data(), (size_t)n);
+        done += n;
+        if (deflating) {
+            zs.next_in = (Bytef*)buf.data();
+            zs.avail_in = (uInt)n;
+            deflating = deflate_into(zs, out.body, limit, done == size ? Z_FINISH : Z_NO_FLUSH);
+        }
     }
+    if (started) deflateEnd(&zs);
+    if (!ok || !deflating) std::string().swap(out.body);
+    else out.fields = {{"chunk_encoding", "deflate"}};
+    out.hex = ok ? sha.hex_digest() : "";
+}
 
-    // find array start for "files"
-    size_t files_key = response.find("\"files\"");
-    size_t arr_start = std::string::npos;
-    if (files_key != std::string::npos) arr_start = response.find("[", files_key);
-    if (arr_start == std::string::npos) arr_start = response.find("[");
-    if (arr_start == std::string::npos) { curl_easy_cleanup(curl); return true; }
+// replaces data with its deflated form if that pays off
+static bool deflate_buffer(std::string &data) {
+    if (data.empty() || !looks_compressible(data.data(), data.size())) return false;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK) return false;
+    zs.next_in = (Bytef*)&data[0];
+    zs.avail_in = (uInt)data.size();
+    std::string out;
+    bool ok = deflate_into(zs, out, deflate_limit((curl_off_t)data.size()), Z_FINISH);
+    deflateEnd(&zs);
+    if (ok) data.swap(out);
+    return ok;
+}
 
-    size_t arr_end = response.find("]", arr_start);
-    if (arr_end == std::string::npos) arr_end = response.size();
+// Hashes a file front to back on its own thread without ever reading past
+// the bytes declared complete with advance(), so it can trail a transfer
+// that fills the file in any order and finish right after it. Given a chunk
+// size it also hashes each chunk in the same pass and hands its digest to
+// on_chunk, with an empty digest for the chunks it could not read.
+class PrefixHasher {
+public:
+    using ChunkDone = std::function<void(int index, const std::string &hex)>;
 
-    size_t pos = arr_start;
-    while (true) {
-        size_t obj_start = response.find("{", pos);
-        if (obj_start == std::string::npos || obj_start > arr_end) break;
-        size_t obj_end = response.find("}", obj_start);
-        if (obj_end == std::string::npos || obj_end > arr_end) break;
-        std::string obj = response.substr(obj_start, obj_end - obj_start + 1);
+    // size may be -1 when the final length is only known at finish()
+    PrefixHasher(int fd, curl_off_t size, curl_off_t chunk_size = 0, ChunkDone on_chunk = nullptr)
+        : fd_(fd), size_(size), chunk_size_(chunk_size), on_chunk_(std::move(on_chunk)), thread_([this] { run(); }) {}
 
-        FileEntry e; e.file_id = ""; e.filename = ""; e.size = -1;
+    ~PrefixHasher() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            aborted_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
 
-        // file_id
-        size_t fid_pos = obj.find("\"file_id\"");
-        if (fid_pos != std::string::npos) {
-            size_t colon = obj.find(":", fid_pos);
-            size_t q1 = obj.find("\"", colon);
-            if (q1 != std::string::npos) {
-                size_t q2 = obj.find("\"", q1 + 1);
-                if (q2 != std::string::npos) e.file_id = obj.substr(q1 + 1, q2 - q1 - 1);
-            }
+    void advance(curl_off_t upto) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            ready_ = std::max(ready_, upto);
         }
+        cv_.notify_all();
+    }
 
-        // filename
-        size_t fname_pos = obj.find("\"filename\"");
-        if (fname_pos != std::string::npos) {
-            size_t colon = obj.find(":", fname_pos);
-            size_t q1 = obj.find("\"", colon);
-            if (q1 != std::string::npos) {
-                size_t q2 = obj.find("\"", q1 + 1);
-                if (q2 != std::string::npos) e.filename = obj.substr(q1 + 1, q2 - q1 - 1);
-            }
+    // marks everything up to final_size (or the known size) complete and
+    // waits for the hash; empty on read errors
+    std::string finish(curl_off_t final_size = -1) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (final_size >= 0) size_ = final_size;
+            if (size_ < 0) size_ = ready_;
+            ready_ = std::max(ready_, size_);
         }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+        return hex_;
+    }
 
-        // size
-        size_t size_pos = obj.find("\"size\"");
-        if (size_pos != std::string::npos) {
-            size_t colon = obj.find(":", size_pos);
-            if (colon != std::string::npos) {
-                size_t endpos = obj.find_first_of(",}", colon);
-                if (endpos == std::string::npos) endpos = obj.size();
-                std::string size_str = obj.substr(colon + 1, endpos - colon - 1);
-                // trim
-                size_str.erase(size_str.begin(), std::find_if(size_str.begin(), size_str.end(), [](int ch){ return !std::isspace(ch); }));
-                size_str.erase(std::find_if(size_str.rbegin(), size_str.rend(), [](int ch){ return !std::isspace(ch); }).base(), size_str.end());
-                // digits only
-                std::string digits;
-                for (char c : size_str) if (std::isdigit((unsigned char)c)) digits.push_back(c);
-                if (!digits.empty()) {
-                    try { e.size = std::stol(digits); } catch(...) { e.size = -1; }
+private:
+    void run() {
+        Sha256 sha, part;
+        std::vector<char> buf(1024 * 1024);
+        curl_off_t pos = 0;
+        int index = 0;
+        bool chunked = chunk_size_ > 0 && on_chunk_;
+        while (true) {
+            curl_off_t limit;
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [&] { return aborted_ || ready_ > pos || (size_ >= 0 && pos >= size_); });
+                if (aborted_) return;
+                if (size_ >= 0 && pos >= size_) break;
+                limit = ready_;
+            }
+            while (pos < limit) {
+                curl_off_t stop = chunked ? std::min(limit, (index + 1) * chunk_size_) : limit;
+                size_t want = (size_t)std::min((curl_off_t)buf.size(), stop - pos);
+                ssize_t n = pread(fd_, buf.data(), want, (off_t)pos);
+                if (n <= 0) {
+                    // the chunks left would otherwise be waited for forever
+                    for (; chunked && size_ > 0 && index * chunk_size_ < size_; ++index) on_chunk_(index, "");
+                    return;
+                }
+                sha.update(buf.data(), (size_t)n);
+                pos += n;
+                if (!chunked) continue;
+                part.update(buf.data(), (size_t)n);
+                if (pos == (index + 1) * chunk_size_ || pos == size_) {
+                    on_chunk_(index++, part.hex_digest());
+                    part = Sha256();
                 }
             }
         }
-
-        if (!e.filename.empty() || !e.file_id.empty()) out_items.push_back(e);
-        pos = obj_end + 1;
+        hex_ = sha.hex_digest();
     }
 
-    curl_easy_cleanup(curl);
-    return true;
-}
+    int fd_;
+    curl_off_t size_;
+    curl_off_t chunk_size_;
+    ChunkDone on_chunk_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    curl_off_t ready_ = 0;
+    bool aborted_ = false;
+    std::string hex_;
+    std::thread thread_;
+};
 
-bool list_files(const std::string &username, const std::string &password) {
-    std::vector<FileEntry> items;
-    if (!get_files_meta(username, password, items)) return false;
+// ---------------- Upload journal ----------------
+// One journal per in-progress upload under ~/.network_terminal_uploads/. The
+// header is written once and renamed into place; every acknowledged chunk is
+// appended and synced, so the journal survives Ctrl-C, crashes and reboots.
+struct UploadJournal {
+    std::string journal_path;
+    std::string file_id;
+    std::string source;          // absolute path of the file being uploaded
+    std::string name;            // name it is stored under
+    long size = 0;
+    long long mtime_ns = 0;
+    long chunk_size = 0;
+    int total_chunks = 0;
+    std::vector<bool> acked;
+    int fd = -1;
+};
 
-    if (items.empty()) {
-        std::cout << "Files: (none)\n";
-        return true;
+static std::string journal_dir() {
+    const char* home = getenv("HOME");
+    if (home && home[0] != '\0') {
+        return std::string(home) + "/.network_terminal_uploads";
     }
-
-    size_t max_name = std::string("Filename").size();
-    size_t id_width = std::string("FileID").size();
-    for (auto &e : items) {
-        max_name = std::max(max_name, e.filename.size());
-        id_width = std::max(id_width, (size_t)8);
+    struct passwd *pw = getpwuid(getuid());
+    if (pw && pw->pw_dir) {
+        return std::string(pw->pw_dir) + "/.network_terminal_uploads";
     }
+    return std::string(".") + "/.network_terminal_uploads";
+}
 
-    std::cout << std::left << std::setw((int)id_width + 2) << "FileID"
-              << std::left << std::setw((int)max_name + 2) << "Filename"
-              << "Size\n";
-    std::cout << std::string(id_width + 2 + max_name + 2 + 6, '-') << "\n";
-
-    for (auto &e : items) {
-        std::string short_id = e.file_id.size() > 8 ? e.file_id.substr(0,8) : e.file_id;
-        std::cout << std::left << std::setw((int)id_width + 2) << short_id
-                  << std::left << std::setw((int)max_name + 2) << e.filename
-                  << human_readable_size(e.size) << "\n";
-    }
-    return true;
+static long long mtime_ns_of(const struct stat &st) {
+    return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
 }
 
-// ---------------- Share / Delete client ops ----------------
-bool resolve_file_id(const std::string &id_or_name, const std::string &username, const std::string &password, std::string &out_file_id) {
+static bool journal_create(UploadJournal &j) {
+    std::string dir = journal_dir();
+    if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) return false;
+    j.journal_path = dir + "/" + j.file_id + ".journal";
+    j.acked.assign(j.total_chunks, false);
+
+    std::ostringstream oss;
+    oss << "netserve-journal 1\n"
+        << "file_id " << j.file_id << "\n"
+        << "size " << j.size << "\n"
+        << "mtime " << j.mtime_ns << "\n"
+        << "chunk_size " << j.chunk_size << "\n"
+        << "total_chunks " << j.total_chunks << "\n"
+        << "name " << j.name << "\n"
+        << "path " << j.source << "\n";
+    std::string header = oss.str();
+
+    std::string tmp = j.journal_path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) return false;
+    bool ok = write(fd, header.data(), header.size()) == (ssize_t)header.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), j.journal_path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    j.fd = open(j.journal_path.c_str(), O_WRONLY | O_APPEND);
+    return j.fd >= 0;
+}
+
+// parses one journal file; a torn trailing "ack" line from a crash is ignored
+static bool journal_read(const std::string &journal_path, UploadJournal &j) {
+    std::ifstream in(journal_path);
+    if (!in) return false;
+    std::string line;
+    if (!std::getline(in, line) || line != "netserve-journal 1") return false;
+    j = UploadJournal();
+    j.journal_path = journal_path;
+    std::vector<int> acks;
+    while (std::getline(in, line)) {
+        size_t sp = line.find(' ');
+        if (sp == std::string::npos) continue;
+        std::string key = line.substr(0, sp), val = line.substr(sp + 1);
+        if (key == "path") { j.source = val; continue; }
+        if (key == "name") { j.name = val; continue; }
+        if (key == "file_id") { j.file_id = val; continue; }
+        char* end = nullptr;
+        long long v = strtoll(val.c_str(), &end, 10);
+        if (val.empty() || *end != '\0') continue;
+        if (key == "size") j.size = (long)v;
+        else if (key == "mtime") j.mtime_ns = v;
+        else if (key == "chunk_size") j.chunk_size = (long)v;
+        else if (key == "total_chunks") j.total_chunks = (int)v;
+        else if (key == "ack") acks.push_back((int)v);
+    }
+    if (j.file_id.empty() || j.source.empty() || j.total_chunks < 0) return false;
+    j.acked.assign(j.total_chunks, false);
+    for (int i : acks) if (i >= 0 && i < j.total_chunks) j.acked[i] = true;
+    return true;
+}
+
+static void journal_remove(UploadJournal &j) {
+    if (j.fd >= 0) close(j.fd);
+    j.fd = -1;
+    if (!j.journal_path.empty()) unlink(j.journal_path.c_str());
+    j.journal_path.clear();
+}
+
+// finds the newest journal for `source` stored as `name`, by the time of its
+// last ack; journals for a changed source are discarded
+static bool journal_find(const std::string &source, const std::string &name, const struct stat &st,
+                         UploadJournal &out) {
+    std::string dir = journal_dir();
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    bool found = false;
+    long long newest = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d))) {
+        std::string entry = ent->d_name;
+        if (entry.size() < 8 || entry.compare(entry.size() - 8, 8, ".journal") != 0) continue;
+        UploadJournal j;
+        if (!journal_read(dir + "/" + entry, j) || j.source != source) continue;
+        // journals from before --name hold the basename
+        if ((j.name.empty() ? source.substr(source.find_last_of('/') + 1) : j.name) != name) continue;
+        if (j.size != (long)st.st_size || j.mtime_ns != mtime_ns_of(st) || j.chunk_size <= 0 ||
+            j.total_chunks != (int)((j.size + j.chunk_size - 1) / j.chunk_size)) {
+            std::cerr << "Source changed since the interrupted upload; starting over\n";
+            journal_remove(j);
+            continue;
+        }
+        struct stat js;
+        if (stat(j.journal_path.c_str(), &js) != 0) continue;
+        if (found && mtime_ns_of(js) <= newest) continue;
+        newest = mtime_ns_of(js);
+        out = j;
+        found = true;
+    }
+    closedir(d);
+    if (!found) return false;
+    out.fd = open(out.journal_path.c_str(), O_WRONLY | O_APPEND);
+    return out.fd >= 0;
+}
+
+static void journal_ack(UploadJournal &j, int chunk_index) {
+    if (j.fd < 0) return;
+    std::string line = "ack " + std::to_string(chunk_index) + "\n";
+    if (write(j.fd, line.data(), line.size()) == (ssize_t)line.size()) fdatasync(j.fd);
+    j.acked[chunk_index] = true;
+}
+
+// ---------------- Server endpoint builder ----------------
+static std::string g_base_url = "http://10.0.1.128:5001"; // default
+
+static std::string endpoint(const std::string &path) {
+    if (g_base_url.empty()) return path;
+    if (g_base_url.back() == '/' && path.size() && path.front() == '/') {
+        return g_base_url + path.substr(1);
+    } else if (g_base_url.back() != '/' && path.size() && path.front() != '/') {
+        return g_base_url + "/" + path;
+    } else {
+        return g_base_url + path;
+    }
+}
+
+// ---------------- Client session ----------------
+// One session per process. All easy handles share a CURLSH connection, DNS
+// and TLS session cache, and one-at-a-time requests reuse a single easy
+// handle per thread, so keep-alive connections, TLS and HTTP/2 are
+// negotiated once and e.g. the listing fetch that resolves names plus the
+// share/delete call ride one connection.
+struct ClientSession {
+    CURLSH* share = nullptr;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+};
+static ClientSession g_session;
+// reused by the thread's sequential requests; agent workers each have one
+static thread_local CURL* g_thread_handle = nullptr;
+
+static void session_lock(CURL*, curl_lock_data data, curl_lock_access, void*) {
+    g_session.locks[data].lock();
+}
+
+static void session_unlock(CURL*, curl_lock_data data, void*) {
+    g_session.locks[data].unlock();
+}
+
+static void session_begin() {
+    g_session.share = curl_share_init();
+    if (!g_session.share) return;
+    curl_share_setopt(g_session.share, CURLSHOPT_LOCKFUNC, session_lock);
+    curl_share_setopt(g_session.share, CURLSHOPT_UNLOCKFUNC, session_unlock);
+    curl_share_setopt(g_session.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(g_session.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_session.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void session_end() {
+    // handles must let go of the share before it can be destroyed
+    if (g_thread_handle) curl_easy_cleanup(g_thread_handle);
+    g_thread_handle = nullptr;
+    if (g_session.share) curl_share_cleanup(g_session.share);
+    g_session.share = nullptr;
+}
+
+// options every handle gets: the shared caches, keep-alive and HTTP/2 over TLS
+static void session_attach(CURL* curl) {
+    if (g_session.share) curl_easy_setopt(curl, CURLOPT_SHARE, g_session.share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+}
+
+// a fresh easy handle for concurrent transfers; the caller cleans it up
+static CURL* session_new_handle() {
+    CURL* curl = curl_easy_init();
+    if (curl) session_attach(curl);
+    return curl;
+}
+
+// the thread's reusable handle, reset to default options for a new request;
+// callers must not clean it up
+static CURL* session_handle() {
+    if (!g_thread_handle) g_thread_handle = curl_easy_init();
+    else curl_easy_reset(g_thread_handle);
+    if (g_thread_handle) session_attach(g_thread_handle);
+    return g_thread_handle;
+}
+
+// an empty password means the saved session token stands in for it
+static void set_auth(CURL* curl, const std::string &username, const std::string &password) {
+    if (password.empty() && !g_session_token.empty()) {
+        curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BEARER);
+        curl_easy_setopt(curl, CURLOPT_XOAUTH2_BEARER, g_session_token.c_str());
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
+    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
+}
+
+// multi handle for parallel chunk/range transfers: each transfer gets its own
+// connection rather than being multiplexed onto one HTTP/2 stream
+static CURLM* session_multi() {
+    CURLM* multi = curl_multi_init();
+    if (multi) curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_NOTHING);
+    return multi;
+}
+
+// ---------------- Transfer metrics ----------------
+// Every request records curl's timings as it completes, split into phases
+// (DNS, TCP connect, TLS handshake, request body, time to first response
+// byte) so a slow transfer can be pinned on the tunnel, TLS or the server.
+// curl before 8.10 cannot tell when a request body finished; there the body
+// time reads 0 and an upload's ttfb starts when its body starts. `--metrics-json FILE`
+// writes them all at exit, with latency percentiles and a histogram per
+// kind of request. Uploads and downloads also draw a progress line.
+struct RequestMetric {
+    std::string kind; // "chunk", "range", "init", ...
+    int tag = -1;     // chunk, bundle or range number
+    bool ok = false;
+    long status = 0;
+    double dns = 0, connect = 0, tls = 0, body = 0, ttfb = 0, total = 0; // seconds
+    curl_off_t sent = 0, received = 0;
+};
+
+struct MetricsLog {
+    std::mutex lock;
+    std::vector<RequestMetric> requests;
+    std::string json_path; // set by --metrics-json
+    std::string command;
+    bool keep = true;      // false in the agent, which would otherwise grow forever
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+static MetricsLog g_metrics;
+
+static RequestMetric record_request(CURL* curl, const std::string &kind, int tag, CURLcode res) {
+    curl_off_t dns = 0, conn = 0, tls = 0, pre = 0, post = 0, first = 0, total = 0;
+    RequestMetric m;
+    m.kind = kind;
+    m.tag = tag;
+    m.ok = res == CURLE_OK;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &m.status);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &conn);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pre);
+#if LIBCURL_VERSION_NUM >= 0x080a00
+    curl_easy_getinfo(curl, CURLINFO_POSTTRANSFER_TIME_T, &post);
+#endif
+    post = std::max(post, pre);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &m.sent);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &m.received);
+    // curl's times are cumulative from the start; a reused connection
+    // reports zero for the phases it skipped
+    m.dns = dns / 1e6;
+    m.connect = conn > dns ? (conn - dns) / 1e6 : 0;
+    m.tls = tls > conn ? (tls - conn) / 1e6 : 0;
+    m.body = (post - pre) / 1e6;
+    m.ttfb = first > post ? (first - post) / 1e6 : 0;
+    m.total = total / 1e6;
+    std::lock_guard<std::mutex> lk(g_metrics.lock);
+    if (g_metrics.keep) g_metrics.requests.push_back(m);
+    return m;
+}
+
+// curl_easy_perform, recorded under `kind`
+static CURLcode session_perform(CURL* curl, const std::string &kind) {
+    CURLcode res = curl_easy_perform(curl);
+    record_request(curl, kind, -1, res);
+    return res;
+}
+
+// nearest-rank percentile of sorted values
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size(), std::max(rank, (size_t)1)) - 1];
+}
+
+static void json_latency(std::ostream &out, std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    out << "{\"p50\":" << percentile(v, 50) << ",\"p99\":" << percentile(v, 99)
+        << ",\"max\":" << (v.empty() ? 0 : v.back()) << "}";
+}
+
+static bool write_metrics_json(const std::string &path) {
+    std::lock_guard<std::mutex> lk(g_metrics.lock);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_metrics.start).count();
+    std::map<std::string, std::vector<const RequestMetric*>> by_kind;
+    curl_off_t sent = 0, received = 0;
+    for (const auto &m : g_metrics.requests) {
+        by_kind[m.kind].push_back(&m);
+        sent += m.sent;
+        received += m.received;
+    }
+
+    std::ofstream out(path, std::ios::trunc);
+    out << std::setprecision(6);
+    out << "{\"command\":" << json_quote(g_metrics.command) << ",\"server\":" << json_quote(g_base_url)
+        << ",\"wall_seconds\":" << wall << ",\"requests\":" << g_metrics.requests.size()
+        << ",\"bytes_sent\":" << sent << ",\"bytes_received\":" << received << ",\"kinds\":{";
+    bool first_kind = true;
+    for (const auto &k : by_kind) {
+        std::vector<double> dns, conn, tls, body, ttfb, total;
+        size_t failed = 0;
+        curl_off_t k_sent = 0, k_received = 0;
+        double busy = 0;
+        for (const RequestMetric* m : k.second) {
+            dns.push_back(m->dns);
+            conn.push_back(m->connect);
+            tls.push_back(m->tls);
+            body.push_back(m->body);
+            ttfb.push_back(m->ttfb);
+            total.push_back(m->total);
+            if (!m->ok || m->status >= 400) failed++;
+            k_sent += m->sent;
+            k_received += m->received;
+            busy += m->total;
+        }
+        // request counts by total time, in power-of-two buckets from 1 ms
+        std::vector<size_t> buckets;
+        for (double t : total) {
+            size_t b = 0;
+            for (double le = 0.001; t > le && b < 20; le *= 2) b++;
+            if (buckets.size() <= b) buckets.resize(b + 1, 0);
+            buckets[b]++;
+        }
+        out << (first_kind ? "" : ",") << json_quote(k.first) << ":{\"count\":" << k.second.size()
+            << ",\"failed\":" << failed << ",\"bytes_sent\":" << k_sent << ",\"bytes_received\":" << k_received
+            << ",\"bytes_per_request_second\":" << (busy > 0 ? (double)(k_sent + k_received) / busy : 0)
+            << ",\"dns\":";
+        json_latency(out, dns);
+        out << ",\"connect\":";
+        json_latency(out, conn);
+        out << ",\"tls\":";
+        json_latency(out, tls);
+        out << ",\"body\":";
+        json_latency(out, body);
+        out << ",\"ttfb\":";
+        json_latency(out, ttfb);
+        out << ",\"total\":";
+        json_latency(out, total);
+        out << ",\"histogram\":[";
+        double le = 0.001;
+        for (size_t b = 0; b < buckets.size(); ++b, le *= 2) {
+            out << (b ? "," : "") << "{\"le\":";
+            if (b == 20) out << "null";
+            else out << le;
+            out << ",\"count\":" << buckets[b] << "}";
+        }
+        out << "]}";
+        first_kind = false;
+    }
+    out << "},\"log\":[";
+    for (size_t i = 0; i < g_metrics.requests.size(); ++i) {
+        const RequestMetric &m = g_metrics.requests[i];
+        out << (i ? "," : "") << "{\"kind\":" << json_quote(m.kind) << ",\"tag\":" << m.tag
+            << ",\"ok\":" << (m.ok ? "true" : "false") << ",\"status\":" << m.status
+            << ",\"dns\":" << m.dns << ",\"connect\":" << m.connect << ",\"tls\":" << m.tls
+            << ",\"body\":" << m.body << ",\"ttfb\":" << m.ttfb << ",\"total\":" << m.total
+            << ",\"sent\":" << m.sent << ",\"received\":" << m.received << "}";
+    }
+    out << "]}\n";
+    out.close();
+    if (!out) std::cerr << "Cannot write metrics to " << path << std::endl;
+    return (bool)out;
+}
+
+// A progress line on stderr with throughput and ETA, redrawn at most five
+// times a second and only when stderr is a terminal. A negative total means
+// the size is unknown. The line is cleared again by finish().
+static bool g_show_progress = true;
+
+class Progress {
+public:
+    Progress(const std::string &label, curl_off_t total)
+        : label_(label), total_(total), live_(g_show_progress && isatty(STDERR_FILENO) == 1),
+          last_(std::chrono::steady_clock::now()) {}
+    ~Progress() { finish(); }
+    Progress(const Progress &) = delete;
+    Progress &operator=(const Progress &) = delete;
+
+    bool live() const { return live_; }
+
+    void update(curl_off_t done) {
+        if (!live_) return;
+        auto now = std::chrono::steady_clock::now();
+        double dt = std::chrono::duration<double>(now - last_).count();
+        if (dt < 0.2) return;
+        double rate = (double)(done - last_done_) / dt;
+        rate_ = rate_ > 0 ? 0.7 * rate_ + 0.3 * rate : rate;
+        last_ = now;
+        last_done_ = done;
+
+        std::ostringstream line;
+        line << "\r" << label_ << "  " << human_readable_size((long)done);
+        if (total_ > 0) line << " of " << human_readable_size((long)total_) << " (" << done * 100 / total_ << "%)";
+        line << "  " << human_readable_size((long)std::max(rate_, 0.0)) << "/s";
+        if (total_ > 0 && rate_ > 0 && done < total_) {
+            long eta = (long)((double)(total_ - done) / rate_);
+            line << "  ETA " << eta / 60 << ":" << std::setw(2) << std::setfill('0') << eta % 60;
+        }
+        line << "\033[K";
+        std::cerr << line.str() << std::flush;
+        drawn_ = true;
+    }
+
+    void finish() {
+        if (drawn_) std::cerr << "\r\033[K" << std::flush;
+        drawn_ = false;
+    }
+
+private:
+    std::string label_;
+    curl_off_t total_;
+    bool live_;
+    bool drawn_ = false;
+    std::chrono::steady_clock::time_point last_;
+    curl_off_t last_done_ = 0;
+    double rate_ = 0;
+};
+
+// ---------------- Chunk sizing ----------------
+// Servers advertise their chunk limits at /api/capabilities; one without it
+// gets fixed CHUNK_SIZE chunks. Otherwise every upload picks its own size:
+// large enough that a request's round trip stays a small share of the
+// chunk's time, small enough that a failed chunk costs only a few seconds to
+// resend. The per-connection throughput of recent uploads to the server is
+// kept in ~/.network_terminal_cache/<server>.link for the next choice.
+static const size_t START_CHUNK_SIZE = 16ull * 1024 * 1024; // until a throughput is known
+static const double CHUNK_SECONDS = 4.0;
+static const double CHUNK_RTTS = 20.0;
+
+struct ServerLimits {
+    bool adaptive = false;
+    size_t min_chunk = CHUNK_SIZE;
+    size_t max_chunk = CHUNK_SIZE;
+    double rtt = 0; // seconds from request to first response byte
+};
+
+static const ServerLimits &server_limits() {
+    static ServerLimits limits;
+    static bool fetched = false;
+    static std::mutex lock;
+    std::lock_guard<std::mutex> lk(lock);
+    if (fetched) return limits;
+    fetched = true;
+    CURL* curl = session_handle();
+    if (!curl) return limits;
+    std::string url = endpoint("/api/capabilities");
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    long status = 0;
+    if (session_perform(curl, "capabilities") != CURLE_OK) return limits;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    long long lo = json_int_field(response, "min_chunk_size"), hi = json_int_field(response, "max_chunk_size");
+    if (status != 200 || lo <= 0 || hi < lo) return limits;
+    curl_off_t pre = 0, first = 0;
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pre);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first);
+    limits.adaptive = true;
+    limits.min_chunk = (size_t)lo;
+    limits.max_chunk = (size_t)hi;
+    limits.rtt = (double)std::max<curl_off_t>(first - pre, 0) / 1e6;
+    return limits;
+}
+
+static std::string link_stats_path() {
+    const char* home = getenv("HOME");
+    std::string base;
+    if (home && home[0] != '\0') base = home;
+    else {
+        struct passwd *pw = getpwuid(getuid());
+        base = (pw && pw->pw_dir) ? pw->pw_dir : ".";
+    }
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << fnv1a64(g_base_url);
+    return base + "/.network_terminal_cache/" + name.str() + ".link";
+}
+
+// bytes per second one connection carried in recent uploads, or 0
+static double link_throughput() {
+    std::ifstream in(link_stats_path());
+    std::string key;
+    double v = 0;
+    if (!(in >> key >> v) || key != "throughput" || v < 0) return 0;
+    return v;
+}
+
+// folds a finished upload's measurement into the stored throughput
+static void record_link_throughput(long long bytes, double seconds) {
+    if (bytes < (long long)(1024 * 1024) || seconds <= 0) return;
+    double measured = (double)bytes / seconds, old = link_throughput();
+    double v = old > 0 ? (old + measured) / 2 : measured;
+    std::string path = link_stats_path();
+    std::string dir = path.substr(0, path.find_last_of('/'));
+    if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) return;
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << "throughput " << (long long)v << "\n";
+        if (!out) return;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+}
+
+// fixed size for every new upload, e.g. while benchmarking; 0 chooses per upload
+static size_t g_forced_chunk_size = 0;
+
+// Chunk size for a new upload of total_size bytes over `jobs` connections.
+// Compressed chunks are built in memory, so they stay at COMPRESS_MAX_BODY
+// or less (a server without limits still gets CHUNK_SIZE, and its chunks
+// are sent deflated only when they fit in COMPRESS_MAX_BODY).
+static size_t choose_chunk_size(long total_size, int jobs, bool compress) {
+    const ServerLimits &limits = server_limits();
+    if (!limits.adaptive) return CHUNK_SIZE;
+    if (g_forced_chunk_size) return std::min(std::max(g_forced_chunk_size, limits.min_chunk), limits.max_chunk);
+    double tput = link_throughput();
+    double want = tput > 0 ? tput * std::max(CHUNK_SECONDS, CHUNK_RTTS * limits.rtt) : (double)START_CHUNK_SIZE;
+    // leave every connection a chunk to carry
+    if (jobs > 1 && total_size > 0) want = std::min(want, (double)total_size / jobs);
+    size_t hi = compress ? std::min(limits.max_chunk, COMPRESS_MAX_BODY) : limits.max_chunk;
+    size_t size = (size_t)std::min(want, (double)hi);
+    size -= size % (1024 * 1024); // whole MiB
+    return std::max(size, limits.min_chunk);
+}
+
+// ---------------- Network operations ----------------
+bool create_user(const std::string &username, const std::string &password) {
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint("/api/user/create");
+    std::string json = "{\"username\":\"" + username + "\",\"password\":\"" + password + "\"}";
+
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, "create_user");
+    bool ok = (res == CURLE_OK);
+    if (!ok) std::cerr << "create_user failed: " << curl_easy_strerror(res) << std::endl;
+
+    curl_slist_free_all(headers);
+    return ok;
+}
+
+// returns file_id or empty on error
+// trades the password for a session token; http_status is set whenever the
+// server answered so callers can tell an old server (404) from bad credentials
+bool create_session(const std::string &username, const std::string &password, std::string &token, long long &expires,
+                    long &http_status) {
+    http_status = 0;
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint("/api/session");
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0L);
+    set_auth(curl, username, password);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, "session");
+    if (res != CURLE_OK) {
+        std::cerr << "login failed: " << curl_easy_strerror(res) << std::endl;
+        return false;
+    }
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+    token = json_string_field(response, "token");
+    expires = json_int_field(response, "expires_at");
+    if (http_status != 201 || token.empty()) {
+        if (http_status != 404) std::cerr << "login failed (HTTP " << http_status << "): " << response << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// registers an upload; chunk_size 0 leaves the size to the server
+std::string init_upload(const std::string &filename, long total_size, const std::string &username, const std::string &password,
+                        size_t chunk_size = 0) {
+    CURL* curl = session_handle();
+    if (!curl) return "";
+    std::string url = endpoint("/api/upload/init");
+    std::ostringstream oss;
+    oss << "{\"filename\":" << json_quote(filename) << ",\"total_size\":" << total_size;
+    if (chunk_size) oss << ",\"chunk_size\":" << chunk_size;
+    oss << "}";
+    std::string json = oss.str();
+
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    set_auth(curl, username, password);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, "init");
+    std::string file_id;
+    if (res == CURLE_OK) {
+        size_t p = response.find("\"file_id\"");
+        if (p != std::string::npos) {
+            size_t colon = response.find(":", p);
+            if (colon != std::string::npos) {
+                size_t q1 = response.find("\"", colon);
+                if (q1 != std::string::npos) {
+                    size_t q2 = response.find("\"", q1 + 1);
+                    if (q2 != std::string::npos) file_id = response.substr(q1 + 1, q2 - q1 - 1);
+                }
+            }
+        }
+        if (file_id.empty()) {
+            std::cerr << "init_upload: no file_id in response: " << response << std::endl;
+        }
+    } else {
+        std::cerr << "init_upload failed: " << curl_easy_strerror(res) << std::endl;
+    }
+
+    curl_slist_free_all(headers);
+    return file_id;
+}
+
+// asks the server which chunks of file_id it already holds; http_status is
+// set whenever the server answered, so callers can tell 404 from a network error
+bool get_upload_status(const std::string &file_id, const std::string &username, const std::string &password,
+                       std::vector<int> &received, bool &assembled, long &http_status) {
+    received.clear();
+    assembled = false;
+    http_status = 0;
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint("/api/upload/status/") + file_id;
+    std::string response;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    set_auth(curl, username, password);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, "status");
+    if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+    if (res != CURLE_OK) {
+        std::cerr << "get_upload_status failed: " << curl_easy_strerror(res) << std::endl;
+        return false;
+    }
+    if (http_status != 200) {
+        std::cerr << "get_upload_status: " << response << std::endl;
+        return false;
+    }
+
+    size_t a = response.find("\"assembled\"");
+    if (a != std::string::npos) {
+        size_t colon = response.find(":", a);
+        if (colon != std::string::npos) {
+            size_t v = response.find_first_not_of(" \t", colon + 1);
+            assembled = v != std::string::npos && response.compare(v, 4, "true") == 0;
+        }
+    }
+
+    size_t r = response.find("\"received\"");
+    if (r == std::string::npos) return true;
+    size_t lb = response.find("[", r), rb = response.find("]", r);
+    if (lb == std::string::npos || rb == std::string::npos || rb < lb) return true;
+    std::istringstream list(response.substr(lb + 1, rb - lb - 1));
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        char* end = nullptr;
+        long v = strtol(item.c_str(), &end, 10);
+        if (end != item.c_str()) received.push_back((int)v);
+    }
+    return true;
+}
+
+// A window [offset, offset + size) of the source file, fed to curl as the
+// chunk body with pread so no chunk is ever staged or held in memory. When
+// `mem` is set the body is that buffer instead (a deflated chunk).
+struct ChunkSource {
+    int fd = -1;
+    off_t offset = 0;
+    curl_off_t size = 0;
+    curl_off_t pos = 0;
+    const char* mem = nullptr;
+};
+
+static size_t chunk_read_cb(char* buffer, size_t size, size_t nitems, void* arg) {
+    ChunkSource* src = (ChunkSource*)arg;
+    curl_off_t left = src->size - src->pos;
+    size_t want = size * nitems;
+    if ((curl_off_t)want > left) want = (size_t)left;
+    if (want == 0) return 0;
+    if (src->mem) {
+        memcpy(buffer, src->mem + src->pos, want);
+        src->pos += (curl_off_t)want;
+        return want;
+    }
+    ssize_t n = pread(src->fd, buffer, want, src->offset + (off_t)src->pos);
+    if (n <= 0) return CURL_READFUNC_ABORT; // source shrank or I/O error
+    src->pos += n;
+    return (size_t)n;
+}
+
+static int chunk_seek_cb(void* arg, curl_off_t offset, int origin) {
+    ChunkSource* src = (ChunkSource*)arg;
+    if (origin != SEEK_SET || offset < 0 || offset > src->size) return CURL_SEEKFUNC_CANTSEEK;
+    src->pos = offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+// One multipart POST: plain form fields followed by a body part that is a
+// window of a file. `tag` identifies the post to the caller (e.g. chunk index).
+struct ChunkPost {
+    int tag = -1;
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::string part_name = "chunk";
+    std::string part_filename;
+    ChunkSource src;
+    // optional field sent after the body whose value (a hex SHA-256) is
+    // computed by a worker while the body streams
+    std::string trailer_name;
+    std::shared_ptr<PendingChunk> trailer;
+    size_t trailer_pos = 0;
+    bool trailer_paused = false;
+    // start only once the trailer's worker is done, since it may replace
+    // the body and add fields
+    bool deferred = false;
+    // source bytes the post carries, for progress; the body may be smaller
+    curl_off_t raw_size = 0;
+    // how long the POST took, set before the done callback runs
+    double seconds = 0;
+};
+
+// the trailer is 64 hex digits; if its worker is not done yet the transfer
+// pauses here and run_chunk_posts resumes it once the digest is ready
+static size_t trailer_read_cb(char* buffer, size_t size, size_t nitems, void* arg) {
+    ChunkPost* post = (ChunkPost*)arg;
+    if (!post->trailer->ready.load(std::memory_order_acquire)) {
+        post->trailer_paused = true;
+        return CURL_READFUNC_PAUSE;
+    }
+    const std::string &hex = post->trailer->hex;
+    if (hex.size() != 64) return CURL_READFUNC_ABORT; // worker could not read the chunk
+    size_t n = std::min(size * nitems, hex.size() - post->trailer_pos);
+    memcpy(buffer, hex.data() + post->trailer_pos, n);
+    post->trailer_pos += n;
+    return n;
+}
+
+static int trailer_seek_cb(void* arg, curl_off_t offset, int origin) {
+    ChunkPost* post = (ChunkPost*)arg;
+    if (origin != SEEK_SET || offset < 0 || offset > 64) return CURL_SEEKFUNC_CANTSEEK;
+    post->trailer_pos = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+// builds the multipart form for one chunk POST on the given easy handle
+static curl_mime* build_post_form(CURL* curl, ChunkPost &post) {
+    curl_mime *form = curl_mime_init(curl);
+    curl_mimepart *part;
+    for (auto &f : post.fields) {
+        part = curl_mime_addpart(form);
+        curl_mime_name(part, f.first.c_str());
+        curl_mime_data(part, f.second.c_str(), f.second.size());
+    }
+
+    // what the worker of a deferred post produced
+    if (post.deferred) {
+        for (auto &f : post.trailer->fields) {
+            part = curl_mime_addpart(form);
+            curl_mime_name(part, f.first.c_str());
+            curl_mime_data(part, f.second.c_str(), f.second.size());
+        }
+        if (!post.trailer->body.empty()) {
+            post.src.mem = post.trailer->body.data();
+            post.src.size = (curl_off_t)post.trailer->body.size();
+        }
+    }
+
+    // body, read straight from the source file; the part filename is what
+    // makes the server treat it as a file field
+    part = curl_mime_addpart(form);
+    curl_mime_name(part, post.part_name.c_str());
+    curl_mime_filename(part, post.part_filename.c_str());
+    curl_mime_type(part, "application/octet-stream");
+    curl_mime_data_cb(part, post.src.size, chunk_read_cb, chunk_seek_cb, nullptr, &post.src);
+
+    if (post.trailer) {
+        part = curl_mime_addpart(form);
+        curl_mime_name(part, post.trailer_name.c_str());
+        curl_mime_data_cb(part, 64, trailer_read_cb, trailer_seek_cb, nullptr, &post);
+    }
+
+    return form;
+}
+
+// One POST slot. The easy handle lives for the whole run so connections
+// are reused; only the form and the response are per post. A busy slot holds
+// a post, which is on the wire once `started`.
+struct UploadSlot {
+    CURL* curl = nullptr;
+    curl_mime* form = nullptr;
+    bool busy = false;
+    bool started = false;
+    ChunkPost post;
+    std::string response;
+};
+
+static void release_slot(CURLM* multi, UploadSlot &s) {
+    if (!s.busy) return;
+    if (s.started) {
+        curl_multi_remove_handle(multi, s.curl);
+        curl_mime_free(s.form);
+    }
+    s.form = nullptr;
+    s.busy = false;
+    s.started = false;
+    s.post = ChunkPost(); // drops any buffer the post held
+}
+
+// Sends POSTs to `url` with up to `jobs` in flight on one curl_multi loop.
+// next() fills in the next post and returns false once there are none left;
+// done() is called as each post succeeds, in completion order, and may
+// return false to abort. Any failed post aborts the run. Each post is
+// recorded under its part name, and `progress` follows the posts' raw_size.
+static bool run_chunk_posts(const std::string &url, const std::string &username, const std::string &password, int jobs,
+                            const std::function<bool(ChunkPost &)> &next,
+                            const std::function<bool(const ChunkPost &, const std::string &)> &done,
+                            Progress* progress = nullptr) {
+    CURLM* multi = session_multi();
+    if (!multi) return false;
+    if (jobs < 1) jobs = 1;
+
+    // without this curl holds every large body back for up to a second
+    // waiting for a "100 Continue" the server never sends
+    struct curl_slist* headers = curl_slist_append(nullptr, "Expect:");
+
+    std::vector<UploadSlot> slots(jobs);
+    bool ok = true;
+    for (auto &s : slots) {
+        s.curl = session_new_handle();
+        if (!s.curl) { ok = false; break; }
+        curl_easy_setopt(s.curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(s.curl, CURLOPT_HTTPHEADER, headers);
+        set_auth(s.curl, username, password);
+        curl_easy_setopt(s.curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(s.curl, CURLOPT_WRITEDATA, &s.response);
+        curl_easy_setopt(s.curl, CURLOPT_PRIVATE, &s);
+    }
+
+    bool exhausted = false;
+    int in_flight = 0;
+    curl_off_t raw_done = 0;
+    while (ok && (!exhausted || in_flight > 0)) {
+        // keep the window full
+        for (auto &s : slots) {
+            if (s.busy || exhausted) continue;
+            s.post = ChunkPost();
+            if (!next(s.post)) { exhausted = true; break; }
+            s.busy = true;
+            in_flight++;
+        }
+        if (in_flight == 0) break;
+
+        // start posts whose body is ready and resume transfers that were
+        // waiting for their trailing digest
+        bool waiting = false;
+        for (auto &s : slots) {
+            if (s.busy && !s.started) {
+                if (s.post.deferred && !s.post.trailer->ready.load(std::memory_order_acquire)) {
+                    waiting = true;
+                    continue;
+                }
+                s.post.src.pos = 0;
+                s.form = build_post_form(s.curl, s.post);
+                s.response.clear();
+                s.started = true;
+                curl_easy_setopt(s.curl, CURLOPT_MIMEPOST, s.form);
+                curl_multi_add_handle(multi, s.curl);
+                continue;
+            }
+            if (!s.busy || !s.post.trailer_paused) continue;
+            if (s.post.trailer->ready.load(std::memory_order_acquire)) {
+                s.post.trailer_paused = false;
+                curl_easy_pause(s.curl, CURLPAUSE_CONT);
+            } else {
+                waiting = true;
+            }
+        }
+
+        int running = 0;
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc != CURLM_OK) {
+            std::cerr << "upload: " << curl_multi_strerror(mc) << std::endl;
+            ok = false;
+            break;
+        }
+
+        CURLMsg* msg;
+        int queued = 0;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            UploadSlot* s = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&s);
+            long status = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+            s->post.seconds = record_request(msg->easy_handle, s->post.part_name, s->post.tag, msg->data.result).total;
+            int tag = s->post.tag;
+            if (msg->data.result != CURLE_OK) {
+                std::cerr << "upload_chunk failed: " << curl_easy_strerror(msg->data.result) << std::endl;
+                std::cerr << "Failed uploading chunk " << tag << std::endl;
+                ok = false;
+            } else if (status >= 400) {
+                std::cerr << "Failed uploading chunk " << tag << " (HTTP " << status << "): " << s->response << std::endl;
+                ok = false;
+            } else if (!done(s->post, s->response)) {
+                ok = false;
+            }
+            raw_done += s->post.raw_size;
+            release_slot(multi, *s);
+            in_flight--;
+        }
+
+        if (progress) {
+            // scale what in-flight posts have sent to the source bytes they carry
+            curl_off_t partial = 0;
+            for (auto &s : slots) {
+                if (!s.started || s.post.src.size <= 0) continue;
+                curl_off_t sent = 0;
+                curl_easy_getinfo(s.curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+                partial += std::min(s.post.raw_size, sent * s.post.raw_size / s.post.src.size);
+            }
+            progress->update(raw_done + partial);
+        }
+
+        // a transfer that paused for its digest during this perform has no
+        // socket activity to wake the poll
+        for (auto &s : slots)
+            if (s.busy && s.post.trailer_paused) waiting = true;
+        if (ok && (running > 0 || waiting)) curl_multi_poll(multi, nullptr, 0, waiting ? 5 : 1000, nullptr);
+    }
+
+    for (auto &s : slots) {
+        release_slot(multi, s);
+        if (s.curl) curl_easy_cleanup(s.curl);
+    }
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(headers);
+    return ok;
+}
+
+// Uploads the file with up to `jobs` chunk POSTs in flight on one curl_multi
+// loop. Chunks complete out of order; the server assembles once it holds all.
+// The chunk size is chosen per upload from the link (see Chunk sizing) and
+// kept in the journal, so a resumed upload continues with the same size.
+// Progress is journaled, and with `resume` an interrupted upload of the same
+// unchanged file continues with only the chunks the server is missing. With
+// `compress`, chunks that shrink are sent deflated. The file is stored under
+// `remote_name`, or its basename if that is empty; on success its file_id is
+// stored in `uploaded_id` if given.
+bool upload_file(const std::string &path, const std::string &username, const std::string &password, int jobs, bool resume,
+                 bool compress, const std::string &remote_name, std::string* uploaded_id) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        std::cerr << "Cannot stat file: " << path << std::endl;
+        return false;
+    }
+    long total_size = (long)st.st_size;
+
+    std::string filename = remote_name;
+    if (filename.empty()) {
+        size_t pos = path.find_last_of("/\\");
+        if (pos == std::string::npos) filename = path;
+        else filename = path.substr(pos + 1);
+    }
+
+    char* real = realpath(path.c_str(), nullptr);
+    std::string source = real ? real : path;
+    free(real);
+
+    UploadJournal journal;
+    bool resumed = false;
+    if (resume && journal_find(source, filename, st, journal)) {
+        std::vector<int> received;
+        bool assembled = false;
+        long http_status = 0;
+        if (get_upload_status(journal.file_id, username, password, received, assembled, http_status)) {
+            if (assembled) {
+                std::cout << "Upload already complete for " << path << std::endl;
+                journal_remove(journal);
+                return true;
+            }
+            // the server's list is the truth: a chunk it acked and then lost
+            // is sent again
+            journal.acked.assign(journal.total_chunks, false);
+            for (int i : received) if (i >= 0 && i < journal.total_chunks) journal.acked[i] = true;
+            resumed = true;
+        } else if (http_status == 404) {
+            std::cerr << "Server no longer has upload " << journal.file_id << "; starting over" << std::endl;
+            journal_remove(journal);
+            journal = UploadJournal();
+        } else {
+            close(journal.fd); // keep the journal for the next attempt
+            return false;
+        }
+    }
+
+    std::string file_id;
+    size_t chunk_size;
+    int total_chunks;
+    if (resumed) {
+        file_id = journal.file_id;
+        chunk_size = (size_t)journal.chunk_size;
+        total_chunks = journal.total_chunks;
+        std::cout << "Resuming upload " << file_id << std::endl;
+    } else {
+        chunk_size = choose_chunk_size(total_size, jobs, compress);
+        total_chunks = (int)((total_size + (long)chunk_size - 1) / (long)chunk_size);
+        file_id = init_upload(filename, total_size, username, password,
+                              server_limits().adaptive ? chunk_size : 0);
+        if (file_id.empty()) {
+            std::cerr << "init_upload failed" << std::endl;
+            return false;
+        }
+        journal.file_id = file_id;
+        journal.source = source;
+        journal.name = filename;
+        journal.size = total_size;
+        journal.mtime_ns = mtime_ns_of(st);
+        journal.chunk_size = (long)chunk_size;
+        journal.total_chunks = total_chunks;
+        if (!journal_create(journal)) {
+            std::cerr << "Warning: cannot write upload journal; --resume will not be possible" << std::endl;
+            journal.acked.assign(total_chunks, false);
+        }
+    }
+
+    std::vector<int> pending;
+    for (int i = 0; i < total_chunks; ++i) if (!journal.acked[i]) pending.push_back(i);
+    // every chunk is stored but assembly never ran: resend one to trigger it
+    if (pending.empty() && total_chunks > 0) pending.push_back(total_chunks - 1);
+    if (total_chunks > 1)
+        std::cout << "Uploading " << total_chunks << " chunks of " << human_readable_size(chunk_size) << std::endl;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Unable to open file for reading: " << path << std::endl;
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::string url = endpoint("/api/upload/chunk");
+    std::string tots = std::to_string(total_chunks);
+    jobs = std::min(jobs, std::max((int)pending.size(), 1));
+
+    auto chunk_len = [&](int idx) {
+        return std::min((curl_off_t)chunk_size, (curl_off_t)total_size - (curl_off_t)idx * (curl_off_t)chunk_size);
+    };
+
+    bool ok;
+    std::string server_digest, file_digest;
+    {
+        // Digests are computed off the network thread. The file hasher
+        // reads the whole file in order alongside the transfer and takes
+        // each chunk's digest in the same pass; with compress, workers
+        // deflate (and hash) each chunk a window ahead of its POST instead.
+        std::atomic<bool> stop{false};
+        WorkerPool pool(hash_threads());
+        std::vector<std::shared_ptr<PendingChunk>> digests(pending.size());
+        std::vector<std::shared_ptr<PendingChunk>> by_index(compress ? 0 : total_chunks);
+        if (!compress)
+            for (size_t i = 0; i < pending.size(); ++i)
+                by_index[pending[i]] = digests[i] = std::make_shared<PendingChunk>();
+        PrefixHasher file_hasher(fd, total_size, compress ? 0 : (curl_off_t)chunk_size,
+                                 [&by_index](int index, const std::string &hex) {
+                                     if (!by_index[index]) return;
+                                     by_index[index]->hex = hex;
+                                     by_index[index]->ready.store(true, std::memory_order_release);
+                                 });
+        file_hasher.advance(total_size);
+
+        size_t hashed = compress ? 0 : pending.size();
+        auto hash_ahead = [&](size_t upto) {
+            for (; hashed < std::min(upto, pending.size()); ++hashed) {
+                auto d = std::make_shared<PendingChunk>();
+                digests[hashed] = d;
+                off_t off = (off_t)pending[hashed] * (off_t)chunk_size;
+                curl_off_t len = chunk_len(pending[hashed]);
+                pool.submit([d, fd, off, len, compress, &stop] {
+                    if (!stop.load()) digest_chunk(fd, off, len, compress, *d);
+                    d->ready.store(true, std::memory_order_release);
+                });
+            }
+        };
+        long long raw_bytes = 0, sent_bytes = 0;
+        double post_seconds = 0;
+        int deflated = 0;
+        curl_off_t pending_bytes = 0;
+        for (int idx : pending) pending_bytes += chunk_len(idx);
+        Progress progress(filename, pending_bytes);
+
+        size_t next = 0;
+        ok = run_chunk_posts(url, username, password, jobs,
+            [&](ChunkPost &post) {
+                if (next >= pending.size()) return false;
+                hash_ahead(next + (size_t)jobs + 1);
+                int idx = pending[next];
+                post.tag = idx;
+                post.fields = {{"file_id", file_id}, {"chunk_index", std::to_string(idx)},
+                               {"total_chunks", tots}, {"filename", filename}};
+                post.part_filename = filename + ".part" + std::to_string(idx);
+                post.src.fd = fd;
+                post.src.offset = (off_t)idx * (off_t)chunk_size;
+                post.src.size = chunk_len(idx);
+                post.raw_size = post.src.size;
+                post.trailer_name = "chunk_sha256";
+                post.trailer = std::move(digests[next++]);
+                post.deferred = compress;
+                return true;
+            },
+            [&](const ChunkPost &post, const std::string &response) {
+                if (!progress.live()) std::cout << "Uploaded chunk " << post.tag << " response: " << response << std::endl;
+                raw_bytes += chunk_len(post.tag);
+                sent_bytes += post.src.size;
+                post_seconds += post.seconds;
+                if (post.src.mem) deflated++;
+                journal_ack(journal, post.tag);
+                if (response.find("\"assembled\"") != std::string::npos) server_digest = json_string_field(response, "sha256");
+                return true;
+            }, &progress);
+        stop.store(true);
+        progress.finish();
+        if (ok) record_link_throughput(raw_bytes, post_seconds);
+        if (ok && !server_digest.empty()) file_digest = file_hasher.finish();
+        if (ok && compress && raw_bytes > 0)
+            std::cout << "Compressed " << deflated << " of " << pending.size() << " chunks: sent "
+                      << human_readable_size(sent_bytes) << " for " << human_readable_size(raw_bytes) << std::endl;
+    }
+    close(fd);
+
+    if (ok && !server_digest.empty()) {
+        if (file_digest.empty()) {
+            std::cerr << "Warning: could not re-read " << path << " to verify the upload" << std::endl;
+        } else if (file_digest != server_digest) {
+            std::cerr << "Integrity check failed: server assembled sha256 " << server_digest
+                      << " but the local file is " << file_digest << " (was it modified during the upload?)" << std::endl;
+            journal_remove(journal); // the server copy is complete, resuming cannot fix it
+            ok = false;
+        } else {
+            std::cout << "Verified sha256 " << file_digest << std::endl;
+        }
+    }
+
+    if (ok) {
+        journal_remove(journal);
+        if (uploaded_id) *uploaded_id = file_id;
+        std::cout << "Upload complete for " << path << std::endl;
+    } else {
+        if (journal.fd >= 0) close(journal.fd);
+        if (!journal.journal_path.empty())
+            std::cerr << "Run 'netserve upload " << path << " --resume' to continue this upload" << std::endl;
+    }
+    return ok;
+}
+
+// Stream uploads cut chunks from stdin as it is read, so they hold them in
+// memory, each at most STREAM_MAX_CHUNK: jobs + 1 queued ahead of the posts,
+// jobs in flight and the one being read, 2 * jobs + 2 in all.
+static const size_t STREAM_MAX_CHUNK = 32ull * 1024 * 1024;
+
+// servers without adaptive limits accept any chunk up to CHUNK_SIZE, so the
+// stream cap applies to them as well
+static size_t stream_chunk_size(const ServerLimits &limits, int jobs, bool compress) {
+    if (!limits.adaptive) return STREAM_MAX_CHUNK;
+    return std::max(std::min(choose_chunk_size(0, jobs, compress), STREAM_MAX_CHUNK), limits.min_chunk);
+}
+
+// hashes (and with compress possibly deflates) a chunk read into d.body
+static void digest_buffer(PendingChunk &d, bool compress) {
+    d.hex = sha256_hex(d.body.data(), d.body.size());
+    if (compress && deflate_buffer(d.body)) d.fields = {{"chunk_encoding", "deflate"}};
+}
+
+// reads up to n bytes, stopping early only at end of input; -1 on errors
+static ssize_t read_full(int fd, char* buf, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = read(fd, buf + got, n - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+// Uploads standard input as `name` without knowing its length. A reader
+// thread cuts chunks and keeps up to jobs + 1 of them queued while the posts
+// run; every chunk but the last goes out without total_chunks, and the last
+// is held back until the others are stored, then sent with the final count
+// so the server completes the upload. The input's SHA-256 is taken as it is
+// read and checked against the server's. Nothing is journaled: a pipe cannot
+// be replayed, so an interrupted stream upload is started over.
+bool upload_stream(const std::string &name, const std::string &username, const std::string &password, int jobs,
+                   bool compress) {
+    size_t chunk_size = stream_chunk_size(server_limits(), jobs, compress);
+    std::string file_id = init_upload(name, 0, username, password, server_limits().adaptive ? chunk_size : 0);
+    if (file_id.empty()) {
+        std::cerr << "init_upload failed" << std::endl;
+        return false;
+    }
+
+    struct StreamChunk { int index; std::shared_ptr<PendingChunk> data; size_t size; };
+    std::deque<StreamChunk> ready;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool eof = false, stop = false;
+    int read_errno = 0;
+    long long total_bytes = 0;
+    std::string stream_digest;
+    WorkerPool pool(hash_threads());
+
+    std::thread reader([&] {
+        Sha256 sha;
+        for (int index = 0;; ++index) {
+            auto d = std::make_shared<PendingChunk>();
+            d->body.resize(chunk_size);
+            ssize_t n = read_full(STDIN_FILENO, &d->body[0], chunk_size);
+            std::unique_lock<std::mutex> lock(mu);
+            if (n < 0) {
+                read_errno = errno ? errno : EIO;
+                eof = true;
+                cv.notify_all();
+                return;
+            }
+            d->body.resize((size_t)n);
+            sha.update(d->body.data(), (size_t)n);
+            total_bytes += n;
+            // a short read is the end; a full one may be followed by an
+            // empty last chunk, which is how the server learns the count
+            bool last = (size_t)n < chunk_size;
+            cv.wait(lock, [&] { return stop || ready.size() <= (size_t)jobs; });
+            if (stop) return;
+            ready.push_back({index, d, (size_t)n});
+            pool.submit([d, compress] {
+                digest_buffer(*d, compress);
+                d->ready.store(true, std::memory_order_release);
+            });
+            if (last) {
+                stream_digest = sha.hex_digest();
+                eof = true;
+                cv.notify_all();
+                return;
+            }
+            cv.notify_all();
+        }
+    });
+
+    // the next chunk from the reader; false once only the last is left,
+    // which is left at the front of the queue
+    auto take = [&](StreamChunk &out) {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return ready.size() > 1 || eof; });
+        if (ready.size() <= 1) return false;
+        out = ready.front();
+        ready.pop_front();
+        cv.notify_all();
+        return true;
+    };
+
+    std::string url = endpoint("/api/upload/chunk");
+    std::string server_digest;
+    long long raw_bytes = 0, sent_bytes = 0;
+    double post_seconds = 0;
+    int chunks = 0;
+    Progress progress(name, -1);
+    auto fill = [&](ChunkPost &post, const StreamChunk &c) {
+        post.tag = c.index;
+        post.fields = {{"file_id", file_id}, {"chunk_index", std::to_string(c.index)}, {"filename", name}};
+        post.part_filename = name + ".part" + std::to_string(c.index);
+        post.src.mem = c.data->body.data();
+        post.src.size = (curl_off_t)c.size;
+        post.raw_size = (curl_off_t)c.size;
+        post.trailer_name = "chunk_sha256";
+        post.trailer = c.data;
+        // the worker may swap the body for its deflated form
+        post.deferred = compress;
+    };
+    auto done = [&](const ChunkPost &post, const std::string &response) {
+        if (!progress.live()) std::cout << "Uploaded chunk " << post.tag << " response: " << response << std::endl;
+        raw_bytes += post.raw_size;
+        sent_bytes += post.src.size;
+        post_seconds += post.seconds;
+        chunks++;
+        if (response.find("\"assembled\"") != std::string::npos) server_digest = json_string_field(response, "sha256");
+        return true;
+    };
+
+    bool ok = run_chunk_posts(url, username, password, jobs,
+                              [&](ChunkPost &post) {
+                                  StreamChunk c;
+                                  if (!take(c)) return false;
+                                  fill(post, c);
+                                  return true;
+                              },
+                              done, &progress);
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return eof || !ok; });
+        stop = true;
+        cv.notify_all();
+    }
+    reader.join();
+    if (read_errno) {
+        std::cerr << "Error reading standard input: " << strerror(read_errno) << std::endl;
+        ok = false;
+    }
+    if (ok) {
+        // every other chunk is stored; the last one carries the count
+        StreamChunk last = ready.front();
+        bool sent = false;
+        ok = run_chunk_posts(url, username, password, 1,
+                             [&](ChunkPost &post) {
+                                 if (sent) return false;
+                                 fill(post, last);
+                                 post.fields.push_back({"total_chunks", std::to_string(last.index + 1)});
+                                 sent = true;
+                                 return true;
+                             },
+                             done, &progress);
+    }
+    progress.finish();
+    if (ok) record_link_throughput(raw_bytes, post_seconds);
+
+    if (ok && server_digest.empty()) {
+        std::cerr << "Server did not complete upload " << file_id << std::endl;
+        ok = false;
+    } else if (ok && server_digest != stream_digest) {
+        std::cerr << "Integrity check failed: server assembled sha256 " << server_digest << " but the input was "
+                  << stream_digest << std::endl;
+        ok = false;
+    }
+    if (ok) {
+        if (compress && raw_bytes > 0)
+            std::cout << "Sent " << human_readable_size(sent_bytes) << " for " << human_readable_size(raw_bytes)
+                      << std::endl;
+        std::cout << "Verified sha256 " << stream_digest << std::endl;
+        std::cout << "Upload complete for " << name << ": " << chunks << " chunks, "
+                  << human_readable_size((long)total_bytes) << std::endl;
+    }
+    return ok;
+}
+
+// ---------------- Content-defined chunking ----------------
+// FastCDC: a gear rolling hash picks cut points from the content itself, so an
+// insert or edit only changes the chunks around it and the rest dedupe against
+// what the server already stores. Cut-point skipping ignores the first
+// CDC_MIN_SIZE bytes of each chunk, and normalized chunking uses a stricter
+// mask before CDC_AVG_SIZE and a looser one after it to tighten the size spread.
+static const size_t CDC_MIN_SIZE = 512 * 1024;
+static const size_t CDC_AVG_SIZE = 2 * 1024 * 1024;
+static const size_t CDC_MAX_SIZE = 8 * 1024 * 1024;
+static const uint64_t CDC_MASK_S = ~0ull << (64 - 23); // avg bits + 2
+static const uint64_t CDC_MASK_L = ~0ull << (64 - 19); // avg bits - 2
+
+static const uint64_t* gear_table() {
+    static uint64_t table[256];
+    static std::once_flag ready;
+    std::call_once(ready, [] {
+        // fixed splitmix64 sequence so every client cuts identical content identically
+        uint64_t x = 0x6e657473657276ull;
+        for (auto &v : table) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            v = z ^ (z >> 31);
+        }
+    });
+    return table;
+}
+
+// returns the length of the chunk starting at data[0] out of n remaining bytes
+static size_t cdc_cut(const unsigned char* data, size_t n) {
+    if (n <= CDC_MIN_SIZE) return n;
+    const uint64_t* gear = gear_table();
+    size_t normal = std::min(n, CDC_AVG_SIZE);
+    size_t limit = std::min(n, CDC_MAX_SIZE);
+    uint64_t fp = 0;
+    size_t i = CDC_MIN_SIZE;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & CDC_MASK_S)) return i + 1;
+    }
+    for (; i < limit; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & CDC_MASK_L)) return i + 1;
+    }
+    return limit;
+}
+
+struct CdcChunk { off_t offset; size_t size; std::string hash; };
+
+// maps the file and splits it into content-defined chunks with their SHA-256,
+// hashing the whole file in the same pass
+static bool cdc_split(int fd, size_t size, std::vector<CdcChunk> &out, std::string &file_digest) {
+    out.clear();
+    Sha256 file_sha;
+    if (size == 0) {
+        file_digest = file_sha.hex_digest();
+        return true;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+    const unsigned char* data = (const unsigned char*)map;
+    size_t off = 0;
+    while (off < size) {
+        size_t len = cdc_cut(data + off, size - off);
+        out.push_back({(off_t)off, len, sha256_hex(data + off, len)});
+        file_sha.update(data + off, len);
+        off += len;
+    }
+    munmap(map, size);
+    file_digest = file_sha.hex_digest();
+    return true;
+}
+
+// POSTs a JSON body on the session handle; returns false on transport errors
+static bool post_json(const std::string &path, const std::string &json, const std::string &username,
+                      const std::string &password, std::string &response, long &http_status) {
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint(path);
+
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    response.clear();
+    http_status = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)json.size());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    set_auth(curl, username, password);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, path.substr(path.find_last_of('/') + 1));
+    if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+    else std::cerr << path << " failed: " << curl_easy_strerror(res) << std::endl;
+    curl_slist_free_all(headers);
+    return res == CURLE_OK;
+}
+
+// asks the chunk store which of `hashes` it lacks, in bounded batches
+static bool query_missing_chunks(const std::vector<std::string> &hashes, const std::string &username,
+                                 const std::string &password, std::set<std::string> &missing) {
+    static const size_t BATCH = 1000;
+    for (size_t i = 0; i < hashes.size(); i += BATCH) {
+        std::string json = "{\"hashes\":[";
+        for (size_t j = i; j < std::min(hashes.size(), i + BATCH); ++j) {
+            if (j > i) json += ",";
+            json += "\"" + hashes[j] + "\"";
+        }
+        json += "]}";
+        std::string response;
+        long status = 0;
+        if (!post_json("/api/chunks/query", json, username, password, response, status)) return false;
+        if (status != 200) {
+            std::cerr << "chunk query failed (HTTP " << status << "): " << response << std::endl;
+            return false;
+        }
+        for (auto &h : json_string_list(response, "missing")) missing.insert(h);
+    }
+    return true;
+}
+
+// Uploads the file as content-defined chunks into the server's deduplicated
+// chunk store, sending only chunks it lacks, then records the file as a
+// manifest of chunk hashes. Rerunning after a failure only sends what is
+// still missing.
+bool upload_file_cdc(const std::string &path, const std::string &username, const std::string &password, int jobs) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Cannot open file: " << path << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    std::string filename;
+    size_t pos = path.find_last_of("/\\");
+    if (pos == std::string::npos) filename = path;
+    else filename = path.substr(pos + 1);
+
+    std::vector<CdcChunk> chunks;
+    std::string file_digest;
+    if (!cdc_split(fd, (size_t)st.st_size, chunks, file_digest)) {
+        std::cerr << "Unable to map file for chunking: " << path << std::endl;
+        close(fd);
+        return false;
+    }
+
+    std::vector<std::string> unique;
+    std::map<std::string, size_t> first_seen; // hash -> index of first chunk with it
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (first_seen.emplace(chunks[i].hash, i).second) unique.push_back(chunks[i].hash);
+    }
+
+    std::set<std::string> missing;
+    if (!query_missing_chunks(unique, username, password, missing)) { close(fd); return false; }
+
+    std::string manifest_chunks;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i) manifest_chunks += ",";
+        manifest_chunks += "{\"hash\":\"" + chunks[i].hash + "\",\"size\":" + std::to_string(chunks[i].size) + "}";
+    }
+
+    // the file is registered only once its chunks are stored, so a failed
+    // send leaves no entry behind
+    std::string file_id;
+    size_t sent_chunks = 0, sent_bytes = 0;
+    bool ok = true;
+    // the second round covers chunks the store dropped between query and commit
+    for (int round = 0; ok && round < 2; ++round) {
+        std::vector<size_t> todo;
+        for (auto &h : missing) todo.push_back(first_seen[h]);
+        std::sort(todo.begin(), todo.end());
+
+        curl_off_t todo_bytes = 0;
+        for (size_t i : todo) todo_bytes += (curl_off_t)chunks[i].size;
+        Progress progress(filename, todo_bytes);
+
+        size_t next = 0;
+        ok = run_chunk_posts(endpoint("/api/chunks/upload"), username, password,
+                             std::min(jobs, std::max((int)todo.size(), 1)),
+            [&](ChunkPost &post) {
+                if (next >= todo.size()) return false;
+                const CdcChunk &c = chunks[todo[next]];
+                post.tag = (int)todo[next++];
+                post.fields = {{"hash", c.hash}};
+                post.part_filename = c.hash;
+                post.src.fd = fd;
+                post.src.offset = c.offset;
+                post.src.size = (curl_off_t)c.size;
+                post.raw_size = post.src.size;
+                return true;
+            },
+            [&](const ChunkPost &post, const std::string &) {
+                sent_chunks++;
+                sent_bytes += (size_t)post.src.size;
+                return true;
+            }, &progress);
+        progress.finish();
+        if (!ok) break;
+
+        if (file_id.empty()) file_id = init_upload(filename, (long)st.st_size, username, password);
+        if (file_id.empty()) {
+            std::cerr << "init_upload failed" << std::endl;
+            ok = false;
+            break;
+        }
+        std::string manifest = "{\"file_id\":\"" + file_id + "\",\"sha256\":\"" + file_digest + "\",\"chunks\":[" +
+                               manifest_chunks + "]}";
+        std::string response;
+        long status = 0;
+        if (!post_json("/api/upload/manifest", manifest, username, password, response, status)) { ok = false; break; }
+        if (status == 200) break;
+        std::vector<std::string> gone = json_string_list(response, "missing");
+        if (status != 409 || gone.empty() || round == 1) {
+            std::cerr << "manifest commit failed (HTTP " << status << "): " << response << std::endl;
+            ok = false;
+            break;
+        }
+        missing = std::set<std::string>(gone.begin(), gone.end());
+    }
+    close(fd);
+    if (!ok && !file_id.empty()) {
+        std::string response;
+        long status = 0;
+        post_json("/api/file/delete_batch", "{\"file_ids\":[" + json_quote(file_id) + "]}", username, password,
+                  response, status);
+    }
+
+    if (ok) {
+        std::cout << "Upload complete for " << path << ": " << chunks.size() << " chunks, sent "
+                  << sent_chunks << " (" << sent_bytes << " bytes), deduplicated "
+                  << ((size_t)st.st_size - std::min((size_t)st.st_size, sent_bytes)) << " bytes" << std::endl;
+    }
+    return ok;
+}
+
+// ---------------- Directory upload ----------------
+// `upload -r` walks the tree on a pool of threads. Files up to
+// BUNDLE_FILE_LIMIT are registered with batched init requests and sent packed
+// back to back into bundle POSTs; larger files go through upload_file. Files
+// are named by their path relative to the directory.
+static const curl_off_t BUNDLE_FILE_LIMIT = 1024 * 1024;
+static const curl_off_t BUNDLE_SIZE = 8 * 1024 * 1024;
+static const size_t BUNDLE_MAX_FILES = 1000;
+static const size_t INIT_BATCH_FILES = 5000; // server MAX_BATCH_FILES
+static const unsigned WALK_THREADS = 8;
+
+struct TreeFile {
+    std::string path;
+    std::string rel;
+    curl_off_t size;
+    long long mtime_ns;
+    uint64_t inode;
+};
+
+// collects the regular files under root, sorted by relative path; symlinks
+// and special files are skipped. false if any directory could not be read
+static bool walk_tree(const std::string &root, std::vector<TreeFile> &out) {
+    std::mutex mu;
+    std::condition_variable cv;
+    int outstanding = 1;
+    bool ok = true;
+    std::function<void(const std::string &)> visit;
+    WorkerPool pool(WALK_THREADS); // joined before visit goes away
+
+    visit = [&](const std::string &rel) {
+        std::string dir = rel.empty() ? root : root + "/" + rel;
+        std::vector<TreeFile> files;
+        std::vector<std::string> subdirs;
+        std::string failed;
+        int err = 0;
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            failed = dir;
+            err = errno;
+        } else {
+            struct dirent* e;
+            while ((e = readdir(d))) {
+                std::string name = e->d_name;
+                if (name == "." || name == "..") continue;
+                std::string child = rel.empty() ? name : rel + "/" + name;
+                struct stat st;
+                if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    failed = root + "/" + child;
+                    err = errno;
+                    continue;
+                }
+                if (S_ISDIR(st.st_mode)) subdirs.push_back(child);
+                else if (S_ISREG(st.st_mode))
+                    files.push_back({root + "/" + child, child, (curl_off_t)st.st_size, mtime_ns_of(st), (uint64_t)st.st_ino});
+            }
+            closedir(d);
+        }
+
+        std::lock_guard<std::mutex> lock(mu);
+        if (!failed.empty()) {
+            std::cerr << "Cannot read " << failed << ": " << strerror(err) << std::endl;
+            ok = false;
+        }
+        out.insert(out.end(), files.begin(), files.end());
+        for (auto &sub : subdirs) {
+            outstanding++;
+            pool.submit([&visit, sub] { visit(sub); });
+        }
+        if (--outstanding == 0) cv.notify_all();
+    };
+
+    pool.submit([&visit] { visit(""); });
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return outstanding == 0; });
+    }
+    std::sort(out.begin(), out.end(), [](const TreeFile &a, const TreeFile &b) { return a.rel < b.rel; });
+    return ok;
+}
+
+// The name a tree member is stored under. Servers keep files in one flat
+// directory and reduce names to [A-Za-z0-9_.-], so '/' becomes '_' and every
+// other byte that would be lost or clash escapes as "-xx" in hex ("--" for
+// '-'): src/main.cpp stays src_main.cpp, while a/b_c and a_b/c stay apart.
+static std::string tree_member_name(const std::string &rel) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (size_t i = 0; i < rel.size(); ++i) {
+        unsigned char c = (unsigned char)rel[i];
+        bool edge = i == 0 || i + 1 == rel.size(); // a leading or trailing '.' would be stripped
+        if (c == '/') out += '_';
+        else if (c == '-') out += "--";
+        else if (std::isalnum(c) || (c == '.' && !edge)) out += (char)c;
+        else out += std::string("-") + digits[c >> 4] + digits[c & 15];
+    }
+    return out;
+}
+
+// registers files with /api/upload/init_batch, INIT_BATCH_FILES per request
+static bool init_upload_batch(const std::vector<const TreeFile*> &files, const std::string &username,
+                              const std::string &password, std::vector<std::string> &file_ids) {
+    file_ids.clear();
+    for (size_t first = 0; first < files.size(); first += INIT_BATCH_FILES) {
+        size_t last = std::min(files.size(), first + INIT_BATCH_FILES);
+        std::ostringstream json;
+        json << "{\"files\":[";
+        for (size_t i = first; i < last; ++i) {
+            if (i > first) json << ",";
+            json << "{\"filename\":" << json_quote(tree_member_name(files[i]->rel)) << ",\"total_size\":"
+                 << files[i]->size << "}";
+        }
+        json << "]}";
+        std::string response;
+        long http_status = 0;
+        if (!post_json("/api/upload/init_batch", json.str(), username, password, response, http_status)) return false;
+        std::vector<std::string> ids = json_string_list(response, "file_ids");
+        if (http_status != 201 || ids.size() != last - first) {
+            std::cerr << "init_batch failed (HTTP " << http_status << "): " << response << std::endl;
+            return false;
+        }
+        file_ids.insert(file_ids.end(), ids.begin(), ids.end());
+    }
+    return true;
+}
+
+// deletes registrations a failed tree upload leaves behind; best effort,
+// since the server drops those of a bundle it rejects on its own
+static void drop_registrations(const std::vector<std::string> &file_ids, const std::string &username,
+                               const std::string &password) {
+    for (size_t first = 0; first < file_ids.size(); first += INIT_BATCH_FILES) {
+        size_t last = std::min(file_ids.size(), first + INIT_BATCH_FILES);
+        std::string json = "{\"file_ids\":[";
+        for (size_t i = first; i < last; ++i) json += (i > first ? "," : "") + json_quote(file_ids[i]);
+        json += "]}";
+        std::string response;
+        long http_status = 0;
+        post_json("/api/file/delete_batch", json, username, password, response, http_status);
+    }
+}
+
+// files[first, first + count) sent in one POST
+struct Bundle { size_t first; size_t count; curl_off_t bytes; };
+
+// reads a bundle's files back to back into out.body and hashes it; with
+// `compress` the body is deflated when that pays off
+static void build_bundle(const std::vector<const TreeFile*> &files, const Bundle &b, bool compress, PendingChunk &out) {
+    std::string body;
+    body.reserve((size_t)b.bytes);
+    for (size_t i = b.first; i < b.first + b.count; ++i) {
+        const TreeFile &f = *files[i];
+        int fd = open(f.path.c_str(), O_RDONLY);
+        size_t at = body.size();
+        body.resize(at + (size_t)f.size);
+        curl_off_t done = 0;
+        while (fd >= 0 && done < f.size) {
+            ssize_t n = pread(fd, &body[at + (size_t)done], (size_t)(f.size - done), (off_t)done);
+            if (n <= 0) break;
+            done += n;
+        }
+        if (fd >= 0) close(fd);
+        if (done < f.size) {
+            std::cerr << "Cannot read " << f.path << " (was it changed during the upload?)" << std::endl;
+            return; // empty hex aborts the post
+        }
+    }
+    out.hex = sha256_hex(body.data(), body.size());
+    if (compress && deflate_buffer(body)) out.fields = {{"chunk_encoding", "deflate"}};
+    out.body.swap(body);
+}
+
+// Uploads the given files, named by tree_member_name of their relative
+// paths. Small files take one init request per INIT_BATCH_FILES and one POST
+// per bundle, with up to `jobs` bundles in flight while workers read the
+// next ones; larger files go through upload_file. On success file_ids[i] is
+// the new id of files[i]; on failure the small files whose bundle was not
+// stored are unregistered again.
+static bool upload_tree_files(const std::vector<const TreeFile*> &files, const std::string &username,
+                              const std::string &password, int jobs, bool compress, std::vector<std::string> &file_ids) {
+    file_ids.assign(files.size(), "");
+    std::vector<const TreeFile*> small;
+    std::vector<size_t> small_at, large_at;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i]->size <= BUNDLE_FILE_LIMIT) {
+            small.push_back(files[i]);
+            small_at.push_back(i);
+        } else {
+            large_at.push_back(i);
+        }
+    }
+
+    std::vector<Bundle> bundles;
+    for (size_t i = 0; i < small.size(); ++i) {
+        if (bundles.empty() || bundles.back().count >= BUNDLE_MAX_FILES ||
+            bundles.back().bytes + small[i]->size > BUNDLE_SIZE)
+            bundles.push_back({i, 0, 0});
+        bundles.back().count++;
+        bundles.back().bytes += small[i]->size;
+    }
+
+    std::vector<std::string> small_ids;
+    if (!small.empty() && !init_upload_batch(small, username, password, small_ids)) return false;
+
+    bool ok = true;
+    if (!bundles.empty()) {
+        std::atomic<bool> stop{false};
+        WorkerPool pool(hash_threads());
+        std::vector<std::shared_ptr<PendingChunk>> built(bundles.size());
+        size_t queued = 0;
+        auto build_ahead = [&](size_t upto) {
+            for (; queued < std::min(upto, bundles.size()); ++queued) {
+                auto d = std::make_shared<PendingChunk>();
+                built[queued] = d;
+                const Bundle* b = &bundles[queued];
+                pool.submit([d, b, &small, compress, &stop] {
+                    if (!stop.load()) build_bundle(small, *b, compress, *d);
+                    d->ready.store(true, std::memory_order_release);
+                });
+            }
+        };
+
+        curl_off_t bundle_bytes = 0;
+        for (const Bundle &b : bundles) bundle_bytes += (curl_off_t)b.bytes;
+        Progress progress(std::to_string(small.size()) + " small files", bundle_bytes);
+
+        size_t next = 0;
+        ok = run_chunk_posts(endpoint("/api/upload/bundle"), username, password, jobs,
+            [&](ChunkPost &post) {
+                if (next >= bundles.size()) return false;
+                build_ahead(next + (size_t)jobs + 1);
+                const Bundle &b = bundles[next];
+                std::ostringstream list;
+                list << "[";
+                for (size_t i = b.first; i < b.first + b.count; ++i) {
+                    if (i > b.first) list << ",";
+                    list << "{\"file_id\":" << json_quote(small_ids[i]) << ",\"size\":" << small[i]->size << "}";
+                }
+                list << "]";
+                post.tag = (int)next;
+                post.fields = {{"files", list.str()}};
+                post.part_name = "bundle";
+                post.part_filename = "bundle" + std::to_string(next);
+                post.trailer_name = "chunk_sha256";
+                post.raw_size = (curl_off_t)b.bytes;
+                post.trailer = std::move(built[next++]);
+                post.deferred = true;
+                return true;
+            },
+            [&](const ChunkPost &post, const std::string &) {
+                const Bundle &b = bundles[post.tag];
+                for (size_t i = b.first; i < b.first + b.count; ++i) file_ids[small_at[i]] = small_ids[i];
+                if (!progress.live())
+                    std::cout << "Uploaded bundle " << post.tag << ": " << b.count << " files, "
+                              << human_readable_size((long)b.bytes) << std::endl;
+                return true;
+            }, &progress);
+        stop.store(true);
+        progress.finish();
+    }
+    if (!ok) {
+        std::vector<std::string> unsent;
+        for (size_t i = 0; i < small.size(); ++i)
+            if (file_ids[small_at[i]].empty()) unsent.push_back(small_ids[i]);
+        drop_registrations(unsent, username, password);
+    }
+
+    for (size_t k = 0; ok && k < large_at.size(); ++k) {
+        const TreeFile &f = *files[large_at[k]];
+        ok = upload_file(f.path, username, password, jobs, false, compress, tree_member_name(f.rel),
+                         &file_ids[large_at[k]]);
+    }
+    return ok;
+}
+
+// strips a trailing slash; false if root is not a directory
+static bool tree_root(const std::string &root, std::string &base) {
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        std::cerr << "Not a directory: " << root << std::endl;
+        return false;
+    }
+    base = root;
+    while (base.size() > 1 && base.back() == '/') base.pop_back();
+    return true;
+}
+
+// Uploads every file under root.
+bool upload_tree(const std::string &root, const std::string &username, const std::string &password, int jobs,
+                 bool compress) {
+    std::string base;
+    std::vector<TreeFile> files;
+    if (!tree_root(root, base) || !walk_tree(base, files)) return false;
+
+    std::vector<const TreeFile*> all;
+    curl_off_t small_count = 0, total_bytes = 0;
+    for (auto &f : files) {
+        all.push_back(&f);
+        if (f.size <= BUNDLE_FILE_LIMIT) small_count++;
+        total_bytes += f.size;
+    }
+    std::cout << "Found " << files.size() << " files under " << base << " (" << small_count
+              << " small, " << files.size() - small_count << " large)" << std::endl;
+
+    std::vector<std::string> file_ids;
+    bool ok = upload_tree_files(all, username, password, jobs, compress, file_ids);
+    if (ok)
+        std::cout << "Uploaded " << files.size() << " files (" << human_readable_size((long)total_bytes)
+                  << ") from " << base << std::endl;
+    return ok;
+}
+
+// ---------------- Listing / metadata ----------------
+struct FileEntry { std::string file_id; std::string filename; long size; std::string sha256; };
+
+// Streams the caller's files whose names start with `prefix` from
+// /api/files, a page at a time. Each page is parsed as it arrives and every
+// entry goes to on_entry as soon as its object closes, so memory stays flat
+// however many files the account has. With a validator, the first page is
+// requested conditionally: on 304 nothing is streamed and `not_modified` is
+// set; otherwise `etag` is the first page's ETag.
+static const int LIST_PAGE_SIZE = 1000;
+
+// a conditional request: the ETag sent as If-None-Match and what came back
+struct Validator {
+    std::string if_none_match;
+    std::string etag;
+    bool not_modified = false;
+};
+
+bool for_each_file(const std::string &username, const std::string &password, const std::string &prefix,
+                   const std::function<void(const FileEntry &)> &on_entry, Validator* validator) {
+    std::string cursor;
+    bool first = true;
+    do {
+        CURL* curl = session_handle();
+        if (!curl) return false;
+        char* p = curl_easy_escape(curl, prefix.c_str(), (int)prefix.size());
+        char* c = curl_easy_escape(curl, cursor.c_str(), (int)cursor.size());
+        std::string url = endpoint("/api/files") + "?limit=" + std::to_string(LIST_PAGE_SIZE) + "&prefix=" + p + "&cursor=" + c;
+        curl_free(p);
+        curl_free(c);
+
+        // depth 1 is the reply object, 2 the "files" array, 3 one entry
+        int depth = 0;
+        bool in_files = false;
+        std::string key;
+        FileEntry e;
+        cursor.clear();
+        JsonParser parser([&](JsonEvent ev, const std::string &text) {
+            switch (ev) {
+            case JsonEvent::BeginObject:
+            case JsonEvent::BeginArray:
+                depth++;
+                if (ev == JsonEvent::BeginArray && depth == 2) in_files = (key == "files");
+                if (ev == JsonEvent::BeginObject && depth == 3 && in_files) e = FileEntry{"", "", -1, ""};
+                break;
+            case JsonEvent::EndObject:
+            case JsonEvent::EndArray:
+                if (ev == JsonEvent::EndObject && depth == 3 && in_files && (!e.filename.empty() || !e.file_id.empty()))
+                    on_entry(e);
+                if (depth == 2) in_files = false;
+                depth--;
+                break;
+            case JsonEvent::Key:
+                key = text;
+                break;
+            case JsonEvent::String:
+                if (depth == 1 && key == "next_cursor") cursor = text;
+                else if (depth == 3 && in_files && key == "file_id") e.file_id = text;
+                else if (depth == 3 && in_files && key == "filename") e.filename = text;
+                else if (depth == 3 && in_files && key == "sha256") e.sha256 = text;
+                break;
+            case JsonEvent::Number:
+                if (depth == 3 && in_files && key == "size") e.size = strtol(text.c_str(), nullptr, 10);
+                break;
+            case JsonEvent::Literal:
+                break;
+            }
+        });
+
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        set_auth(curl, username, password);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, json_write_cb);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &parser);
+        std::string headers;
+        struct curl_slist* request_headers = nullptr;
+        if (first && validator) {
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+            if (!validator->if_none_match.empty()) {
+                request_headers = curl_slist_append(request_headers, ("If-None-Match: " + validator->if_none_match).c_str());
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+            }
+        }
+
+        CURLcode res = session_perform(curl, "list");
+        curl_slist_free_all(request_headers);
+        long status = 0;
+        if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if (first && validator && status == 304) {
+            validator->not_modified = true;
+            return true;
+        }
+        if (res != CURLE_OK || !parser.finish()) {
+            std::cerr << "get_files_meta failed: "
+                      << (parser.error().empty() ? curl_easy_strerror(res) : parser.error()) << std::endl;
+            return false;
+        }
+        if (first && validator) validator->etag = header_value(headers, "etag");
+        first = false;
+    } while (!cursor.empty());
+    return true;
+}
+
+// ---------------- Listing cache ----------------
+// The last full listing is kept under ~/.network_terminal_cache/, one file
+// per server and user, together with the ETag it was served with. Every
+// lookup revalidates it with If-None-Match; the server answers 304 until
+// any metadata changes, so an unchanged account costs one empty round trip
+// instead of a full listing. The file is used in place through mmap:
+//
+//   header | records (listing order) | id_order | name buckets | names
+//
+// Records are in the server's (filename, file_id) order, so prefix listings
+// are a binary search. id_order holds record numbers sorted by file_id for
+// exact and prefix id lookups, and the buckets are an open-addressed table
+// of record number + 1 keyed by the FNV-1a hash of the filename.
+static const char LISTING_MAGIC[8] = {'N', 'S', 'L', 'I', 'S', 'T', '1', '\0'};
+
+struct ListingHeader {
+    char magic[8];
+    char etag[64]; // NUL-terminated
+    uint64_t count;
+    uint64_t buckets; // power of two
+    uint64_t names_offset;
+};
+
+struct ListingRecord {
+    char file_id[40]; // NUL-terminated
+    int64_t size;
+    char sha256[64];
+    uint32_t name_off;
+    uint32_t name_len;
+};
+static_assert(sizeof(ListingRecord) == 120, "listing cache records are 120 bytes on disk");
+
+static std::string listing_cache_path(const std::string &username) {
+    const char* home = getenv("HOME");
+    std::string base;
+    if (home && home[0] != '\0') base = home;
+    else {
+        struct passwd *pw = getpwuid(getuid());
+        base = (pw && pw->pw_dir) ? pw->pw_dir : ".";
+    }
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << fnv1a64(g_base_url + "\n" + username);
+    return base + "/.network_terminal_cache/" + name.str() + ".listing";
+}
+
+// Lays out the cache image for a full listing, or returns "" if an entry
+// does not fit the fixed-size fields.
+static std::string listing_image(const std::string &etag, const std::vector<FileEntry> &entries) {
+    uint64_t buckets = 16;
+    while (buckets < entries.size() * 2) buckets <<= 1;
+
+    ListingHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LISTING_MAGIC, sizeof(LISTING_MAGIC));
+    memcpy(h.etag, etag.data(), etag.size());
+    h.count = entries.size();
+    h.buckets = buckets;
+    h.names_offset = sizeof(h) + entries.size() * (sizeof(ListingRecord) + sizeof(uint32_t)) + buckets * sizeof(uint32_t);
+
+    std::vector<ListingRecord> records(entries.size());
+    std::vector<uint32_t> id_order(entries.size()), table(buckets, 0);
+    std::string names;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const FileEntry &e = entries[i];
+        ListingRecord &r = records[i];
+        memset(&r, 0, sizeof(r));
+        if (e.file_id.size() >= sizeof(r.file_id) || e.sha256.size() > sizeof(r.sha256)) return "";
+        memcpy(r.file_id, e.file_id.data(), e.file_id.size());
+        memcpy(r.sha256, e.sha256.data(), e.sha256.size());
+        r.size = e.size;
+        r.name_off = (uint32_t)names.size();
+        r.name_len = (uint32_t)e.filename.size();
+        names += e.filename;
+        id_order[i] = (uint32_t)i;
+        uint64_t b = fnv1a64(e.filename) & (buckets - 1);
+        while (table[b]) b = (b + 1) & (buckets - 1);
+        table[b] = (uint32_t)i + 1;
+    }
+    std::sort(id_order.begin(), id_order.end(),
+              [&](uint32_t a, uint32_t b) { return strcmp(records[a].file_id, records[b].file_id) < 0; });
+
+    std::string out((const char*)&h, sizeof(h));
+    out.append((const char*)records.data(), records.size() * sizeof(ListingRecord));
+    out.append((const char*)id_order.data(), id_order.size() * sizeof(uint32_t));
+    out.append((const char*)table.data(), table.size() * sizeof(uint32_t));
+    out += names;
+    return out;
+}
+
+static bool listing_write(const std::string &path, const std::string &image) {
+    std::string dir = path.substr(0, path.find_last_of('/'));
+    if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) return false;
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) return false;
+    bool ok = write(fd, image.data(), image.size()) == (ssize_t)image.size();
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A cached listing, mapped from its file or held in memory when the file
+// could not be written. Empty if the file is missing or invalid.
+class ListingCache {
+public:
+    ListingCache() = default;
+    ~ListingCache() { unmap(); }
+    ListingCache(const ListingCache &) = delete;
+    ListingCache &operator=(const ListingCache &) = delete;
+
+    void load(const std::string &path) {
+        unmap();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ListingHeader)) {
+            void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                map_ = p;
+                len_ = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+        if (map_ && !attach((const char*)map_, len_)) unmap();
+    }
+
+    void adopt(std::string image) {
+        unmap();
+        owned_ = std::move(image);
+        attach(owned_.data(), owned_.size());
+    }
+
+    bool valid() const { return header_ != nullptr; }
+    std::string etag() const { return header_ ? header_->etag : ""; }
+    size_t size() const { return count_; }
+
+    FileEntry entry(size_t i) const {
+        const ListingRecord &r = records_[i];
+        return FileEntry{r.file_id, name(i), (long)r.size, std::string(r.sha256, strnlen(r.sha256, sizeof(r.sha256)))};
+    }
+
+    std::string name(size_t i) const { return std::string(names_ + records_[i].name_off, records_[i].name_len); }
+
+    // first record (in listing order) named `filename`, or -1
+    long find_name(const std::string &filename) const {
+        if (!buckets_) return -1;
+        for (uint64_t b = fnv1a64(filename) & (buckets_ - 1); table_[b]; b = (b + 1) & (buckets_ - 1)) {
+            uint32_t i = table_[b] - 1;
+            if (records_[i].name_len == filename.size() && memcmp(names_ + records_[i].name_off, filename.data(), filename.size()) == 0)
+                return (long)i;
+        }
+        return -1;
+    }
+
+    // record numbers whose file_id starts with `prefix`, in file_id order
+    std::vector<uint32_t> find_id_prefix(const std::string &prefix) const {
+        std::vector<uint32_t> out;
+        const uint32_t* end = id_order_ + count_;
+        const uint32_t* it = std::lower_bound(id_order_, end, prefix,
+            [&](uint32_t i, const std::string &p) { return strcmp(records_[i].file_id, p.c_str()) < 0; });
+        for (; it != end && strncmp(records_[*it].file_id, prefix.c_str(), prefix.size()) == 0; ++it) out.push_back(*it);
+        return out;
+    }
+
+    // first record whose name is not before `prefix`
+    size_t lower_bound_name(const std::string &prefix) const {
+        size_t lo = 0, hi = count_;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (name(mid) < prefix) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+private:
+    bool attach(const char* base, size_t len) {
+        const ListingHeader* h = (const ListingHeader*)base;
+        if (len < sizeof(ListingHeader) || memcmp(h->magic, LISTING_MAGIC, sizeof(LISTING_MAGIC)) != 0 ||
+            h->etag[sizeof(h->etag) - 1] != '\0' || h->buckets == 0 || (h->buckets & (h->buckets - 1)) != 0 ||
+            h->count >= h->buckets || h->names_offset > len ||
+            h->names_offset != sizeof(ListingHeader) + h->count * (sizeof(ListingRecord) + sizeof(uint32_t)) + h->buckets * sizeof(uint32_t))
+            return false;
+        const ListingRecord* records = (const ListingRecord*)(base + sizeof(ListingHeader));
+        const uint32_t* id_order = (const uint32_t*)(records + h->count);
+        const uint32_t* table = id_order + h->count;
+        size_t names_len = len - h->names_offset;
+        for (uint64_t i = 0; i < h->count; ++i) {
+            if ((uint64_t)records[i].name_off + records[i].name_len > names_len ||
+                records[i].file_id[sizeof(records[i].file_id) - 1] != '\0' || id_order[i] >= h->count) return false;
+        }
+        for (uint64_t b = 0; b < h->buckets; ++b)
+            if (table[b] > h->count) return false;
+        header_ = h;
+        records_ = records;
+        id_order_ = id_order;
+        table_ = table;
+        names_ = base + h->names_offset;
+        count_ = (size_t)h->count;
+        buckets_ = h->buckets;
+        return true;
+    }
+
+    void unmap() {
+        if (map_) munmap(map_, len_);
+        map_ = nullptr;
+        len_ = 0;
+        owned_.clear();
+        header_ = nullptr;
+        count_ = 0;
+        buckets_ = 0;
+    }
+
+    void* map_ = nullptr;
+    size_t len_ = 0;
+    std::string owned_;
+    const ListingHeader* header_ = nullptr;
+    const ListingRecord* records_ = nullptr;
+    const uint32_t* id_order_ = nullptr;
+    const uint32_t* table_ = nullptr;
+    const char* names_ = nullptr;
+    size_t count_ = 0;
+    uint64_t buckets_ = 0;
+};
+
+// Stores a freshly fetched full listing. It is only kept in memory when
+// the server sent no usable ETag or the cache file cannot be written.
+static bool listing_store(ListingCache &cache, const std::string &path, std::string etag,
+                          const std::vector<FileEntry> &entries) {
+    if (etag.size() >= sizeof(ListingHeader::etag)) etag.clear();
+    std::string image = listing_image(etag, entries);
+    if (image.empty()) {
+        std::cerr << "listing does not fit the cache format" << std::endl;
+        return false;
+    }
+    if (!etag.empty() && listing_write(path, image)) {
+        cache.load(path);
+        if (cache.valid()) return true;
+    } else {
+        unlink(path.c_str());
+    }
+    cache.adopt(std::move(image));
+    return true;
+}
+
+// Brings `cache` up to date with the server: a 304 keeps the cached
+// listing, anything else replaces it.
+static bool refresh_listing(const std::string &username, const std::string &password, ListingCache &cache) {
+    std::string path = listing_cache_path(username);
+    cache.load(path);
+    Validator v;
+    if (cache.valid()) v.if_none_match = cache.etag();
+    std::vector<FileEntry> entries;
+    if (!for_each_file(username, password, "", [&](const FileEntry &e) { entries.push_back(e); }, &v)) return false;
+    if (v.not_modified) return true;
+    return listing_store(cache, path, v.etag, entries);
+}
+
+// all of the caller's files, from the revalidated cache
+bool get_files_meta(const std::string &username, const std::string &password, std::vector<FileEntry> &out_items) {
+    out_items.clear();
+    ListingCache cache;
+    if (!refresh_listing(username, password, cache)) return false;
+    out_items.reserve(cache.size());
+    for (size_t i = 0; i < cache.size(); ++i) out_items.push_back(cache.entry(i));
+    return true;
+}
+
+// Prints the listing as it streams in; names longer than the column push
+// their size out rather than holding output back to measure every name.
+// While the cached listing is current it is printed from the cache, and a
+// full listing that streams in replaces it.
+bool list_files(const std::string &username, const std::string &password, const std::string &prefix) {
+    const int id_width = 10, name_width = 42;
+    size_t count = 0;
+    auto print = [&](const FileEntry &e) {
+        if (count++ == 0) {
+            std::cout << std::left << std::setw(id_width) << "FileID"
+                      << std::left << std::setw(name_width) << "Filename"
+                      << "Size\n";
+            std::cout << std::string(id_width + name_width + 6, '-') << "\n";
+        }
+        std::string short_id = e.file_id.size() > 8 ? e.file_id.substr(0,8) : e.file_id;
+        std::cout << std::left << std::setw(id_width) << short_id
+                  << std::left << std::setw(name_width) << (e.filename + " ")
+                  << human_readable_size(e.size) << "\n";
+    };
+
+    std::string path = listing_cache_path(username);
+    ListingCache cache;
+    cache.load(path);
+    Validator v;
+    if (cache.valid()) v.if_none_match = cache.etag();
+    std::vector<FileEntry> entries;
+    bool ok = for_each_file(username, password, prefix, [&](const FileEntry &e) {
+        print(e);
+        if (prefix.empty()) entries.push_back(e);
+    }, &v);
+    if (ok && v.not_modified) {
+        for (size_t i = cache.lower_bound_name(prefix); i < cache.size(); ++i) {
+            if (cache.name(i).compare(0, prefix.size(), prefix) != 0) break;
+            print(cache.entry(i));
+        }
+    } else if (ok && prefix.empty()) {
+        listing_store(cache, path, v.etag, entries);
+    }
+    if (ok && count == 0) std::cout << "Files: (none)\n";
+    return ok;
+}
+
+// ---------------- Share / Delete client ops ----------------
+// `share` and `delete` take any number of file IDs, ID prefixes, names and
+// name globs, resolved against a single listing fetch. More than one file
+// goes to the batch endpoints, up to BATCH_FILES per request, with all
+// requests in flight at once on one connection (as HTTP/2 streams where
+// the server negotiates it), so the server writes its metadata once per
+// batch instead of once per file. Servers without the batch endpoints get
+// one request per file.
+static const size_t BATCH_FILES = 1000;
+
+// file_id for an ID, unique ID prefix or name in a fetched listing
+static bool lookup_file_id(const ListingCache &cache, const std::string &id_or_name, std::string &out_file_id) {
     out_file_id.clear();
     bool looks_like_id = false;
     if (id_or_name.find("-") != std::string::npos) looks_like_id = true;
@@ -467,270 +3310,7147 @@ bool resolve_file_id(const std::string &id_or_name, const std::string &username,
         if (count_hex >= 8) looks_like_id = true;
     }
 
-    std::vector<FileEntry> items;
-    if (!get_files_meta(username, password, items)) return false;
+    if (looks_like_id) {
+        std::vector<uint32_t> matches = cache.find_id_prefix(id_or_name);
+        for (uint32_t i : matches) {
+            if (cache.entry(i).file_id == id_or_name) { out_file_id = id_or_name; return true; }
+        }
+        if (matches.size() == 1) { out_file_id = cache.entry(matches[0]).file_id; return true; }
+        if (matches.size() > 1) {
+            std::cerr << "'" << id_or_name << "' matches " << matches.size() << " file IDs; use more of the ID\n";
+            return false;
+        }
+    }
+
+    long i = cache.find_name(id_or_name);
+    if (i >= 0) { out_file_id = cache.entry((size_t)i).file_id; return true; }
+
+    return false;
+}
+
+static bool is_glob(const std::string &s) {
+    return s.find_first_of("*?[") != std::string::npos;
+}
+
+// file_ids for every target, in order and without repeats. A glob matches
+// file names and may match nothing; any other target must resolve.
+static bool resolve_targets(const std::vector<std::string> &targets, const std::string &username,
+                            const std::string &password, std::vector<std::string> &file_ids) {
+    file_ids.clear();
+    ListingCache cache;
+    if (!refresh_listing(username, password, cache)) return false;
+
+    std::set<std::string> seen;
+    bool ok = true;
+    for (const std::string &t : targets) {
+        if (is_glob(t)) {
+            for (size_t i = 0; i < cache.size(); ++i) {
+                if (fnmatch(t.c_str(), cache.name(i).c_str(), 0) != 0) continue;
+                std::string id = cache.entry(i).file_id;
+                if (seen.insert(id).second) file_ids.push_back(id);
+            }
+            continue;
+        }
+        std::string id;
+        if (!lookup_file_id(cache, t, id)) {
+            std::cerr << "Could not find file matching '" << t << "'\n";
+            ok = false;
+            continue;
+        }
+        if (seen.insert(id).second) file_ids.push_back(id);
+    }
+    return ok;
+}
+
+// JSON bodies for the batch endpoints, BATCH_FILES ids each; `extra` is
+// appended to every body
+static std::vector<std::string> batch_bodies(const std::vector<std::string> &file_ids, const std::string &extra) {
+    std::vector<std::string> bodies;
+    for (size_t i = 0; i < file_ids.size(); i += BATCH_FILES) {
+        std::string body = "{\"file_ids\":[";
+        for (size_t j = i; j < std::min(file_ids.size(), i + BATCH_FILES); ++j)
+            body += (j > i ? "," : "") + json_quote(file_ids[j]);
+        bodies.push_back(body + "]" + extra + "}");
+    }
+    return bodies;
+}
+
+// POSTs every body to `path` at once on one multi handle. The handles wait
+// for the first connection rather than opening their own and are capped at
+// one connection to the host, so they become streams of one HTTP/2
+// connection, or take turns on one keep-alive connection over HTTP/1.1.
+// `statuses` holds 0 for requests that got no answer.
+static bool post_json_multiplexed(const std::string &path, const std::vector<std::string> &bodies,
+                                  const std::string &username, const std::string &password, const std::string &kind,
+                                  std::vector<std::string> &responses, std::vector<long> &statuses) {
+    responses.assign(bodies.size(), "");
+    statuses.assign(bodies.size(), 0);
+    CURLM* multi = curl_multi_init();
+    if (!multi) return false;
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+
+    std::string url = endpoint(path);
+    struct curl_slist* headers = curl_slist_append(nullptr, "Content-Type: application/json");
+    std::vector<CURL*> handles;
+    bool ok = true;
+    for (size_t i = 0; i < bodies.size(); ++i) {
+        CURL* curl = session_new_handle();
+        if (!curl) { ok = false; break; }
+        handles.push_back(curl);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, bodies[i].c_str());
+        set_auth(curl, username, password);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responses[i]);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, (char*)(uintptr_t)i);
+        curl_multi_add_handle(multi, curl);
+    }
+
+    int running = ok ? 1 : 0;
+    while (running > 0) {
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc == CURLM_OK && running > 0) mc = curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+        if (mc != CURLM_OK) {
+            std::cerr << kind << ": " << curl_multi_strerror(mc) << std::endl;
+            ok = false;
+            break;
+        }
+        CURLMsg* msg;
+        int queued = 0;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            char* priv = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+            size_t i = (size_t)(uintptr_t)priv;
+            record_request(msg->easy_handle, kind, (int)i, msg->data.result);
+            if (msg->data.result == CURLE_OK) {
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &statuses[i]);
+            } else {
+                std::cerr << kind << " failed: " << curl_easy_strerror(msg->data.result) << std::endl;
+                ok = false;
+            }
+        }
+    }
+
+    for (CURL* curl : handles) {
+        curl_multi_remove_handle(multi, curl);
+        curl_easy_cleanup(curl);
+    }
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(headers);
+    return ok;
+}
+
+struct BatchResult {
+    std::string file_id, status, error;
+};
+
+// the "results" array of a batch reply
+static bool parse_batch_results(const std::string &response, std::vector<BatchResult> &results) {
+    // depth 1 is the reply object, 2 the "results" array, 3 one result
+    int depth = 0;
+    bool in_results = false;
+    std::string key;
+    BatchResult r;
+    JsonParser parser([&](JsonEvent ev, const std::string &text) {
+        switch (ev) {
+        case JsonEvent::BeginObject:
+        case JsonEvent::BeginArray:
+            depth++;
+            if (ev == JsonEvent::BeginArray && depth == 2) in_results = (key == "results");
+            if (ev == JsonEvent::BeginObject && depth == 3 && in_results) r = BatchResult();
+            break;
+        case JsonEvent::EndObject:
+        case JsonEvent::EndArray:
+            if (ev == JsonEvent::EndObject && depth == 3 && in_results) results.push_back(r);
+            if (depth == 2) in_results = false;
+            depth--;
+            break;
+        case JsonEvent::Key:
+            key = text;
+            break;
+        case JsonEvent::String:
+            if (depth == 3 && in_results && key == "file_id") r.file_id = text;
+            else if (depth == 3 && in_results && key == "status") r.status = text;
+            else if (depth == 3 && in_results && key == "error") r.error = text;
+            break;
+        case JsonEvent::Number:
+        case JsonEvent::Literal:
+            break;
+        }
+    });
+    return parser.feed(response.data(), response.size()) && parser.finish();
+}
+
+// Sends the ids to a batch endpoint and prints a line per file. Returns
+// false if any file failed; `unsupported` is set instead when the server
+// has no such endpoint.
+static bool run_batches(const std::string &path, const std::vector<std::string> &file_ids, const std::string &extra,
+                        const std::string &username, const std::string &password, const std::string &kind,
+                        bool &unsupported) {
+    unsupported = false;
+    std::vector<std::string> bodies = batch_bodies(file_ids, extra), responses;
+    std::vector<long> statuses;
+    bool ok = post_json_multiplexed(path, bodies, username, password, kind, responses, statuses);
+    size_t done = 0;
+    for (size_t i = 0; i < bodies.size(); ++i) {
+        if (statuses[i] == 0) continue;
+        if (statuses[i] == 404 && json_string_field(responses[i], "error") != "target user not found") {
+            unsupported = true;
+            return false;
+        }
+        std::vector<BatchResult> results;
+        if (statuses[i] != 200 || !parse_batch_results(responses[i], results)) {
+            std::cerr << kind << " failed (HTTP " << statuses[i] << "): " << responses[i] << std::endl;
+            ok = false;
+            continue;
+        }
+        for (const BatchResult &r : results) {
+            if (!r.error.empty()) {
+                std::cerr << r.file_id << ": " << r.error << std::endl;
+                ok = false;
+                continue;
+            }
+            std::cout << r.file_id << ": " << r.status << std::endl;
+            done++;
+        }
+    }
+    std::cout << done << " of " << file_ids.size() << " files done" << std::endl;
+    return ok;
+}
+
+// POST /api/file/share for one file; the server's reply goes to `response`
+static bool share_file_id(const std::string &file_id, const std::string &share_with, const std::string &username,
+                          const std::string &password, std::string &response) {
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint("/api/file/share");
+    std::string json = "{\"file_id\":" + json_quote(file_id) + ",\"share_with\":" + json_quote(share_with) + "}";
+
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    response.clear();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    set_auth(curl, username, password);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, "share");
+    bool ok = (res == CURLE_OK);
+    if (!ok) std::cerr << "share failed: " << curl_easy_strerror(res) << std::endl;
+
+    curl_slist_free_all(headers);
+    return ok;
+}
+
+bool client_share(const std::vector<std::string> &targets, const std::string &share_with, const std::string &username,
+                  const std::string &password) {
+    std::vector<std::string> file_ids;
+    if (!resolve_targets(targets, username, password, file_ids)) return false;
+    if (file_ids.empty()) {
+        std::cerr << "No files match\n";
+        return false;
+    }
+
+    std::string response;
+    if (file_ids.size() == 1) {
+        if (!share_file_id(file_ids[0], share_with, username, password, response)) return false;
+        std::cout << "Share response: " << response << std::endl;
+        return true;
+    }
+
+    bool unsupported = false;
+    bool ok = run_batches("/api/file/share_batch", file_ids, ",\"share_with\":" + json_quote(share_with), username,
+                          password, "share_batch", unsupported);
+    if (!unsupported) return ok;
+    ok = true;
+    for (const std::string &id : file_ids) {
+        if (!share_file_id(id, share_with, username, password, response)) ok = false;
+        else std::cout << "Share response: " << response << std::endl;
+    }
+    return ok;
+}
+
+// DELETE /api/file/<file_id>; the server's reply goes to `response`
+static bool delete_file_id(const std::string &file_id, const std::string &username, const std::string &password,
+                           std::string &response, long &http_status) {
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint("/api/file/") + file_id;
+
+    response.clear();
+    http_status = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+
+    set_auth(curl, username, password);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    CURLcode res = session_perform(curl, "delete");
+    if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+    else std::cerr << "delete failed: " << curl_easy_strerror(res) << std::endl;
+    return res == CURLE_OK;
+}
+
+bool client_delete(const std::vector<std::string> &targets, const std::string &username, const std::string &password) {
+    std::vector<std::string> file_ids;
+    if (!resolve_targets(targets, username, password, file_ids)) return false;
+    if (file_ids.empty()) {
+        std::cerr << "No files match\n";
+        return false;
+    }
+
+    std::string response;
+    long http_status = 0;
+    if (file_ids.size() == 1) {
+        bool ok = delete_file_id(file_ids[0], username, password, response, http_status);
+        if (ok) std::cout << "Delete response: " << response << std::endl;
+        return ok;
+    }
+
+    bool unsupported = false;
+    bool ok = run_batches("/api/file/delete_batch", file_ids, "", username, password, "delete_batch", unsupported);
+    if (!unsupported) return ok;
+    ok = true;
+    for (const std::string &id : file_ids) {
+        if (!delete_file_id(id, username, password, response, http_status)) ok = false;
+        else std::cout << "Delete response: " << response << std::endl;
+    }
+    return ok;
+}
+
+// ---------------- Delta upload ----------------
+// `upload --update <file>` replaces a stored file in place and sends only
+// what changed, the way rsync does. The server sends a signature per block
+// of its copy: an Adler-32 and a SHA-256. The client slides a window over
+// the local file with a rolling Adler-32. Where the checksum and then the
+// SHA-256 match a block, it sends an instruction to copy that block rather
+// than its bytes. The server builds the new version beside its copy, checks
+// the whole-file SHA-256 and renames it into place under the same file_id.
+// The local file is scanned in DELTA_SEGMENT pieces on the hashing workers.
+// A match never straddles two pieces, which costs at most one block each.
+static const size_t DELTA_MIN_BLOCK = 4 * 1024;
+static const size_t DELTA_MAX_BLOCK = 1024 * 1024;
+static const size_t DELTA_SEGMENT = 256 * 1024 * 1024;
+static const size_t DELTA_RECORD = 36; // Adler-32 + SHA-256 per block
+static const long long ADLER_MOD = 65521;
+
+// about the square root of the stored size, as rsync picks it, so large
+// files get fewer, larger blocks and a short signature list
+static size_t delta_block_size(long long size) {
+    size_t block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (long long)block * (long long)block < size) block *= 2;
+    return block;
+}
+
+struct BlockSignatures {
+    size_t block = 0;
+    long long size = 0;   // of the stored copy
+    std::string sha256;   // of the stored copy
+    std::string records;  // DELTA_RECORD bytes per block, the last block possibly short
+
+    size_t count() const { return records.size() / DELTA_RECORD; }
+    uint32_t weak(size_t i) const {
+        const unsigned char* p = (const unsigned char*)records.data() + i * DELTA_RECORD;
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+    const unsigned char* strong(size_t i) const { return (const unsigned char*)records.data() + i * DELTA_RECORD + 4; }
+};
+
+// The full-size blocks sorted by checksum, behind a bit filter so the
+// probe at every byte of the scan is usually a single load. A short last
+// block is not indexed; its bytes are sent instead.
+class SignatureIndex {
+public:
+    explicit SignatureIndex(const BlockSignatures &sigs) : sigs_(sigs) {
+        size_t full = (size_t)(sigs.size / (long long)sigs.block);
+        while (bits_ < 26 && ((size_t)1 << bits_) < full * 16) ++bits_;
+        filter_.assign(((size_t)1 << bits_) / 64, 0);
+        entries_.reserve(full);
+        for (size_t i = 0; i < full; ++i) {
+            uint32_t w = sigs.weak(i);
+            size_t s = slot(w);
+            filter_[s / 64] |= 1ull << (s % 64);
+            entries_.emplace_back(w, (uint32_t)i);
+        }
+        std::sort(entries_.begin(), entries_.end());
+    }
+
+    bool maybe(uint32_t weak) const {
+        size_t s = slot(weak);
+        return filter_[s / 64] >> (s % 64) & 1;
+    }
+
+    // a block whose checksum and SHA-256 match data[0, block), preferring
+    // `hint` so runs of unchanged blocks stay one copy; -1 if there is none
+    long match(uint32_t weak, const unsigned char* data, long hint) const {
+        auto range = std::equal_range(entries_.begin(), entries_.end(), std::make_pair(weak, 0u),
+            [](const std::pair<uint32_t, uint32_t> &x, const std::pair<uint32_t, uint32_t> &y) { return x.first < y.first; });
+        if (range.first == range.second) return -1;
+        unsigned char strong[32];
+        Sha256 sha;
+        sha.update(data, sigs_.block);
+        sha.digest(strong);
+        long found = -1;
+        for (auto it = range.first; it != range.second; ++it) {
+            if (memcmp(sigs_.strong(it->second), strong, sizeof(strong)) != 0) continue;
+            if ((long)it->second == hint) return hint;
+            if (found < 0) found = (long)it->second;
+        }
+        return found;
+    }
+
+private:
+    size_t slot(uint32_t weak) const { return (size_t)((weak * 0x9e3779b1u) >> (32 - bits_)); }
+
+    const BlockSignatures &sigs_;
+    int bits_ = 16;
+    std::vector<uint64_t> filter_;
+    std::vector<std::pair<uint32_t, uint32_t>> entries_; // (checksum, block)
+};
+
+// One record of a delta: `length` bytes copied from `base` in the stored
+// copy, or literal bytes from `offset` in the local file when base is -1
+struct DeltaOp {
+    long long base;
+    long long offset;
+    long long length;
+};
+
+// appends op, extending the last record when op carries straight on from it
+static void delta_push(std::vector<DeltaOp> &ops, const DeltaOp &op) {
+    if (op.length <= 0) return;
+    if (!ops.empty()) {
+        DeltaOp &last = ops.back();
+        bool joins = op.base < 0 ? last.base < 0 && last.offset + last.length == op.offset
+                                 : last.base >= 0 && last.base + last.length == op.base;
+        if (joins) {
+            last.length += op.length;
+            return;
+        }
+    }
+    ops.push_back(op);
+}
+
+// matches blocks against data[begin, end); no window reaches past end
+static std::vector<DeltaOp> delta_scan(const unsigned char* data, size_t begin, size_t end, const SignatureIndex &index,
+                                       size_t block) {
+    std::vector<DeltaOp> ops;
+    size_t pos = begin, literal = begin;
+    long hint = -1;
+    bool fresh = true;
+    long long a = 0, b = 0;
+    const long long n = (long long)block % ADLER_MOD;
+    while (pos + block <= end) {
+        if (fresh) {
+            uLong sum = adler32(1, data + pos, (uInt)block);
+            a = (long long)(sum & 0xffff);
+            b = (long long)(sum >> 16);
+            fresh = false;
+        }
+        uint32_t weak = (uint32_t)(b << 16 | a);
+        if (index.maybe(weak)) {
+            long m = index.match(weak, data + pos, hint);
+            if (m >= 0) {
+                delta_push(ops, {-1, (long long)literal, (long long)(pos - literal)});
+                delta_push(ops, {(long long)m * (long long)block, (long long)pos, (long long)block});
+                pos += block;
+                literal = pos;
+                hint = m + 1;
+                fresh = true;
+                continue;
+            }
+        }
+        if (pos + block == end) break;
+        // roll one byte on: data[pos] leaves the window, data[pos + block] enters
+        long long out = data[pos], in = data[pos + block];
+        a = (a - out + in) % ADLER_MOD;
+        if (a < 0) a += ADLER_MOD;
+        b = (b + a - 1 - n * out) % ADLER_MOD;
+        if (b < 0) b += ADLER_MOD;
+        ++pos;
+    }
+    delta_push(ops, {-1, (long long)literal, (long long)(end - literal)});
+    return ops;
+}
+
+// the delta that turns the stored copy into data[0, size)
+static std::vector<DeltaOp> delta_compute(const unsigned char* data, size_t size, const BlockSignatures &sigs) {
+    SignatureIndex index(sigs);
+    size_t pieces = std::max<size_t>(1, (size + DELTA_SEGMENT - 1) / DELTA_SEGMENT);
+    std::vector<std::vector<DeltaOp>> parts(pieces);
+    {
+        WorkerPool pool(hash_threads());
+        for (size_t i = 0; i < pieces; ++i) {
+            size_t begin = i * DELTA_SEGMENT, end = std::min(size, begin + DELTA_SEGMENT);
+            pool.submit([&parts, &index, &sigs, data, i, begin, end] {
+                parts[i] = delta_scan(data, begin, end, index, sigs.block);
+            });
+        }
+    }
+    std::vector<DeltaOp> ops;
+    for (const auto &part : parts)
+        for (const DeltaOp &op : part) delta_push(ops, op);
+    return ops;
+}
+
+// GETs the signatures of file_id's stored copy; on anything but a 200 the
+// server's reply is left in `response`
+static bool fetch_signatures(const std::string &file_id, size_t block, const std::string &username,
+                             const std::string &password, BlockSignatures &sigs, std::string &response,
+                             long &http_status) {
+    http_status = 0;
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string url = endpoint("/api/file/signatures/" + file_id + "?block_size=" + std::to_string(block));
+    std::string headers;
+    response.clear();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    set_auth(curl, username, password);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    CURLcode res = session_perform(curl, "signatures");
+    if (res != CURLE_OK) {
+        std::cerr << "signatures failed: " << curl_easy_strerror(res) << std::endl;
+        return false;
+    }
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+    if (http_status != 200) return true;
+    sigs.block = block;
+    sigs.size = strtoll(header_value(headers, "x-file-size").c_str(), nullptr, 10);
+    sigs.sha256 = header_value(headers, "x-content-sha256");
+    sigs.records = std::move(response);
+    response.clear();
+    if (sigs.size < 0 || sigs.records.size() % DELTA_RECORD != 0 ||
+        (long long)sigs.count() != (sigs.size + (long long)block - 1) / (long long)block) {
+        std::cerr << "signatures failed: the server sent " << sigs.count() << " blocks for "
+                  << sigs.size << " bytes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The delta part of the POST, encoded as curl asks for it: "C" + base +
+// length or "L" + length and the literal bytes, with big-endian u64s
+struct DeltaSource {
+    const std::vector<DeltaOp>* ops = nullptr;
+    const unsigned char* data = nullptr;
+    size_t op = 0;    // record being sent
+    size_t done = 0;  // bytes of it already sent
+};
+
+static size_t delta_header(const DeltaOp &op, unsigned char* out) {
+    size_t n = 0;
+    out[n++] = op.base < 0 ? 'L' : 'C';
+    auto put = [&](unsigned long long v) {
+        for (int i = 7; i >= 0; --i) out[n++] = (unsigned char)(v >> (8 * i));
+    };
+    if (op.base >= 0) put((unsigned long long)op.base);
+    put((unsigned long long)op.length);
+    return n;
+}
+
+static curl_off_t delta_body_size(const std::vector<DeltaOp> &ops) {
+    curl_off_t total = 0;
+    for (const DeltaOp &op : ops) total += op.base < 0 ? 9 + op.length : 17;
+    return total;
+}
+
+static size_t delta_read_cb(char* buffer, size_t size, size_t nitems, void* arg) {
+    DeltaSource* src = (DeltaSource*)arg;
+    size_t want = size * nitems, n = 0;
+    while (n < want && src->op < src->ops->size()) {
+        const DeltaOp &op = (*src->ops)[src->op];
+        unsigned char head[17];
+        size_t head_len = delta_header(op, head);
+        size_t record = head_len + (op.base < 0 ? (size_t)op.length : 0);
+        size_t end = src->done + std::min(want - n, record - src->done);
+        for (size_t i = src->done; i < end;) {
+            size_t k;
+            if (i < head_len) {
+                k = std::min(end, head_len) - i;
+                memcpy(buffer + n, head + i, k);
+            } else {
+                k = end - i;
+                memcpy(buffer + n, src->data + op.offset + (i - head_len), k);
+            }
+            n += k;
+            i += k;
+        }
+        src->done = end;
+        if (src->done == record) {
+            src->op++;
+            src->done = 0;
+        }
+    }
+    return n;
+}
+
+static int delta_seek_cb(void* arg, curl_off_t offset, int origin) {
+    DeltaSource* src = (DeltaSource*)arg;
+    if (origin != SEEK_SET || offset != 0) return CURL_SEEKFUNC_CANTSEEK;
+    src->op = 0;
+    src->done = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+static int delta_progress_cb(void* arg, curl_off_t, curl_off_t, curl_off_t, curl_off_t sent) {
+    ((Progress*)arg)->update(sent);
+    return 0;
+}
+
+// Replaces the stored file `target` (a file ID, ID prefix or name) with the
+// file at path, sending a delta against the stored copy. The file keeps its
+// file_id and name on the server.
+bool upload_update(const std::string &path, const std::string &target, const std::string &username,
+                   const std::string &password) {
+    ListingCache cache;
+    if (!refresh_listing(username, password, cache)) return false;
+    std::string file_id;
+    if (!lookup_file_id(cache, target, file_id)) {
+        std::cerr << "Could not find file matching '" << target << "'" << std::endl;
+        return false;
+    }
+    FileEntry stored = cache.entry(cache.find_id_prefix(file_id).front());
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Cannot open file: " << path << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+
+    BlockSignatures sigs;
+    std::string response;
+    long status = 0;
+    if (!fetch_signatures(file_id, delta_block_size(stored.size), username, password, sigs, response, status)) {
+        close(fd);
+        return false;
+    }
+    if (status != 200) {
+        std::string error = json_string_field(response, "error");
+        if (status == 404 && error != "invalid file_id" && error != "file not found")
+            std::cerr << "The server does not support --update; upload the file without it" << std::endl;
+        else
+            std::cerr << "Cannot update " << stored.filename << " (HTTP " << status << "): "
+                      << (error.empty() ? response : error) << std::endl;
+        close(fd);
+        return false;
+    }
+    if (sigs.sha256.empty()) {
+        std::cerr << "Cannot update " << stored.filename << ": the server has no digest for it" << std::endl;
+        close(fd);
+        return false;
+    }
+
+    const unsigned char* data = nullptr;
+    if (size > 0) {
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            std::cerr << "Unable to map file: " << path << std::endl;
+            close(fd);
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = (const unsigned char*)map;
+    }
+
+    bool ok = true;
+    std::string file_digest;
+    {
+        // the whole-file digest is read alongside the scan
+        PrefixHasher file_hasher(fd, (curl_off_t)size);
+        file_hasher.advance((curl_off_t)size);
+        std::vector<DeltaOp> ops = delta_compute(data, size, sigs);
+        file_digest = file_hasher.finish();
+        if (file_digest.empty()) {
+            std::cerr << "Cannot read " << path << std::endl;
+            ok = false;
+        }
+
+        long long literal = 0;
+        for (const DeltaOp &op : ops) if (op.base < 0) literal += op.length;
+        bool current = ok && file_digest == sigs.sha256;
+        if (current) {
+            std::cout << stored.filename << " is already up to date" << std::endl;
+        } else if (ok) {
+            std::cout << "Delta for " << stored.filename << ": " << human_readable_size((long)((long long)size - literal))
+                      << " unchanged, sending " << human_readable_size((long)literal) << " in " << ops.size()
+                      << " records" << std::endl;
+        }
+
+        if (ok && !current) {
+            DeltaSource src;
+            src.ops = &ops;
+            src.data = data;
+            curl_off_t body = delta_body_size(ops);
+            CURL* curl = session_handle();
+            ok = curl != nullptr;
+            if (ok) {
+                std::string url = endpoint("/api/upload/delta");
+                std::vector<std::pair<std::string, std::string>> fields = {
+                    {"file_id", file_id}, {"base_sha256", sigs.sha256},
+                    {"size", std::to_string(size)}, {"sha256", file_digest}};
+                curl_mime* form = curl_mime_init(curl);
+                for (auto &f : fields) {
+                    curl_mimepart* part = curl_mime_addpart(form);
+                    curl_mime_name(part, f.first.c_str());
+                    curl_mime_data(part, f.second.c_str(), f.second.size());
+                }
+                curl_mimepart* part = curl_mime_addpart(form);
+                curl_mime_name(part, "delta");
+                curl_mime_filename(part, (stored.filename + ".delta").c_str());
+                curl_mime_type(part, "application/octet-stream");
+                curl_mime_data_cb(part, body, delta_read_cb, delta_seek_cb, nullptr, &src);
+                struct curl_slist* headers = curl_slist_append(nullptr, "Expect:");
+
+                Progress progress(stored.filename, body);
+                response.clear();
+                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+                set_auth(curl, username, password);
+                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+                curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+                curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, delta_progress_cb);
+                curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &progress);
+                CURLcode res = session_perform(curl, "delta");
+                progress.finish();
+                status = 0;
+                if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+                curl_mime_free(form);
+                curl_slist_free_all(headers);
+                if (res != CURLE_OK) {
+                    std::cerr << "delta upload failed: " << curl_easy_strerror(res) << std::endl;
+                    ok = false;
+                } else if (status != 200) {
+                    std::cerr << "delta upload failed (HTTP " << status << "): " << response << std::endl;
+                    ok = false;
+                } else if (json_string_field(response, "sha256") != file_digest) {
+                    std::cerr << "Integrity check failed: server stored sha256 " << json_string_field(response, "sha256")
+                              << " but the local file is " << file_digest << std::endl;
+                    ok = false;
+                } else {
+                    std::cout << "Verified sha256 " << file_digest << std::endl;
+                }
+            }
+        }
+    }
+    if (data) munmap((void*)data, size);
+    close(fd);
+    if (ok) std::cout << "Update complete for " << path << std::endl;
+    return ok;
+}
+
+// ---------------- Sync ----------------
+// `sync <dir>` keeps an index of what it last uploaded from the directory
+// under ~/.network_terminal_sync/, one file per server, user and directory.
+// The index is a header and fixed-size records sorted by path hash, used in
+// place through mmap so even a million entries cost no parsing at startup.
+// A file whose size, mtime and inode match its record, and whose file_id is
+// still listed by the server, is left alone. Anything else is hashed (when a
+// listed copy of the same size might already match) or uploaded.
+static const char SYNC_MAGIC[8] = {'N', 'S', 'S', 'Y', 'N', 'C', '1', '\0'};
+
+struct SyncHeader {
+    char magic[8];
+    uint64_t count;
+};
+
+struct SyncRecord {
+    uint64_t path_hash;
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t inode;
+    unsigned char sha256[32];
+    char file_id[40]; // NUL-terminated
+};
+static_assert(sizeof(SyncRecord) == 104, "sync index records are 104 bytes on disk");
+
+static std::string hex_of(const unsigned char* p, size_t n) {
+    static const char* digits = "0123456789abcdef";
+    std::string out;
+    for (size_t i = 0; i < n; ++i) {
+        out += digits[p[i] >> 4];
+        out += digits[p[i] & 15];
+    }
+    return out;
+}
+
+static bool bytes_of_hex(const std::string &hex, unsigned char* out, size_t n) {
+    if (hex.size() != n * 2) return false;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned v = 0;
+        if (sscanf(hex.c_str() + 2 * i, "%2x", &v) != 1) return false;
+        out[i] = (unsigned char)v;
+    }
+    return true;
+}
+
+// the name the server stores a relative path under, following werkzeug's
+// secure_filename for ASCII names
+static std::string server_filename(const std::string &rel) {
+    std::string joined, word;
+    std::vector<std::string> words;
+    for (char c : rel + " ") {
+        if (c == '/' || std::isspace((unsigned char)c)) {
+            if (!word.empty()) words.push_back(word);
+            word.clear();
+        } else {
+            word += c;
+        }
+    }
+    for (size_t i = 0; i < words.size(); ++i) joined += (i ? "_" : "") + words[i];
+    std::string out;
+    for (char c : joined)
+        if (std::isalnum((unsigned char)c) || c == '_' || c == '.' || c == '-') out += c;
+    size_t b = out.find_first_not_of("._"), e = out.find_last_not_of("._");
+    return b == std::string::npos ? "" : out.substr(b, e - b + 1);
+}
+
+static std::string sync_index_path(const std::string &dir, const std::string &username) {
+    const char* home = getenv("HOME");
+    std::string base;
+    if (home && home[0] != '\0') base = home;
+    else {
+        struct passwd *pw = getpwuid(getuid());
+        base = (pw && pw->pw_dir) ? pw->pw_dir : ".";
+    }
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << fnv1a64(g_base_url + "\n" + username + "\n" + dir);
+    return base + "/.network_terminal_sync/" + name.str() + ".idx";
+}
+
+// A read-only mapping of an index file; empty if it is missing or invalid.
+class SyncIndex {
+public:
+    explicit SyncIndex(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SyncHeader)) {
+            void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                map_ = p;
+                len_ = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+        if (!map_) return;
+        const SyncHeader* h = (const SyncHeader*)map_;
+        if (memcmp(h->magic, SYNC_MAGIC, sizeof(SYNC_MAGIC)) != 0 ||
+            len_ != sizeof(SyncHeader) + h->count * sizeof(SyncRecord)) return;
+        records_ = (const SyncRecord*)((const char*)map_ + sizeof(SyncHeader));
+        count_ = (size_t)h->count;
+    }
+
+    ~SyncIndex() {
+        if (map_) munmap(map_, len_);
+    }
+
+    SyncIndex(const SyncIndex &) = delete;
+    SyncIndex &operator=(const SyncIndex &) = delete;
+
+    const SyncRecord* find(uint64_t path_hash) const {
+        const SyncRecord* end = records_ + count_;
+        const SyncRecord* r = std::lower_bound(records_, end, path_hash,
+            [](const SyncRecord &rec, uint64_t h) { return rec.path_hash < h; });
+        return (r != end && r->path_hash == path_hash) ? r : nullptr;
+    }
+
+    size_t size() const { return count_; }
+
+private:
+    void* map_ = nullptr;
+    size_t len_ = 0;
+    const SyncRecord* records_ = nullptr;
+    size_t count_ = 0;
+};
+
+static bool sync_index_write(const std::string &path, std::vector<SyncRecord> &records) {
+    std::string dir = path.substr(0, path.find_last_of('/'));
+    if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) return false;
+    std::sort(records.begin(), records.end(),
+              [](const SyncRecord &a, const SyncRecord &b) { return a.path_hash < b.path_hash; });
+    SyncHeader h;
+    memcpy(h.magic, SYNC_MAGIC, sizeof(SYNC_MAGIC));
+    h.count = records.size();
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) return false;
+    size_t body = records.size() * sizeof(SyncRecord);
+    bool ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+              (body == 0 || write(fd, records.data(), body) == (ssize_t)body) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static std::string hash_path(const std::string &path, curl_off_t size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return "";
+    PendingChunk out;
+    digest_chunk(fd, 0, size, false, out);
+    close(fd);
+    return out.hex;
+}
+
+// Uploads new and changed files under root. The server keeps whatever the
+// directory no longer has; sync never deletes remote files for local ones.
+bool sync_tree(const std::string &root, const std::string &username, const std::string &password, int jobs,
+               bool compress) {
+    std::string base;
+    std::vector<TreeFile> files;
+    if (!tree_root(root, base)) return false;
+    char* real = realpath(base.c_str(), nullptr);
+    std::string absdir = real ? real : base;
+    free(real);
+    if (!walk_tree(base, files)) return false;
+
+    std::vector<FileEntry> remote;
+    if (!get_files_meta(username, password, remote)) return false;
+    std::map<std::string, const FileEntry*> by_id;
+    std::multimap<std::string, const FileEntry*> by_name;
+    for (auto &e : remote) {
+        by_id[e.file_id] = &e;
+        by_name.emplace(e.filename, &e);
+    }
+
+    std::string index_path = sync_index_path(absdir, username);
+    std::vector<SyncRecord> records;
+    std::vector<const TreeFile*> upload;
+    std::vector<std::string> stale; // remote copies an upload replaces
+    // a file that may match a listed copy: that copy's digest and id, and
+    // what to replace if it does not match
+    struct SyncCheck { size_t file; std::string sha256; std::string file_id; std::vector<std::string> replaces; };
+    std::vector<SyncCheck> checks;
+    size_t unchanged = 0;
+
+    auto record_for = [](const TreeFile &f, const std::string &file_id, const std::string &sha) {
+        SyncRecord r;
+        memset(&r, 0, sizeof(r));
+        r.path_hash = fnv1a64(f.rel);
+        r.size = f.size;
+        r.mtime_ns = f.mtime_ns;
+        r.inode = f.inode;
+        bytes_of_hex(sha, r.sha256, sizeof(r.sha256));
+        strncpy(r.file_id, file_id.c_str(), sizeof(r.file_id) - 1);
+        return r;
+    };
+
+    {
+        SyncIndex index(index_path);
+        for (size_t i = 0; i < files.size(); ++i) {
+            const TreeFile &f = files[i];
+            const SyncRecord* rec = index.find(fnv1a64(f.rel));
+            const FileEntry* listed = rec ? (by_id.count(rec->file_id) ? by_id[rec->file_id] : nullptr) : nullptr;
+            if (listed && rec->size == f.size && rec->mtime_ns == f.mtime_ns && rec->inode == f.inode) {
+                records.push_back(*rec);
+                unchanged++;
+                continue;
+            }
+            SyncCheck check{i, "", "", {}};
+            if (listed) check.replaces.push_back(listed->file_id);
+            auto range = by_name.equal_range(tree_member_name(f.rel));
+            for (auto it = range.first; it != range.second; ++it) check.replaces.push_back(it->second->file_id);
+
+            // a listed copy of the same size may still hold the same bytes
+            // (touched file, first sync of an uploaded tree): hash to find out
+            if (listed && rec->size == f.size) {
+                check.sha256 = hex_of(rec->sha256, sizeof(rec->sha256));
+                check.file_id = listed->file_id;
+            }
+            for (auto it = range.first; check.file_id.empty() && it != range.second; ++it) {
+                if (it->second->size == (long)f.size && it->second->sha256.size() == 64) {
+                    check.sha256 = it->second->sha256;
+                    check.file_id = it->second->file_id;
+                }
+            }
+            if (!check.file_id.empty()) {
+                checks.push_back(check);
+            } else {
+                upload.push_back(&f);
+                stale.insert(stale.end(), check.replaces.begin(), check.replaces.end());
+            }
+        }
+        std::cout << "Sync " << absdir << ": " << files.size() << " files, " << index.size() << " indexed, "
+                  << unchanged << " unchanged" << std::endl;
+    }
+
+    // hash the candidates in parallel
+    if (!checks.empty()) {
+        std::vector<std::string> digests(checks.size());
+        {
+            WorkerPool pool(hash_threads());
+            for (size_t k = 0; k < checks.size(); ++k) {
+                const TreeFile* f = &files[checks[k].file];
+                std::string* out = &digests[k];
+                pool.submit([f, out] { *out = hash_path(f->path, f->size); });
+            }
+        }
+        size_t matched = 0;
+        for (size_t k = 0; k < checks.size(); ++k) {
+            const SyncCheck &c = checks[k];
+            if (!digests[k].empty() && digests[k] == c.sha256) {
+                // the same bytes are on the server: adopt that copy, and
+                // drop older ones left by a run that failed before it could
+                records.push_back(record_for(files[c.file], c.file_id, c.sha256));
+                for (const std::string &id : c.replaces)
+                    if (id != c.file_id) stale.push_back(id);
+                matched++;
+            } else {
+                upload.push_back(&files[c.file]);
+                stale.insert(stale.end(), c.replaces.begin(), c.replaces.end());
+            }
+        }
+        std::cout << "Checked " << checks.size() << " files by content: " << matched << " already on the server" << std::endl;
+    }
+
+    bool ok = true;
+    if (!upload.empty()) {
+        curl_off_t bytes = 0;
+        for (auto f : upload) bytes += f->size;
+        std::cout << "Uploading " << upload.size() << " new or changed files (" << human_readable_size((long)bytes)
+                  << ")" << std::endl;
+        std::vector<std::string> file_ids;
+        ok = upload_tree_files(upload, username, password, jobs, compress, file_ids);
+
+        // the server hashed what it received; take the digests from a fresh listing
+        if (ok) ok = get_files_meta(username, password, remote);
+        if (ok) {
+            std::map<std::string, std::string> sha_of;
+            for (auto &e : remote) sha_of[e.file_id] = e.sha256;
+            for (size_t i = 0; i < upload.size(); ++i) records.push_back(record_for(*upload[i], file_ids[i], sha_of[file_ids[i]]));
+        }
+    }
+
+    // the older entries an upload replaced go only once the new copies are
+    // listed, so a run that fails part way leaves every file with a copy on
+    // the server; the server keeps the bytes at a name for its newest entry
+    std::sort(stale.begin(), stale.end());
+    stale.erase(std::unique(stale.begin(), stale.end()), stale.end());
+    for (size_t i = 0; ok && i < stale.size(); ++i) {
+        std::string response;
+        long http_status = 0;
+        if (!delete_file_id(stale[i], username, password, response, http_status) ||
+            (http_status != 200 && http_status != 404)) {
+            std::cerr << "Cannot remove replaced remote file " << stale[i] << " (HTTP " << http_status
+                      << "): " << response << std::endl;
+            ok = false;
+        }
+    }
+
+    // files uploaded before a failure are adopted by content on the next run
+    if (ok && !sync_index_write(index_path, records)) {
+        std::cerr << "Cannot write sync index " << index_path << std::endl;
+        ok = false;
+    }
+    if (ok) std::cout << "Sync complete: " << upload.size() << " uploaded, " << records.size() - upload.size()
+                      << " up to date" << std::endl;
+    return ok;
+}
+
+// ---------------- Download cache ----------------
+// Downloads the server names with an ETag and a SHA-256 are kept in a
+// content-addressed store under ~/.network_terminal_cache/blobs/, one
+// read-only file per digest. A ref file per server, user and name records
+// the ETag, digest and size the name was last served with, and the next
+// download of that name sends the ETag as If-None-Match. On 304 the blob is
+// hashed again and reflinked, or else copied, into place instead of fetched;
+// it is never hard-linked, so editing a download cannot corrupt the store.
+// Blobs are evicted least recently used first (by mtime, which every hit
+// refreshes) once the store outgrows its limit, and refs go with their blob.
+static const long long DOWNLOAD_CACHE_DEFAULT = 10ll * 1024 * 1024 * 1024;
+
+struct CachedDownload {
+    std::string etag, sha256;
+    long long size = -1;
+};
+
+static std::string download_cache_dir() {
+    const char* home = getenv("HOME");
+    std::string base;
+    if (home && home[0] != '\0') base = home;
+    else {
+        struct passwd *pw = getpwuid(getuid());
+        base = (pw && pw->pw_dir) ? pw->pw_dir : ".";
+    }
+    return base + "/.network_terminal_cache";
+}
+
+static std::string download_ref_path(const std::string &username, const std::string &filename) {
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << fnv1a64(g_base_url + "\n" + username + "\n" + filename);
+    return download_cache_dir() + "/" + name.str() + ".download";
+}
+
+static std::string blob_path(const std::string &sha256) {
+    return download_cache_dir() + "/blobs/" + sha256;
+}
+
+static bool is_sha256_hex(const std::string &s) {
+    return s.size() == 64 && std::all_of(s.begin(), s.end(), [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
+
+// what `filename` was last served as, if its blob is still stored whole
+static bool cache_lookup(const std::string &username, const std::string &filename, CachedDownload &out) {
+    std::ifstream in(download_ref_path(username, filename));
+    std::string size;
+    if (!std::getline(in, out.etag) || !std::getline(in, out.sha256) || !std::getline(in, size)) return false;
+    out.size = strtoll(size.c_str(), nullptr, 10);
+    struct stat st;
+    return !out.etag.empty() && is_sha256_hex(out.sha256) && stat(blob_path(out.sha256).c_str(), &st) == 0 &&
+           S_ISREG(st.st_mode) && st.st_size == out.size;
+}
+
+// marks a blob as just used
+static void cache_touch(const std::string &sha256) {
+    utimensat(AT_FDCWD, blob_path(sha256).c_str(), nullptr, 0);
+}
+
+// Hashes the blob for `c` again; a blob that no longer matches its name is
+// dropped together with the ref that led to it.
+static bool cache_verify(const std::string &username, const std::string &filename, const CachedDownload &c) {
+    std::string blob = blob_path(c.sha256);
+    int fd = open(blob.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0;
+    Sha256 sha;
+    std::vector<char> buf(1024 * 1024);
+    long long total = 0;
+    ssize_t n = 0;
+    while (ok && (n = read(fd, buf.data(), buf.size())) > 0) {
+        sha.update(buf.data(), (size_t)n);
+        total += n;
+    }
+    if (fd >= 0) close(fd);
+    if (ok && n == 0 && total == c.size && sha.hex_digest() == c.sha256) return true;
+    std::cerr << "Dropping damaged cached copy of " << filename << std::endl;
+    unlink(blob.c_str());
+    unlink(download_ref_path(username, filename).c_str());
+    return false;
+}
+
+// Creates dst with src's contents, sharing its blocks by reflink where the
+// filesystem can and copying them otherwise.
+static bool clone_file(const std::string &src, const std::string &dst) {
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    bool ok = false;
+#ifdef FICLONE
+    ok = ioctl(out, FICLONE, in) == 0;
+#endif
+    if (!ok) {
+        ok = true;
+        while (true) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+            if (n > 0) continue;
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                // no in-kernel copy between these files; fall back to read/write
+                char buf[1 << 16];
+                ssize_t r;
+                while (ok && (r = read(in, buf, sizeof(buf))) > 0) ok = write(out, buf, (size_t)r) == r;
+                ok = ok && r == 0;
+            } else {
+                ok = n == 0;
+            }
+            break;
+        }
+    }
+    if (close(out) != 0) ok = false;
+    close(in);
+    if (!ok) unlink(dst.c_str());
+    return ok;
+}
+
+// Drops the least recently used blobs until the store, refs included, fits
+// in `limit` bytes, then every ref whose blob is gone.
+static void cache_evict(long long limit) {
+    std::string dir = download_cache_dir();
+    struct Blob { struct timespec mtime; long long size; std::string path; };
+    std::vector<Blob> blobs;
+    std::vector<std::string> refs;
+    long long total = 0;
+    if (DIR* d = opendir((dir + "/blobs").c_str())) {
+        while (struct dirent* e = readdir(d)) {
+            std::string path = dir + "/blobs/" + e->d_name;
+            struct stat st;
+            if (e->d_name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            blobs.push_back({st.st_mtim, (long long)st.st_size, path});
+            total += st.st_size;
+        }
+        closedir(d);
+    }
+    if (DIR* d = opendir(dir.c_str())) {
+        static const std::string suffix = ".download";
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            struct stat st;
+            if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0 ||
+                stat((dir + "/" + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            refs.push_back(dir + "/" + name);
+            total += st.st_size;
+        }
+        closedir(d);
+    }
+    if (total > limit) {
+        std::sort(blobs.begin(), blobs.end(), [](const Blob &a, const Blob &b) {
+            return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec
+                                                    : a.mtime.tv_nsec < b.mtime.tv_nsec;
+        });
+        for (const Blob &b : blobs) {
+            if (total <= limit) break;
+            if (unlink(b.path.c_str()) == 0) total -= b.size;
+        }
+    }
+    for (const std::string &ref : refs) {
+        std::ifstream in(ref);
+        std::string etag, sha256;
+        struct stat st;
+        if (std::getline(in, etag) && std::getline(in, sha256) && is_sha256_hex(sha256) &&
+            stat(blob_path(sha256).c_str(), &st) == 0)
+            continue;
+        unlink(ref.c_str());
+    }
+}
+
+// Keeps the verified download at `path` as the blob for its digest and
+// records that `filename` was served as it; a failure only costs the cache.
+static void cache_store(const std::string &username, const std::string &filename, const std::string &path,
+                        const CachedDownload &c, long long limit) {
+    struct stat st;
+    if (limit <= 0 || c.etag.empty() || !is_sha256_hex(c.sha256) || stat(path.c_str(), &st) != 0 ||
+        st.st_size > limit)
+        return;
+    std::string dir = download_cache_dir();
+    if ((mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) ||
+        (mkdir((dir + "/blobs").c_str(), S_IRWXU) != 0 && errno != EEXIST))
+        return;
+
+    std::string blob = blob_path(c.sha256);
+    struct stat b;
+    if (stat(blob.c_str(), &b) != 0 || b.st_size != st.st_size) {
+        std::string tmp = blob + "." + std::to_string(getpid()) + ".tmp";
+        unlink(tmp.c_str());
+        if (!clone_file(path, tmp)) return;
+        chmod(tmp.c_str(), S_IRUSR | S_IRGRP | S_IROTH);
+        if (rename(tmp.c_str(), blob.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return;
+        }
+    } else {
+        cache_touch(c.sha256);
+    }
+
+    std::string ref = download_ref_path(username, filename), tmp = ref + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << c.etag << "\n" << c.sha256 << "\n" << (long long)st.st_size << "\n";
+        if (!out) return;
+    }
+    if (rename(tmp.c_str(), ref.c_str()) != 0) unlink(tmp.c_str());
+    cache_evict(limit);
+}
+
+// puts the cached blob at outpath, by way of partpath
+static bool cache_materialize(const CachedDownload &c, const std::string &partpath, const std::string &outpath) {
+    std::string blob = blob_path(c.sha256);
+    cache_touch(c.sha256);
+    unlink(partpath.c_str());
+    if (!clone_file(blob, partpath)) {
+        std::cerr << "Cannot copy cached " << blob << " to " << partpath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (rename(partpath.c_str(), outpath.c_str()) != 0) {
+        std::cerr << "Cannot move " << partpath << " to " << outpath << ": " << strerror(errno) << std::endl;
+        unlink(partpath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// ---------------- Download ----------------
+static std::string download_path(const std::string &filename) {
+    const char* home = getenv("HOME");
+    std::string downloads_dir;
+    if (home) {
+        downloads_dir = std::string(home) + "/Downloads";
+        struct stat st;
+        if (stat(downloads_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            downloads_dir = std::string(home);
+        }
+    } else downloads_dir = ".";
+    return downloads_dir + "/" + filename;
+}
+
+// HEAD the object to learn its size, its digest, whether the server serves
+// byte ranges and whether it would send the file compressed; with a
+// validator the request is conditional
+static bool probe_download(const std::string &url, const std::string &username, const std::string &password,
+                           curl_off_t &size, bool &ranges, std::string &digest, bool &encoded, Validator &validator) {
+    size = -1;
+    ranges = false;
+    encoded = false;
+    digest.clear();
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    std::string headers;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    set_auth(curl, username, password);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+    struct curl_slist* request_headers = nullptr;
+    if (!validator.if_none_match.empty()) {
+        request_headers = curl_slist_append(request_headers, ("If-None-Match: " + validator.if_none_match).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+    }
+
+    CURLcode res = session_perform(curl, "probe");
+    curl_slist_free_all(request_headers);
+    if (res == CURLE_OK) {
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        validator.not_modified = status == 304;
+        validator.etag = header_value(headers, "etag");
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+        ranges = header_value(headers, "accept-ranges") == "bytes";
+        digest = header_value(headers, "x-content-sha256");
+        encoded = !header_value(headers, "content-encoding").empty();
+    } else {
+        std::cerr << "download_file failed: " << curl_easy_strerror(res) << std::endl;
+    }
+    return res == CURLE_OK;
+}
+
+// Destination of one byte range: bytes land with pwrite at their offset in
+// the preallocated output, so ranges may finish in any order.
+struct RangeSlot {
+    CURL* curl = nullptr;
+    int fd = -1;
+    curl_off_t offset = -1;   // -1 when idle
+    curl_off_t length = 0;
+    curl_off_t written = 0;
+    std::string range;
+};
+
+static size_t range_write_cb(char* ptr, size_t size, size_t nmemb, void* arg) {
+    RangeSlot* s = (RangeSlot*)arg;
+    size_t n = size * nmemb;
+    // a server that ignores Range would send more than asked for
+    if (s->written + (curl_off_t)n > s->length) return 0;
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = pwrite(s->fd, ptr + done, n - done, (off_t)(s->offset + s->written + done));
+        if (w <= 0) return 0;
+        done += (size_t)w;
+    }
+    s->written += (curl_off_t)n;
+    return n;
+}
+
+// fetches [0, size) as concurrent ranges; the hasher is advanced over the
+// contiguous prefix of completed ranges as they land
+static bool download_ranges(const std::string &url, const std::string &username, const std::string &password,
+                            int fd, curl_off_t size, int jobs, PrefixHasher &hasher, Progress &progress) {
+    // several ranges per connection so a slow range does not hold up the tail
+    curl_off_t range_size = size / ((curl_off_t)jobs * 4);
+    range_size = std::max(range_size, (curl_off_t)4 * 1024 * 1024);
+    range_size = std::min(range_size, (curl_off_t)64 * 1024 * 1024);
+    curl_off_t total_ranges = (size + range_size - 1) / range_size;
+    if (jobs > total_ranges) jobs = (int)std::max(total_ranges, (curl_off_t)1);
+
+    CURLM* multi = session_multi();
+    if (!multi) return false;
+
+    std::vector<RangeSlot> slots(jobs);
+    bool ok = true;
+    for (auto &s : slots) {
+        s.curl = session_new_handle();
+        if (!s.curl) { ok = false; break; }
+        s.fd = fd;
+        curl_easy_setopt(s.curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(s.curl, CURLOPT_FAILONERROR, 1L);
+        set_auth(s.curl, username, password);
+        curl_easy_setopt(s.curl, CURLOPT_WRITEFUNCTION, range_write_cb);
+        curl_easy_setopt(s.curl, CURLOPT_WRITEDATA, &s);
+        curl_easy_setopt(s.curl, CURLOPT_PRIVATE, &s);
+    }
+
+    std::vector<bool> range_done((size_t)total_ranges, false);
+    size_t frontier = 0;
+    curl_off_t next_offset = 0, done_bytes = 0;
+    while (ok && done_bytes < size) {
+        for (auto &s : slots) {
+            if (s.offset >= 0 || next_offset >= size) continue;
+            s.offset = next_offset;
+            s.length = std::min(range_size, size - next_offset);
+            s.written = 0;
+            next_offset += s.length;
+            s.range = std::to_string(s.offset) + "-" + std::to_string(s.offset + s.length - 1);
+            curl_easy_setopt(s.curl, CURLOPT_RANGE, s.range.c_str());
+            curl_multi_add_handle(multi, s.curl);
+        }
+
+        int running = 0;
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc != CURLM_OK) {
+            std::cerr << "download_file: " << curl_multi_strerror(mc) << std::endl;
+            ok = false;
+            break;
+        }
+
+        CURLMsg* msg;
+        int queued = 0;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            RangeSlot* s = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&s);
+            long status = record_request(msg->easy_handle, "range", (int)(s->offset / range_size), msg->data.result).status;
+            if (msg->data.result != CURLE_OK) {
+                std::cerr << "download_file failed for bytes " << s->range << ": " << curl_easy_strerror(msg->data.result) << std::endl;
+                ok = false;
+            } else if (status != 206 || s->written != s->length) {
+                std::cerr << "download_file: server did not honor range " << s->range << " (HTTP " << status << ")" << std::endl;
+                ok = false;
+            } else {
+                done_bytes += s->length;
+                range_done[(size_t)(s->offset / range_size)] = true;
+                while (frontier < range_done.size() && range_done[frontier]) frontier++;
+                hasher.advance(std::min(size, (curl_off_t)frontier * range_size));
+            }
+            curl_multi_remove_handle(multi, s->curl);
+            s->offset = -1;
+        }
+
+        curl_off_t partial = 0;
+        for (auto &s : slots) if (s.offset >= 0) partial += s.written;
+        progress.update(done_bytes + partial);
+
+        if (ok && running > 0) curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+
+    for (auto &s : slots) {
+        if (s.offset >= 0) curl_multi_remove_handle(multi, s.curl);
+        if (s.curl) curl_easy_cleanup(s.curl);
+    }
+    curl_multi_cleanup(multi);
+    return ok;
+}
+
+// Sequential destination for single-stream downloads; the hasher trails the
+// bytes as they are written.
+struct StreamSink {
+    int fd = -1;
+    curl_off_t written = 0;
+    PrefixHasher* hasher = nullptr;
+    Sha256* sha = nullptr;    // hashes in line instead, for output that cannot be read back
+    Progress* progress = nullptr;
+};
+
+static size_t stream_write_cb(char* ptr, size_t size, size_t nmemb, void* arg) {
+    StreamSink* sink = (StreamSink*)arg;
+    size_t n = size * nmemb, done = 0;
+    while (done < n) {
+        ssize_t w = write(sink->fd, ptr + done, n - done);
+        if (w <= 0) return 0;
+        done += (size_t)w;
+    }
+    sink->written += (curl_off_t)n;
+    if (sink->sha) sink->sha->update(ptr, n);
+    else sink->hasher->advance(sink->written);
+    sink->progress->update(sink->written);
+    return n;
+}
+
+// Streams the file to standard output as it arrives, hashing it on the way
+// since a pipe cannot be read back; messages go to stderr. The bytes are out
+// before the digest can be checked, so a mismatch only fails the exit status.
+// A cached copy the server still vouches for is written out instead.
+static bool download_to_stdout(const std::string &url, const std::string &filename, const std::string &username,
+                               const std::string &password, const CachedDownload* cached) {
+    CURL* curl = session_handle();
+    if (!curl) return false;
+    Sha256 sha;
+    Progress progress(filename, -1);
+    StreamSink sink;
+    sink.fd = STDOUT_FILENO;
+    sink.sha = &sha;
+    sink.progress = &progress;
+    std::string headers;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    set_auth(curl, username, password);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+    struct curl_slist* request_headers = nullptr;
+    if (cached) {
+        request_headers = curl_slist_append(request_headers, ("If-None-Match: " + cached->etag).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+    }
+
+    CURLcode res = session_perform(curl, "download");
+    curl_slist_free_all(request_headers);
+    long status = 0;
+    if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status == 304) {
+        cache_touch(cached->sha256);
+        int fd = open(blob_path(cached->sha256).c_str(), O_RDONLY | O_CLOEXEC);
+        bool ok = fd >= 0;
+        char buf[1 << 16];
+        ssize_t n = 0;
+        while (ok && (n = read(fd, buf, sizeof(buf))) > 0) ok = stream_write_cb(buf, 1, (size_t)n, &sink) == (size_t)n;
+        if (fd >= 0) close(fd);
+        progress.finish();
+        if (!ok || n < 0 || sha.hex_digest() != cached->sha256) {
+            std::cerr << "Cannot read cached copy of " << filename << std::endl;
+            unlink(blob_path(cached->sha256).c_str());
+            unlink(download_ref_path(username, filename).c_str());
+            return false;
+        }
+        std::cerr << "Not modified; sent the cached copy, sha256 " << cached->sha256 << std::endl;
+        return true;
+    }
+    progress.finish();
+    if (res != CURLE_OK) {
+        std::cerr << "download_file failed: " << curl_easy_strerror(res) << std::endl;
+        return false;
+    }
+    std::string expected_digest = header_value(headers, "x-content-sha256");
+    std::string digest = sha.hex_digest();
+    if (!expected_digest.empty() && digest != expected_digest) {
+        std::cerr << "Integrity check failed for " << filename << ": expected sha256 " << expected_digest << ", got "
+                  << digest << std::endl;
+        return false;
+    }
+    if (!expected_digest.empty()) std::cerr << "Verified sha256 " << digest << std::endl;
+    return true;
+}
+
+// Downloads into <Downloads>/<filename>.part and renames it into place only
+// once every byte has arrived. With jobs > 1 and a server that serves byte
+// ranges, the file is preallocated and fetched as concurrent ranges, unless
+// the server offers it compressed: a single compressed stream, which curl
+// inflates as it arrives, moves fewer bytes than any split of it. When the
+// server reports the file's SHA-256, a worker hashes the output as it lands
+// and a mismatch fails the download. `output` replaces the Downloads path;
+// "-" streams the file to stdout. Verified downloads go into the download
+// cache, bounded by `cache_limit` bytes (0 bypasses it), and a name the cache
+// holds is requested conditionally.
+bool download_file(const std::string &filename, const std::string &username, const std::string &password, int jobs,
+                   const std::string &output = "", long long cache_limit = DOWNLOAD_CACHE_DEFAULT) {
+    std::string url = endpoint("/api/download/") + filename;
+    CachedDownload cached;
+    Validator validator;
+    if (cache_limit > 0 && cache_lookup(username, filename, cached)) validator.if_none_match = cached.etag;
+    if (output == "-")
+        return download_to_stdout(url, filename, username, password, validator.if_none_match.empty() ? nullptr : &cached);
+    std::string outpath = output.empty() ? download_path(filename) : output;
+    std::string partpath = outpath + ".part";
+
+    curl_off_t size = -1;
+    bool ranges = false, encoded = false;
+    std::string expected_digest;
+    bool probed = jobs > 1;
+    if (probed && !probe_download(url, username, password, size, ranges, expected_digest, encoded, validator))
+        return false;
+
+    int fd = -1;
+    if (!validator.not_modified) {
+        fd = open(partpath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Cannot open output file: " << partpath << std::endl;
+            return false;
+        }
+    }
+
+    bool ok = true;
+    std::string digest;
+    if (validator.not_modified) {
+        // the probe already found the cached copy current
+    } else if (jobs > 1 && ranges && size > 0 && !encoded) {
+        if (fallocate(fd, 0, 0, (off_t)size) != 0 && (errno != EOPNOTSUPP || ftruncate(fd, (off_t)size) != 0)) {
+            std::cerr << "Cannot allocate " << size << " bytes for " << partpath << ": " << strerror(errno) << std::endl;
+            close(fd);
+            unlink(partpath.c_str());
+            return false;
+        }
+        PrefixHasher hasher(fd, size);
+        Progress progress(filename, size);
+        ok = download_ranges(url, username, password, fd, size, jobs, hasher, progress);
+        progress.finish();
+        if (ok && !expected_digest.empty()) digest = hasher.finish();
+    } else {
+        CURL* curl = session_handle();
+        if (!curl) { close(fd); unlink(partpath.c_str()); return false; }
+
+        PrefixHasher hasher(fd, -1);
+        // a compressed stream's probed size is not what lands on disk
+        Progress progress(filename, encoded ? -1 : size);
+        StreamSink sink;
+        sink.fd = fd;
+        sink.hasher = &hasher;
+        sink.progress = &progress;
+        std::string headers;
+
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        set_auth(curl, username, password);
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_write_cb);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+        // a probe that came back 200 already settled the validator
+        struct curl_slist* request_headers = nullptr;
+        if (!probed && !validator.if_none_match.empty()) {
+            request_headers = curl_slist_append(request_headers, ("If-None-Match: " + validator.if_none_match).c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+        }
+
+        CURLcode res = session_perform(curl, "download");
+        curl_slist_free_all(request_headers);
+        progress.finish();
+        ok = (res == CURLE_OK);
+        if (res != CURLE_OK) std::cerr << "download_file failed: " << curl_easy_strerror(res) << std::endl;
+        long status = 0;
+        if (ok) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        validator.not_modified = status == 304;
+        validator.etag = header_value(headers, "etag");
+        expected_digest = header_value(headers, "x-content-sha256");
+        if (ok && !validator.not_modified && !expected_digest.empty()) digest = hasher.finish(sink.written);
+    }
+    if (fd >= 0 && close(fd) != 0) ok = false;
+
+    if (ok && validator.not_modified) {
+        unlink(partpath.c_str());
+        // the damaged entry is gone, so this asks for the whole file
+        if (!cache_verify(username, filename, cached))
+            return download_file(filename, username, password, jobs, output, cache_limit);
+        if (!cache_materialize(cached, partpath, outpath)) return false;
+        std::cout << "Not modified; restored " << outpath << " from the download cache" << std::endl;
+        std::cout << "Verified sha256 " << cached.sha256 << std::endl;
+        return true;
+    }
+    if (ok && !expected_digest.empty() && digest != expected_digest) {
+        std::cerr << "Integrity check failed for " << filename << ": expected sha256 " << expected_digest
+                  << ", got " << (digest.empty() ? "(unreadable)" : digest) << std::endl;
+        ok = false;
+    }
+    if (ok && rename(partpath.c_str(), outpath.c_str()) != 0) {
+        std::cerr << "Cannot move " << partpath << " to " << outpath << ": " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    if (!ok) {
+        unlink(partpath.c_str());
+    } else {
+        std::cout << "Downloaded to " << outpath << std::endl;
+        if (!expected_digest.empty()) std::cout << "Verified sha256 " << digest << std::endl;
+        if (!expected_digest.empty()) {
+            CachedDownload fresh;
+            fresh.etag = validator.etag;
+            fresh.sha256 = expected_digest;
+            cache_store(username, filename, outpath, fresh, cache_limit);
+        }
+    }
+    return ok;
+}
+
+// ---------------- Remote reads ----------------
+// RemoteFile reads byte ranges of a stored file without downloading the rest
+// of it. Each miss is one Range request on the session connection, and the
+// 64 KB blocks it brings back stay in an in-memory LRU cache of up to 64 MB.
+// A read that starts where the previous one ended doubles a readahead
+// window, up to 8 MB, so streaming through a file takes few round trips
+// while scattered reads fetch only their own blocks. Every response must
+// carry the ETag the file was opened with, so a file replaced mid-read fails
+// instead of mixing versions. When the download cache holds the current
+// contents, the first request comes back 304 and reads come from the blob.
+static const long long REMOTE_BLOCK = 64 * 1024;
+static const long long REMOTE_MIN_READAHEAD = 256 * 1024;
+static const long long REMOTE_MAX_READAHEAD = 8 * 1024 * 1024;
+static const long long REMOTE_MAX_FETCH = 2 * REMOTE_MAX_READAHEAD;
+static const size_t REMOTE_CACHE_BLOCKS = 1024;
+
+// body of one range response, cut off past the bytes asked for
+struct RangeBuffer {
+    std::string data;
+    size_t limit = 0;
+};
+
+static size_t range_buffer_cb(char* ptr, size_t size, size_t nmemb, void* arg) {
+    RangeBuffer* b = (RangeBuffer*)arg;
+    size_t n = size * nmemb;
+    if (b->data.size() + n > b->limit) return 0;
+    b->data.append(ptr, n);
+    return n;
+}
+
+// "bytes a-b/total", or "bytes */total" with start and end left at -1
+static bool parse_content_range(const std::string &v, long long &start, long long &end, long long &total) {
+    size_t slash = v.find('/');
+    if (v.compare(0, 6, "bytes ") != 0 || slash == std::string::npos) return false;
+    char* stop = nullptr;
+    total = strtoll(v.c_str() + slash + 1, &stop, 10);
+    if (stop == v.c_str() + slash + 1 || total < 0) return false;
+    start = end = -1;
+    if (v[6] == '*') return true;
+    return sscanf(v.c_str() + 6, "%lld-%lld", &start, &end) == 2 && start <= end && end < total;
+}
+
+class RemoteFile {
+public:
+    RemoteFile() = default;
+    ~RemoteFile() { if (blob_fd_ >= 0) close(blob_fd_); }
+    RemoteFile(const RemoteFile &) = delete;
+    RemoteFile &operator=(const RemoteFile &) = delete;
+
+    // learns the size with a first request that also fetches the block
+    // holding `first`, or the last block when `first` is negative
+    bool open(const std::string &filename, const std::string &username, const std::string &password,
+              long long first = 0) {
+        filename_ = filename;
+        username_ = username;
+        password_ = password;
+        url_ = endpoint("/api/download/") + filename;
+        CachedDownload cached;
+        bool have_cached = cache_lookup(username, filename, cached);
+        long long start = first / REMOTE_BLOCK * REMOTE_BLOCK;
+        std::string range = first < 0 ? "-" + std::to_string(REMOTE_BLOCK)
+                                      : std::to_string(start) + "-" + std::to_string(start + REMOTE_BLOCK - 1);
+        return request(range, REMOTE_BLOCK, have_cached ? &cached : nullptr);
+    }
+
+    long long size() const { return size_; }
+    bool failed() const { return failed_; }
+
+    // copies up to len bytes at offset into buf; the count, 0 past the end
+    // or -1 once a request has failed
+    long long read(long long offset, char* buf, long long len) {
+        if (failed_ || offset < 0 || len < 0) return -1;
+        if (offset >= size_ || len == 0) return 0;
+        len = std::min(len, size_ - offset);
+        if (blob_fd_ >= 0) {
+            ssize_t n = pread(blob_fd_, buf, (size_t)len, (off_t)offset);
+            if (n <= 0) {
+                std::cerr << "Cannot read cached copy of " << filename_ << std::endl;
+                failed_ = true;
+                return -1;
+            }
+            return n;
+        }
+
+        // a read that continues the previous one grows the readahead
+        if (offset == next_) readahead_ = std::min(std::max(readahead_ * 2, REMOTE_MIN_READAHEAD), REMOTE_MAX_READAHEAD);
+        else readahead_ = 0;
+        next_ = offset + len;
+        long long last_block = (size_ - 1) / REMOTE_BLOCK;
+        long long want = std::min(last_block, (offset + len + readahead_ - 1) / REMOTE_BLOCK);
+        long long done = 0;
+        while (done < len) {
+            long long pos = offset + done, k = pos / REMOTE_BLOCK;
+            const std::string* b = block(k);
+            if (!b) {
+                long long upto = std::min(want, k + REMOTE_MAX_FETCH / REMOTE_BLOCK - 1);
+                if (!fetch(k, std::max(k, upto))) return -1;
+                if (!(b = block(k))) {
+                    std::cerr << "Cannot read " << filename_ << ": the server sent a short range" << std::endl;
+                    failed_ = true;
+                    return -1;
+                }
+            }
+            long long in = pos - k * REMOTE_BLOCK;
+            long long n = std::min((long long)b->size() - in, len - done);
+            if (n <= 0) {
+                std::cerr << "Cannot read " << filename_ << ": the server sent a short range" << std::endl;
+                failed_ = true;
+                return -1;
+            }
+            memcpy(buf + done, b->data() + in, (size_t)n);
+            done += n;
+        }
+        return done;
+    }
+
+private:
+    bool fetch(long long first_block, long long last_block) {
+        long long from = first_block * REMOTE_BLOCK, to = std::min((last_block + 1) * REMOTE_BLOCK, size_);
+        return request(std::to_string(from) + "-" + std::to_string(to - 1), to - from, nullptr);
+    }
+
+    // one Range request; the first one learns the size and ETag, and later
+    // ones must agree with them
+    bool request(const std::string &range, long long limit, const CachedDownload* cached) {
+        CURL* curl = session_handle();
+        if (!curl) return fail("");
+        RangeBuffer body;
+        body.limit = (size_t)limit;
+        std::string headers;
+        curl_easy_setopt(curl, CURLOPT_URL, url_.c_str());
+        set_auth(curl, username_, password_);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_buffer_cb);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+        struct curl_slist* request_headers = nullptr;
+        if (cached) {
+            request_headers = curl_slist_append(request_headers, ("If-None-Match: " + cached->etag).c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+        }
+
+        CURLcode res = session_perform(curl, "range");
+        curl_slist_free_all(request_headers);
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status == 304 && cached) {
+            // a range read cannot afford to hash the whole blob; the store
+            // keeps blobs read-only and never links them out, so a blob of
+            // the right size is trusted and any other is read around
+            struct stat st;
+            blob_fd_ = ::open(blob_path(cached->sha256).c_str(), O_RDONLY | O_CLOEXEC);
+            if (blob_fd_ >= 0 && (fstat(blob_fd_, &st) != 0 || st.st_size != cached->size)) {
+                ::close(blob_fd_);
+                blob_fd_ = -1;
+            }
+            if (blob_fd_ < 0) return request(range, limit, nullptr);
+            cache_touch(cached->sha256);
+            size_ = cached->size;
+            return true;
+        }
+        if (status != 200 && status != 206 && status != 416) {
+            if (res != CURLE_OK) return fail(curl_easy_strerror(res));
+            std::string error = json_string_field(body.data, "error");
+            return fail((error.empty() ? "request failed" : error) + " (HTTP " + std::to_string(status) + ")");
+        }
+        // a server that ignores Range starts the whole file, which overruns the buffer
+        if (status == 200) return fail("the server does not serve byte ranges; use download instead");
+        if (res != CURLE_OK) return fail(curl_easy_strerror(res));
+
+        long long start = -1, end = -1, total = -1;
+        if (!parse_content_range(header_value(headers, "content-range"), start, end, total))
+            return fail("the server sent no usable Content-Range");
+        std::string etag = header_value(headers, "etag");
+        if (size_ < 0) {
+            size_ = total;
+            etag_ = etag;
+        } else if (total != size_ || etag != etag_) {
+            return fail("it changed on the server since it was opened");
+        }
+        if (status == 416) return true;
+        if ((long long)body.data.size() != end - start + 1) return fail("the server sent a short range");
+        store(start, body.data);
+        return true;
+    }
+
+    bool fail(const std::string &why) {
+        if (!why.empty()) std::cerr << "Cannot read " << filename_ << ": " << why << std::endl;
+        failed_ = true;
+        return false;
+    }
+
+    // keeps the whole blocks in data, which starts at `start`
+    void store(long long start, const std::string &data) {
+        long long end = start + (long long)data.size();
+        for (long long k = (start + REMOTE_BLOCK - 1) / REMOTE_BLOCK; k * REMOTE_BLOCK < end; ++k) {
+            long long from = k * REMOTE_BLOCK, to = std::min(from + REMOTE_BLOCK, size_);
+            if (to > end) break;
+            put(k, data.substr((size_t)(from - start), (size_t)(to - from)));
+        }
+    }
+
+    void put(long long k, std::string bytes) {
+        auto it = blocks_.find(k);
+        if (it != blocks_.end()) {
+            lru_.erase(it->second.second);
+            blocks_.erase(it);
+        }
+        lru_.push_front(k);
+        blocks_.emplace(k, std::make_pair(std::move(bytes), lru_.begin()));
+        while (blocks_.size() > REMOTE_CACHE_BLOCKS) {
+            blocks_.erase(lru_.back());
+            lru_.pop_back();
+        }
+    }
+
+    // cached block k, marked as just used; null on a miss
+    const std::string* block(long long k) {
+        auto it = blocks_.find(k);
+        if (it == blocks_.end()) return nullptr;
+        lru_.splice(lru_.begin(), lru_, it->second.second);
+        return &it->second.first;
+    }
+
+    std::string filename_, username_, password_, url_, etag_;
+    long long size_ = -1;
+    int blob_fd_ = -1;
+    bool failed_ = false;
+    long long next_ = -1;       // where a sequential read would continue
+    long long readahead_ = 0;
+    std::list<long long> lru_;  // most recently used first
+    std::unordered_map<long long, std::pair<std::string, std::list<long long>::iterator>> blocks_;
+};
+
+// std::istream access to a RemoteFile for code that wants a seekable stream;
+// seeks within the current buffer keep it, and others cost nothing until
+// the next read
+class RemoteStreamBuf : public std::streambuf {
+public:
+    explicit RemoteStreamBuf(RemoteFile &file) : file_(file), buf_((size_t)REMOTE_BLOCK) {}
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        long long n = file_.read(pos_, buf_.data(), (long long)buf_.size());
+        if (n <= 0) return traits_type::eof();
+        pos_ += n;
+        setg(buf_.data(), buf_.data(), buf_.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+        long long begin = pos_ - (egptr() - eback()), cur = pos_ - (egptr() - gptr());
+        long long target = dir == std::ios_base::beg ? (long long)off
+                           : dir == std::ios_base::cur ? cur + off
+                           : file_.size() + off;
+        if (target < 0 || target > file_.size()) return pos_type(off_type(-1));
+        if (target >= begin && target <= pos_) {
+            setg(eback(), eback() + (target - begin), egptr());
+        } else {
+            pos_ = target;
+            setg(buf_.data(), buf_.data(), buf_.data());
+        }
+        return pos_type(off_type(target));
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+    std::streamsize showmanyc() override {
+        long long left = file_.size() - pos_;
+        return left > 0 ? (std::streamsize)left : -1;
+    }
+
+private:
+    RemoteFile &file_;
+    std::vector<char> buf_;
+    long long pos_ = 0;   // file offset just past the buffer
+};
+
+class RemoteStream : public std::istream {
+public:
+    explicit RemoteStream(RemoteFile &file) : std::istream(nullptr), buf_(file) { rdbuf(&buf_); }
+
+private:
+    RemoteStreamBuf buf_;
+};
+
+// writes [offset, offset + length) of the file to stdout; a negative length
+// runs to the end
+static bool remote_cat(RemoteFile &file, long long offset, long long length) {
+    long long end = length < 0 ? file.size() : std::min(file.size(), offset + length);
+    std::vector<char> buf(1024 * 1024);
+    for (long long pos = offset; pos < end;) {
+        long long n = file.read(pos, buf.data(), std::min((long long)buf.size(), end - pos));
+        if (n <= 0) return false;
+        if (!write_all(STDOUT_FILENO, buf.data(), (size_t)n)) {
+            std::cerr << "Cannot write to standard output: " << strerror(errno) << std::endl;
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+// writes the file's first `lines` lines to stdout
+static bool remote_head_lines(RemoteFile &file, long long lines) {
+    RemoteStream in(file);
+    std::streambuf* sb = in.rdbuf();
+    std::string out;
+    auto flush = [&out] {
+        bool ok = write_all(STDOUT_FILENO, out.data(), out.size());
+        if (!ok) std::cerr << "Cannot write to standard output: " << strerror(errno) << std::endl;
+        out.clear();
+        return ok;
+    };
+    int c;
+    while (lines > 0 && (c = sb->sbumpc()) != std::char_traits<char>::eof()) {
+        out += (char)c;
+        if (c == '\n') lines--;
+        if (out.size() >= 1024 * 1024 && !flush()) return false;
+    }
+    return flush() && !file.failed();
+}
+
+// offset where the file's last `lines` lines start, scanning back a block at
+// a time; -1 if a read fails
+static long long remote_tail_start(RemoteFile &file, long long lines) {
+    long long size = file.size();
+    if (lines == 0) return size;
+    std::vector<char> buf((size_t)REMOTE_BLOCK);
+    for (long long pos = size; pos > 0;) {
+        long long from = (pos - 1) / REMOTE_BLOCK * REMOTE_BLOCK;
+        if (file.read(from, buf.data(), pos - from) != pos - from) return -1;
+        for (long long i = pos - from - 1; i >= 0; --i) {
+            // the last line's own newline does not start another line
+            if (buf[(size_t)i] == '\n' && from + i != size - 1 && --lines == 0) return from + i + 1;
+        }
+        pos = from;
+    }
+    return 0;
+}
+
+// ---------------- Server: documents ----------------
+// `netserve serve` keeps server.py's on-disk layout (users.json,
+// metadata.json, chunk_refs.json, incomplete/, complete/, chunks/,
+// manifests/), so either server can run on an uploads directory the other
+// wrote. Json is a small DOM over JsonParser for those files and for request
+// bodies; numbers keep the text they were written with.
+struct Json {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+    Type type = Type::Null;
+    bool flag = false;
+    std::string text;                                 // string value or number as written
+    std::vector<Json> items;                          // array elements
+    std::vector<std::pair<std::string, Json>> members; // object members in insertion order
+
+    static Json of(const std::string &s) { Json j; j.type = Type::String; j.text = s; return j; }
+    static Json of(const char* s) { return of(std::string(s)); }
+    static Json of(long long n) { Json j; j.type = Type::Number; j.text = std::to_string(n); return j; }
+    static Json of(bool b) { Json j; j.type = Type::Bool; j.flag = b; return j; }
+    static Json object() { Json j; j.type = Type::Object; return j; }
+    static Json array() { Json j; j.type = Type::Array; return j; }
+
+    bool is_string() const { return type == Type::String; }
+    bool is_int() const { return type == Type::Number && text.find_first_of(".eE") == std::string::npos; }
+    long long as_int() const { return strtoll(text.c_str(), nullptr, 10); }
+
+    // Python truthiness, for the `info.get("assembled")` style checks
+    bool truthy() const {
+        switch (type) {
+        case Type::Null: return false;
+        case Type::Bool: return flag;
+        case Type::Number: return strtod(text.c_str(), nullptr) != 0;
+        case Type::String: return !text.empty();
+        case Type::Array: return !items.empty();
+        default: return !members.empty();
+        }
+    }
+
+    // member `key`, or null if absent or this is not an object
+    const Json* get(const std::string &key) const {
+        if (type != Type::Object) return nullptr;
+        for (const auto &m : members)
+            if (m.first == key) return &m.second;
+        return nullptr;
+    }
+
+    // string member `key`, or def if it is absent or not a string
+    std::string str(const std::string &key, const std::string &def = "") const {
+        const Json* v = get(key);
+        return v && v->is_string() ? v->text : def;
+    }
+
+    bool flag_of(const std::string &key) const {
+        const Json* v = get(key);
+        return v && v->truthy();
+    }
+
+    Json &set(const std::string &key, Json v) {
+        for (auto &m : members)
+            if (m.first == key) return m.second = std::move(v);
+        members.emplace_back(key, std::move(v));
+        return members.back().second;
+    }
+};
+
+static bool json_parse(const std::string &text, Json &out) {
+    out = Json();
+    std::vector<Json*> open;
+    std::string key;
+    JsonParser parser([&](JsonEvent ev, const std::string &t) {
+        if (ev == JsonEvent::EndObject || ev == JsonEvent::EndArray) {
+            open.pop_back();
+            return;
+        }
+        if (ev == JsonEvent::Key) {
+            key = t;
+            return;
+        }
+        Json v;
+        if (ev == JsonEvent::BeginObject) v.type = Json::Type::Object;
+        else if (ev == JsonEvent::BeginArray) v.type = Json::Type::Array;
+        else if (ev == JsonEvent::String) v = Json::of(t);
+        else if (ev == JsonEvent::Number) { v.type = Json::Type::Number; v.text = t; }
+        else if (t != "null") v = Json::of(t == "true");
+        // the open containers only ever grow at their end, so the pointers
+        // on the stack stay valid
+        Json* slot;
+        if (open.empty()) {
+            out = std::move(v);
+            slot = &out;
+        } else if (open.back()->type == Json::Type::Array) {
+            open.back()->items.push_back(std::move(v));
+            slot = &open.back()->items.back();
+        } else {
+            open.back()->members.emplace_back(key, std::move(v));
+            slot = &open.back()->members.back().second;
+        }
+        if (ev == JsonEvent::BeginObject || ev == JsonEvent::BeginArray) open.push_back(slot);
+    });
+    return parser.feed(text.data(), text.size()) && parser.finish();
+}
+
+// json.dumps() layout, so files written here read like server.py's
+static void json_dump(const Json &j, std::string &out) {
+    switch (j.type) {
+    case Json::Type::Null: out += "null"; break;
+    case Json::Type::Bool: out += j.flag ? "true" : "false"; break;
+    case Json::Type::Number: out += j.text; break;
+    case Json::Type::String: out += json_quote(j.text); break;
+    case Json::Type::Array:
+        out += '[';
+        for (size_t i = 0; i < j.items.size(); ++i) {
+            if (i) out += ", ";
+            json_dump(j.items[i], out);
+        }
+        out += ']';
+        break;
+    case Json::Type::Object:
+        out += '{';
+        for (size_t i = 0; i < j.members.size(); ++i) {
+            if (i) out += ", ";
+            out += json_quote(j.members[i].first) + ": ";
+            json_dump(j.members[i].second, out);
+        }
+        out += '}';
+        break;
+    }
+}
+
+static std::string json_dump(const Json &j) {
+    std::string out;
+    json_dump(j, out);
+    return out;
+}
+
+static bool read_whole_file(const std::string &path, std::string &out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+// like server.py's _save_json: written beside the target, then renamed over it
+static bool write_file_atomic(const std::string &path, const std::string &data, mode_t mode = 0) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        // narrowed before any data lands in it
+        if (mode && chmod(tmp.c_str(), mode) != 0) return false;
+        out.write(data.data(), (std::streamsize)data.size());
+        if (!out) return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// the object stored at path, or an empty object if it is missing or unreadable
+static Json load_json_file(const std::string &path) {
+    std::string text;
+    Json j;
+    if (!read_whole_file(path, text) || !json_parse(text, j) || j.type != Json::Type::Object) return Json::object();
+    return j;
+}
+
+static std::string random_bytes(size_t n) {
+    thread_local std::random_device rd;
+    std::string out;
+    while (out.size() < n) {
+        uint32_t v = rd();
+        out.append((const char*)&v, std::min<size_t>(4, n - out.size()));
+    }
+    return out;
+}
+
+static std::string uuid4() {
+    std::string b = random_bytes(16);
+    b[6] = (char)((b[6] & 0x0f) | 0x40);
+    b[8] = (char)((b[8] & 0x3f) | 0x80);
+    std::string hex = hex_of((const unsigned char*)b.data(), b.size());
+    return hex.substr(0, 8) + "-" + hex.substr(8, 4) + "-" + hex.substr(12, 4) + "-" + hex.substr(16, 4) + "-" +
+           hex.substr(20);
+}
+
+// ---------------- Server: password hashes ----------------
+// werkzeug's "pbkdf2:sha256[:iterations]$salt$hex" and "scrypt[:n:r:p]$salt$hex"
+// formats, so accounts created through either server work with both. New
+// accounts get PBKDF2, which every werkzeug release can check.
+static const unsigned PBKDF2_ITERATIONS = 600000; // werkzeug 3's default
+
+// HMAC-SHA256 with the padded key states computed once, since PBKDF2 runs
+// all of its MACs under one key
+struct HmacSha256 {
+    Sha256 inner, outer;
+
+    explicit HmacSha256(const std::string &key) {
+        unsigned char k[64] = {0};
+        if (key.size() > 64) {
+            Sha256 sha;
+            sha.update(key.data(), key.size());
+            sha.digest(k);
+        } else {
+            memcpy(k, key.data(), key.size());
+        }
+        unsigned char pad[64];
+        for (int i = 0; i < 64; ++i) pad[i] = k[i] ^ 0x36;
+        inner.update(pad, 64);
+        for (int i = 0; i < 64; ++i) pad[i] = k[i] ^ 0x5c;
+        outer.update(pad, 64);
+    }
+
+    // out may alias data
+    void mac(const void* data, size_t n, unsigned char out[32]) const {
+        Sha256 in = inner, on = outer;
+        unsigned char d[32];
+        in.update(data, n);
+        in.digest(d);
+        on.update(d, 32);
+        on.digest(out);
+    }
+};
+
+static std::string pbkdf2_sha256(const std::string &password, const std::string &salt, unsigned iterations,
+                                 size_t length) {
+    HmacSha256 prf(password);
+    std::string out;
+    for (uint32_t block = 1; out.size() < length; ++block) {
+        std::string s = salt;
+        for (int i = 3; i >= 0; --i) s += (char)(block >> (8 * i));
+        unsigned char u[32], t[32];
+        prf.mac(s.data(), s.size(), u);
+        memcpy(t, u, 32);
+        for (unsigned it = 1; it < iterations; ++it) {
+            prf.mac(u, 32, u);
+            for (int i = 0; i < 32; ++i) t[i] ^= u[i];
+        }
+        out.append((const char*)t, std::min<size_t>(32, length - out.size()));
+    }
+    return out;
+}
+
+static void salsa20_8(uint32_t b[16]) {
+    auto rotl = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= rotl(x[0] + x[12], 7);   x[8] ^= rotl(x[4] + x[0], 9);
+        x[12] ^= rotl(x[8] + x[4], 13);  x[0] ^= rotl(x[12] + x[8], 18);
+        x[9] ^= rotl(x[5] + x[1], 7);    x[13] ^= rotl(x[9] + x[5], 9);
+        x[1] ^= rotl(x[13] + x[9], 13);  x[5] ^= rotl(x[1] + x[13], 18);
+        x[14] ^= rotl(x[10] + x[6], 7);  x[2] ^= rotl(x[14] + x[10], 9);
+        x[6] ^= rotl(x[2] + x[14], 13);  x[10] ^= rotl(x[6] + x[2], 18);
+        x[3] ^= rotl(x[15] + x[11], 7);  x[7] ^= rotl(x[3] + x[15], 9);
+        x[11] ^= rotl(x[7] + x[3], 13);  x[15] ^= rotl(x[11] + x[7], 18);
+        x[1] ^= rotl(x[0] + x[3], 7);    x[2] ^= rotl(x[1] + x[0], 9);
+        x[3] ^= rotl(x[2] + x[1], 13);   x[0] ^= rotl(x[3] + x[2], 18);
+        x[6] ^= rotl(x[5] + x[4], 7);    x[7] ^= rotl(x[6] + x[5], 9);
+        x[4] ^= rotl(x[7] + x[6], 13);   x[5] ^= rotl(x[4] + x[7], 18);
+        x[11] ^= rotl(x[10] + x[9], 7);  x[8] ^= rotl(x[11] + x[10], 9);
+        x[9] ^= rotl(x[8] + x[11], 13);  x[10] ^= rotl(x[9] + x[8], 18);
+        x[12] ^= rotl(x[15] + x[14], 7); x[13] ^= rotl(x[12] + x[15], 9);
+        x[14] ^= rotl(x[13] + x[12], 13); x[15] ^= rotl(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; ++i) b[i] += x[i];
+}
+
+// scrypt's BlockMix over 2r 64-byte blocks: even outputs go to the first
+// half of y, odd ones to the second
+static void scrypt_blockmix(const uint32_t* b, uint32_t* y, size_t r) {
+    uint32_t x[16];
+    memcpy(x, b + (2 * r - 1) * 16, sizeof(x));
+    for (size_t i = 0; i < 2 * r; ++i) {
+        for (int k = 0; k < 16; ++k) x[k] ^= b[i * 16 + k];
+        salsa20_8(x);
+        memcpy(y + (i / 2 + (i % 2) * r) * 16, x, sizeof(x));
+    }
+}
+
+static void scrypt_romix(unsigned char* block, size_t r, uint64_t n) {
+    size_t words = 32 * r;
+    std::vector<uint32_t> x(words), y(words), v(words * n);
+    for (size_t i = 0; i < words; ++i) {
+        const unsigned char* p = block + 4 * i;
+        x[i] = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+        std::copy(x.begin(), x.end(), v.begin() + i * words);
+        scrypt_blockmix(x.data(), y.data(), r);
+        x.swap(y);
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+        for (size_t k = 0; k < words; ++k) x[k] ^= v[j * words + k];
+        scrypt_blockmix(x.data(), y.data(), r);
+        x.swap(y);
+    }
+    for (size_t i = 0; i < words; ++i)
+        for (int b = 0; b < 4; ++b) block[4 * i + b] = (unsigned char)(x[i] >> (8 * b));
+}
+
+// RFC 7914; false for parameters hashlib.scrypt would refuse under werkzeug's
+// maxmem of 132 * n * r * p
+static bool scrypt(const std::string &password, const std::string &salt, uint64_t n, size_t r, size_t p,
+                   size_t length, std::string &out) {
+    if (n < 2 || (n & (n - 1)) || r == 0 || p == 0 || n * r * p > (1ull << 24)) return false;
+    std::string b = pbkdf2_sha256(password, salt, 1, p * 128 * r);
+    for (size_t i = 0; i < p; ++i) scrypt_romix((unsigned char*)&b[i * 128 * r], r, n);
+    out = pbkdf2_sha256(password, b, 1, length);
+    return true;
+}
+
+static bool check_password_hash(const std::string &stored, const std::string &password) {
+    size_t d1 = stored.find('$');
+    size_t d2 = d1 == std::string::npos ? d1 : stored.find('$', d1 + 1);
+    if (d2 == std::string::npos) return false;
+    std::string method = stored.substr(0, d1), salt = stored.substr(d1 + 1, d2 - d1 - 1);
+    std::string expected = stored.substr(d2 + 1);
+    std::vector<std::string> parts;
+    std::stringstream ss(method);
+    for (std::string part; std::getline(ss, part, ':');) parts.push_back(part);
+    if (parts.empty()) return false;
+
+    std::string raw;
+    if (parts[0] == "pbkdf2" && parts.size() <= 3 && (parts.size() < 2 || parts[1] == "sha256")) {
+        long iterations = parts.size() == 3 ? strtol(parts[2].c_str(), nullptr, 10) : PBKDF2_ITERATIONS;
+        if (iterations < 1) return false;
+        raw = pbkdf2_sha256(password, salt, (unsigned)iterations, 32);
+    } else if (parts[0] == "scrypt" && (parts.size() == 1 || parts.size() == 4)) {
+        uint64_t n = 1ull << 15;
+        size_t r = 8, p = 1;
+        if (parts.size() == 4) {
+            n = strtoull(parts[1].c_str(), nullptr, 10);
+            r = strtoul(parts[2].c_str(), nullptr, 10);
+            p = strtoul(parts[3].c_str(), nullptr, 10);
+        }
+        if (!scrypt(password, salt, n, r, p, 64, raw)) return false;
+    } else {
+        return false;
+    }
+    std::string actual = hex_of((const unsigned char*)raw.data(), raw.size());
+    if (actual.size() != expected.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < actual.size(); ++i) diff |= (unsigned char)(actual[i] ^ expected[i]);
+    return diff == 0;
+}
+
+static std::string generate_password_hash(const std::string &password) {
+    static const char* alphabet = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::string salt;
+    for (unsigned char c : random_bytes(16)) salt += alphabet[c % 62];
+    std::string raw = pbkdf2_sha256(password, salt, PBKDF2_ITERATIONS, 32);
+    return "pbkdf2:sha256:" + std::to_string(PBKDF2_ITERATIONS) + "$" + salt + "$" +
+           hex_of((const unsigned char*)raw.data(), raw.size());
+}
+
+// ---------------- Server: storage ----------------
+// Users are loaded once and kept in memory; every change rewrites
+// users.json. File metadata uses server.py's layout: metadata.json is a
+// snapshot and metadata.log holds the changes since, one JSON line each,
+// [file_id, entry] or [file_id, null] for a removal.
+static const size_t SERVE_MIN_CHUNK_SIZE = 1024 * 1024;
+static const size_t SERVE_MAX_CHUNK_SIZE = 512ull * 1024 * 1024;
+// no upload is written past this offset, well inside the filesystems' limits
+static const long long SERVE_MAX_UPLOAD_SIZE = 1ll << 40;
+static const size_t SERVE_MAX_STORE_CHUNK = 16 * 1024 * 1024; // client cuts at most 8 MB
+static const size_t SERVE_MAX_QUERY_HASHES = 10000;
+static const size_t SERVE_MAX_BATCH_FILES = 5000;
+static const long SERVE_MAX_LIST_PAGE = 10000;
+static const size_t SERVE_DELTA_MIN_BLOCK = 1024;
+static const size_t SERVE_DELTA_MAX_BLOCK = 8 * 1024 * 1024;
+static const size_t SERVE_META_COMPACT_MIN = 10000; // log lines before compaction is considered
+static const long long SERVE_SESSION_TTL = 24 * 3600;
+
+// An in-progress upload lives in incomplete/<file_id>/: each chunk is written
+// straight to offset index * chunk_size of UPLOAD_DATA, which init
+// preallocates as a sparse file when the size is known. UPLOAD_BITMAP has one
+// bit per stored chunk and UPLOAD_CHUNK_LOG one JSON line [index, info] per
+// stored chunk, so completing an upload is a rename into complete/. A bit is
+// only set once the chunk's data and log line are on disk. UPLOAD_DIGEST
+// keeps the whole-file digest of the chunks hashed so far, so a restart
+// carries on from there. The layout is shared with server.py, which does not
+// keep a digest and drops this one when it rewrites a chunk it covers.
+static const char* UPLOAD_DATA = "data";
+static const char* UPLOAD_BITMAP = "received";
+static const char* UPLOAD_CHUNK_LOG = "chunks.log";
+static const char* UPLOAD_DIGEST = "digest";
+
+struct UploadState {
+    // the fields up to the digest, and the folder's bitmap and chunk log
+    std::mutex lock;
+    bool loaded = false;
+    std::vector<unsigned char> bitmap;
+    long long count = 0;
+    std::map<long long, Json> chunks; // index -> info, as logged
+    std::set<long long> writing;      // chunks a request is writing into the data file
+    // whole-file digest of chunks 0..hashed-1, advanced as they arrive so
+    // the last chunk does not have to wait for the whole file; goes with
+    // the upload's assembly lock
+    Sha256 sha;
+    long long hashed = 0;
+
+    bool has(long long index) const {
+        return index >= 0 && (size_t)(index / 8) < bitmap.size() && (bitmap[(size_t)(index / 8)] >> (index % 8) & 1);
+    }
+};
+
+// one request's hold on writing a chunk into its place in the data file;
+// there is never more than one writer per chunk
+struct ChunkClaim {
+    std::shared_ptr<UploadState> state;
+    long long index;
+
+    // caller holds state->lock and has checked nobody else holds the chunk
+    ChunkClaim(std::shared_ptr<UploadState> s, long long i) : state(std::move(s)), index(i) {
+        state->writing.insert(index);
+    }
+
+    ~ChunkClaim() {
+        std::lock_guard<std::mutex> lk(state->lock);
+        state->writing.erase(index);
+    }
+};
+
+struct ServerStore {
+    std::string base, incomplete, complete, chunks, manifests;
+    std::string users_file, metadata_file, refs_file;
+
+    // users, meta, its indexes and log, and the listing generation; held
+    // across each read-modify-write so concurrent requests do not lose each
+    // other's changes. Every metadata change is one append to the log.
+    std::mutex lock;
+    // users.json as last read, with the (inode, mtime, size) it had; see
+    // users_locked
+    std::map<std::string, Json> users;
+    std::tuple<ino_t, long long, off_t> users_stamp{0, -1, -1};
+    struct MetaEntry {
+        unsigned long long seq; // order of first write, like server.py's dict order
+        Json info;
+    };
+    std::unordered_map<std::string, MetaEntry> meta;
+    std::unordered_map<std::string, std::set<std::string>> by_owner;
+    std::unordered_map<std::string, std::set<std::string>> by_shared; // user -> files shared with them
+    std::unordered_map<std::string, std::map<unsigned long long, std::string>> by_name; // oldest first, see meta_find_by_name
+    unsigned long long next_seq = 0;
+    std::string log_file;
+    int log_fd = -1;
+    size_t log_lines = 0;
+    std::mutex compact_lock;
+    std::string epoch;
+    unsigned long long generation = 0;
+    // passwords that verified once, as an HMAC under a per-process key,
+    // keyed by user and tied to the hash they matched
+    std::string mac_key;
+    std::map<std::string, std::pair<std::string, std::string>> verified;
+    // signs session tokens; shared with server.py through session.key
+    std::string session_key;
+
+    // chunk_refs.json together with the chunk existence checks and removals
+    // that depend on it, and when the chunk store was last swept
+    std::mutex refs_lock;
+    time_t chunks_swept = 0;
+
+    // in-progress uploads as loaded from their folders, and per-upload
+    // locks for advancing the digest and completing the upload. Only the
+    // maps are under counts_lock; each upload has its own lock for the rest.
+    std::mutex counts_lock;
+    std::map<std::string, std::shared_ptr<UploadState>> uploads;
+    std::map<std::string, std::shared_ptr<std::mutex>> assembly_locks;
+};
+static ServerStore g_store;
+
+static std::map<std::string, Json> load_json_map(const std::string &path) {
+    std::map<std::string, Json> out;
+    for (auto &m : load_json_file(path).members) out[m.first] = std::move(m.second);
+    return out;
+}
+
+static bool save_json_map(const std::string &path, const std::map<std::string, Json> &map) {
+    std::string out = "{";
+    for (const auto &e : map) {
+        if (out.size() > 1) out += ", ";
+        out += json_quote(e.first) + ": ";
+        json_dump(e.second, out);
+    }
+    return write_file_atomic(path, out + "}");
+}
+
+static std::string meta_name_key(const Json &info) {
+    return info.str("final_filename", info.str("filename"));
+}
+
+static std::vector<std::string> meta_shared_users(const Json &info) {
+    std::vector<std::string> out;
+    if (const Json* shared = info.get("shared_with"))
+        for (const Json &u : shared->items) out.push_back(u.text);
+    return out;
+}
+
+static void meta_drop(std::unordered_map<std::string, std::set<std::string>> &index, const std::string &key,
+                      const std::string &file_id) {
+    auto it = index.find(key);
+    if (it == index.end()) return;
+    it->second.erase(file_id);
+    if (it->second.empty()) index.erase(it);
+}
+
+// replaces (or with info null removes) an entry and keeps the indexes in
+// step; an entry that keeps its name keeps its place. Caller holds
+// g_store.lock, or is store_open.
+static void meta_apply(const std::string &file_id, const Json* info) {
+    ServerStore &s = g_store;
+    auto it = s.meta.find(file_id);
+    if (it != s.meta.end()) {
+        const Json &old = it->second.info;
+        std::string owner = old.str("owner"), name = meta_name_key(old);
+        if (!info || info->str("owner") != owner) meta_drop(s.by_owner, owner, file_id);
+        if (!info || meta_name_key(*info) != name) {
+            auto n = s.by_name.find(name);
+            if (n != s.by_name.end()) {
+                n->second.erase(it->second.seq);
+                if (n->second.empty()) s.by_name.erase(n);
+            }
+        }
+        std::vector<std::string> keep = info ? meta_shared_users(*info) : std::vector<std::string>();
+        for (const std::string &user : meta_shared_users(old))
+            if (std::find(keep.begin(), keep.end(), user) == keep.end()) meta_drop(s.by_shared, user, file_id);
+    }
+    if (!info) {
+        if (it != s.meta.end()) s.meta.erase(it);
+        return;
+    }
+    if (it == s.meta.end())
+        it = s.meta.emplace(file_id, ServerStore::MetaEntry{s.next_seq++, *info}).first;
+    else
+        it->second.info = *info;
+    s.by_owner[info->str("owner")].insert(file_id);
+    s.by_name[meta_name_key(*info)][it->second.seq] = file_id;
+    for (const std::string &user : meta_shared_users(*info)) s.by_shared[user].insert(file_id);
+}
+
+static void meta_replay(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::string line;
+    while (std::getline(in, line)) {
+        Json change;
+        // a line that does not parse was torn by a crash mid-append
+        if (!json_parse(line, change) || change.type != Json::Type::Array || change.items.size() != 2 ||
+            !change.items[0].is_string())
+            continue;
+        const Json &info = change.items[1];
+        meta_apply(change.items[0].text, info.type == Json::Type::Null ? nullptr : &info);
+    }
+}
+
+// moves the live log aside and opens an empty one; caller holds g_store.lock.
+// A log still set aside means the last snapshot failed, so this one is
+// added to it rather than replacing it. False if the log could not be set
+// aside, in which case writes go on appending to it.
+static bool meta_rotate_locked() {
+    ServerStore &s = g_store;
+    if (s.log_fd >= 0) close(s.log_fd);
+    std::string old = s.log_file + ".old";
+    bool moved = true;
+    if (access(s.log_file.c_str(), F_OK) == 0) {
+        std::string pending;
+        if (access(old.c_str(), F_OK) != 0) {
+            moved = rename(s.log_file.c_str(), old.c_str()) == 0;
+        } else if ((moved = read_whole_file(s.log_file, pending))) {
+            int fd = ::open(old.c_str(), O_WRONLY | O_APPEND);
+            moved = fd >= 0 && write_all(fd, pending.data(), pending.size()) && fsync(fd) == 0 &&
+                    unlink(s.log_file.c_str()) == 0;
+            if (fd >= 0) close(fd);
+        }
+    }
+    s.log_fd = ::open(s.log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (moved) s.log_lines = 0;
+    if (s.log_fd < 0) std::cerr << "Cannot open " << s.log_file << ": " << strerror(errno) << std::endl;
+    else if (!moved) std::cerr << "Cannot set " << s.log_file << " aside: " << strerror(errno) << std::endl;
+    return s.log_fd >= 0 && moved;
+}
+
+// the entries as metadata.json, in the order they were first written;
+// caller holds g_store.lock
+static std::string meta_snapshot_locked() {
+    std::vector<const std::pair<const std::string, ServerStore::MetaEntry>*> order;
+    order.reserve(g_store.meta.size());
+    for (const auto &e : g_store.meta) order.push_back(&e);
+    std::sort(order.begin(), order.end(), [](auto a, auto b) { return a->second.seq < b->second.seq; });
+    std::string out = "{";
+    for (auto e : order) {
+        if (out.size() > 1) out += ", ";
+        out += json_quote(e->first) + ": ";
+        json_dump(e->second.info, out);
+    }
+    return out + "}";
+}
+
+// writes a fresh snapshot and drops the log it replaces; writers only wait
+// for the log swap and the serialization, not for the disk
+static void meta_compact() {
+    std::unique_lock<std::mutex> busy(g_store.compact_lock, std::try_to_lock);
+    if (!busy.owns_lock()) return; // another thread is at it
+    std::string snapshot;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        if (!meta_rotate_locked()) return;
+        snapshot = meta_snapshot_locked();
+    }
+    if (!write_file_atomic(g_store.metadata_file, snapshot)) {
+        // the set-aside log stays and the next compaction retries
+        std::cerr << "Cannot write " << g_store.metadata_file << std::endl;
+        return;
+    }
+    unlink((g_store.log_file + ".old").c_str());
+}
+
+// a fresh session key written beside `path` and moved into place: linked, so
+// a key another server created meanwhile is kept, or renamed over a damaged one
+static bool new_session_key(const std::string &path, bool replace) {
+    std::string key = random_bytes(32), tmp = path + "." + uuid4() + ".tmp";
+    std::string hex = hex_of((const unsigned char*)key.data(), key.size()) + "\n";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, hex.data(), hex.size()) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && (replace ? rename(tmp.c_str(), path.c_str()) : link(tmp.c_str(), path.c_str())) == 0;
+    int saved = errno;
+    unlink(tmp.c_str());
+    errno = saved;
+    if (ok) g_store.session_key = key;
+    return ok;
+}
+
+// reads uploads/session.key, creating it on first use, as server.py does. A
+// key shorter than 32 bytes, as a crash while it was written leaves it, is
+// replaced, which ends the sessions signed with it.
+static bool store_session_key() {
+    std::string path = g_store.base + "/session.key";
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        std::string hex;
+        if (!read_whole_file(path, hex)) {
+            if (new_session_key(path, false)) return true;
+            if (errno != EEXIST) break;
+            continue; // another server created it first
+        }
+        hex.erase(hex.find_last_not_of(" \t\r\n") + 1);
+        bool valid = hex.size() >= 64 && hex.size() % 2 == 0 &&
+                     hex.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos;
+        if (!valid) {
+            if (new_session_key(path, true)) return true;
+            break;
+        }
+        g_store.session_key.clear();
+        for (size_t i = 0; i + 1 < hex.size(); i += 2)
+            g_store.session_key += (char)strtol(hex.substr(i, 2).c_str(), nullptr, 16);
+        return true;
+    }
+    std::cerr << "Cannot use " << path << std::endl;
+    return false;
+}
+
+static bool store_open(const std::string &dir) {
+    ServerStore &s = g_store;
+    s.base = dir;
+    s.incomplete = dir + "/incomplete";
+    s.complete = dir + "/complete";
+    s.chunks = dir + "/chunks";
+    s.manifests = dir + "/manifests";
+    s.users_file = dir + "/users.json";
+    s.metadata_file = dir + "/metadata.json";
+    s.log_file = dir + "/metadata.log";
+    s.refs_file = dir + "/chunk_refs.json";
+    for (const std::string &d : {s.base, s.incomplete, s.complete, s.chunks, s.manifests}) {
+        if (mkdir(d.c_str(), 0755) != 0 && errno != EEXIST) {
+            std::cerr << "Cannot create " << d << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    for (const auto &m : load_json_file(s.metadata_file).members) meta_apply(m.first, &m.second);
+    // a log left behind by an interrupted compaction comes first
+    meta_replay(s.log_file + ".old");
+    meta_replay(s.log_file);
+    // starts from a clean snapshot, so a line torn by a crash is never
+    // followed by new ones
+    meta_compact();
+    if (s.log_fd < 0) return false;
+    s.epoch = uuid4();
+    s.epoch.erase(std::remove(s.epoch.begin(), s.epoch.end(), '-'), s.epoch.end());
+    s.epoch.resize(12);
+    s.mac_key = random_bytes(32);
+    return store_session_key();
+}
+
+// appends the changes to the log, syncs it and only then applies them;
+// every commit moves listing ETags on. `ok` is false, and nothing changed,
+// if the log could not be written. Caller holds g_store.lock; true once the
+// log is due for compaction, which the caller runs after letting go of the lock.
+static bool meta_commit_locked(const std::vector<std::pair<std::string, const Json*>> &changes, bool* ok) {
+    ServerStore &s = g_store;
+    std::string lines;
+    for (const auto &c : changes) {
+        lines += "[" + json_quote(c.first) + ", ";
+        if (c.second)
+            json_dump(*c.second, lines);
+        else
+            lines += "null";
+        lines += "]\n";
+    }
+    off_t end = lseek(s.log_fd, 0, SEEK_END);
+    bool written = write_all(s.log_fd, lines.data(), lines.size()) && fdatasync(s.log_fd) == 0;
+    if (ok) *ok = written;
+    if (!written) {
+        std::cerr << "Cannot write " << s.log_file << ": " << strerror(errno) << std::endl;
+        // a torn line would hide the ones appended after it from replay
+        if (end >= 0 && ftruncate(s.log_fd, end) != 0)
+            std::cerr << "Cannot trim " << s.log_file << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    for (const auto &c : changes) meta_apply(c.first, c.second);
+    s.log_lines += changes.size();
+    s.generation++;
+    return s.log_lines >= std::max(SERVE_META_COMPACT_MIN, 2 * s.meta.size());
+}
+
+// meta_commit_locked for a single entry, taking the lock; false if the log
+// could not be written
+static bool meta_put(const std::string &file_id, const Json* info) {
+    bool ok = true, due;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        due = meta_commit_locked({{file_id, info}}, &ok);
+    }
+    if (due) meta_compact();
+    return ok;
+}
+
+static std::string meta_etag_locked() {
+    return "\"" + g_store.epoch + "-" + std::to_string(g_store.generation) + "\"";
+}
+
+// copy of the metadata entry for file_id; false if there is none
+static bool meta_get(const std::string &file_id, Json &info) {
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    auto it = g_store.meta.find(file_id);
+    if (it == g_store.meta.end()) return false;
+    info = it->second.info;
+    return true;
+}
+
+// the entry a download name resolves to: the newest assembled one, which
+// is the current owner of the path, since each upload under a name takes
+// the path over from the ones before it; false if there is none
+static bool meta_find_by_name(const std::string &name, std::string &file_id, Json &info) {
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    auto named = g_store.by_name.find(name);
+    if (named == g_store.by_name.end()) return false;
+    for (auto e = named->second.rbegin(); e != named->second.rend(); ++e) {
+        const Json &entry = g_store.meta.at(e->second).info;
+        if (!entry.flag_of("assembled")) continue;
+        file_id = e->second;
+        info = entry;
+        return true;
+    }
+    return false;
+}
+
+// copies of the entries owned by user, and with shared those shared with
+// them too, in the order they were first written; caller holds g_store.lock
+static std::vector<std::pair<std::string, Json>> meta_visible_locked(const std::string &user, bool shared) {
+    std::set<std::string> ids;
+    auto owned = g_store.by_owner.find(user);
+    if (owned != g_store.by_owner.end()) ids = owned->second;
+    auto with = g_store.by_shared.find(user);
+    if (shared && with != g_store.by_shared.end()) ids.insert(with->second.begin(), with->second.end());
+    std::vector<std::pair<unsigned long long, std::string>> order;
+    for (const std::string &id : ids) order.emplace_back(g_store.meta.at(id).seq, id);
+    std::sort(order.begin(), order.end());
+    std::vector<std::pair<std::string, Json>> out;
+    for (const auto &o : order) out.emplace_back(o.second, g_store.meta.at(o.second).info);
+    return out;
+}
+
+static std::string final_name_of(const std::string &file_id, const Json &info) {
+    return info.str("final_filename", info.str("filename", file_id + ".bin"));
+}
+
+// whether an entry still names a stored file at `name`; an upload under a
+// name takes over its path, so removing an older entry for that name must
+// leave the file to the newer one. Callers remove their entries first.
+static bool complete_path_in_use(const std::string &name) {
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    auto named = g_store.by_name.find(name);
+    if (named == g_store.by_name.end()) return false;
+    for (const auto &e : named->second)
+        if (!g_store.meta.at(e.second).info.flag_of("manifest")) return true;
+    return false;
+}
+
+static std::string store_chunk_path(const std::string &hash) {
+    return g_store.chunks + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+// who has sent a stored chunk, one user per line beside it. Dedup only
+// counts a chunk as present for a user listed there, so knowing a hash is
+// not enough to reference someone else's data.
+static std::string store_chunk_users_path(const std::string &hash) {
+    return store_chunk_path(hash) + ".users";
+}
+
+static std::string store_manifest_path(const std::string &file_id) {
+    return g_store.manifests + "/" + file_id + ".json";
+}
+
+static bool is_regular_file(const std::string &path, off_t* size = nullptr) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    if (size) *size = st.st_size;
+    return true;
+}
+
+// (hash, size) entries of a stored manifest
+static std::vector<std::pair<std::string, long long>> load_manifest(const std::string &file_id) {
+    std::vector<std::pair<std::string, long long>> out;
+    Json doc = load_json_file(store_manifest_path(file_id));
+    const Json* chunks = doc.get("chunks");
+    if (!chunks) return out;
+    for (const Json &c : chunks->items)
+        if (c.items.size() == 2) out.emplace_back(c.items[0].text, c.items[1].as_int());
+    return out;
+}
+
+// size of a completed file, or -1 if its data is gone
+static long long stored_size(const std::string &file_id, const Json &info, const std::string &final_name) {
+    if (info.flag_of("manifest")) {
+        const Json* size = info.get("size");
+        return is_regular_file(store_manifest_path(file_id)) ? (size ? size->as_int() : 0) : -1;
+    }
+    off_t size = 0;
+    return is_regular_file(g_store.complete + "/" + final_name, &size) ? (long long)size : -1;
+}
+
+// "<hashed> <bytes> <state> <pending>" for UPLOAD_DIGEST, in hex but for
+// the counts
+static std::string digest_state(const UploadState &state) {
+    char words[8 * 8 + 1];
+    for (int i = 0; i < 8; ++i) snprintf(words + 8 * i, 9, "%08x", state.sha.h[i]);
+    return std::to_string(state.hashed) + " " + std::to_string(state.sha.total) + " " + words + " " +
+           hex_of(state.sha.buf, state.sha.buf_len) + "\n";
+}
+
+static bool parse_digest_state(const std::string &text, long long &hashed, Sha256 &sha) {
+    std::istringstream in(text);
+    std::string words, pending;
+    unsigned long long total;
+    if (!(in >> hashed >> total >> words) || hashed < 0 || words.size() != 64) return false;
+    in >> pending;
+    if (pending.size() % 2 || pending.size() / 2 != total % 64) return false;
+    for (int i = 0; i < 8; ++i) sha.h[i] = (uint32_t)strtoul(words.substr(8 * i, 8).c_str(), nullptr, 16);
+    sha.total = total;
+    sha.buf_len = pending.size() / 2;
+    for (size_t i = 0; i < sha.buf_len; ++i) sha.buf[i] = (unsigned char)strtoul(pending.substr(2 * i, 2).c_str(), nullptr, 16);
+    return true;
+}
+
+// the upload's state, loaded from its folder the first time this process
+// sees it
+static std::shared_ptr<UploadState> upload_state(const std::string &file_id, const std::string &folder) {
+    std::shared_ptr<UploadState> state;
+    {
+        std::lock_guard<std::mutex> lk(g_store.counts_lock);
+        auto &s = g_store.uploads[file_id];
+        if (!s) s = std::make_shared<UploadState>();
+        state = s;
+    }
+    std::lock_guard<std::mutex> lk(state->lock);
+    if (state->loaded) return state;
+    state->loaded = true;
+    std::string text;
+    if (read_whole_file(folder + "/" + UPLOAD_BITMAP, text)) state->bitmap.assign(text.begin(), text.end());
+    for (unsigned char b : state->bitmap) state->count += __builtin_popcount(b);
+    if (read_whole_file(folder + "/" + UPLOAD_CHUNK_LOG, text)) {
+        std::istringstream lines(text);
+        std::string line;
+        Json entry;
+        while (std::getline(lines, line)) {
+            // a line cut short by a crash never had its bit set
+            if (json_parse(line, entry) && entry.items.size() == 2 && entry.items[0].is_int())
+                state->chunks[entry.items[0].as_int()] = entry.items[1];
+        }
+    }
+    // a digest only counts if every chunk it covers is still recorded
+    long long hashed;
+    Sha256 sha;
+    if (read_whole_file(folder + "/" + UPLOAD_DIGEST, text) && parse_digest_state(text, hashed, sha)) {
+        bool whole = true;
+        for (long long i = 0; i < hashed && whole; ++i) whole = state->has(i);
+        if (whole) {
+            state->sha = sha;
+            state->hashed = hashed;
+        }
+    }
+    return state;
+}
+
+static bool sync_file(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// records a chunk already written to the data file; returns how many
+// distinct chunks the upload now has, or -1 if it could not be recorded.
+// The data and the log line reach the disk before the bit does, so a bit
+// that survives a crash always stands for a whole chunk.
+static long long mark_received(const std::string &file_id, const std::string &folder, long long index,
+                               const Json &chunk_info) {
+    auto state = upload_state(file_id, folder);
+    if (!sync_file(folder + "/" + UPLOAD_DATA)) return -1;
+    std::lock_guard<std::mutex> lk(state->lock);
+    std::string line = "[" + std::to_string(index) + ", " + json_dump(chunk_info) + "]\n";
+    int fd = open((folder + "/" + UPLOAD_CHUNK_LOG).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    bool logged = fd >= 0 && write_all(fd, line.data(), line.size()) && fdatasync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!logged) return -1;
+    state->chunks[index] = chunk_info;
+    if (!state->has(index)) {
+        size_t byte = (size_t)(index / 8);
+        if (byte >= state->bitmap.size()) state->bitmap.resize(byte + 1);
+        state->bitmap[byte] |= (unsigned char)(1 << (index % 8));
+        fd = open((folder + "/" + UPLOAD_BITMAP).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            if (pwrite(fd, &state->bitmap[byte], 1, (off_t)byte) != 1)
+                std::cerr << "Cannot record chunk " << index << " of " << file_id << std::endl;
+            close(fd);
+        }
+        state->count++;
+    }
+    return state->count;
+}
+
+// forgets the upload's digest; the caller holds the assembly lock
+static void reset_digest(UploadState &state, const std::string &folder) {
+    state.sha = Sha256();
+    state.hashed = 0;
+    unlink((folder + "/" + UPLOAD_DIGEST).c_str());
+}
+
+// feeds the chunks that now follow on from the hashed prefix into the
+// upload's digest, reading them back from the data file, and saves it;
+// the caller holds the upload's assembly lock
+static void advance_digest(UploadState &state, const std::string &folder, long long chunk_size) {
+    int fd = open((folder + "/" + UPLOAD_DATA).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    std::vector<char> buf(4 * 1024 * 1024);
+    long long start = state.hashed;
+    while (true) {
+        long long left = chunk_size;
+        {
+            std::lock_guard<std::mutex> lk(state.lock);
+            if (!state.has(state.hashed)) break;
+            auto it = state.chunks.find(state.hashed);
+            if (it != state.chunks.end() && it->second.get("size")) left = it->second.get("size")->as_int();
+        }
+        off_t off = (off_t)state.hashed * (off_t)chunk_size;
+        while (left > 0) {
+            ssize_t n = pread(fd, buf.data(), (size_t)std::min<long long>(left, (long long)buf.size()), off);
+            if (n <= 0) break;
+            state.sha.update(buf.data(), (size_t)n);
+            off += n;
+            left -= n;
+        }
+        state.hashed++;
+    }
+    close(fd);
+    if (state.hashed != start) write_file_atomic(folder + "/" + UPLOAD_DIGEST, digest_state(state));
+}
+
+// removes an upload's folder under incomplete/ and forgets its state
+static void drop_upload(const std::string &file_id) {
+    std::string folder = g_store.incomplete + "/" + file_id;
+    if (DIR* d = opendir(folder.c_str())) {
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name != "." && name != "..") unlink((folder + "/" + name).c_str());
+        }
+        closedir(d);
+    }
+    rmdir(folder.c_str());
+    std::lock_guard<std::mutex> lk(g_store.counts_lock);
+    g_store.uploads.erase(file_id);
+}
+
+static std::shared_ptr<std::mutex> assembly_lock(const std::string &file_id) {
+    std::lock_guard<std::mutex> lk(g_store.counts_lock);
+    auto &l = g_store.assembly_locks[file_id];
+    if (!l) l = std::make_shared<std::mutex>();
+    return l;
+}
+
+// copies a verified chunk of `size` bytes that was staged beside the data
+// file into its place there. The chunk stops counting as received while it
+// is copied, and the digest starts over if it covered the chunk. The caller
+// keeps `claim` until the chunk is recorded again. 0 on success, else the
+// status to answer with and why.
+static int place_chunk(const std::string &file_id, const std::string &folder, long long index, off_t offset,
+                       const std::string &staged, long long size, std::shared_ptr<ChunkClaim> &claim,
+                       std::string &error) {
+    auto lock = assembly_lock(file_id);
+    std::lock_guard<std::mutex> alk(*lock);
+    Json info;
+    if (!meta_get(file_id, info) || info.flag_of("assembled")) {
+        error = "upload already complete";
+        return 409;
+    }
+    auto state = upload_state(file_id, folder);
+    {
+        std::lock_guard<std::mutex> lk(state->lock);
+        if (state->writing.count(index)) {
+            error = "chunk " + std::to_string(index) + " is being written by another request";
+            return 409;
+        }
+        claim = std::make_shared<ChunkClaim>(state, index);
+        if (state->has(index)) {
+            size_t byte = (size_t)(index / 8);
+            state->bitmap[byte] &= (unsigned char)~(1 << (index % 8));
+            state->count--;
+            int fd = open((folder + "/" + UPLOAD_BITMAP).c_str(), O_WRONLY | O_CLOEXEC);
+            bool cleared = fd >= 0 && pwrite(fd, &state->bitmap[byte], 1, (off_t)byte) == 1 && fdatasync(fd) == 0;
+            if (fd >= 0) close(fd);
+            if (!cleared) {
+                error = "failed to store chunk " + std::to_string(index);
+                return 500;
+            }
+        }
+    }
+    if (index < state->hashed) reset_digest(*state, folder);
+    int in = open(staged.c_str(), O_RDONLY | O_CLOEXEC);
+    int out = open((folder + "/" + UPLOAD_DATA).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    bool ok = in >= 0 && out >= 0;
+    std::vector<char> buf(1024 * 1024);
+    for (long long done = 0; ok && done < size;) {
+        ssize_t n = read(in, buf.data(), buf.size());
+        ok = n > 0 && pwrite(out, buf.data(), (size_t)n, offset + (off_t)done) == n;
+        done += n;
+    }
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (!ok) {
+        error = "failed to store chunk " + std::to_string(index);
+        return 500;
+    }
+    return 0;
+}
+
+// the users, read again whenever users.json's (inode, mtime, size)
+// changes, so a user server.py or an edit added behind this server's back
+// is seen on the next request. Caller holds g_store.lock.
+static std::map<std::string, Json> &users_locked() {
+    struct stat st;
+    if (stat(g_store.users_file.c_str(), &st) != 0) {
+        g_store.users = load_json_map(g_store.users_file);
+        g_store.users_stamp = std::make_tuple((ino_t)0, -1ll, (off_t)-1);
+    } else if (std::make_tuple(st.st_ino, mtime_ns_of(st), st.st_size) != g_store.users_stamp) {
+        g_store.users = load_json_map(g_store.users_file);
+        g_store.users_stamp = std::make_tuple(st.st_ino, mtime_ns_of(st), st.st_size);
+    }
+    return g_store.users;
+}
+
+// the user's stored password hash, or empty if there is no such user
+static std::string user_password_hash(const std::string &user) {
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    std::map<std::string, Json> &users = users_locked();
+    auto it = users.find(user);
+    return it == users.end() ? "" : it->second.str("password_hash");
+}
+
+static std::string password_tag(const std::string &password) {
+    unsigned char mac[32];
+    HmacSha256(g_store.mac_key).mac(password.data(), password.size(), mac);
+    return std::string((const char*)mac, 32);
+}
+
+// what can be said about a password without running the KDF: 1 if this
+// user and password pair was verified before, 0 if there is no such user,
+// -1 if it takes verify_user
+static int verify_user_cached(const std::string &user, const std::string &password) {
+    std::string stored = user_password_hash(user);
+    if (stored.empty()) return 0;
+    std::string tag = password_tag(password);
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    auto it = g_store.verified.find(user);
+    return it != g_store.verified.end() && it->second.first == stored && it->second.second == tag ? 1 : -1;
+}
+
+// checks the password against users.json; the KDF only runs the first time
+// a user and password pair is seen, not on every chunk. The loop threads
+// only call verify_user_cached and leave the rest to a worker.
+static bool verify_user(const std::string &user, const std::string &password) {
+    int known = verify_user_cached(user, password);
+    if (known >= 0) return known == 1;
+    std::string stored = user_password_hash(user);
+    if (stored.empty() || !check_password_hash(stored, password)) return false;
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    g_store.verified[user] = {stored, password_tag(password)};
+    return true;
+}
+
+// Session tokens are <hex username>.<expiry>.<hex mac>, signed over the
+// user's stored password hash as well so a new password revokes them; the
+// same format and key as server.py's
+static std::string session_mac(const std::string &user_hex, long long expires, const std::string &password_hash) {
+    std::string msg = user_hex + "." + std::to_string(expires) + "." + password_hash;
+    unsigned char mac[32];
+    HmacSha256(g_store.session_key).mac(msg.data(), msg.size(), mac);
+    return hex_of(mac, 32);
+}
+
+static std::string make_session_token(const std::string &user, const std::string &password_hash, long long &expires) {
+    expires = (long long)time(nullptr) + SERVE_SESSION_TTL;
+    std::string user_hex = hex_of((const unsigned char*)user.data(), user.size());
+    return user_hex + "." + std::to_string(expires) + "." + session_mac(user_hex, expires, password_hash);
+}
+
+// the user a token was issued to, or empty if it is forged, expired or revoked
+static std::string check_session_token(const std::string &token) {
+    size_t a = token.find('.'), b = a == std::string::npos ? a : token.find('.', a + 1);
+    if (b == std::string::npos || token.find('.', b + 1) != std::string::npos) return "";
+    std::string user_hex = token.substr(0, a), mac = token.substr(b + 1), user;
+    if (user_hex.empty() || user_hex.size() % 2 || user_hex.find_first_not_of("0123456789abcdef") != std::string::npos)
+        return "";
+    for (size_t i = 0; i < user_hex.size(); i += 2) user += (char)strtol(user_hex.substr(i, 2).c_str(), nullptr, 16);
+    char* end = nullptr;
+    std::string exp = token.substr(a + 1, b - a - 1);
+    long long expires = strtoll(exp.c_str(), &end, 10);
+    if (exp.empty() || *end != '\0' || expires < (long long)time(nullptr)) return "";
+    std::string stored = user_password_hash(user);
+    if (stored.empty()) return "";
+    std::string want = session_mac(user_hex, expires, stored);
+    if (mac.size() != want.size()) return "";
+    unsigned char diff = 0;
+    for (size_t i = 0; i < want.size(); ++i) diff |= (unsigned char)(mac[i] ^ want[i]);
+    return diff == 0 ? user : "";
+}
+
+// ---------------- Server: HTTP messages ----------------
+struct SinkPlan {
+    std::string path;     // empty: count and hash the bytes but store nothing
+    size_t limit = 0;
+    bool inflate = false;
+    off_t offset = -1;    // >= 0: write into path at this offset instead of replacing it
+    std::shared_ptr<ChunkClaim> claim; // the chunk an offset write holds
+};
+
+// Where the file part of a multipart upload goes as it arrives, like
+// server.py's _save_hashed: written to plan.path while hashed, inflated on
+// the way for deflate data, and stored and hashed only up to plan.limit
+// bytes. Bytes past the limit are read and dropped so the connection stays
+// usable for the 413 reply.
+class UploadSink {
+public:
+    explicit UploadSink(const SinkPlan &plan) : plan_(plan) {
+        if (!plan.path.empty()) {
+            fd_ = open(plan.path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (plan.offset < 0 ? O_TRUNC : 0), 0644);
+            failed_ = fd_ < 0 || (plan.offset >= 0 && lseek(fd_, plan.offset, SEEK_SET) < 0);
+        }
+        if (plan.inflate) {
+            memset(&zs_, 0, sizeof(zs_));
+            inflating_ = inflateInit(&zs_) == Z_OK;
+            corrupt_ = !inflating_;
+        }
+    }
+
+    ~UploadSink() {
+        if (fd_ >= 0) close(fd_);
+        if (inflating_) inflateEnd(&zs_);
+    }
+
+    void write(const char* data, size_t n) {
+        wire_ += n;
+        if (over() || corrupt_) return;
+        if (!plan_.inflate) {
+            store(data, n);
+            return;
+        }
+        if (ended_) return; // bytes after the end of the deflate stream are ignored
+        static thread_local std::vector<unsigned char> out(256 * 1024);
+        zs_.next_in = (Bytef*)data;
+        zs_.avail_in = (uInt)n;
+        // a full output buffer may leave more output pending
+        do {
+            zs_.next_out = out.data();
+            zs_.avail_out = (uInt)out.size();
+            int rc = inflate(&zs_, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                corrupt_ = true;
+                return;
+            }
+            store((const char*)out.data(), out.size() - zs_.avail_out);
+            ended_ = rc == Z_STREAM_END;
+            if (rc == Z_BUF_ERROR) break;
+        } while (!ended_ && !over() && (zs_.avail_in > 0 || zs_.avail_out == 0));
+    }
+
+    // completes the digest; returns false if the data was not valid deflate
+    bool finish() {
+        if (plan_.inflate && !over() && !ended_) corrupt_ = true;
+        if (fd_ >= 0) {
+            if (close(fd_) != 0) failed_ = true;
+            fd_ = -1;
+        }
+        digest_ = sha_.hex_digest();
+        return !corrupt_;
+    }
+
+    // drops what was stored; a write at an offset is left for a resend to overwrite
+    void remove() const {
+        if (!plan_.path.empty() && plan_.offset < 0) unlink(plan_.path.c_str());
+    }
+
+    const SinkPlan &plan() const { return plan_; }
+    bool over() const { return size_ > plan_.limit; }
+    bool corrupt() const { return corrupt_; }
+    bool failed() const { return failed_; }
+    size_t size() const { return size_; }
+    size_t wire_size() const { return wire_; }
+    const std::string &digest() const { return digest_; }
+
+private:
+    void store(const char* data, size_t n) {
+        // never keep more than one byte past the limit
+        n = std::min(n, plan_.limit + 1 - size_);
+        size_ += n;
+        if (over()) return;
+        sha_.update(data, n);
+        while (fd_ >= 0 && n > 0 && !failed_) {
+            ssize_t w = ::write(fd_, data, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                failed_ = true;
+                break;
+            }
+            data += w;
+            n -= (size_t)w;
+        }
+    }
+
+    SinkPlan plan_;
+    int fd_ = -1;
+    Sha256 sha_;
+    z_stream zs_;
+    bool inflating_ = false, ended_ = false, corrupt_ = false, failed_ = false;
+    size_t size_ = 0, wire_ = 0;
+    std::string digest_;
+};
+
+// Incremental multipart/form-data parser: bytes are fed as they arrive and
+// each part's body is passed on without being collected, holding back only
+// as much as could be the start of the next boundary.
+class MultipartParser {
+public:
+    using Begin = std::function<void(const std::string &name, const std::string &filename, bool is_file)>;
+    using Data = std::function<void(const char*, size_t)>;
+
+    MultipartParser(const std::string &boundary, Begin begin, Data data)
+        : delim_("\r\n--" + boundary), begin_(std::move(begin)), data_(std::move(data)) {
+        // the first boundary has no CRLF before it
+        buf_ = "\r\n";
+    }
+
+    bool feed(const char* data, size_t n) {
+        if (state_ == State::Failed) return false;
+        if (state_ == State::Done) return true; // the epilogue is ignored
+        buf_.append(data, n);
+        size_t pos = 0;
+        while (state_ != State::Failed && state_ != State::Done) {
+            if (state_ == State::Body || state_ == State::Preamble) {
+                size_t hit = buf_.find(delim_, pos);
+                size_t safe = hit != std::string::npos ? hit
+                              : buf_.size() >= pos + delim_.size() ? buf_.size() - delim_.size() + 1 : pos;
+                if (state_ == State::Body && safe > pos) data_(buf_.data() + pos, safe - pos);
+                pos = safe;
+                if (hit == std::string::npos) break;
+                pos += delim_.size();
+                state_ = State::AfterBoundary;
+            } else if (state_ == State::AfterBoundary) {
+                if (buf_.size() - pos < 2) break;
+                if (buf_.compare(pos, 2, "--") == 0) {
+                    state_ = State::Done;
+                } else {
+                    // transport padding, then CRLF
+                    size_t eol = buf_.find("\r\n", pos);
+                    if (eol == std::string::npos) {
+                        if (buf_.size() - pos > 256) state_ = State::Failed;
+                        break;
+                    }
+                    pos = eol + 2;
+                    state_ = State::Headers;
+                }
+            } else if (state_ == State::Headers) {
+                std::string headers;
+                if (buf_.compare(pos, 2, "\r\n") == 0) {
+                    pos += 2;
+                } else {
+                    size_t end = buf_.find("\r\n\r\n", pos);
+                    if (end == std::string::npos) {
+                        if (buf_.size() - pos > 16 * 1024) state_ = State::Failed;
+                        break;
+                    }
+                    headers = buf_.substr(pos, end - pos);
+                    pos = end + 4;
+                }
+                state_ = begin_part("\r\n" + headers) ? State::Body : State::Failed;
+            }
+        }
+        buf_.erase(0, pos);
+        return state_ != State::Failed;
+    }
+
+    // true once the closing boundary has been seen
+    bool done() const { return state_ == State::Done; }
+
+private:
+    enum class State { Preamble, AfterBoundary, Headers, Body, Done, Failed };
+
+    // parameter `key` of a Content-Disposition value, quoted or not
+    static bool param(const std::string &value, const std::string &key, std::string &out) {
+        std::string lower = value;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+        for (size_t p = lower.find(key + "="); p != std::string::npos; p = lower.find(key + "=", p + 1)) {
+            if (p > 0 && lower[p - 1] != ';' && lower[p - 1] != ' ' && lower[p - 1] != '\t') continue;
+            size_t v = p + key.size() + 1;
+            if (v < value.size() && value[v] == '"') {
+                out.clear();
+                for (size_t i = v + 1; i < value.size() && value[i] != '"'; ++i) {
+                    if (value[i] == '\\' && i + 1 < value.size()) ++i;
+                    out += value[i];
+                }
+            } else {
+                size_t e = value.find(';', v);
+                out = value.substr(v, e == std::string::npos ? std::string::npos : e - v);
+                while (!out.empty() && std::isspace((unsigned char)out.back())) out.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool begin_part(const std::string &headers) {
+        std::string disposition = header_value(headers, "content-disposition");
+        std::string name, filename;
+        if (!param(disposition, "name", name)) return false;
+        bool is_file = param(disposition, "filename", filename);
+        begin_(name, filename, is_file);
+        return true;
+    }
+
+    std::string delim_;
+    Begin begin_;
+    Data data_;
+    State state_ = State::Preamble;
+    std::string buf_;
+};
+
+struct HttpRequest {
+    std::string method, path, query;
+    std::vector<std::pair<std::string, std::string>> headers; // names lowercased
+    std::map<std::string, std::string> args;                  // query parameters
+    std::map<std::string, std::string> form;                  // multipart fields
+    std::string body;                                         // any other body
+    std::string param;                                        // path after a route's prefix
+    std::string user;                                         // authenticated caller
+    // the multipart file part, stored as it arrived, and its field name
+    std::unique_ptr<UploadSink> file;
+    std::string file_field;
+
+    std::string header(const std::string &name) const {
+        for (const auto &h : headers)
+            if (h.first == name) return h.second;
+        return "";
+    }
+
+    bool has_header(const std::string &name) const {
+        for (const auto &h : headers)
+            if (h.first == name) return true;
+        return false;
+    }
+
+    std::string arg(const std::string &name) const {
+        auto it = args.find(name);
+        return it == args.end() ? "" : it->second;
+    }
+
+    const std::string* field(const std::string &name) const {
+        auto it = form.find(name);
+        return it == form.end() ? nullptr : &it->second;
+    }
+};
+
+struct HttpResponse {
+    int status = 200;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // sent after body with sendfile(): whole files or byte ranges of them
+    struct Slice { std::string path; off_t offset; off_t length; };
+    std::vector<Slice> slices;
+    // body of unknown length, produced piece by piece and sent chunked;
+    // appends the next piece and returns false once there is no more
+    std::function<bool(std::string &)> stream;
+};
+
+static HttpResponse json_response(int status, const std::string &json) {
+    HttpResponse r;
+    r.status = status;
+    r.headers.emplace_back("Content-Type", "application/json");
+    r.body = json + "\n";
+    return r;
+}
+
+static HttpResponse error_response(int status, const std::string &message, const std::string &extra = "") {
+    return json_response(status, "{\"error\": " + json_quote(message) + extra + "}");
+}
+
+static const char* http_reason(int status) {
+    switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    default: return "Unknown";
+    }
+}
+
+static std::string url_decode(const std::string &s, bool plus_is_space) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '%' && i + 2 < s.size() && std::isxdigit((unsigned char)s[i + 1]) &&
+            std::isxdigit((unsigned char)s[i + 2])) {
+            out += (char)strtol(s.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+        } else {
+            out += plus_is_space && s[i] == '+' ? ' ' : s[i];
+        }
+    }
+    return out;
+}
+
+static const char* BASE64_STD = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char* BASE64_URL = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static std::string base64_encode(const std::string &in, const char* alphabet) {
+    std::string out;
+    for (size_t i = 0; i < in.size(); i += 3) {
+        uint32_t v = (uint32_t)(unsigned char)in[i] << 16;
+        if (i + 1 < in.size()) v |= (uint32_t)(unsigned char)in[i + 1] << 8;
+        if (i + 2 < in.size()) v |= (unsigned char)in[i + 2];
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += i + 1 < in.size() ? alphabet[(v >> 6) & 63] : '=';
+        out += i + 2 < in.size() ? alphabet[v & 63] : '=';
+    }
+    return out;
+}
+
+static bool base64_decode(const std::string &in, const char* alphabet, std::string &out) {
+    out.clear();
+    uint32_t v = 0;
+    int bits = 0;
+    for (char c : in) {
+        if (c == '=') break;
+        const char* p = strchr(alphabet, c);
+        if (!p || !c) return false;
+        v = (v << 6) | (uint32_t)(p - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += (char)((v >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+// a single "bytes=" range of a total-byte body, as server.py's _send_manifest
+// reads it; false if the header should be ignored. Sets status 416 if the
+// range cannot be satisfied.
+static bool parse_range(const std::string &header, long long total, long long &start, long long &end, int &status) {
+    std::string h = header;
+    h.erase(0, h.find_first_not_of(" \t"));
+    h.erase(h.find_last_not_of(" \t") + 1);
+    if (h.compare(0, 6, "bytes=") != 0) return false;
+    size_t dash = h.find('-', 6);
+    if (dash == std::string::npos) return false;
+    std::string a = h.substr(6, dash - 6), b = h.substr(dash + 1);
+    auto digits = [](const std::string &s) {
+        return std::all_of(s.begin(), s.end(), [](char c) { return c >= '0' && c <= '9'; });
+    };
+    if (!digits(a) || !digits(b) || (a.empty() && b.empty())) return false;
+    if (!a.empty()) {
+        start = strtoll(a.c_str(), nullptr, 10);
+        end = b.empty() ? total - 1 : std::min(strtoll(b.c_str(), nullptr, 10), total - 1);
+    } else {
+        start = std::max(0ll, total - strtoll(b.c_str(), nullptr, 10));
+        end = total - 1;
+    }
+    status = start >= total || start > end ? 416 : 206;
+    return true;
+}
+
+// ---------------- Server: API ----------------
+// One handler per server.py endpoint, with the same checks in the same
+// order, the same status codes and the same JSON fields.
+// the request body as a JSON object, like request.get_json(force=True)
+static bool json_body(const HttpRequest &req, Json &data) {
+    return json_parse(req.body, data) && data.type == Json::Type::Object;
+}
+
+static HttpResponse bad_json() {
+    return error_response(400, "request body must be a JSON object");
+}
+
+static std::string json_string_array(const std::vector<std::string> &items) {
+    std::string out = "[";
+    for (size_t i = 0; i < items.size(); ++i) out += (i ? ", " : "") + json_quote(items[i]);
+    return out + "]";
+}
+
+static bool parse_long(const std::string &s, long long &out) {
+    char* end = nullptr;
+    out = strtoll(s.c_str(), &end, 10);
+    while (end && std::isspace((unsigned char)*end)) ++end;
+    return !s.empty() && end != s.c_str() && *end == '\0';
+}
+
+// makes the stored file part match `want`. A part that came before the
+// fields deciding its limit or encoding was stored under a guess or spooled
+// raw, and is replayed through a sink for `want` now; its temporary path is
+// kept otherwise.
+static bool take_file(HttpRequest &req, const SinkPlan &want) {
+    SinkPlan have = req.file->plan();
+    if (have.path.empty()) return false;
+    if (have.limit == want.limit && have.inflate == want.inflate) return true;
+    if (have.offset >= 0) return false; // stored in place, so there is nothing to replay from
+    auto sink = std::make_unique<UploadSink>(want);
+    int fd = open(have.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    std::vector<char> buf(1024 * 1024);
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) sink->write(buf.data(), (size_t)n);
+    close(fd);
+    sink->finish();
+    req.file->remove();
+    req.file = std::move(sink);
+    return n == 0;
+}
+
+static void drop_file(HttpRequest &req) {
+    if (req.file) req.file->remove();
+}
+
+// spool for a file part that arrived before the fields that place it
+static SinkPlan spool_plan() {
+    SinkPlan plan;
+    plan.path = g_store.incomplete + "/spool-" + uuid4() + ".tmp";
+    plan.limit = SERVE_MAX_CHUNK_SIZE;
+    return plan;
+}
+
+// same reply as server.py, which clients use to check the server is up
+static HttpResponse api_greet(HttpRequest &) {
+    return json_response(200, "{\"message\": \"Hello from Python!\"}");
+}
+
+static HttpResponse api_capabilities(HttpRequest &) {
+    std::ostringstream out;
+    out << "{\"default_chunk_size\": " << CHUNK_SIZE << ", \"min_chunk_size\": " << SERVE_MIN_CHUNK_SIZE
+        << ", \"max_chunk_size\": " << SERVE_MAX_CHUNK_SIZE << ", \"chunk_encodings\": [\"identity\", \"deflate\"]"
+        << ", \"max_batch_files\": " << SERVE_MAX_BATCH_FILES << ", \"max_list_page\": " << SERVE_MAX_LIST_PAGE << "}";
+    return json_response(200, out.str());
+}
+
+static HttpResponse api_create_user(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    std::string username = data.str("username"), password = data.str("password");
+    if (username.empty() || password.empty()) return error_response(400, "username and password required");
+    if (!user_password_hash(username).empty()) return error_response(409, "user exists");
+    std::string hash = generate_password_hash(password);
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        std::map<std::string, Json> &users = users_locked();
+        if (users.count(username)) return error_response(409, "user exists");
+        Json user = Json::object();
+        user.set("password_hash", Json::of(hash));
+        users[username] = user;
+        if (!save_json_map(g_store.users_file, users)) {
+            users.erase(username);
+            return error_response(500, "failed to save users");
+        }
+    }
+    return json_response(201, "{\"status\": \"created\", \"username\": " + json_quote(username) + "}");
+}
+
+// trades Basic credentials (or a token about to expire) for a session token
+// a token only ever comes from the password, so a stolen one lapses with
+// its expiry rather than renewing itself
+static HttpResponse api_session(HttpRequest &req) {
+    if (strncasecmp(req.header("authorization").c_str(), "bearer ", 7) == 0)
+        return error_response(403, "a new session needs the password");
+    long long expires = 0;
+    std::string token = make_session_token(req.user, user_password_hash(req.user), expires);
+    return json_response(201, "{\"token\": " + json_quote(token) + ", \"username\": " + json_quote(req.user) +
+                                  ", \"expires_at\": " + std::to_string(expires) + "}");
+}
+
+// the chunk size an upload's registration asks for, CHUNK_SIZE if it names
+// none; false with the 400 in `error` if it is outside the advertised limits
+static bool requested_chunk_size(const Json &spec, long long &chunk_size, HttpResponse &error) {
+    const Json* arg = spec.get("chunk_size");
+    chunk_size = arg ? arg->as_int() : (long long)CHUNK_SIZE;
+    if ((arg && !arg->is_int()) || chunk_size < (long long)SERVE_MIN_CHUNK_SIZE ||
+        chunk_size > (long long)SERVE_MAX_CHUNK_SIZE) {
+        error = error_response(400, "chunk_size must be between " + std::to_string(SERVE_MIN_CHUNK_SIZE) + " and " +
+                                        std::to_string(SERVE_MAX_CHUNK_SIZE));
+        return false;
+    }
+    return true;
+}
+
+static HttpResponse api_upload_init(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    std::string filename = data.str("filename");
+    const Json* total_size = data.get("total_size");
+    if (filename.empty()) return error_response(400, "filename is required");
+    long long chunk_size;
+    HttpResponse error;
+    if (!requested_chunk_size(data, chunk_size, error)) return error;
+    if (total_size && total_size->is_int() && total_size->as_int() > SERVE_MAX_UPLOAD_SIZE)
+        return error_response(400, "total_size must be at most " + std::to_string(SERVE_MAX_UPLOAD_SIZE));
+
+    std::string safe_name = server_filename(filename);
+    std::string file_id = uuid4();
+    std::string folder = g_store.incomplete + "/" + file_id;
+    mkdir(folder.c_str(), 0755);
+
+    Json expected;
+    if (total_size && total_size->is_int() && total_size->as_int() > 0) {
+        expected = Json::of((total_size->as_int() + chunk_size - 1) / chunk_size);
+        // sparse: no blocks are allocated until the chunks land
+        int fd = open((folder + "/" + UPLOAD_DATA).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, (off_t)total_size->as_int()) != 0)
+            std::cerr << "Cannot preallocate " << folder << "/" << UPLOAD_DATA << std::endl;
+        if (fd >= 0) close(fd);
+    }
+
+    Json info = Json::object();
+    info.set("owner", Json::of(req.user));
+    info.set("filename", Json::of(safe_name));
+    info.set("expected_chunks", expected);
+    info.set("chunk_size", Json::of(chunk_size));
+    info.set("assembled", Json::of(false));
+    if (!meta_put(file_id, &info)) {
+        drop_upload(file_id);
+        return error_response(500, "failed to update metadata");
+    }
+    return json_response(201, "{\"file_id\": " + json_quote(file_id) + ", \"filename\": " + json_quote(safe_name) +
+                                  ", \"expected_chunks\": " + json_dump(expected) +
+                                  ", \"chunk_size\": " + std::to_string(chunk_size) + "}");
+}
+
+static HttpResponse api_upload_init_batch(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    const Json* files = data.get("files");
+    if (!files || files->type != Json::Type::Array || files->items.empty())
+        return error_response(400, "files must be a non-empty list");
+    if (files->items.size() > SERVE_MAX_BATCH_FILES)
+        return error_response(413, "at most " + std::to_string(SERVE_MAX_BATCH_FILES) + " files per request");
+
+    std::vector<std::string> ids, names;
+    std::vector<Json> expected;
+    std::vector<long long> chunk_sizes;
+    for (const Json &f : files->items) {
+        std::string filename = f.str("filename");
+        if (filename.empty()) return error_response(400, "each file needs a filename");
+        const Json* total_size = f.get("total_size");
+        if (total_size && total_size->is_int() && total_size->as_int() > SERVE_MAX_UPLOAD_SIZE)
+            return error_response(400, "total_size must be at most " + std::to_string(SERVE_MAX_UPLOAD_SIZE));
+        long long chunk_size;
+        HttpResponse error;
+        if (!requested_chunk_size(f, chunk_size, error)) return error;
+        Json e;
+        if (total_size && total_size->is_int() && total_size->as_int() > 0)
+            e = Json::of((total_size->as_int() + chunk_size - 1) / chunk_size);
+        ids.push_back(uuid4());
+        names.push_back(server_filename(filename));
+        expected.push_back(e);
+        chunk_sizes.push_back(chunk_size);
+    }
+
+    std::vector<Json> infos(ids.size(), Json::object());
+    std::vector<std::pair<std::string, const Json*>> changes;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        infos[i].set("owner", Json::of(req.user));
+        infos[i].set("filename", Json::of(names[i]));
+        infos[i].set("expected_chunks", expected[i]);
+        infos[i].set("chunk_size", Json::of(chunk_sizes[i]));
+        infos[i].set("assembled", Json::of(false));
+        changes.emplace_back(ids[i], &infos[i]);
+    }
+    bool ok = true, due;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        due = meta_commit_locked(changes, &ok);
+    }
+    if (due) meta_compact();
+    if (!ok) return error_response(500, "failed to update metadata");
+    return json_response(201, "{\"file_ids\": " + json_string_array(ids) + ", \"filenames\": " +
+                                  json_string_array(names) + "}");
+}
+
+static HttpResponse api_upload_status(HttpRequest &req) {
+    const std::string &file_id = req.param;
+    Json info;
+    if (!meta_get(file_id, info)) return error_response(404, "invalid file_id");
+    if (info.str("owner") != req.user) return error_response(403, "not authorized for this file_id");
+
+    std::vector<long long> received;
+    std::string folder = g_store.incomplete + "/" + file_id;
+    struct stat st;
+    if (!info.flag_of("assembled") && stat(folder.c_str(), &st) == 0) {
+        auto state = upload_state(file_id, folder);
+        std::lock_guard<std::mutex> lk(state->lock);
+        for (long long i = 0; i < (long long)state->bitmap.size() * 8; ++i)
+            if (state->has(i)) received.push_back(i);
+    }
+    const Json* expected = info.get("expected_chunks");
+    const Json* chunk_size = info.get("chunk_size");
+    std::string out = "{\"file_id\": " + json_quote(file_id) +
+                      ", \"expected_chunks\": " + (expected ? json_dump(*expected) : "null") +
+                      ", \"chunk_size\": " + (chunk_size ? json_dump(*chunk_size) : std::to_string(CHUNK_SIZE)) +
+                      ", \"assembled\": " + (info.flag_of("assembled") ? "true" : "false") + ", \"received\": [";
+    for (size_t i = 0; i < received.size(); ++i) out += (i ? ", " : "") + std::to_string(received[i]);
+    return json_response(200, out + "]}");
+}
+
+static std::string chunk_staging_path(const std::string &folder) {
+    return folder + "/chunk-" + uuid4() + ".tmp";
+}
+
+// Where an /api/upload/chunk file part goes, given the fields sent before
+// it; the client sends file_id, chunk_index and any chunk_encoding first.
+// A chunk goes straight into its place in the data file, unless it is
+// stored already or another request is writing it: then it is staged and
+// only copied into place once verified, so a bad resend cannot overwrite
+// good data. Parts for uploads the caller cannot write to are only counted.
+// whether chunk idx of an upload cut into chunk_size chunks lies below
+// SERVE_MAX_UPLOAD_SIZE; without a declared size nothing else bounds the
+// offset it is written at
+static bool chunk_offset_allowed(long long idx, size_t chunk_size) {
+    return idx >= 0 && idx < SERVE_MAX_UPLOAD_SIZE / (long long)chunk_size;
+}
+
+static bool plan_chunk(HttpRequest &req, SinkPlan &plan) {
+    const std::string* file_id = req.field("file_id");
+    const std::string* index = req.field("chunk_index");
+    long long idx;
+    if (!file_id || !index || !parse_long(*index, idx)) return false;
+    Json info;
+    plan = SinkPlan();
+    if (!meta_get(*file_id, info) || info.str("owner") != req.user || info.flag_of("assembled")) return true;
+    const Json* chunk_size = info.get("chunk_size");
+    size_t limit = chunk_size && chunk_size->is_int() ? (size_t)chunk_size->as_int() : CHUNK_SIZE;
+    // api_upload_chunk answers 400 for these
+    if (!chunk_offset_allowed(idx, limit)) return true;
+    std::string folder = g_store.incomplete + "/" + *file_id;
+    mkdir(folder.c_str(), 0755);
+    const std::string* encoding = req.field("chunk_encoding");
+    plan.limit = limit;
+    plan.inflate = encoding && *encoding == "deflate";
+    auto state = upload_state(*file_id, folder);
+    std::lock_guard<std::mutex> lk(state->lock);
+    if (state->has(idx) || state->writing.count(idx)) {
+        plan.path = chunk_staging_path(folder);
+        return true;
+    }
+    plan.path = folder + "/" + UPLOAD_DATA;
+    plan.offset = (off_t)idx * (off_t)plan.limit;
+    plan.claim = std::make_shared<ChunkClaim>(state, idx);
+    return true;
+}
+
+struct Assembly {
+    bool done = false;
+    std::string filename, sha256, error;
+};
+
+// moves an upload's data file into complete/ once all `expect` chunks are
+// present, unless another request already did
+static Assembly assemble_upload(const std::string &file_id, const std::string &folder, long long expect,
+                                long long chunk_size, const std::string &safe_name) {
+    Assembly out;
+    auto lock = assembly_lock(file_id);
+    std::lock_guard<std::mutex> lk(*lock);
+    // double-check presence and assembly state inside the lock
+    Json info;
+    if (!meta_get(file_id, info) || info.flag_of("assembled")) return out;
+    auto state = upload_state(file_id, folder);
+    Json chunks = Json::array();
+    long long size = 0;
+    {
+        std::lock_guard<std::mutex> slk(state->lock);
+        for (long long i = 0; i < expect; ++i) {
+            auto it = state->chunks.find(i);
+            if (!state->has(i) || it == state->chunks.end()) return out;
+            chunks.items.push_back(it->second);
+        }
+        const Json* last = chunks.items.back().get("size");
+        size = (expect - 1) * chunk_size + (last ? last->as_int() : chunk_size);
+    }
+    advance_digest(*state, folder, chunk_size);
+
+    std::string final_name = safe_name.empty() ? file_id + ".bin" : safe_name;
+    std::string data = folder + "/" + UPLOAD_DATA, complete = g_store.complete + "/" + final_name;
+    if (truncate(data.c_str(), (off_t)size) != 0 || rename(data.c_str(), complete.c_str()) != 0) {
+        out.error = "failed to write " + final_name;
+        return out;
+    }
+    std::string sha256 = state->sha.hex_digest();
+    bool ok = true, due = false;
+    {
+        std::lock_guard<std::mutex> mlk(g_store.lock);
+        auto it = g_store.meta.find(file_id);
+        if (it != g_store.meta.end()) {
+            Json info = it->second.info;
+            info.set("assembled", Json::of(true));
+            info.set("final_filename", Json::of(final_name));
+            info.set("sha256", Json::of(sha256));
+            info.set("chunks", chunks);
+            due = meta_commit_locked({{file_id, &info}}, &ok);
+        }
+    }
+    if (due) meta_compact();
+    if (!ok) {
+        // still an upload in progress, so the last chunk can be sent again
+        rename(complete.c_str(), data.c_str());
+        out.error = "failed to update metadata";
+        return out;
+    }
+    drop_upload(file_id);
+    out.done = true;
+    out.filename = final_name;
+    out.sha256 = sha256;
+    return out;
+}
+
+static HttpResponse api_upload_chunk(HttpRequest &req) {
+    const std::string* file_id = req.field("file_id");
+    const std::string* index = req.field("chunk_index");
+    if (!file_id || file_id->empty() || !index || !req.file || req.file_field != "chunk") {
+        drop_file(req);
+        return error_response(400, "file_id, chunk_index and chunk file are required");
+    }
+    Json info;
+    if (!meta_get(*file_id, info)) {
+        drop_file(req);
+        return error_response(404, "invalid file_id");
+    }
+    if (info.str("owner") != req.user) {
+        drop_file(req);
+        return error_response(403, "not authorized for this file_id");
+    }
+    long long chunk_index;
+    if (!parse_long(*index, chunk_index)) {
+        drop_file(req);
+        return error_response(400, "chunk_index must be an integer");
+    }
+    long long total_chunks = -1;
+    if (const std::string* total = req.field("total_chunks")) {
+        if (!parse_long(*total, total_chunks)) total_chunks = -1;
+    }
+    const std::string* filename = req.field("filename");
+    std::string safe_name = filename && !filename->empty() ? server_filename(*filename) : info.str("filename");
+    std::string folder = g_store.incomplete + "/" + *file_id;
+    const std::string* encoding_field = req.field("chunk_encoding");
+    std::string encoding = encoding_field ? *encoding_field : "identity";
+    if (encoding != "identity" && encoding != "deflate") {
+        drop_file(req);
+        return error_response(400, "unsupported chunk_encoding " + encoding);
+    }
+
+    // prefer the client's total_chunks, otherwise the metadata's
+    long long expect = total_chunks;
+    const Json* expected = info.get("expected_chunks");
+    if (expect < 0 && expected && expected->is_int()) expect = expected->as_int();
+    const Json* chunk_size = info.get("chunk_size");
+    size_t limit = chunk_size && chunk_size->is_int() ? (size_t)chunk_size->as_int() : CHUNK_SIZE;
+    if (!chunk_offset_allowed(chunk_index, limit) || (expect >= 0 && chunk_index >= expect)) {
+        drop_file(req);
+        return error_response(400, "chunk_index " + std::to_string(chunk_index) + " is out of range");
+    }
+
+    // the chunk was written into its place in the data file (or staged, see
+    // plan_chunk), decompressed and hashed as it arrived; it only counts as
+    // received once it is complete and verified, since chunks arrive
+    // concurrently
+    SinkPlan want = req.file->plan();
+    if (want.offset < 0) want.path = chunk_staging_path(folder);
+    want.limit = limit;
+    want.inflate = encoding == "deflate";
+    if (!take_file(req, want)) {
+        drop_file(req);
+        return error_response(500, "failed to store chunk " + std::to_string(chunk_index));
+    }
+    UploadSink &sink = *req.file;
+    std::string idx = std::to_string(chunk_index);
+    if (sink.corrupt()) {
+        sink.remove();
+        return error_response(400, "chunk " + idx + " is not valid deflate data");
+    }
+    if (sink.failed()) {
+        sink.remove();
+        return error_response(500, "failed to store chunk " + idx);
+    }
+    if (sink.over()) {
+        sink.remove();
+        return error_response(413, "Chunk too large (" + std::to_string(sink.size()) + " bytes). Max allowed is " +
+                                       std::to_string(want.limit) + " bytes.");
+    }
+    // all but the last chunk fill their slot
+    if (expect >= 0 && chunk_index < expect - 1 && sink.size() != want.limit) {
+        sink.remove();
+        return error_response(400, "chunk " + idx + " must be " + std::to_string(want.limit) + " bytes, got " +
+                                       std::to_string(sink.size()));
+    }
+    const std::string* expected_digest = req.field("chunk_sha256");
+    if (expected_digest && !expected_digest->empty()) {
+        std::string lower = *expected_digest;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+        if (lower != sink.digest()) {
+            sink.remove();
+            return error_response(400, "chunk " + idx + " failed integrity check",
+                                  ", \"sha256\": " + json_quote(sink.digest()));
+        }
+    }
+    // how the chunk travelled; collected into the file's metadata on completion
+    Json chunk_info = Json::object();
+    chunk_info.set("encoding", Json::of(encoding));
+    chunk_info.set("size", Json::of((long long)sink.size()));
+    chunk_info.set("wire_size", Json::of((long long)sink.wire_size()));
+    std::shared_ptr<ChunkClaim> claim = sink.plan().claim;
+    if (sink.plan().offset < 0) {
+        std::string error;
+        int status = place_chunk(*file_id, folder, chunk_index, (off_t)chunk_index * (off_t)want.limit,
+                                 sink.plan().path, (long long)sink.size(), claim, error);
+        sink.remove();
+        if (status) return error_response(status, error);
+    }
+    long long received = mark_received(*file_id, folder, chunk_index, chunk_info);
+    claim.reset();
+    if (received < 0) return error_response(500, "failed to record chunk " + idx);
+
+    Assembly assembly;
+    if (expect >= 0 && received == expect) {
+        assembly = assemble_upload(*file_id, folder, expect, (long long)want.limit, safe_name);
+        if (!assembly.error.empty()) return error_response(500, assembly.error);
+    } else {
+        // whoever holds the lock is already hashing; chunks it misses are
+        // picked up by the next one or on completion
+        auto lock = assembly_lock(*file_id);
+        if (lock->try_lock()) {
+            advance_digest(*upload_state(*file_id, folder), folder, (long long)want.limit);
+            lock->unlock();
+        }
+    }
+
+    std::string out = "{\"status\": \"uploaded\", \"file_id\": " + json_quote(*file_id) + ", \"chunk_index\": " + idx;
+    if (assembly.done)
+        out += ", \"assembled\": true, \"filename\": " + json_quote(assembly.filename) +
+               ", \"sha256\": " + json_quote(assembly.sha256);
+    return json_response(200, out + "}");
+}
+
+static bool plan_bundle(HttpRequest &req, SinkPlan &plan) {
+    const std::string* encoding = req.field("chunk_encoding");
+    plan.path = g_store.incomplete + "/bundle-" + uuid4() + ".tmp";
+    plan.limit = CHUNK_SIZE;
+    plan.inflate = encoding && *encoding == "deflate";
+    return true;
+}
+
+static HttpResponse api_upload_bundle(HttpRequest &req) {
+    const std::string* files_field = req.field("files");
+    Json files;
+    if (!files_field || !json_parse(*files_field, files)) {
+        drop_file(req);
+        return error_response(400, "files must be a JSON list");
+    }
+    if (files.type != Json::Type::Array || files.items.empty() || !req.file || req.file_field != "bundle") {
+        drop_file(req);
+        return error_response(400, "files and bundle file are required");
+    }
+    if (files.items.size() > SERVE_MAX_BATCH_FILES) {
+        drop_file(req);
+        return error_response(413, "at most " + std::to_string(SERVE_MAX_BATCH_FILES) + " files per bundle");
+    }
+    for (const Json &f : files.items) {
+        const Json* id = f.get("file_id");
+        const Json* size = f.get("size");
+        if (!id || !id->is_string() || !size || !size->is_int() || size->as_int() < 0) {
+            drop_file(req);
+            return error_response(400, "each file needs a file_id and a size");
+        }
+    }
+    const std::string* encoding_field = req.field("chunk_encoding");
+    std::string encoding = encoding_field ? *encoding_field : "identity";
+    if (encoding != "identity" && encoding != "deflate") {
+        drop_file(req);
+        return error_response(400, "unsupported chunk_encoding " + encoding);
+    }
+
+    std::vector<std::string> names;
+    long long total = 0;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        for (const Json &f : files.items) {
+            std::string id = f.str("file_id");
+            auto it = g_store.meta.find(id);
+            HttpResponse err;
+            if (it == g_store.meta.end()) err = error_response(404, "invalid file_id " + id);
+            else if (it->second.info.str("owner") != req.user) err = error_response(403, "not authorized for file_id " + id);
+            else if (it->second.info.flag_of("assembled")) err = error_response(409, "upload " + id + " already complete");
+            else {
+                names.push_back(it->second.info.str("filename"));
+                if (names.back().empty()) names.back() = id + ".bin";
+                total += f.get("size")->as_int();
+                continue;
+            }
+            drop_file(req);
+            return err;
+        }
+    }
+
+    // from here on a failed bundle takes its files' registrations with it,
+    // so a client that gives up leaves no entries that never complete
+    std::vector<std::string> ids;
+    for (const Json &f : files.items) ids.push_back(f.str("file_id"));
+    auto reject = [&](HttpResponse r) {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        std::vector<std::pair<std::string, const Json*>> changes;
+        for (const std::string &id : std::set<std::string>(ids.begin(), ids.end())) {
+            auto it = g_store.meta.find(id);
+            if (it != g_store.meta.end() && !it->second.info.flag_of("assembled")) changes.emplace_back(id, nullptr);
+        }
+        bool ok = true;
+        if (!changes.empty()) meta_commit_locked(changes, &ok);
+        return ok ? r : error_response(500, "failed to update metadata");
+    };
+    std::set<std::string> distinct(names.begin(), names.end());
+    if (distinct.size() != names.size() || std::set<std::string>(ids.begin(), ids.end()).size() != ids.size()) {
+        drop_file(req);
+        return reject(error_response(400, "files in a bundle need distinct file_ids and names"));
+    }
+    if (total > (long long)CHUNK_SIZE) {
+        drop_file(req);
+        return reject(error_response(413, "Bundle too large (" + std::to_string(total) + " bytes). Max allowed is " +
+                                              std::to_string(CHUNK_SIZE) + " bytes."));
+    }
+
+    SinkPlan want;
+    plan_bundle(req, want);
+    if (!take_file(req, want)) {
+        drop_file(req);
+        return reject(error_response(500, "failed to store bundle"));
+    }
+    UploadSink &sink = *req.file;
+    if (sink.corrupt()) {
+        sink.remove();
+        return reject(error_response(400, "bundle is not valid deflate data"));
+    }
+    if (sink.failed()) {
+        sink.remove();
+        return reject(error_response(500, "failed to store bundle"));
+    }
+    if ((long long)sink.size() != total) {
+        sink.remove();
+        return reject(error_response(400, "bundle holds " + std::to_string(sink.size()) +
+                                              " bytes but its files add up to " + std::to_string(total)));
+    }
+    const std::string* expected_digest = req.field("chunk_sha256");
+    if (expected_digest && !expected_digest->empty()) {
+        std::string lower = *expected_digest;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+        if (lower != sink.digest()) {
+            sink.remove();
+            return reject(
+                error_response(400, "bundle failed integrity check", ", \"sha256\": " + json_quote(sink.digest())));
+        }
+    }
+
+    // split the bundle into the files, hashing each on the way; each goes to
+    // a temporary file first and all are renamed into place once written
+    int fin = open(sink.plan().path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::vector<std::string> digests, temps;
+    std::vector<char> buf(4 * 1024 * 1024);
+    bool ok = fin >= 0;
+    for (size_t i = 0; ok && i < files.items.size(); ++i) {
+        temps.push_back(g_store.complete + "/." + names[i] + "." + uuid4() + ".tmp");
+        int fout = open(temps.back().c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        ok = fout >= 0;
+        Sha256 sha;
+        long long left = files.items[i].get("size")->as_int();
+        while (ok && left > 0) {
+            ssize_t n = read(fin, buf.data(), (size_t)std::min<long long>(left, (long long)buf.size()));
+            ok = n > 0 && write_all(fout, buf.data(), (size_t)n);
+            if (ok) sha.update(buf.data(), (size_t)n);
+            left -= n;
+        }
+        if (fout >= 0 && close(fout) != 0) ok = false;
+        digests.push_back(sha.hex_digest());
+    }
+    if (fin >= 0) close(fin);
+    sink.remove();
+    size_t placed = 0;
+    while (ok && placed < temps.size() &&
+           rename(temps[placed].c_str(), (g_store.complete + "/" + names[placed]).c_str()) == 0)
+        ++placed;
+    ok = ok && placed == temps.size();
+    if (!ok) {
+        for (size_t i = placed; i < temps.size(); ++i) unlink(temps[i].c_str());
+        return reject(error_response(500, "failed to write bundle files"));
+    }
+
+    std::string out = "{\"status\": \"assembled\", \"files\": [";
+    bool committed = true, due = false;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        std::vector<std::pair<std::string, Json>> updated;
+        for (size_t i = 0; i < files.items.size(); ++i) {
+            std::string id = files.items[i].str("file_id");
+            auto it = g_store.meta.find(id);
+            if (it != g_store.meta.end()) {
+                Json info = it->second.info;
+                info.set("assembled", Json::of(true));
+                info.set("final_filename", Json::of(names[i]));
+                info.set("sha256", Json::of(digests[i]));
+                updated.emplace_back(id, std::move(info));
+            }
+            out += std::string(i ? ", " : "") + "{\"file_id\": " + json_quote(id) + ", \"filename\": " +
+                   json_quote(names[i]) + ", \"sha256\": " + json_quote(digests[i]) + "}";
+        }
+        std::vector<std::pair<std::string, const Json*>> changes;
+        for (const auto &u : updated) changes.emplace_back(u.first, &u.second);
+        if (!changes.empty()) due = meta_commit_locked(changes, &committed);
+    }
+    if (due) meta_compact();
+    if (!committed) return reject(error_response(500, "failed to update metadata"));
+    return json_response(200, out + "]}");
+}
+
+static const time_t CHUNK_SWEEP_GRACE = 24 * 3600;  // how long an unreferenced chunk waits for its manifest
+static const time_t CHUNK_SWEEP_INTERVAL = 3600;
+
+static bool chunk_possessed(const std::string &hash, const std::string &user) {
+    if (!is_regular_file(store_chunk_path(hash))) return false;
+    std::ifstream in(store_chunk_users_path(hash));
+    for (std::string line; std::getline(in, line);)
+        if (line == user) return true;
+    return false;
+}
+
+// notes that `user` sent the chunk and restarts its grace period; caller
+// holds refs_lock
+static bool record_possession(const std::string &hash, const std::string &user) {
+    utimensat(AT_FDCWD, store_chunk_path(hash).c_str(), nullptr, 0);
+    if (chunk_possessed(hash, user)) return true;
+    int fd = open(store_chunk_users_path(hash).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    std::string line = user + "\n";
+    bool ok = write(fd, line.data(), line.size()) == (ssize_t)line.size();
+    return close(fd) == 0 && ok;
+}
+
+// Removes what no manifest will claim: chunks sent for uploads that never
+// committed once their grace period is over, and the temporaries of
+// interrupted writes. Caller holds refs_lock.
+static void sweep_chunk_store_locked(const std::map<std::string, Json> &refs) {
+    time_t cutoff = time(nullptr) - CHUNK_SWEEP_GRACE;
+    DIR* top = opendir(g_store.chunks.c_str());
+    if (!top) return;
+    while (struct dirent* t = readdir(top)) {
+        if (t->d_name[0] == '.') continue;
+        std::string sub = g_store.chunks + "/" + t->d_name;
+        DIR* d = opendir(sub.c_str());
+        if (!d) continue;
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name, path = sub + "/" + name;
+            struct stat st;
+            if (name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_mtime >= cutoff)
+                continue;
+            std::string hash = name.substr(0, 64);
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+                unlink(path.c_str());
+            } else if (name == hash && is_sha256_hex(hash) && !refs.count(hash)) {
+                unlink(path.c_str());
+                unlink(store_chunk_users_path(hash).c_str());
+            } else if (name == hash + ".users" && !is_regular_file(store_chunk_path(hash))) {
+                unlink(path.c_str());
+            }
+        }
+        closedir(d);
+    }
+    closedir(top);
+}
+
+static HttpResponse api_chunks_query(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    const Json* hashes = data.get("hashes");
+    if (!hashes || hashes->type != Json::Type::Array) return error_response(400, "hashes must be a list");
+    if (hashes->items.size() > SERVE_MAX_QUERY_HASHES)
+        return error_response(413, "at most " + std::to_string(SERVE_MAX_QUERY_HASHES) + " hashes per query");
+    std::vector<std::string> missing;
+    for (const Json &h : hashes->items)
+        if (!h.is_string() || !is_sha256_hex(h.text)) return error_response(400, "hashes must be lowercase hex sha256");
+    // a chunk this user never sent counts as missing even when stored
+    for (const Json &h : hashes->items)
+        if (!chunk_possessed(h.text, req.user)) missing.push_back(h.text);
+    return json_response(200, "{\"missing\": " + json_string_array(missing) + "}");
+}
+
+// the store is addressed by content, so chunks are verified while written
+// beside their final name; one already stored is only hashed, as the
+// sender's proof that they have it
+static bool plan_store_chunk(HttpRequest &req, SinkPlan &plan) {
+    const std::string* hash = req.field("hash");
+    if (!hash || !is_sha256_hex(*hash)) return false;
+    plan = SinkPlan();
+    plan.limit = SERVE_MAX_STORE_CHUNK;
+    std::string path = store_chunk_path(*hash);
+    if (is_regular_file(path)) return true;
+    mkdir((g_store.chunks + "/" + hash->substr(0, 2)).c_str(), 0755);
+    plan.path = path + "." + uuid4() + ".tmp";
+    return true;
+}
+
+static HttpResponse api_chunks_upload(HttpRequest &req) {
+    const std::string* hash = req.field("hash");
+    if (!hash || !is_sha256_hex(*hash) || !req.file || req.file_field != "chunk") {
+        drop_file(req);
+        return error_response(400, "hash and chunk file are required");
+    }
+    std::string path = store_chunk_path(*hash);
+    SinkPlan want;
+    plan_store_chunk(req, want);
+    // a part only hashed was planned against the same limit
+    bool hashed = req.file->plan().path.empty() && req.file->plan().limit == want.limit;
+    if (!hashed && !take_file(req, want)) {
+        drop_file(req);
+        return error_response(500, "failed to store chunk");
+    }
+    UploadSink &sink = *req.file;
+    if (sink.over()) {
+        sink.remove();
+        return error_response(413, "Chunk too large. Max allowed is " + std::to_string(SERVE_MAX_STORE_CHUNK) + " bytes.");
+    }
+    if (sink.failed()) {
+        sink.remove();
+        return error_response(500, "failed to store chunk");
+    }
+    if (sink.digest() != *hash) {
+        sink.remove();
+        return error_response(400, "chunk content does not match hash");
+    }
+    std::lock_guard<std::mutex> lk(g_store.refs_lock);
+    bool stored = false;
+    if (is_regular_file(path)) {
+        sink.remove();
+    } else if (sink.plan().path.empty()) {
+        // swept between the plan and now
+        return error_response(409, "chunk no longer stored; send it again");
+    } else if (rename(sink.plan().path.c_str(), path.c_str()) != 0) {
+        sink.remove();
+        return error_response(500, "failed to store chunk");
+    } else {
+        stored = true;
+    }
+    if (!record_possession(*hash, req.user)) return error_response(500, "failed to store chunk");
+    if (!stored) return json_response(200, "{\"status\": \"exists\", \"hash\": " + json_quote(*hash) + "}");
+    return json_response(201, "{\"status\": \"stored\", \"hash\": " + json_quote(*hash) +
+                                  ", \"size\": " + std::to_string(sink.size()) + "}");
+}
+
+// drops a manifest and the stored chunks no other manifest references
+static void release_manifest(const std::string &file_id) {
+    std::lock_guard<std::mutex> lk(g_store.refs_lock);
+    std::map<std::string, Json> refs = load_json_map(g_store.refs_file);
+    std::set<std::string> unique;
+    for (const auto &e : load_manifest(file_id)) unique.insert(e.first);
+    for (const auto &h : unique) {
+        auto it = refs.find(h);
+        long long count = (it != refs.end() ? it->second.as_int() : 0) - 1;
+        if (count > 0) {
+            refs[h] = Json::of(count);
+            continue;
+        }
+        if (it != refs.end()) refs.erase(it);
+        unlink(store_chunk_path(h).c_str());
+        unlink(store_chunk_users_path(h).c_str());
+    }
+    save_json_map(g_store.refs_file, refs);
+    unlink(store_manifest_path(file_id).c_str());
+}
+
+// the digest of a manifest's chunks read back from the store in order;
+// empty if one cannot be read in full
+static std::string manifest_digest(const std::vector<std::pair<std::string, long long>> &entries) {
+    Sha256 sha;
+    std::vector<char> buf(1024 * 1024);
+    for (const auto &e : entries) {
+        int fd = open(store_chunk_path(e.first).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return "";
+        long long left = e.second;
+        ssize_t n;
+        while (left > 0 && (n = read(fd, buf.data(), (size_t)std::min((long long)buf.size(), left))) > 0) {
+            sha.update(buf.data(), (size_t)n);
+            left -= n;
+        }
+        close(fd);
+        if (left != 0) return "";
+    }
+    return sha.hex_digest();
+}
+
+static HttpResponse api_upload_manifest(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    std::string file_id = data.str("file_id");
+    const Json* chunks = data.get("chunks");
+    const Json* file_digest = data.get("sha256");
+    if (file_id.empty() || !chunks || chunks->type != Json::Type::Array)
+        return error_response(400, "file_id and chunks are required");
+    if (file_digest && file_digest->type != Json::Type::Null &&
+        (!file_digest->is_string() || !is_sha256_hex(file_digest->text)))
+        return error_response(400, "sha256 must be lowercase hex");
+
+    Json info;
+    if (!meta_get(file_id, info)) return error_response(404, "invalid file_id");
+    if (info.str("owner") != req.user) return error_response(403, "not authorized for this file_id");
+    if (info.flag_of("assembled")) return error_response(409, "upload already complete");
+
+    std::vector<std::pair<std::string, long long>> entries;
+    for (const Json &c : chunks->items) {
+        const Json* h = c.get("hash");
+        const Json* size = c.get("size");
+        if (!h || !h->is_string() || !is_sha256_hex(h->text) || !size || !size->is_int() || size->as_int() < 0)
+            return error_response(400, "each chunk needs a sha256 hash and a size");
+        entries.emplace_back(h->text, size->as_int());
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(g_store.refs_lock);
+        // again under the lock: a commit for this upload that got here first
+        // has saved its manifest and referenced the chunks already
+        if (!meta_get(file_id, info)) return error_response(404, "invalid file_id");
+        if (info.flag_of("assembled") || is_regular_file(store_manifest_path(file_id)))
+            return error_response(409, "upload already complete");
+        std::set<std::string> missing;
+        for (const auto &e : entries)
+            if (!chunk_possessed(e.first, req.user)) missing.insert(e.first);
+        if (!missing.empty())
+            return error_response(409, "chunks missing from store",
+                                  ", \"missing\": " + json_string_array({missing.begin(), missing.end()}));
+        for (const auto &e : entries) {
+            off_t size = 0;
+            is_regular_file(store_chunk_path(e.first), &size);
+            if ((long long)size != e.second) return error_response(400, "size mismatch for chunk " + e.first);
+        }
+        std::string doc = "{\"chunks\": [";
+        for (size_t i = 0; i < entries.size(); ++i)
+            doc += (i ? ", [" : "[") + json_quote(entries[i].first) + ", " + std::to_string(entries[i].second) + "]";
+        if (!write_file_atomic(store_manifest_path(file_id), doc + "]}"))
+            return error_response(500, "failed to write manifest");
+        std::map<std::string, Json> refs = load_json_map(g_store.refs_file);
+        std::set<std::string> unique;
+        for (const auto &e : entries) unique.insert(e.first);
+        for (const auto &h : unique) {
+            auto it = refs.find(h);
+            refs[h] = Json::of((it != refs.end() ? it->second.as_int() : 0) + 1);
+        }
+        if (!save_json_map(g_store.refs_file, refs)) {
+            unlink(store_manifest_path(file_id).c_str());
+            return error_response(500, "failed to save chunk references");
+        }
+        time_t now = time(nullptr);
+        if (now - g_store.chunks_swept >= CHUNK_SWEEP_INTERVAL) {
+            g_store.chunks_swept = now;
+            sweep_chunk_store_locked(refs);
+        }
+    }
+
+    // the chunks are referenced now, so they stay while they are read back
+    std::string digest = manifest_digest(entries);
+    if (digest.empty() || (file_digest && file_digest->is_string() && file_digest->text != digest)) {
+        release_manifest(file_id);
+        if (digest.empty()) return error_response(500, "failed to read stored chunks");
+        return error_response(400, "sha256 does not match the chunks");
+    }
+
+    long long total = 0;
+    for (const auto &e : entries) total += e.second;
+    std::string final_name;
+    bool ok = true, due = false;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        auto it = g_store.meta.find(file_id);
+        Json entry = it != g_store.meta.end() ? it->second.info : info;
+        entry.set("assembled", Json::of(true));
+        entry.set("manifest", Json::of(true));
+        entry.set("size", Json::of(total));
+        final_name = entry.str("filename");
+        if (final_name.empty()) final_name = file_id + ".bin";
+        entry.set("final_filename", Json::of(final_name));
+        entry.set("sha256", Json::of(digest));
+        // a file deleted meanwhile stays deleted
+        if (it != g_store.meta.end()) due = meta_commit_locked({{file_id, &entry}}, &ok);
+    }
+    if (due) meta_compact();
+    if (!ok) {
+        release_manifest(file_id);
+        return error_response(500, "failed to update metadata");
+    }
+    // the folder init made, with its preallocated data file
+    drop_upload(file_id);
+    return json_response(200, "{\"status\": \"assembled\", \"file_id\": " + json_quote(file_id) +
+                                  ", \"filename\": " + json_quote(final_name) + ", \"size\": " + std::to_string(total) +
+                                  ", \"chunks\": " + std::to_string(entries.size()) +
+                                  ", \"sha256\": " + json_quote(digest) + "}");
+}
+
+// the stored file a delta may apply to, as server.py's _delta_target
+// checks it; false with the reply in `error` otherwise
+static bool delta_target(const HttpRequest &req, const std::string &file_id, Json &info, std::string &path,
+                         HttpResponse &error) {
+    if (!meta_get(file_id, info)) error = error_response(404, "invalid file_id");
+    else if (info.str("owner") != req.user) error = error_response(403, "not authorized for this file_id");
+    else if (!info.flag_of("assembled")) error = error_response(409, "upload not complete");
+    else if (info.flag_of("manifest"))
+        error = error_response(409, "file is stored as content-defined chunks; upload it again with --cdc");
+    else if (!is_regular_file(path = g_store.complete + "/" + final_name_of(file_id, info)))
+        error = error_response(404, "file not found");
+    else return true;
+    return false;
+}
+
+// block signatures, read and hashed as the connection drains. Each call
+// reads at most SIGNATURE_STEP bytes of the file, carrying a block's hashes
+// over to the next call, so large blocks do not hold up the event loop.
+static const size_t SIGNATURE_STEP = 1024 * 1024;
+
+struct SignatureSource {
+    int fd = -1;
+    size_t block = 0;
+    std::vector<unsigned char> buf;
+    // the block being read
+    size_t have = 0;
+    uLong weak = adler32(0, nullptr, 0);
+    Sha256 sha;
+    bool done = false;
+
+    ~SignatureSource() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool next(std::string &out) {
+        if (buf.empty()) buf.resize(std::min(block, SIGNATURE_STEP));
+        for (size_t budget = SIGNATURE_STEP; !done && budget > 0;) {
+            ssize_t n = read(fd, buf.data(), std::min({buf.size(), block - have, budget}));
+            if (n < 0 && errno == EINTR) continue;
+            done = n <= 0;
+            if (n > 0) {
+                weak = adler32(weak, buf.data(), (uInt)n);
+                sha.update(buf.data(), (size_t)n);
+                have += (size_t)n;
+                budget -= (size_t)n;
+            }
+            if (have == block || (done && have > 0)) {
+                for (int s = 24; s >= 0; s -= 8) out += (char)((weak >> s) & 0xff);
+                unsigned char strong[32];
+                sha.digest(strong);
+                out.append((const char*)strong, sizeof(strong));
+                have = 0;
+                weak = adler32(0, nullptr, 0);
+                sha = Sha256();
+            }
+        }
+        return !done;
+    }
+};
+
+static HttpResponse api_file_signatures(HttpRequest &req) {
+    long long block = 0;
+    if (!parse_long(req.arg("block_size"), block) || block < (long long)SERVE_DELTA_MIN_BLOCK ||
+        block > (long long)SERVE_DELTA_MAX_BLOCK)
+        return error_response(400, "block_size must be between " + std::to_string(SERVE_DELTA_MIN_BLOCK) + " and " +
+                                       std::to_string(SERVE_DELTA_MAX_BLOCK));
+    Json info;
+    std::string path;
+    HttpResponse error;
+    if (!delta_target(req, req.param, info, path, error)) return error;
+    // opened now so the records describe one version even if it is replaced
+    auto src = std::make_shared<SignatureSource>();
+    src->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (src->fd < 0 || fstat(src->fd, &st) != 0) return error_response(500, "cannot read " + final_name_of(req.param, info));
+    src->block = (size_t)block;
+    HttpResponse r;
+    r.headers.emplace_back("Content-Type", "application/octet-stream");
+    r.headers.emplace_back("X-Block-Size", std::to_string(block));
+    r.headers.emplace_back("X-File-Size", std::to_string((long long)st.st_size));
+    if (!info.str("sha256").empty()) r.headers.emplace_back("X-Content-SHA256", info.str("sha256"));
+    r.stream = [src](std::string &out) { return src->next(out); };
+    return r;
+}
+
+// every record adds at least a byte to the new file, so a delta is never
+// more than 18 bytes per byte of it
+static bool plan_delta(HttpRequest &req, SinkPlan &plan) {
+    const std::string* size = req.field("size");
+    long long n;
+    if (!size || !parse_long(*size, n) || n < 0) return false;
+    plan.path = g_store.incomplete + "/delta-" + uuid4() + ".tmp";
+    plan.limit = (size_t)n * 18;
+    return true;
+}
+
+// writes the file a delta describes to out_path, copying from base_path,
+// and its SHA-256 to digest. Returns 200, or 400 for a malformed delta and
+// 500 for an I/O error, with the reason in error.
+static int apply_delta(const std::string &delta_path, const std::string &base_path, const std::string &out_path,
+                       long long size, std::string &digest, std::string &error) {
+    int in = open(delta_path.c_str(), O_RDONLY | O_CLOEXEC);
+    int base = open(base_path.c_str(), O_RDONLY | O_CLOEXEC);
+    int out = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct stat st;
+    int status = 200;
+    if (in < 0 || base < 0 || out < 0 || fstat(base, &st) != 0) {
+        status = 500;
+        error = strerror(errno);
+    }
+    auto read_full = [](int fd, unsigned char* p, size_t n) -> ssize_t {
+        size_t got = 0;
+        while (got < n) {
+            ssize_t r = read(fd, p + got, n - got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) return -1;
+            if (r == 0) break;
+            got += (size_t)r;
+        }
+        return (ssize_t)got;
+    };
+    auto fail = [&](int code, const std::string &why) {
+        status = code;
+        error = why;
+    };
+
+    Sha256 sha;
+    long long written = 0;
+    std::vector<char> buf(4 * 1024 * 1024);
+    while (status == 200) {
+        unsigned char head[17];
+        ssize_t n = read_full(in, head, 1);
+        if (n == 0) break;
+        if (n < 0) { fail(500, strerror(errno)); break; }
+        bool copy = head[0] == 'C';
+        if (!copy && head[0] != 'L') { fail(400, "unknown delta record"); break; }
+        size_t need = copy ? 16 : 8;
+        if (read_full(in, head + 1, need) != (ssize_t)need) { fail(400, "delta ends inside a record"); break; }
+        auto u64 = [&](int at) {
+            unsigned long long v = 0;
+            for (int i = 0; i < 8; ++i) v = v << 8 | head[at + i];
+            return v;
+        };
+        unsigned long long offset = copy ? u64(1) : 0, length = u64(copy ? 9 : 1);
+        if (copy && (offset > (unsigned long long)st.st_size || length > (unsigned long long)st.st_size - offset)) {
+            fail(400, "copy past the end of the stored file");
+            break;
+        }
+        if (length == 0 || length > (unsigned long long)(size - written)) {
+            fail(400, "delta records do not add up to the new size");
+            break;
+        }
+        for (unsigned long long done = 0; status == 200 && done < length;) {
+            size_t want = (size_t)std::min<unsigned long long>(length - done, buf.size());
+            ssize_t r = copy ? pread(base, buf.data(), want, (off_t)(offset + done)) : read(in, buf.data(), want);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) fail(500, strerror(errno));
+            else if (r == 0) fail(400, "delta ends inside a record");
+            else if (!write_all(out, buf.data(), (size_t)r)) fail(500, strerror(errno));
+            else {
+                sha.update(buf.data(), (size_t)r);
+                done += (unsigned long long)r;
+            }
+        }
+        written += (long long)length;
+    }
+    if (status == 200 && written != size) fail(400, "delta records do not add up to the new size");
+    if (in >= 0) close(in);
+    if (base >= 0) close(base);
+    if (out >= 0 && close(out) != 0 && status == 200) fail(500, strerror(errno));
+    if (status == 200) digest = sha.hex_digest();
+    return status;
+}
+
+// replaces a completed file from a delta, as server.py's upload_delta: the
+// new version is built beside the old one and renamed over it
+static HttpResponse api_upload_delta(HttpRequest &req) {
+    const std::string* file_id = req.field("file_id");
+    const std::string* base_digest = req.field("base_sha256");
+    const std::string* file_digest = req.field("sha256");
+    const std::string* size_field = req.field("size");
+    long long size = -1;
+    if (size_field && !parse_long(*size_field, size)) size = -1;
+    if (!file_id || file_id->empty() || size < 0 || !base_digest || !is_sha256_hex(*base_digest) || !file_digest ||
+        !is_sha256_hex(*file_digest) || !req.file || req.file_field != "delta") {
+        drop_file(req);
+        return error_response(400, "file_id, base_sha256, size, sha256 and delta file are required");
+    }
+    Json info;
+    std::string path;
+    HttpResponse error;
+    if (!delta_target(req, *file_id, info, path, error)) {
+        drop_file(req);
+        return error;
+    }
+    SinkPlan want;
+    plan_delta(req, want);
+    if (!take_file(req, want)) {
+        drop_file(req);
+        return error_response(500, "failed to store delta");
+    }
+    UploadSink &sink = *req.file;
+    if (sink.failed()) {
+        sink.remove();
+        return error_response(500, "failed to store delta");
+    }
+    if (sink.over()) {
+        sink.remove();
+        return error_response(413, "Delta too large (" + std::to_string(sink.size()) + " bytes). Max allowed is " +
+                                       std::to_string(want.limit) + " bytes.");
+    }
+
+    std::string final_name = final_name_of(*file_id, info);
+    if (info.str("sha256") != *base_digest) {
+        sink.remove();
+        return error_response(409, "file changed since its signatures were fetched");
+    }
+    // the new version is built without the lock; the base is checked again
+    // under it before the new version replaces it
+    std::string tmp = g_store.complete + "/." + final_name + "." + uuid4() + ".delta";
+    std::string digest, problem;
+    int status = apply_delta(sink.plan().path, path, tmp, size, digest, problem);
+    sink.remove();
+    if (status != 200) {
+        unlink(tmp.c_str());
+        return error_response(status, (status == 400 ? "bad delta: " : "failed to apply delta: ") + problem);
+    }
+    if (digest != *file_digest) {
+        unlink(tmp.c_str());
+        return error_response(400, "updated file failed integrity check", ", \"sha256\": " + json_quote(digest));
+    }
+    auto lock = assembly_lock(*file_id);
+    std::lock_guard<std::mutex> lk(*lock);
+    if (!meta_get(*file_id, info)) {
+        unlink(tmp.c_str());
+        return error_response(404, "invalid file_id");
+    }
+    if (info.str("sha256") != *base_digest) {
+        unlink(tmp.c_str());
+        return error_response(409, "file changed since its signatures were fetched");
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return error_response(500, std::string("failed to apply delta: ") + strerror(errno));
+    }
+    bool found = false, ok = true, due = false;
+    {
+        std::lock_guard<std::mutex> mlk(g_store.lock);
+        auto it = g_store.meta.find(*file_id);
+        if (it != g_store.meta.end()) {
+            found = true;
+            Json entry = it->second.info;
+            entry.set("sha256", Json::of(digest));
+            // how the first version's chunks travelled says nothing about this one
+            entry.set("chunks", Json());
+            due = meta_commit_locked({{*file_id, &entry}}, &ok);
+        }
+    }
+    if (due) meta_compact();
+    if (!ok) return error_response(500, "failed to update metadata");
+    if (!found) {
+        unlink(path.c_str()); // deleted meanwhile
+        return error_response(404, "invalid file_id");
+    }
+    return json_response(200, "{\"status\": \"updated\", \"file_id\": " + json_quote(*file_id) + ", \"filename\": " +
+                                  json_quote(final_name) + ", \"size\": " + std::to_string(size) +
+                                  ", \"sha256\": " + json_quote(digest) + "}");
+}
+
+static HttpResponse api_share(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    std::string file_id = data.str("file_id"), share_with = data.str("share_with");
+    if (file_id.empty() || share_with.empty()) return error_response(400, "file_id and share_with are required");
+
+    std::string status = "already_shared";
+    Json shared;
+    bool ok = true, due = false;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        if (!users_locked().count(share_with)) return error_response(404, "target user not found");
+        auto it = g_store.meta.find(file_id);
+        if (it == g_store.meta.end()) return error_response(404, "invalid file_id");
+        if (it->second.info.str("owner") != req.user) return error_response(403, "only owner can share the file");
+        const Json* current = it->second.info.get("shared_with");
+        shared = current && current->type == Json::Type::Array ? *current : Json::array();
+        if (std::none_of(shared.items.begin(), shared.items.end(), [&](const Json &u) { return u.text == share_with; })) {
+            shared.items.push_back(Json::of(share_with));
+            Json info = it->second.info;
+            info.set("shared_with", shared);
+            due = meta_commit_locked({{file_id, &info}}, &ok);
+            status = "shared";
+        }
+    }
+    if (due) meta_compact();
+    if (!ok) return error_response(500, "failed to update metadata");
+    return json_response(200, "{\"status\": " + json_quote(status) + ", \"file_id\": " + json_quote(file_id) +
+                                  ", \"shared_with\": " + json_dump(shared) + "}");
+}
+
+// the "file_ids" list of a batch request; false with `error` set if it is
+// missing, empty, not all strings or too long
+static bool batch_file_ids(const Json &data, std::vector<std::string> &ids, HttpResponse &error) {
+    const Json* list = data.get("file_ids");
+    if (!list || list->type != Json::Type::Array || list->items.empty() ||
+        std::any_of(list->items.begin(), list->items.end(), [](const Json &f) { return !f.is_string(); })) {
+        error = error_response(400, "file_ids must be a non-empty list");
+        return false;
+    }
+    if (list->items.size() > SERVE_MAX_BATCH_FILES) {
+        error = error_response(413, "at most " + std::to_string(SERVE_MAX_BATCH_FILES) + " files per request");
+        return false;
+    }
+    for (const Json &f : list->items) ids.push_back(f.text);
+    return true;
+}
+
+// one file's entry in a batch reply: its status, or why it failed
+static Json batch_result(const std::string &file_id, const char* status, const std::string &error = "") {
+    Json r = Json::object();
+    if (status) r.set("status", Json::of(status));
+    r.set("file_id", Json::of(file_id));
+    if (!error.empty()) r.set("error", Json::of(error));
+    return r;
+}
+
+// api_share for many files; every change lands in one metadata write and
+// each file_id gets a result in request order
+static HttpResponse api_share_batch(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    std::string share_with = data.str("share_with");
+    std::vector<std::string> ids;
+    HttpResponse error;
+    if (!batch_file_ids(data, ids, error)) return error;
+    if (share_with.empty()) return error_response(400, "file_ids (a non-empty list) and share_with are required");
+
+    Json results = Json::array();
+    bool ok = true, due = false;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        if (!users_locked().count(share_with)) return error_response(404, "target user not found");
+        std::map<std::string, Json> changed;
+        for (const std::string &file_id : ids) {
+            auto it = g_store.meta.find(file_id);
+            if (it == g_store.meta.end()) {
+                results.items.push_back(batch_result(file_id, nullptr, "invalid file_id"));
+                continue;
+            }
+            if (it->second.info.str("owner") != req.user) {
+                results.items.push_back(batch_result(file_id, nullptr, "only owner can share the file"));
+                continue;
+            }
+            auto c = changed.find(file_id);
+            const Json* current = c != changed.end() ? c->second.get("shared_with") : it->second.info.get("shared_with");
+            Json shared = current && current->type == Json::Type::Array ? *current : Json::array();
+            bool already = std::any_of(shared.items.begin(), shared.items.end(),
+                                       [&](const Json &u) { return u.text == share_with; });
+            if (!already) {
+                shared.items.push_back(Json::of(share_with));
+                if (c == changed.end()) c = changed.emplace(file_id, it->second.info).first;
+                c->second.set("shared_with", shared);
+            }
+            Json r = batch_result(file_id, already ? "already_shared" : "shared");
+            r.set("shared_with", shared);
+            results.items.push_back(r);
+        }
+        std::vector<std::pair<std::string, const Json*>> changes;
+        for (const auto &c : changed) changes.emplace_back(c.first, &c.second);
+        if (!changes.empty()) due = meta_commit_locked(changes, &ok);
+    }
+    if (due) meta_compact();
+    if (!ok) return error_response(500, "failed to update metadata");
+    Json out = Json::object();
+    out.set("results", results);
+    return json_response(200, json_dump(out));
+}
+
+static HttpResponse api_files_shared(HttpRequest &req) {
+    std::vector<std::pair<std::string, Json>> visible;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        for (auto &v : meta_visible_locked(req.user, true))
+            if (v.second.flag_of("assembled")) visible.push_back(std::move(v));
+    }
+    std::string out = "{\"files\": [";
+    bool first = true;
+    for (const auto &v : visible) {
+        const Json &info = v.second;
+        std::string final_name = final_name_of(v.first, info);
+        long long size = stored_size(v.first, info, final_name);
+        if (size < 0) continue;
+        const Json* shared = info.get("shared_with");
+        const Json* sha = info.get("sha256");
+        out += std::string(first ? "" : ", ") + "{\"file_id\": " + json_quote(v.first) + ", \"filename\": " +
+               json_quote(final_name) + ", \"size\": " + std::to_string(size) + ", \"owner\": " +
+               json_quote(info.str("owner")) + ", \"shared_with\": " + (shared ? json_dump(*shared) : "[]") +
+               ", \"sha256\": " + (sha ? json_dump(*sha) : "null") + "}";
+        first = false;
+    }
+    return json_response(200, out + "]}");
+}
+
+// true if the request's If-None-Match lists etag
+static bool etag_matches(const HttpRequest &req, const std::string &etag) {
+    std::stringstream tags(req.header("if-none-match"));
+    for (std::string tag; std::getline(tags, tag, ',');) {
+        tag.erase(0, tag.find_first_not_of(" \t"));
+        tag.erase(tag.find_last_not_of(" \t") + 1);
+        if (tag == etag) return true;
+    }
+    return false;
+}
+
+static HttpResponse api_files(HttpRequest &req) {
+    // optional paging: ?limit=N returns at most N files ordered by name and
+    // a next_cursor to pass back as ?cursor= for the rest; ?prefix= keeps
+    // only names starting with it
+    std::string prefix = req.arg("prefix"), limit_arg = req.arg("limit"), cursor = req.arg("cursor");
+    long long limit = -1;
+    std::pair<std::string, std::string> after;
+    bool has_after = false;
+    if (!limit_arg.empty()) {
+        if (!parse_long(limit_arg, limit)) return error_response(400, "bad limit or cursor");
+        limit = std::min(std::max(limit, 1ll), (long long)SERVE_MAX_LIST_PAGE);
+    }
+    if (!cursor.empty()) {
+        std::string text;
+        Json key;
+        if (!base64_decode(cursor, BASE64_URL, text) || !json_parse(text, key) || key.items.size() != 2 ||
+            !key.items[0].is_string() || !key.items[1].is_string())
+            return error_response(400, "bad limit or cursor");
+        after = {key.items[0].text, key.items[1].text};
+        has_after = true;
+    }
+
+    struct Row { std::string name, file_id; Json info; };
+    std::vector<Row> owned;
+    std::string etag;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        etag = meta_etag_locked();
+        if (etag_matches(req, etag)) {
+            HttpResponse r;
+            r.status = 304;
+            r.headers.emplace_back("ETag", etag);
+            return r;
+        }
+        auto ids = g_store.by_owner.find(req.user);
+        if (ids != g_store.by_owner.end()) {
+            for (const std::string &id : ids->second) {
+                const Json &info = g_store.meta.at(id).info;
+                if (!info.flag_of("assembled")) continue;
+                std::string final_name = final_name_of(id, info);
+                if (final_name.compare(0, prefix.size(), prefix) == 0) owned.push_back({final_name, id, info});
+            }
+        }
+    }
+    std::sort(owned.begin(), owned.end(), [](const Row &a, const Row &b) {
+        return std::tie(a.name, a.file_id) < std::tie(b.name, b.file_id);
+    });
+    size_t start = 0;
+    if (has_after)
+        start = std::upper_bound(owned.begin(), owned.end(), after, [](const std::pair<std::string, std::string> &k, const Row &r) {
+                    return std::tie(k.first, k.second) < std::tie(r.name, r.file_id);
+                }) - owned.begin();
+    size_t end = limit < 0 ? owned.size() : std::min(owned.size(), start + (size_t)limit);
+
+    std::string out = "{\"files\": [";
+    bool first = true;
+    for (size_t i = start; i < end; ++i) {
+        const Row &row = owned[i];
+        long long size = stored_size(row.file_id, row.info, row.name);
+        if (size < 0) continue;
+        const Json* sha = row.info.get("sha256");
+        out += std::string(first ? "" : ", ") + "{\"file_id\": " + json_quote(row.file_id) + ", \"filename\": " +
+               json_quote(row.name) + ", \"size\": " + std::to_string(size) +
+               ", \"sha256\": " + (sha ? json_dump(*sha) : "null") + "}";
+        first = false;
+    }
+    out += "], \"next_cursor\": ";
+    if (end < owned.size()) {
+        std::string key = "[" + json_quote(owned[end - 1].name) + ", " + json_quote(owned[end - 1].file_id) + "]";
+        out += json_quote(base64_encode(key, BASE64_URL));
+    } else {
+        out += "null";
+    }
+    HttpResponse r = json_response(200, out + "}");
+    r.headers.emplace_back("ETag", etag);
+    return r;
+}
+
+// True if the file's chunks arrived at least 10% smaller compressed, i.e. a
+// compressed download is worth the server's CPU
+static bool compresses_well(const Json &info) {
+    const Json* chunks = info.get("chunks");
+    if (!chunks) return false;
+    long long raw = 0, wire = 0;
+    for (const Json &c : chunks->items) {
+        if (const Json* v = c.get("size")) raw += v->as_int();
+        if (const Json* v = c.get("wire_size")) wire += v->as_int();
+    }
+    return raw > 0 && wire * 10 <= raw * 9;
+}
+
+// gzip framing around deflate at level 1, read and compressed a piece at a
+// time as the connection drains
+struct GzipSource {
+    int fd = -1;
+    z_stream zs;
+    bool started = false, done = false;
+    ~GzipSource() {
+        if (fd >= 0) close(fd);
+        if (started) deflateEnd(&zs);
+    }
+    bool next(std::string &out) {
+        if (done) return false;
+        std::vector<char> in(1024 * 1024);
+        ssize_t n = read(fd, in.data(), in.size());
+        if (n < 0) return false;
+        int flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = (Bytef*)in.data();
+        zs.avail_in = (uInt)n;
+        char buf[256 * 1024];
+        int rc;
+        do {
+            zs.next_out = (Bytef*)buf;
+            zs.avail_out = sizeof(buf);
+            rc = deflate(&zs, flush);
+            if (rc == Z_STREAM_ERROR) return false;
+            out.append(buf, sizeof(buf) - zs.avail_out);
+        } while (zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+        done = flush == Z_FINISH;
+        return true;
+    }
+};
+
+static HttpResponse api_download(HttpRequest &req) {
+    std::string safe_name = server_filename(req.param);
+    std::string file_id;
+    Json info;
+    if (!meta_find_by_name(safe_name, file_id, info)) return error_response(404, "file not found");
+    // allow owner or shared users
+    const Json* shared = info.get("shared_with");
+    bool allowed = info.str("owner") == req.user ||
+                   (shared && std::any_of(shared->items.begin(), shared->items.end(), [&](const Json &u) { return u.text == req.user; }));
+    if (!allowed) return error_response(403, "not authorized to download this file");
+
+    // the upload showed this file compresses; ranges stay uncompressed
+    bool manifest = info.flag_of("manifest");
+    bool gzip = !manifest && req.header("accept-encoding").find("gzip") != std::string::npos &&
+                !req.has_header("range") && compresses_well(info);
+
+    // whole-file digest, so clients can verify while they stream; with the
+    // file_id it names these exact bytes, so a client that cached them
+    // revalidates with If-None-Match and gets a 304 instead of the body. The
+    // gzip encoding is other bytes, so it gets a tag of its own.
+    std::string sha = info.str("sha256");
+    std::string etag = sha.empty() ? "" : "\"" + file_id + "." + sha + (gzip ? "-gzip" : "") + "\"";
+    HttpResponse r;
+    r.headers.emplace_back("Vary", "Accept-Encoding");
+    if (!etag.empty()) {
+        r.headers.emplace_back("ETag", etag);
+        r.headers.emplace_back("X-Content-SHA256", sha);
+        if (etag_matches(req, etag)) {
+            r.status = 304;
+            return r;
+        }
+    }
+    r.headers.emplace_back("Content-Type", "application/octet-stream");
+    r.headers.emplace_back("Content-Disposition", "attachment; filename=" + safe_name);
+    std::string path = g_store.complete + "/" + safe_name;
+    off_t file_size = 0;
+    if (!manifest && !is_regular_file(path, &file_size)) return error_response(404, "file not found");
+
+    if (gzip) {
+        auto src = std::make_shared<GzipSource>();
+        memset(&src->zs, 0, sizeof(src->zs));
+        src->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        src->started = src->fd >= 0 && deflateInit2(&src->zs, 1, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!src->started) return error_response(500, "cannot read " + safe_name);
+        r.headers.emplace_back("Content-Encoding", "gzip");
+        r.stream = [src](std::string &out) { return src->next(out); };
+    } else {
+        // the file's extents: a single file, or a manifest's stored chunks
+        std::vector<HttpResponse::Slice> extents;
+        long long total = 0;
+        if (manifest) {
+            for (const auto &e : load_manifest(file_id)) {
+                extents.push_back({store_chunk_path(e.first), 0, (off_t)e.second});
+                total += e.second;
+            }
+        } else {
+            extents.push_back({path, 0, file_size});
+            total = file_size;
+        }
+        long long start = 0, end = total - 1;
+        int status = 200;
+        r.headers.emplace_back("Accept-Ranges", "bytes");
+        if (parse_range(req.header("range"), total, start, end, status)) {
+            if (status == 416) {
+                HttpResponse bad = error_response(416, "requested range not satisfiable");
+                bad.headers.emplace_back("Content-Range", "bytes */" + std::to_string(total));
+                return bad;
+            }
+            r.status = 206;
+            r.headers.emplace_back("Content-Range", "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" +
+                                                       std::to_string(total));
+        }
+        long long offset = 0;
+        for (const auto &x : extents) {
+            long long from = std::max(start, offset), to = std::min(end + 1, offset + (long long)x.length);
+            if (from < to) r.slices.push_back({x.path, (off_t)(from - offset), (off_t)(to - from)});
+            offset += x.length;
+        }
+    }
+    return r;
+}
+
+static HttpResponse api_delete(HttpRequest &req) {
+    const std::string &file_id = req.param;
+    Json info;
+    if (!meta_get(file_id, info)) return error_response(404, "invalid file_id");
+    if (info.str("owner") != req.user) return error_response(403, "not authorized to delete this file");
+
+    // the entry goes first: once it is logged nothing names the bytes, and
+    // a failed append leaves the file as it was
+    if (!meta_put(file_id, nullptr)) return error_response(500, "failed to update metadata");
+    std::string path = g_store.complete + "/" + final_name_of(file_id, info);
+    if (info.flag_of("manifest")) release_manifest(file_id);
+    else if (!complete_path_in_use(meta_name_key(info)) && is_regular_file(path) && unlink(path.c_str()) != 0)
+        return error_response(500, std::string("failed to remove file: ") + strerror(errno));
+    // an upload given up on takes its received chunks with it
+    if (!info.flag_of("assembled")) drop_upload(file_id);
+    return json_response(200, "{\"status\": \"deleted\", \"file_id\": " + json_quote(file_id) + "}");
+}
+
+// api_delete for many files; the removals land in one metadata write and
+// each file_id gets a result in request order
+static HttpResponse api_delete_batch(HttpRequest &req) {
+    Json data;
+    if (!json_body(req, data)) return bad_json();
+    std::vector<std::string> ids;
+    HttpResponse error;
+    if (!batch_file_ids(data, ids, error)) return error;
+
+    Json results = Json::array();
+    std::set<std::string> seen;
+    struct Removal {
+        std::string file_id;
+        Json info;
+        size_t result;
+    };
+    std::vector<Removal> removed;
+    for (const std::string &file_id : ids) {
+        Json info;
+        if (!meta_get(file_id, info) || seen.count(file_id)) {
+            results.items.push_back(batch_result(file_id, nullptr, "invalid file_id"));
+            continue;
+        }
+        if (info.str("owner") != req.user) {
+            results.items.push_back(batch_result(file_id, nullptr, "not authorized to delete this file"));
+            continue;
+        }
+        seen.insert(file_id);
+        removed.push_back({file_id, info, results.items.size()});
+        results.items.push_back(batch_result(file_id, "deleted"));
+    }
+
+    // the entries go first, in one log append: once it is logged nothing
+    // names the bytes, and a failed append leaves every file as it was
+    bool ok = true, due = false;
+    if (!removed.empty()) {
+        std::vector<std::pair<std::string, const Json*>> changes;
+        for (const Removal &r : removed) changes.emplace_back(r.file_id, nullptr);
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        due = meta_commit_locked(changes, &ok);
+    }
+    if (due) meta_compact();
+    if (!ok) return error_response(500, "failed to update metadata");
+    for (const Removal &r : removed) {
+        std::string path = g_store.complete + "/" + final_name_of(r.file_id, r.info);
+        if (r.info.flag_of("manifest"))
+            release_manifest(r.file_id);
+        else if (!complete_path_in_use(meta_name_key(r.info)) && is_regular_file(path) && unlink(path.c_str()) != 0)
+            results.items[r.result] =
+                batch_result(r.file_id, nullptr, std::string("failed to remove file: ") + strerror(errno));
+        if (!r.info.flag_of("assembled")) drop_upload(r.file_id);
+    }
+    Json out = Json::object();
+    out.set("results", results);
+    return json_response(200, json_dump(out));
+}
+
+struct ServerRoute {
+    const char* method;
+    const char* path;  // exact, or a prefix when it ends in '/'
+    bool auth;
+    bool multipart;
+    bool blocking;  // the handler hashes, syncs or copies file data, so runs on a worker
+    HttpResponse (*handler)(HttpRequest &);
+    // for multipart routes: where the file part goes given the fields so far,
+    // or false to spool it until the rest of the form has arrived
+    bool (*plan)(HttpRequest &, SinkPlan &);
+};
+
+static const ServerRoute SERVER_ROUTES[] = {
+    {"GET", "/api/greet", false, false, false, api_greet, nullptr},
+    {"GET", "/api/capabilities", false, false, false, api_capabilities, nullptr},
+    {"POST", "/api/user/create", false, false, true, api_create_user, nullptr},
+    {"POST", "/api/session", true, false, false, api_session, nullptr},
+    {"POST", "/api/upload/init", true, false, true, api_upload_init, nullptr},
+    {"POST", "/api/upload/init_batch", true, false, true, api_upload_init_batch, nullptr},
+    {"GET", "/api/upload/status/", true, false, false, api_upload_status, nullptr},
+    {"POST", "/api/upload/chunk", true, true, true, api_upload_chunk, plan_chunk},
+    {"POST", "/api/upload/bundle", true, true, true, api_upload_bundle, plan_bundle},
+    {"POST", "/api/chunks/query", true, false, false, api_chunks_query, nullptr},
+    {"POST", "/api/chunks/upload", true, true, true, api_chunks_upload, plan_store_chunk},
+    {"POST", "/api/upload/manifest", true, false, true, api_upload_manifest, nullptr},
+    {"POST", "/api/upload/delta", true, true, true, api_upload_delta, plan_delta},
+    {"GET", "/api/file/signatures/", true, false, false, api_file_signatures, nullptr},
+    {"POST", "/api/file/share", true, false, true, api_share, nullptr},
+    {"POST", "/api/file/share_batch", true, false, true, api_share_batch, nullptr},
+    {"POST", "/api/file/delete_batch", true, false, true, api_delete_batch, nullptr},
+    {"GET", "/api/files/shared", true, false, false, api_files_shared, nullptr},
+    {"GET", "/api/files", true, false, false, api_files, nullptr},
+    {"GET", "/api/download/", true, false, false, api_download, nullptr},
+    {"DELETE", "/api/file/", true, false, true, api_delete, nullptr},
+};
+
+// the route for a request, with its path parameter in req.param; sets
+// status to 404 or 405 if there is none
+static const ServerRoute* find_route(HttpRequest &req, int &status) {
+    status = 404;
+    std::string method = req.method == "HEAD" ? "GET" : req.method;
+    for (const ServerRoute &r : SERVER_ROUTES) {
+        size_t n = strlen(r.path);
+        bool prefix = r.path[n - 1] == '/';
+        bool match = prefix ? req.path.size() > n && req.path.compare(0, n, r.path) == 0 : req.path == r.path;
+        // <file_id> and <id> stop at the next slash, <path:filename> does not
+        if (match && prefix && strcmp(r.path, "/api/download/") != 0 && req.path.find('/', n) != std::string::npos)
+            match = false;
+        if (!match) continue;
+        if (method != r.method) {
+            status = 405;
+            continue;
+        }
+        if (prefix) req.param = req.path.substr(n);
+        return &r;
+    }
+    return nullptr;
+}
+
+// ---------------- Server: event loop ----------------
+// One non-blocking epoll loop per core, each with its own SO_REUSEPORT
+// listener so the kernel spreads connections across them. A connection
+// stays on the loop that accepted it: headers are parsed once complete,
+// bodies are handed on as they arrive (multipart file parts straight to
+// disk, never held whole), and file bodies go out with sendfile(). Work
+// that would stall the loop (the password KDF, and handlers that hash,
+// sync or copy file data) runs on a shared worker pool while the
+// connection is parked; the result comes back through the loop's eventfd.
+static const size_t SERVE_MAX_HEADER = 64 * 1024;
+static const size_t SERVE_MAX_JSON_BODY = 64 * 1024 * 1024;
+static const size_t SERVE_MAX_FIELD = 1024 * 1024;
+static const int SERVE_IDLE_SECONDS = 300;
+
+static volatile sig_atomic_t g_serve_stop = 0;
+
+static void serve_stop(int) {
+    g_serve_stop = 1;
+}
+
+struct ServerConn {
+    int fd = -1;
+    std::string in, out;
+    enum class Phase { Head, Body, Work, Send } phase = Phase::Head;
+    uint64_t serial = 0;           // tells a completion for a reused fd apart
+    bool keep_alive = true;
+    bool waiting = false;          // watching for EPOLLOUT rather than EPOLLIN
+    std::chrono::steady_clock::time_point active = std::chrono::steady_clock::now();
+
+    // request being read
+    HttpRequest req;
+    const ServerRoute* route = nullptr;
+    HttpResponse reject;           // answer once the body is drained, if status != 0
+    bool discard = false;          // drop the body
+    bool chunked = false;          // Transfer-Encoding: chunked, else Content-Length
+    long long body_left = 0;       // bytes of the body or current chunk still to come
+    enum class ChunkPhase { Size, Data, DataEnd, Trailer } chunk_phase = ChunkPhase::Size;
+    std::unique_ptr<MultipartParser> multipart;
+    bool in_file = false;          // the current multipart part is the file
+    std::string field_name, field_value;
+
+    // response being sent
+    std::vector<HttpResponse::Slice> slices;
+    size_t slice_index = 0;
+    int slice_fd = -1;
+    off_t slice_offset = 0, slice_left = 0;
+    std::function<bool(std::string &)> stream;
+
+    ~ServerConn() {
+        if (slice_fd >= 0) close(slice_fd);
+        if (fd >= 0) close(fd);
+    }
+};
+
+class ServerLoop {
+public:
+    explicit ServerLoop(WorkerPool &workers) : workers_(workers) {}
+
+    ~ServerLoop() {
+        if (listen_fd_ >= 0) close(listen_fd_);
+        if (event_fd_ >= 0) close(event_fd_);
+        if (epfd_ >= 0) close(epfd_);
+    }
+
+    bool open(const struct addrinfo* ai) {
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        listen_fd_ = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (epfd_ < 0 || event_fd_ < 0 || listen_fd_ < 0 ||
+            setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+            bind(listen_fd_, ai->ai_addr, ai->ai_addrlen) != 0 || listen(listen_fd_, 1024) != 0)
+            return false;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd_;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, listen_fd_, &ev) != 0) return false;
+        ev.data.fd = event_fd_;
+        return epoll_ctl(epfd_, EPOLL_CTL_ADD, event_fd_, &ev) == 0;
+    }
+
+    void run() {
+        std::vector<struct epoll_event> events(256);
+        auto last_sweep = std::chrono::steady_clock::now();
+        while (!g_serve_stop) {
+            int n = epoll_wait(epfd_, events.data(), (int)events.size(), 1000);
+            if (n < 0 && errno != EINTR) {
+                std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd_) {
+                    accept_all();
+                    continue;
+                }
+                if (fd == event_fd_) {
+                    run_completions();
+                    continue;
+                }
+                auto it = conns_.find(fd);
+                if (it == conns_.end()) continue;
+                ServerConn &c = *it->second;
+                c.active = std::chrono::steady_clock::now();
+                bool alive = true;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) alive = false;
+                else if (c.phase == ServerConn::Phase::Work) continue;
+                else if (c.phase == ServerConn::Phase::Send) alive = send_more(c);
+                else alive = read_more(c);
+                if (!alive) conns_.erase(it);
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_sweep > std::chrono::seconds(5)) {
+                last_sweep = now;
+                for (auto it = conns_.begin(); it != conns_.end();) {
+                    if (it->second->phase != ServerConn::Phase::Work &&
+                        now - it->second->active > std::chrono::seconds(SERVE_IDLE_SECONDS))
+                        it = conns_.erase(it);
+                    else ++it;
+                }
+            }
+        }
+    }
+
+private:
+    void accept_all() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto c = std::make_unique<ServerConn>();
+            c->fd = fd;
+            c->serial = ++next_serial_;
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) != 0) continue;
+            conns_[fd] = std::move(c);
+        }
+    }
+
+    void watch(ServerConn &c, uint32_t events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = c.fd;
+        epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    // runs `work` on the worker pool with the connection parked (nothing is
+    // read from it), then `done` back on this loop unless the connection
+    // was closed meanwhile; `done` returns false to drop it. Neither may
+    // keep a reference into the connection, which can go away first.
+    void offload(ServerConn &c, std::function<void()> work, std::function<bool(ServerConn &)> done) {
+        c.phase = ServerConn::Phase::Work;
+        watch(c, 0);
+        int fd = c.fd;
+        uint64_t serial = c.serial;
+        workers_.submit([this, fd, serial, work = std::move(work), done = std::move(done)]() mutable {
+            work();
+            {
+                std::lock_guard<std::mutex> lk(completions_lock_);
+                completions_.push_back({fd, serial, std::move(done)});
+            }
+            uint64_t one = 1;
+            if (write(event_fd_, &one, sizeof(one)) < 0) {
+                // only fails if the counter is saturated, and then a wakeup is already due
+            }
+        });
+    }
+
+    void run_completions() {
+        uint64_t count;
+        if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) return;
+        std::vector<Completion> ready;
+        {
+            std::lock_guard<std::mutex> lk(completions_lock_);
+            ready.swap(completions_);
+        }
+        for (Completion &done : ready) {
+            auto it = conns_.find(done.fd);
+            if (it == conns_.end() || it->second->serial != done.serial) continue;
+            ServerConn &c = *it->second;
+            c.active = std::chrono::steady_clock::now();
+            watch(c, EPOLLIN);
+            if (!done.resume(c)) conns_.erase(it);
+        }
+    }
+
+    // handles input that was buffered while the connection was busy
+    bool resume(ServerConn &c) {
+        return process(c) && (c.phase != ServerConn::Phase::Send || send_more(c));
+    }
+
+    // reads what the socket has (a bounded amount per wakeup, so one fast
+    // upload does not starve the loop's other connections) and processes it
+    bool read_more(ServerConn &c) {
+        static thread_local std::vector<char> buf(256 * 1024);
+        for (int reads = 0; reads < 16; ++reads) {
+            ssize_t n = recv(c.fd, buf.data(), buf.size(), 0);
+            if (n == 0) return false;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            c.in.append(buf.data(), (size_t)n);
+            if (!process(c)) return false;
+            // most responses fit the socket buffer right away; the rest wait
+            // for EPOLLOUT
+            if (c.phase == ServerConn::Phase::Send) return send_more(c);
+            if (c.phase == ServerConn::Phase::Work) return true;
+        }
+        return true;
+    }
+
+    // parses buffered input; false to drop the connection
+    bool process(ServerConn &c) {
+        while (c.phase == ServerConn::Phase::Head || c.phase == ServerConn::Phase::Body) {
+            if (c.phase == ServerConn::Phase::Head) {
+                size_t end = c.in.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    if (c.in.size() > SERVE_MAX_HEADER) return fail(c, 431, "request headers too large");
+                    return true;
+                }
+                std::string head = c.in.substr(0, end + 2);
+                c.in.erase(0, end + 4);
+                if (!begin_request(c, head)) return false;
+                continue;
+            }
+            int state = feed_body(c);
+            if (state < 0) return fail(c, 400, "malformed request body");
+            if (state == 0) return true;
+            finish_request(c);
+        }
+        return true;
+    }
+
+    // answers with an error and closes once it is sent
+    bool fail(ServerConn &c, int status, const std::string &message) {
+        c.keep_alive = false;
+        if (c.req.file) c.req.file->remove();
+        c.req.file.reset();
+        respond(c, error_response(status, message));
+        return true;
+    }
+
+    bool begin_request(ServerConn &c, const std::string &head) {
+        c.req = HttpRequest();
+        c.route = nullptr;
+        c.reject = HttpResponse();
+        c.reject.status = 0;
+        c.discard = false;
+        c.multipart.reset();
+        c.in_file = false;
+
+        size_t eol = head.find("\r\n");
+        std::istringstream line(head.substr(0, eol));
+        std::string target, version;
+        line >> c.req.method >> target >> version;
+        if (c.req.method.empty() || target.empty() || version.compare(0, 5, "HTTP/") != 0)
+            return fail(c, 400, "malformed request line");
+        for (size_t p = eol + 2; p < head.size();) {
+            size_t e = head.find("\r\n", p);
+            std::string h = head.substr(p, e - p);
+            p = e + 2;
+            size_t colon = h.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = h.substr(0, colon), value = h.substr(colon + 1);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char ch) { return (char)std::tolower(ch); });
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t") + 1);
+            c.req.headers.emplace_back(name, value);
+        }
+        size_t q = target.find('?');
+        c.req.path = url_decode(target.substr(0, q), false);
+        if (q != std::string::npos) {
+            c.req.query = target.substr(q + 1);
+            std::stringstream pairs(c.req.query);
+            for (std::string pair; std::getline(pairs, pair, '&');) {
+                size_t eq = pair.find('=');
+                std::string k = url_decode(pair.substr(0, eq), true);
+                std::string v = eq == std::string::npos ? "" : url_decode(pair.substr(eq + 1), true);
+                if (!v.empty()) c.req.args.emplace(k, v);
+            }
+        }
+        std::string connection = c.req.header("connection");
+        std::transform(connection.begin(), connection.end(), connection.begin(), [](unsigned char ch) { return (char)std::tolower(ch); });
+        c.keep_alive = version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+
+        std::string te = c.req.header("transfer-encoding");
+        c.chunked = !te.empty() && te != "identity";
+        c.chunk_phase = ServerConn::ChunkPhase::Size;
+        c.body_left = 0;
+        if (!c.chunked && c.req.has_header("content-length")) {
+            long long length;
+            if (!parse_long(c.req.header("content-length"), length) || length < 0)
+                return fail(c, 400, "bad Content-Length");
+            c.body_left = length;
+        }
+        bool has_body = c.chunked || c.body_left > 0;
+        std::string expect = c.req.header("expect");
+        if (has_body && strcasecmp(expect.c_str(), "100-continue") == 0) {
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            send(c.fd, cont, sizeof(cont) - 1, MSG_NOSIGNAL);
+        }
+
+        int status;
+        c.route = find_route(c.req, status);
+        if (!c.route) {
+            c.reject = error_response(status, status == 404 ? "not found" : "method not allowed");
+        } else if (c.route->auth) {
+            std::string user, password, error;
+            int denied = authenticate(c.req, user, password, error);
+            if (denied < 0) {
+                // the body waits in the socket until the password is checked
+                auto ok = std::make_shared<bool>(false);
+                offload(c, [ok, user, password] { *ok = verify_user(user, password); },
+                        [this, ok, user](ServerConn &c) {
+                            if (*ok) c.req.user = user;
+                            else c.reject = error_response(403, "Invalid credentials");
+                            start_body(c);
+                            return resume(c);
+                        });
+                return true;
+            }
+            if (denied) c.reject = error_response(denied, error);
+            else c.req.user = user;
+        }
+        start_body(c);
+        return true;
+    }
+
+    void start_body(ServerConn &c) {
+        c.discard = c.reject.status != 0;
+        if (!c.discard && c.route->multipart) start_multipart(c);
+        c.phase = ServerConn::Phase::Body;
+    }
+
+    // 0 if authenticated, -1 if Basic credentials (in user and password)
+    // still need the KDF, else the status to answer with and why
+    static int authenticate(const HttpRequest &req, std::string &user, std::string &password, std::string &error) {
+        std::string auth = req.header("authorization"), creds;
+        if (strncasecmp(auth.c_str(), "bearer ", 7) == 0) {
+            std::string token = auth.substr(7);
+            token.erase(0, token.find_first_not_of(' '));
+            token.erase(token.find_last_not_of(' ') + 1);
+            user = check_session_token(token);
+            error = "session expired or invalid; log in again";
+            return user.empty() ? 401 : 0;
+        }
+        error = "Authorization required (Basic)";
+        if (strncasecmp(auth.c_str(), "basic ", 6) != 0) return 401;
+        std::string b64 = auth.substr(6);
+        b64.erase(0, b64.find_first_not_of(' '));
+        size_t colon;
+        if (!base64_decode(b64, BASE64_STD, creds) || (colon = creds.find(':')) == std::string::npos || colon == 0)
+            return 401;
+        user = creds.substr(0, colon);
+        password = creds.substr(colon + 1);
+        error = "Invalid credentials";
+        int known = verify_user_cached(user, password);
+        return known < 0 ? -1 : known ? 0 : 403;
+    }
+
+    void start_multipart(ServerConn &c) {
+        std::string type = c.req.header("content-type");
+        size_t b = type.find("boundary=");
+        if (strncasecmp(type.c_str(), "multipart/form-data", 19) != 0 || b == std::string::npos) return;
+        std::string boundary = type.substr(b + 9);
+        boundary = boundary.substr(0, boundary.find(';'));
+        if (boundary.size() >= 2 && boundary.front() == '"') boundary = boundary.substr(1, boundary.size() - 2);
+        ServerConn* conn = &c;
+        c.multipart = std::make_unique<MultipartParser>(boundary,
+            [conn](const std::string &name, const std::string &, bool is_file) {
+                end_field(*conn);
+                HttpRequest &req = conn->req;
+                conn->in_file = is_file && !req.file;
+                conn->field_name = name;
+                conn->field_value.clear();
+                if (!conn->in_file) return;
+                SinkPlan plan;
+                if (!conn->route->plan || !conn->route->plan(req, plan)) plan = spool_plan();
+                req.file = std::make_unique<UploadSink>(plan);
+                req.file_field = name;
+            },
+            [conn](const char* data, size_t n) {
+                if (conn->in_file) conn->req.file->write(data, n);
+                else if (conn->field_value.size() < SERVE_MAX_FIELD) conn->field_value.append(data, n);
+            });
+    }
+
+    // keeps a finished form field; the first of repeated names wins
+    static void end_field(ServerConn &c) {
+        if (!c.in_file && !c.field_name.empty()) c.req.form.emplace(c.field_name, c.field_value);
+        c.field_name.clear();
+        c.in_file = false;
+    }
+
+    void consume(ServerConn &c, const char* data, size_t n) {
+        if (c.discard || n == 0) return;
+        if (c.multipart) {
+            if (!c.multipart->feed(data, n)) c.discard = true;
+        } else if (c.route->multipart) {
+            // not a form; nothing to keep
+        } else if (c.req.body.size() + n > SERVE_MAX_JSON_BODY) {
+            c.reject = error_response(413, "request body too large");
+            c.discard = true;
+        } else {
+            c.req.body.append(data, n);
+        }
+    }
+
+    // passes buffered body bytes on; 1 once the body is complete, 0 if more
+    // is needed, -1 if the chunked framing is broken
+    int feed_body(ServerConn &c) {
+        if (!c.chunked) {
+            size_t n = (size_t)std::min<long long>(c.body_left, (long long)c.in.size());
+            consume(c, c.in.data(), n);
+            c.in.erase(0, n);
+            c.body_left -= (long long)n;
+            return c.body_left == 0 ? 1 : 0;
+        }
+        size_t pos = 0;
+        int state = 0;
+        while (state == 0) {
+            if (c.chunk_phase == ServerConn::ChunkPhase::Data) {
+                size_t n = (size_t)std::min<long long>(c.body_left, (long long)(c.in.size() - pos));
+                consume(c, c.in.data() + pos, n);
+                pos += n;
+                c.body_left -= (long long)n;
+                if (c.body_left > 0) break;
+                c.chunk_phase = ServerConn::ChunkPhase::DataEnd;
+                continue;
+            }
+            size_t eol = c.in.find("\r\n", pos);
+            if (eol == std::string::npos) {
+                if (c.in.size() - pos > 4096) state = -1;
+                break;
+            }
+            std::string line = c.in.substr(pos, eol - pos);
+            pos = eol + 2;
+            if (c.chunk_phase == ServerConn::ChunkPhase::DataEnd) {
+                if (!line.empty()) state = -1;
+                c.chunk_phase = ServerConn::ChunkPhase::Size;
+            } else if (c.chunk_phase == ServerConn::ChunkPhase::Size) {
+                char* end = nullptr;
+                long long size = strtoll(line.c_str(), &end, 16);
+                if (end == line.c_str() || size < 0) state = -1;
+                c.body_left = size;
+                c.chunk_phase = size == 0 ? ServerConn::ChunkPhase::Trailer : ServerConn::ChunkPhase::Data;
+            } else if (line.empty()) {
+                state = 1;  // end of the trailer section
+            }
+        }
+        c.in.erase(0, pos);
+        return state;
+    }
+
+    void finish_request(ServerConn &c) {
+        if (c.multipart) {
+            end_field(c);
+            if (!c.discard && !c.multipart->done() && c.reject.status == 0)
+                c.reject = error_response(400, "truncated multipart body");
+        }
+        if (c.req.file) c.req.file->finish();
+        if (c.reject.status == 0 && c.discard) c.reject = error_response(400, "malformed multipart body");
+        if (c.reject.status != 0) {
+            if (c.req.file) c.req.file->remove();
+            respond(c, std::move(c.reject));
+            return;
+        }
+        if (!c.route->blocking) {
+            respond(c, c.route->handler(c.req));
+            c.req.file.reset();
+            return;
+        }
+        auto req = std::make_shared<HttpRequest>(std::move(c.req));
+        auto res = std::make_shared<HttpResponse>();
+        c.req = HttpRequest();
+        c.req.method = req->method;
+        const ServerRoute* route = c.route;
+        offload(c,
+                [req, res, route] {
+                    *res = route->handler(*req);
+                    req->file.reset();
+                },
+                [this, res](ServerConn &c) {
+                    respond(c, std::move(*res));
+                    return send_more(c);
+                });
+    }
+
+    void respond(ServerConn &c, HttpResponse r) {
+        bool head = c.req.method == "HEAD";
+        std::string out = "HTTP/1.1 " + std::to_string(r.status) + " " + http_reason(r.status) + "\r\nServer: netserve\r\n";
+        for (const auto &h : r.headers) out += h.first + ": " + h.second + "\r\n";
+        long long length = (long long)r.body.size();
+        for (const auto &s : r.slices) length += s.length;
+        if (r.stream) {
+            if (!head) out += "Transfer-Encoding: chunked\r\n";
+        } else if (r.status != 304) {
+            out += "Content-Length: " + std::to_string(length) + "\r\n";
+        }
+        out += c.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        if (!head) out += r.body;
+        c.out += out;
+        c.slices = head ? std::vector<HttpResponse::Slice>() : std::move(r.slices);
+        c.slice_index = 0;
+        c.stream = head ? nullptr : std::move(r.stream);
+        c.phase = ServerConn::Phase::Send;
+    }
+
+    // after a failed send: true (and wait for EPOLLOUT) if the socket is
+    // only full
+    bool blocked(ServerConn &c) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+        if (!c.waiting) watch(c, EPOLLOUT);
+        c.waiting = true;
+        return true;
+    }
+
+    // writes as much of the response as the socket takes; false to drop
+    // the connection
+    bool send_more(ServerConn &c) {
+        int pieces = 0;
+        while (true) {
+            while (!c.out.empty()) {
+                ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+                if (n < 0) return blocked(c);
+                c.out.erase(0, (size_t)n);
+            }
+            if (c.slice_index < c.slices.size()) {
+                const HttpResponse::Slice &s = c.slices[c.slice_index];
+                if (c.slice_fd < 0) {
+                    c.slice_fd = ::open(s.path.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (c.slice_fd < 0) return false; // the headers are out; all we can do is cut the body short
+                    c.slice_offset = s.offset;
+                    c.slice_left = s.length;
+                }
+                while (c.slice_left > 0) {
+                    ssize_t n = sendfile(c.fd, c.slice_fd, &c.slice_offset, (size_t)std::min<off_t>(c.slice_left, 1 << 30));
+                    if (n < 0) return blocked(c);
+                    if (n == 0) return false; // file shrank underneath us
+                    c.slice_left -= n;
+                }
+                close(c.slice_fd);
+                c.slice_fd = -1;
+                c.slice_index++;
+                continue;
+            }
+            if (c.stream) {
+                // a few pieces per wakeup, so one long stream shares the loop
+                if (++pieces > 8) {
+                    if (!c.waiting) watch(c, EPOLLOUT);
+                    c.waiting = true;
+                    return true;
+                }
+                std::string piece;
+                bool more = c.stream(piece);
+                if (!piece.empty()) {
+                    std::ostringstream size;
+                    size << std::hex << piece.size();
+                    c.out += size.str() + "\r\n" + piece + "\r\n";
+                }
+                if (!more) {
+                    c.stream = nullptr;
+                    c.out += "0\r\n\r\n";
+                }
+                continue;
+            }
+            break;
+        }
+        // response complete
+        if (!c.keep_alive) return false;
+        c.slices.clear();
+        c.phase = ServerConn::Phase::Head;
+        if (c.waiting) watch(c, EPOLLIN);
+        c.waiting = false;
+        // a pipelined request may already be buffered
+        return resume(c);
+    }
+
+    struct Completion {
+        int fd;
+        uint64_t serial;
+        std::function<bool(ServerConn &)> resume;
+    };
+
+    WorkerPool &workers_;
+    int epfd_ = -1, listen_fd_ = -1, event_fd_ = -1;
+    uint64_t next_serial_ = 0;
+    std::unordered_map<int, std::unique_ptr<ServerConn>> conns_;
+    std::mutex completions_lock_;
+    std::vector<Completion> completions_;
+};
+
+// `netserve serve`: runs until SIGINT or SIGTERM
+static bool serve(const std::string &host, int port, const std::string &dir, unsigned loops) {
+    if (!store_open(dir)) return false;
+    struct addrinfo hints, *ai = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    std::string port_s = std::to_string(port);
+    int rc = getaddrinfo(host.c_str(), port_s.c_str(), &hints, &ai);
+    if (rc != 0) {
+        std::cerr << "Cannot resolve " << host << ": " << gai_strerror(rc) << std::endl;
+        return false;
+    }
+    // workers mostly wait on the disk or run the KDF, so there are more of
+    // them than cores, and they stop before the loops they report back to.
+    auto workers = std::make_unique<WorkerPool>(std::max(4u, 2 * loops));
+    std::vector<std::unique_ptr<ServerLoop>> servers;
+    for (unsigned i = 0; i < loops; ++i) {
+        servers.push_back(std::make_unique<ServerLoop>(*workers));
+        if (!servers.back()->open(ai)) {
+            std::cerr << "Cannot listen on " << host << ":" << port << ": " << strerror(errno) << std::endl;
+            freeaddrinfo(ai);
+            return false;
+        }
+    }
+    freeaddrinfo(ai);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+    std::cout << "Serving " << dir << " on http://" << host << ":" << port << " with " << loops << " event loop"
+              << (loops == 1 ? "" : "s") << std::endl;
+    std::vector<std::thread> threads;
+    for (auto &s : servers) threads.emplace_back([&s] { s->run(); });
+    for (auto &t : threads) t.join();
+    workers.reset();
+    return true;
+}
 
-    if (looks_like_id) {
-        for (auto &e : items) if (e.file_id == id_or_name) { out_file_id = e.file_id; return true; }
-        for (auto &e : items) if (e.file_id.size() >= id_or_name.size() && e.file_id.substr(0, id_or_name.size()) == id_or_name) { out_file_id = e.file_id; return true; }
+// ---------------- Benchmark ----------------
+// `netserve bench` starts server.py on a free loopback port in a scratch
+// directory and points the client at it, with HOME moved there too so no
+// real journals, caches or downloads are touched. It sweeps single-file
+// uploads and downloads over file sizes, entropies, chunk sizes and job
+// counts, directory uploads over file counts, and many concurrent users,
+// and prints one JSON document of throughput, request rates and latency
+// percentiles. Synthetic data comes from a fixed seed, so runs of two
+// releases on the same machine can be diffed.
+struct BenchOptions {
+    std::string server_py;
+    std::string python = "python3";
+    bool native = false; // bench `netserve serve` instead of server.py
+    std::vector<long> sizes{64l << 20};
+    std::vector<double> entropies{1.0};
+    std::vector<long> chunk_sizes{4l << 20, 16l << 20, 64l << 20};
+    std::vector<int> jobs{1, 4};
+    std::vector<int> file_counts{1000};
+    long small_size = 4096;
+    std::vector<int> clients{8};
+    int client_files = 20;
+    bool compress = false;
+};
+
+// "4K", "16M", "1G" or plain bytes
+static bool parse_size(const std::string &s, long &out) {
+    char* end = nullptr;
+    double v = strtod(s.c_str(), &end);
+    if (end == s.c_str() || v < 0) return false;
+    std::string unit(end);
+    if (unit == "K" || unit == "k") v *= 1024;
+    else if (unit == "M" || unit == "m") v *= 1024 * 1024;
+    else if (unit == "G" || unit == "g") v *= 1024.0 * 1024 * 1024;
+    else if (!unit.empty()) return false;
+    out = (long)v;
+    return true;
+}
+
+// comma-separated values; "none" is the empty list
+template <typename T>
+static bool parse_list(const std::string &s, std::vector<T> &out, const std::function<bool(const std::string &, T &)> &parse) {
+    out.clear();
+    if (s == "none") return true;
+    std::istringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        T v;
+        if (!parse(item, v)) return false;
+        out.push_back(v);
     }
+    return !out.empty();
+}
 
-    for (auto &e : items) if (e.filename == id_or_name) { out_file_id = e.file_id; return true; }
+// `size` bytes where each 64 KB block is `entropy` random bytes followed
+// by repeated text, so entropy 0 compresses almost away and 1 not at all
+static bool bench_file(const std::string &path, long size, double entropy, uint64_t seed) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    static const char text[] = "netserve benchmark data, deliberately repetitive. ";
+    std::vector<char> block(64 * 1024);
+    uint64_t x = seed * 0x9e3779b97f4a7c15ull + 1;
+    bool ok = true;
+    for (long done = 0; ok && done < size; done += (long)block.size()) {
+        size_t random_bytes = (size_t)(entropy * block.size());
+        for (size_t i = 0; i < block.size(); i += 8) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            if (i < random_bytes) memcpy(&block[i], &x, std::min((size_t)8, random_bytes - i));
+        }
+        for (size_t i = random_bytes; i < block.size(); ++i) block[i] = text[i % (sizeof(text) - 1)];
+        size_t n = (size_t)std::min((long)block.size(), size - done);
+        ok = write(fd, block.data(), n) == (ssize_t)n;
+    }
+    return close(fd) == 0 && ok;
+}
 
-    return false;
+static int remove_entry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
 }
 
-bool client_share(const std::string &id_or_name, const std::string &share_with, const std::string &username, const std::string &password) {
-    std::string file_id;
-    if (!resolve_file_id(id_or_name, username, password, file_id)) {
-        std::cerr << "Could not find file matching '" << id_or_name << "'\n";
-        return false;
+static int free_loopback_port() {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int port = -1;
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) == 0 && getsockname(s, (struct sockaddr*)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    close(s);
+    return port;
+}
+
+// starts server.py (or, with --native, `netserve serve`) in dir/server with
+// its output in dir/server.log and waits until it answers; returns its pid
+// or -1
+static pid_t bench_start_server(const BenchOptions &opt, const std::string &dir, int port) {
+    std::string cwd = dir + "/server";
+    if (mkdir(cwd.c_str(), S_IRWXU) != 0) return -1;
+    char* real = realpath(opt.native ? "/proc/self/exe" : opt.server_py.c_str(), nullptr);
+    if (!real) {
+        std::cerr << "Cannot find " << opt.server_py << "; pass --server path/to/server.py" << std::endl;
+        return -1;
     }
+    std::string script = real;
+    free(real);
+    std::string port_arg = std::to_string(port), log = dir + "/server.log";
 
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-    std::string url = endpoint("/api/file/share");
-    std::string json = "{\"file_id\":\"" + file_id + "\",\"share_with\":\"" + share_with + "\"}";
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int out = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out >= 0) {
+            dup2(out, STDOUT_FILENO);
+            dup2(out, STDERR_FILENO);
+        }
+        if (chdir(cwd.c_str()) != 0) _exit(127);
+        if (opt.native)
+            execl(script.c_str(), script.c_str(), "serve", "--host", "127.0.0.1", "--port", port_arg.c_str(), (char*)nullptr);
+        else
+            execlp(opt.python.c_str(), opt.python.c_str(), script.c_str(), "--host", "127.0.0.1", "--port",
+                   port_arg.c_str(), (char*)nullptr);
+        _exit(127);
+    }
 
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    std::string url = endpoint("/api/greet");
+    for (int tries = 0; tries < 100; ++tries) {
+        usleep(100 * 1000);
+        int status = 0;
+        if (waitpid(pid, &status, WNOHANG) == pid) break;
+        CURL* curl = session_handle();
+        std::string response;
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        long code = 0;
+        if (curl_easy_perform(curl) == CURLE_OK && curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code) == CURLE_OK &&
+            code == 200)
+            return pid;
+    }
+    std::cerr << (opt.native ? "netserve serve" : "server.py") << " did not start; see " << log << std::endl;
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
 
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+// "count", "p50", "p99" and "max" of total request time, per kind
+static void bench_latency_json(std::ostream &out, const std::vector<RequestMetric> &requests) {
+    std::map<std::string, std::vector<double>> by_kind;
+    for (const auto &m : requests) by_kind[m.kind].push_back(m.total);
+    out << "{";
+    bool first = true;
+    for (auto &k : by_kind) {
+        std::sort(k.second.begin(), k.second.end());
+        out << (first ? "" : ",") << json_quote(k.first) << ":{\"count\":" << k.second.size()
+            << ",\"p50\":" << percentile(k.second, 50) << ",\"p99\":" << percentile(k.second, 99)
+            << ",\"max\":" << k.second.back() << "}";
+        first = false;
+    }
+    out << "}";
+}
 
-    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
-    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
+// runs op() and appends a case to `cases`: `fields` describe it, `bytes`
+// is the payload moved, and the requests it made give the latencies
+// Runs one case, appends its report entry and returns whether it succeeded.
+static bool bench_case(std::vector<std::string> &cases, const std::string &fields, long long bytes,
+                       const std::function<bool()> &op) {
+    size_t first;
+    {
+        std::lock_guard<std::mutex> lk(g_metrics.lock);
+        first = g_metrics.requests.size();
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ok = op();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<RequestMetric> requests;
+    {
+        std::lock_guard<std::mutex> lk(g_metrics.lock);
+        requests.assign(g_metrics.requests.begin() + first, g_metrics.requests.end());
+    }
+    std::ostringstream out;
+    out << std::setprecision(6) << "{" << fields << ",\"ok\":" << (ok ? "true" : "false") << ",\"seconds\":" << seconds
+        << ",\"mb_per_s\":" << (double)bytes / (1024 * 1024) / seconds << ",\"requests\":" << requests.size()
+        << ",\"requests_per_s\":" << requests.size() / seconds << ",\"latency\":";
+    bench_latency_json(out, requests);
+    out << "}";
+    cases.push_back(out.str());
+    std::cerr << "  " << fields << (ok ? "" : " FAILED") << ": " << std::fixed << std::setprecision(1)
+              << (double)bytes / (1024 * 1024) / seconds << " MB/s, " << requests.size() / seconds << " req/s" << std::endl;
+    return ok;
+}
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+// Forks `clients` users who each upload their own files one by one and
+// list them, all at once, so every init, assembly and listing contends for
+// the server's metadata store and its log appends. Returns whether every
+// client succeeded.
+static bool bench_clients(std::vector<std::string> &cases, const BenchOptions &opt, const std::string &dir, int clients) {
+    std::string data = dir + "/clients";
+    mkdir(data.c_str(), S_IRWXU);
+    for (int f = 0; f < opt.client_files; ++f)
+        bench_file(data + "/f" + std::to_string(f), opt.small_size, 1.0, 1000 + f);
 
-    CURLcode res = curl_easy_perform(curl);
-    bool ok = (res == CURLE_OK);
-    if (!ok) std::cerr << "share failed: " << curl_easy_strerror(res) << std::endl;
-    else std::cout << "Share response: " << response << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pid_t> pids;
+    for (int c = 0; c < clients; ++c) {
+        pid_t pid = fork();
+        if (pid < 0) break;
+        if (pid == 0) {
+            // a fresh session: the parent's connections are not ours to use
+            g_thread_handle = nullptr;
+            g_session.share = nullptr;
+            session_begin();
+            g_metrics.requests.clear();
+            std::string user = "bench" + std::to_string(c);
+            bool ok = create_user(user, "bench");
+            for (int f = 0; ok && f < opt.client_files; ++f)
+                ok = upload_file(data + "/f" + std::to_string(f), user, "bench", 1, false, false, "", nullptr);
+            std::vector<FileEntry> listed;
+            ok = ok && get_files_meta(user, "bench", listed) && (int)listed.size() == opt.client_files;
+            std::ofstream log(dir + "/client" + std::to_string(c) + ".log");
+            for (const auto &m : g_metrics.requests)
+                log << m.kind << " " << (m.ok && m.status < 400) << " " << m.total << "\n";
+            log.close();
+            _exit(ok && log ? 0 : 1);
+        }
+        pids.push_back(pid);
+    }
+    bool ok = (int)pids.size() == clients;
+    for (pid_t pid : pids) {
+        int status = 0;
+        ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    std::vector<RequestMetric> requests;
+    for (int c = 0; c < clients; ++c) {
+        std::ifstream log(dir + "/client" + std::to_string(c) + ".log");
+        RequestMetric m;
+        while (log >> m.kind >> m.ok >> m.total) requests.push_back(m);
+    }
+    long long bytes = (long long)clients * opt.client_files * opt.small_size;
+    std::ostringstream out;
+    out << std::setprecision(6) << "{\"op\":\"multi_client\",\"clients\":" << clients
+        << ",\"files_per_client\":" << opt.client_files << ",\"file_size\":" << opt.small_size
+        << ",\"ok\":" << (ok ? "true" : "false") << ",\"seconds\":" << seconds
+        << ",\"mb_per_s\":" << (double)bytes / (1024 * 1024) / seconds << ",\"requests\":" << requests.size()
+        << ",\"requests_per_s\":" << requests.size() / seconds << ",\"latency\":";
+    bench_latency_json(out, requests);
+    out << "}";
+    cases.push_back(out.str());
+    std::cerr << "  multi_client clients=" << clients << (ok ? "" : " FAILED") << ": " << std::fixed
+              << std::setprecision(1) << requests.size() / seconds << " req/s" << std::endl;
     return ok;
 }
 
-bool client_delete(const std::string &id_or_name, const std::string &username, const std::string &password) {
-    std::string file_id;
-    if (!resolve_file_id(id_or_name, username, password, file_id)) {
-        std::cerr << "Could not find file matching '" << id_or_name << "'\n";
+bool run_bench(const BenchOptions &opt, std::ostream &report) {
+    char tmpl[] = "/tmp/netserve-bench-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        std::cerr << "Cannot create a scratch directory: " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::string dir = tmpl;
+    int port = free_loopback_port();
+    g_base_url = "http://127.0.0.1:" + std::to_string(port);
+    setenv("HOME", dir.c_str(), 1);
+    pid_t server = port > 0 ? bench_start_server(opt, dir, port) : -1;
+    if (server < 0) {
+        nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
         return false;
     }
 
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-    std::string url = endpoint("/api/file/") + file_id;
+    // the client's own output would drown the report
+    std::ofstream null("/dev/null");
+    std::streambuf* saved = std::cout.rdbuf(null.rdbuf());
+    g_show_progress = false;
 
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    const std::string user = "bench", pass = "bench";
+    bool ok = create_user(user, pass);
+    std::vector<std::string> cases;
+    size_t failed = 0;  // a failed case is reported and the sweep goes on
+    std::string data = dir + "/data";
+    mkdir(data.c_str(), S_IRWXU);
+    std::cerr << "Benchmarking " << g_base_url << " (scratch " << dir << ")" << std::endl;
 
-    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
-    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
+    for (size_t si = 0; ok && si < opt.sizes.size(); ++si) {
+        for (double entropy : opt.entropies) {
+            long size = opt.sizes[si];
+            std::ostringstream name;
+            name << "bench-" << size << "-" << (int)(entropy * 100) << ".bin";
+            std::string path = data + "/" + name.str();
+            if (!bench_file(path, size, entropy, si + 1)) { ok = false; break; }
+            for (long chunk : opt.chunk_sizes) {
+                for (int jobs : opt.jobs) {
+                    std::ostringstream fields;
+                    fields << "\"size\":" << size << ",\"entropy\":" << entropy << ",\"chunk_size\":" << chunk
+                           << ",\"jobs\":" << jobs << ",\"compress\":" << (opt.compress ? "true" : "false");
+                    g_forced_chunk_size = (size_t)chunk;
+                    failed += !bench_case(cases, "\"op\":\"upload\"," + fields.str(), size, [&] {
+                        return upload_file(path, user, pass, jobs, false, opt.compress, "", nullptr);
+                    });
+                    failed += !bench_case(cases, "\"op\":\"download\"," + fields.str(), size, [&] {
+                        // measure the transfer, not the download cache
+                        bool done = download_file(name.str(), user, pass, jobs, "", 0);
+                        unlink((dir + "/" + name.str()).c_str());
+                        return done;
+                    });
+                }
+            }
+            g_forced_chunk_size = 0;
+            unlink(path.c_str());
+        }
+    }
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    for (size_t i = 0; ok && i < opt.file_counts.size(); ++i) {
+        int count = opt.file_counts[i];
+        std::string tree = data + "/tree" + std::to_string(count);
+        mkdir(tree.c_str(), S_IRWXU);
+        for (int f = 0; ok && f < count; ++f)
+            ok = bench_file(tree + "/f" + std::to_string(f), opt.small_size, 1.0, 100 + f);
+        if (!ok) break;
+        std::ostringstream fields;
+        fields << "\"op\":\"upload_tree\",\"files\":" << count << ",\"file_size\":" << opt.small_size;
+        for (int jobs : opt.jobs) {
+            failed += !bench_case(cases, fields.str() + ",\"jobs\":" + std::to_string(jobs),
+                                  (long long)count * opt.small_size,
+                                  [&] { return upload_tree(tree, user, pass, jobs, opt.compress); });
+        }
+        nftw(tree.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
 
-    CURLcode res = curl_easy_perform(curl);
-    bool ok = (res == CURLE_OK);
-    if (!ok) std::cerr << "delete failed: " << curl_easy_strerror(res) << std::endl;
-    else std::cout << "Delete response: " << response << std::endl;
+    for (size_t i = 0; ok && i < opt.clients.size(); ++i) failed += !bench_clients(cases, opt, dir, opt.clients[i]);
 
-    curl_easy_cleanup(curl);
-    return ok;
+    std::cout.rdbuf(saved);
+    g_show_progress = true;
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    report << "{\"netserve_bench\":1,\"server\":" << (opt.native ? "\"native\"" : "\"server.py\"")
+           << ",\"libcurl\":" << json_quote(curl_version_info(CURLVERSION_NOW)->version)
+           << ",\"hash_threads\":" << hash_threads() << ",\"cases\":[";
+    for (size_t i = 0; i < cases.size(); ++i) report << (i ? ",\n" : "\n") << cases[i];
+    report << "\n]}\n";
+    if (failed) std::cerr << failed << " of " << cases.size() << " cases failed" << std::endl;
+    return ok && !failed;
 }
 
-// ---------------- Download ----------------
-bool download_file(const std::string &filename, const std::string &username, const std::string &password) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-    std::string url = endpoint("/api/download/") + filename;
+// ---------------- CLI ----------------
+// removes "<name> <value>" from args; returns false if the option is absent
+static bool take_option(std::vector<std::string> &args, const std::string &name, std::string &value) {
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        if (args[i] == name) {
+            value = args[i + 1];
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            return true;
+        }
+    }
+    return false;
+}
+
+// removes a bare "<name>" flag from args; returns whether it was present
+static bool take_flag(std::vector<std::string> &args, const std::string &name) {
+    auto it = std::find(args.begin(), args.end(), name);
+    if (it == args.end()) return false;
+    args.erase(it);
+    return true;
+}
+
+static void client_cleanup() {
+    if (!g_metrics.json_path.empty()) write_metrics_json(g_metrics.json_path);
+    session_end();
+    curl_global_cleanup();
+}
+
+static bool parse_jobs(const std::string &s, int &jobs) {
+    char* end = nullptr;
+    long v = strtol(s.c_str(), &end, 10);
+    if (s.empty() || *end != '\0' || v < 1 || v > 64) {
+        std::cerr << "--jobs must be between 1 and 64\n";
+        return false;
+    }
+    jobs = (int)v;
+    return true;
+}
+
+// `upload` with the arguments after the command name; returns the exit status
+static int upload_command(std::vector<std::string> args) {
+    std::string filepath, user, pass, jobs_arg;
+    int jobs = 1;
+    if (take_option(args, "--jobs", jobs_arg) && !parse_jobs(jobs_arg, jobs)) return 1;
+    bool resume = take_flag(args, "--resume");
+    bool cdc = take_flag(args, "--cdc");
+    bool compress = take_flag(args, "--compress");
+    bool recursive = take_flag(args, "-r");
+    std::string name, update;
+    take_option(args, "--name", name);
+    bool delta = take_option(args, "--update", update);
+    if (cdc && compress) { std::cerr << "--compress cannot be combined with --cdc\n"; return 1; }
+    if (delta && (resume || cdc || compress || recursive || !name.empty())) {
+        std::cerr << "--update cannot be combined with --resume, --cdc, --compress, -r or --name\n";
+        return 1;
+    }
+    if (recursive && (cdc || resume)) { std::cerr << "-r cannot be combined with --cdc or --resume\n"; return 1; }
+    if (args.size() == 1) {
+        filepath = args[0];
+        if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; return 1; }
+    } else if (args.size() == 3) {
+        filepath = args[0];
+        user = args[1]; pass = args[2];
+    } else {
+        std::cerr << "upload requires filepath or -r <dir> [--jobs N] [--resume] [--cdc | --compress] [--update FILE] "
+                     "[username password]\n";
+        return 1;
+    }
+    bool from_stdin = filepath == "-";
+    if (from_stdin && delta) {
+        std::cerr << "upload - cannot be combined with --update\n";
+        return 1;
+    }
+    if (from_stdin && (name.empty() || recursive || cdc || resume)) {
+        std::cerr << "upload - requires --name NAME and cannot be combined with -r, --cdc or --resume\n";
+        return 1;
+    }
+    if (!from_stdin && !name.empty() && (recursive || cdc)) {
+        std::cerr << "--name cannot be combined with -r or --cdc\n";
+        return 1;
+    }
+    bool ok = from_stdin ? upload_stream(name, user, pass, jobs, compress)
+              : recursive ? upload_tree(filepath, user, pass, jobs, compress)
+              : delta ? upload_update(filepath, update, user, pass)
+              : cdc ? upload_file_cdc(filepath, user, pass, jobs)
+              : upload_file(filepath, user, pass, jobs, resume, compress, name, nullptr);
+    return ok ? 0 : 1;
+}
+
+// `download` with the arguments after the command name; returns the exit status
+static int download_command(std::vector<std::string> args) {
+    std::string filename, user, pass, jobs_arg, output;
+    int jobs = 1;
+    if (take_option(args, "--jobs", jobs_arg) && !parse_jobs(jobs_arg, jobs)) return 1;
+    take_option(args, "-o", output);
+    long cache_limit = DOWNLOAD_CACHE_DEFAULT;
+    std::string cache_arg;
+    if (take_option(args, "--cache-size", cache_arg) && !parse_size(cache_arg, cache_limit)) {
+        std::cerr << "--cache-size takes a size such as 20G, or 0 to bypass the cache\n";
+        return 1;
+    }
+    if (take_flag(args, "--no-cache")) cache_limit = 0;
+    if (args.size() == 1) {
+        filename = args[0];
+        if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; return 1; }
+    } else if (args.size() == 3) {
+        filename = args[0]; user = args[1]; pass = args[2];
+    } else {
+        std::cerr << "download requires filename [--jobs N] [-o FILE | -o -] [--no-cache | --cache-size SIZE] "
+                     "[username password]\n";
+        return 1;
+    }
+    bool ok = download_file(filename, user, pass, jobs, output, cache_limit);
+    return ok ? 0 : 1;
+}
+
+// `cat`, `head` and `tail` with the arguments after the command name;
+// returns the exit status
+static int read_command(const std::string &cmd, std::vector<std::string> args) {
+    std::string filename, user, pass, v;
+    long offset = 0, length = -1, lines = 10, bytes = -1;
+    bool ok = true;
+    if (cmd == "cat") {
+        if (take_option(args, "--offset", v)) ok = parse_size(v, offset);
+        if (take_option(args, "--length", v)) ok = ok && parse_size(v, length);
+    } else {
+        if (take_option(args, "-c", v)) ok = parse_size(v, bytes);
+        if (take_option(args, "-n", v)) {
+            long long n = 0;
+            ok = ok && bytes < 0 && parse_long(v, n) && n >= 0;
+            lines = (long)n;
+        }
+    }
+    if (ok && args.size() == 1) {
+        filename = args[0];
+        if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; return 1; }
+    } else if (ok && args.size() == 3) {
+        filename = args[0]; user = args[1]; pass = args[2];
+    } else {
+        if (cmd == "cat") std::cerr << "cat requires filename [--offset N] [--length N] [username password]\n";
+        else std::cerr << cmd << " requires filename [-n LINES | -c BYTES] [username password]\n";
+        return 1;
+    }
+
+    RemoteFile file;
+    if (!file.open(filename, user, pass, cmd == "tail" ? -1 : cmd == "cat" ? offset : 0)) return 1;
+    if (cmd == "cat") ok = remote_cat(file, offset, length);
+    else if (cmd == "head") ok = bytes >= 0 ? remote_cat(file, 0, bytes) : remote_head_lines(file, lines);
+    else if (bytes >= 0) ok = remote_cat(file, std::max(0ll, file.size() - bytes), -1);
+    else {
+        long long start = remote_tail_start(file, lines);
+        ok = start >= 0 && remote_cat(file, start, -1);
+    }
+    return ok ? 0 : 1;
+}
+
+// ---------------- Agent ----------------
+// `netserve agent` stays up with curl initialized and a warm connection
+// pool, and runs the uploads and downloads that `upload` and `download`
+// hand it over the Unix socket ~/.network_terminal_agent/agent.sock. Jobs
+// wait in a queue ordered by priority, then arrival, and at most --workers
+// of them run at once. The queue is kept in queue.json beside the socket,
+// so jobs that were waiting or running when the agent stopped run again
+// when it restarts, and an interrupted upload resumes from its journal. A
+// submitting command prints its job's output and exits with its status, or
+// with --detach returns once the job is queued; either way the job no
+// longer dies with the terminal that started it.
+//
+// A client sends one JSON request line and gets back lines of "1 text"
+// (stdout), "2 text" (stderr), "# text" (notes) and a final "= status".
+// Jobs run as the saved login: a command given a username and password
+// runs in the submitting process, so credentials never reach the queue.
+static const int AGENT_DEFAULT_WORKERS = 2;
+
+struct AgentJob {
+    long long id = 0;
+    long long priority = 0;
+    std::vector<std::string> argv; // command and arguments, paths made absolute
+    bool started = false;          // an upload that started before resumes
+    bool running = false;
+    int client = -1;               // submitter's connection, or -1
+};
+
+struct Agent {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::shared_ptr<AgentJob>> jobs; // waiting and running, in arrival order
+    long long next_id = 1;
+    std::string queue_file;
+};
+static Agent g_agent;
+
+// positions of the operands in upload or download arguments: the path or
+// name, then the username and password when they are given
+static std::vector<size_t> job_operands(const std::vector<std::string> &args) {
+    static const std::set<std::string> valued = {"--jobs", "--name", "--update", "--cache-size", "-o"};
+    std::vector<size_t> out;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (valued.count(args[i])) ++i;
+        else if (args[i] == "-" || args[i].empty() || args[i][0] != '-') out.push_back(i);
+    }
+    return out;
+}
 
+static std::string agent_dir() {
     const char* home = getenv("HOME");
-    std::string downloads_dir;
-    if (home) {
-        downloads_dir = std::string(home) + "/Downloads";
-        struct stat st;
-        if (stat(downloads_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
-            downloads_dir = std::string(home);
+    std::string base;
+    if (home && home[0] != '\0') base = home;
+    else {
+        struct passwd *pw = getpwuid(getuid());
+        base = (pw && pw->pw_dir) ? pw->pw_dir : ".";
+    }
+    return base + "/.network_terminal_agent";
+}
+
+static bool agent_address(sockaddr_un &addr) {
+    std::string path = agent_dir() + "/agent.sock";
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// a connection to a running agent, or -1
+static int agent_connect() {
+    sockaddr_un addr;
+    if (!agent_address(addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const std::string &data) {
+    for (size_t done = 0; done < data.size();) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+// one reply line to a client; a client that went away just stops getting them
+static void agent_send(int fd, char kind, const std::string &text) {
+    if (fd >= 0) send_all(fd, std::string(1, kind) + " " + text + "\n");
+}
+
+// a job's output, passed on to its client a line at a time
+class AgentJobOutput : public JobOutput {
+public:
+    explicit AgentJobOutput(int fd) : fd_(fd) {}
+    ~AgentJobOutput() override {
+        for (int i = 0; i < 2; ++i)
+            if (!pending_[i].empty()) agent_send(fd_, i ? '2' : '1', pending_[i]);
+    }
+
+    void write(int stream, const char* data, size_t n) override {
+        std::lock_guard<std::mutex> lk(mu_);
+        std::string &buf = pending_[stream == 1 ? 0 : 1];
+        buf.append(data, n);
+        for (size_t nl; (nl = buf.find('\n')) != std::string::npos; buf.erase(0, nl + 1))
+            agent_send(fd_, stream == 1 ? '1' : '2', buf.substr(0, nl));
+    }
+
+private:
+    int fd_;
+    std::mutex mu_;
+    std::string pending_[2];
+};
+
+// writes the queue to disk; caller holds g_agent.lock
+static void agent_save_locked() {
+    Json jobs = Json::array();
+    for (const auto &j : g_agent.jobs) {
+        Json e = Json::object();
+        e.set("id", Json::of(j->id));
+        e.set("priority", Json::of(j->priority));
+        Json argv = Json::array();
+        for (const auto &a : j->argv) argv.items.push_back(Json::of(a));
+        e.set("argv", argv);
+        e.set("started", Json::of(j->started));
+        jobs.items.push_back(e);
+    }
+    Json doc = Json::object();
+    doc.set("next_id", Json::of(g_agent.next_id));
+    doc.set("jobs", jobs);
+    if (!write_file_atomic(g_agent.queue_file, json_dump(doc), S_IRUSR | S_IWUSR))
+        std::cerr << "Cannot write " << g_agent.queue_file << ": " << strerror(errno) << std::endl;
+}
+
+static void agent_load() {
+    Json doc = load_json_file(g_agent.queue_file);
+    const Json* next = doc.get("next_id");
+    if (next) g_agent.next_id = std::max(1ll, next->as_int());
+    const Json* jobs = doc.get("jobs");
+    if (!jobs) return;
+    for (const Json &e : jobs->items) {
+        auto j = std::make_shared<AgentJob>();
+        const Json* id = e.get("id");
+        const Json* priority = e.get("priority");
+        const Json* argv = e.get("argv");
+        if (!id || !argv || argv->items.empty()) continue;
+        j->id = id->as_int();
+        j->priority = priority ? priority->as_int() : 0;
+        for (const Json &a : argv->items) j->argv.push_back(a.text);
+        // a queue written before jobs were held to the saved login
+        std::vector<std::string> args(j->argv.begin() + 1, j->argv.end());
+        std::vector<size_t> operands = job_operands(args);
+        if (operands.size() > 1) j->argv.erase(j->argv.begin() + 1 + operands[1], j->argv.end());
+        j->started = e.flag_of("started");
+        g_agent.next_id = std::max(g_agent.next_id, j->id + 1);
+        g_agent.jobs.push_back(j);
+    }
+}
+
+// the job to run next: highest priority, then first to arrive; caller holds g_agent.lock
+static std::shared_ptr<AgentJob> agent_next_locked() {
+    std::shared_ptr<AgentJob> best;
+    for (const auto &j : g_agent.jobs)
+        if (!j->running && (!best || j->priority > best->priority)) best = j;
+    return best;
+}
+
+static void agent_run(const std::shared_ptr<AgentJob> &job) {
+    std::vector<std::string> args(job->argv.begin() + 1, job->argv.end());
+    // an interrupted single-file upload picks up from its journal
+    if (job->started && job->argv[0] == "upload" && std::find(args.begin(), args.end(), "-r") == args.end() &&
+        std::find(args.begin(), args.end(), "--cdc") == args.end() &&
+        std::find(args.begin(), args.end(), "--update") == args.end() &&
+        std::find(args.begin(), args.end(), "--resume") == args.end())
+        args.push_back("--resume");
+    int status;
+    {
+        AgentJobOutput out(job->client);
+        g_job_output = &out;
+        status = job->argv[0] == "upload" ? upload_command(args) : download_command(args);
+        g_job_output = nullptr;
+    }
+    std::cout << "Job " << job->id << " (" << job->argv[0] << ") " << (status == 0 ? "done" : "failed") << std::endl;
+    agent_send(job->client, '=', std::to_string(status));
+    if (job->client >= 0) close(job->client);
+}
+
+static void agent_worker() {
+    while (true) {
+        std::shared_ptr<AgentJob> job;
+        {
+            std::unique_lock<std::mutex> lk(g_agent.lock);
+            g_agent.cv.wait(lk, [&] { return (job = agent_next_locked()) != nullptr; });
+            job->running = true;
+            job->started = true;
+            agent_save_locked();
         }
-    } else downloads_dir = ".";
+        agent_run(job);
+        std::lock_guard<std::mutex> lk(g_agent.lock);
+        g_agent.jobs.erase(std::find(g_agent.jobs.begin(), g_agent.jobs.end(), job));
+        agent_save_locked();
+    }
+}
 
-    std::string outpath = downloads_dir + "/" + filename;
+// reads the request line and queues or answers it; the connection either
+// goes to the queued job or is closed here
+static void agent_serve_client(int fd) {
+    std::string line;
+    char c;
+    while (line.size() < (1 << 20) && recv(fd, &c, 1, 0) == 1 && c != '\n') line += c;
+    Json req;
+    if (!json_parse(line, req) || req.type != Json::Type::Object) {
+        agent_send(fd, '2', "bad request");
+        agent_send(fd, '=', "1");
+        close(fd);
+        return;
+    }
+    std::string op = req.str("op");
+    if (op == "list") {
+        std::lock_guard<std::mutex> lk(g_agent.lock);
+        for (const auto &j : g_agent.jobs) {
+            std::string text = std::to_string(j->id) + " " + (j->running ? "running" : "queued") + " " +
+                               std::to_string(j->priority);
+            for (const auto &a : j->argv) text += " " + a;
+            agent_send(fd, '1', text);
+        }
+        agent_send(fd, '=', "0");
+        close(fd);
+        return;
+    }
 
-    FILE* fout = fopen(outpath.c_str(), "wb");
-    if (!fout) {
-        curl_easy_cleanup(curl);
-        std::cerr << "Cannot open output file: " << outpath << std::endl;
+    const Json* argv = req.get("argv");
+    std::string error;
+    if (op != "submit" || !argv || argv->items.empty()) error = "bad request";
+    else if (argv->items[0].text != "upload" && argv->items[0].text != "download")
+        error = "the agent runs only upload and download";
+    else if (req.str("server") != g_base_url)
+        error = "the agent serves " + g_base_url + "; restart it to use " + req.str("server");
+    else {
+        std::vector<std::string> args;
+        for (size_t i = 1; i < argv->items.size(); ++i) args.push_back(argv->items[i].text);
+        if (job_operands(args).size() != 1) error = "the agent runs jobs only as the saved login";
+    }
+    if (!error.empty()) {
+        agent_send(fd, '2', error);
+        agent_send(fd, '=', "1");
+        close(fd);
+        return;
+    }
+    auto job = std::make_shared<AgentJob>();
+    for (const Json &a : argv->items) job->argv.push_back(a.text);
+    const Json* priority = req.get("priority");
+    job->priority = priority ? priority->as_int() : 0;
+    bool detach = req.flag_of("detach");
+    std::lock_guard<std::mutex> lk(g_agent.lock);
+    job->id = g_agent.next_id++;
+    job->client = detach ? -1 : fd;
+    g_agent.jobs.push_back(job);
+    agent_save_locked();
+    agent_send(fd, '#', "queued as job " + std::to_string(job->id));
+    if (detach) {
+        agent_send(fd, '=', "0");
+        close(fd);
+    }
+    g_agent.cv.notify_one();
+}
+
+static volatile sig_atomic_t g_agent_stop = 0;
+
+static void agent_stop(int) {
+    g_agent_stop = 1;
+}
+
+// `netserve agent`: serves the socket until SIGINT or SIGTERM. Jobs still
+// queued or running then are in queue.json and run on the next start.
+static bool run_agent(int workers) {
+    std::string dir = agent_dir();
+    if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+        std::cerr << "Cannot create " << dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    sockaddr_un addr;
+    if (!agent_address(addr)) {
+        std::cerr << "Socket path under " << dir << " is too long" << std::endl;
+        return false;
+    }
+    int probe = agent_connect();
+    if (probe >= 0) {
+        close(probe);
+        std::cerr << "An agent is already running on " << addr.sun_path << std::endl;
+        return false;
+    }
+    unlink(addr.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(0077);
+    bool bound = listener >= 0 && bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listener, 64) != 0) {
+        std::cerr << "Cannot listen on " << addr.sun_path << ": " << strerror(errno) << std::endl;
+        if (listener >= 0) close(listener);
         return false;
     }
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
-    curl_easy_setopt(curl, CURLOPT_USERNAME, username.c_str());
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fout);
+    // output from job threads goes to their clients; the agent's own lines pass through
+    static RoutedBuf out_buf(std::cout.rdbuf(), 1), err_buf(std::cerr.rdbuf(), 2);
+    std::cout.rdbuf(&out_buf);
+    std::cerr.rdbuf(&err_buf);
+    g_show_progress = false;
+    g_metrics.keep = false;
 
-    CURLcode res = curl_easy_perform(curl);
-    fclose(fout);
+    g_agent.queue_file = dir + "/queue.json";
+    {
+        std::lock_guard<std::mutex> lk(g_agent.lock);
+        agent_load();
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, agent_stop);
+    signal(SIGTERM, agent_stop);
+    std::cout << "Agent on " << addr.sun_path << " for " << g_base_url << " with " << workers << " worker"
+              << (workers == 1 ? "" : "s") << ", " << g_agent.jobs.size() << " queued jobs" << std::endl;
+    for (int i = 0; i < workers; ++i) std::thread(agent_worker).detach();
 
-    bool ok = (res == CURLE_OK);
-    if (!ok) {
-        std::cerr << "download_file failed: " << curl_easy_strerror(res) << std::endl;
-        unlink(outpath.c_str());
-    } else {
-        std::cout << "Downloaded to " << outpath << std::endl;
+    while (!g_agent_stop) {
+        struct pollfd p = {listener, POLLIN, 0};
+        if (poll(&p, 1, 500) <= 0) continue;
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        std::thread(agent_serve_client, fd).detach();
+    }
+    close(listener);
+    unlink(addr.sun_path);
+    std::lock_guard<std::mutex> lk(g_agent.lock);
+    std::cout << "Agent stopping; " << g_agent.jobs.size() << " jobs left for the next start" << std::endl;
+    // running transfers are abandoned mid-flight; the queue file already has them
+    _exit(0);
+}
+
+// Hands `upload` or `download` to a running agent. Returns false if there
+// is none, or if the job names its own credentials or there is no saved
+// login for it to run as, so the caller runs the command itself; otherwise
+// `status` is the job's exit status (or 0 once queued with --detach).
+static bool agent_submit(const std::string &cmd, std::vector<std::string> args, long long priority, bool detach,
+                         int &status) {
+    std::string user, pass;
+    if (job_operands(args).size() != 1 || !load_credentials(user, pass)) return false;
+    // paths are the client's; the agent has a different working directory
+    char cwd[PATH_MAX];
+    std::string base = getcwd(cwd, sizeof(cwd)) ? std::string(cwd) + "/" : "";
+    auto absolute = [&](std::string &p) { if (!p.empty() && p[0] != '/' && p != "-") p = base + p; };
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string &a = args[i];
+        if (a == "--jobs" || a == "--name" || a == "--update" || a == "--cache-size") { ++i; continue; }
+        if (a == "-o" && i + 1 < args.size()) { absolute(args[++i]); continue; }
+        if (cmd == "upload" && !a.empty() && a[0] != '-') {
+            absolute(args[i]);
+            break;
+        }
+    }
+
+    int fd = agent_connect();
+    if (fd < 0) return false;
+    std::string req = "{\"op\":\"submit\",\"server\":" + json_quote(g_base_url) + ",\"priority\":" +
+                      std::to_string(priority) + ",\"detach\":" + (detach ? "true" : "false") + ",\"argv\":[" +
+                      json_quote(cmd);
+    for (const auto &a : args) req += "," + json_quote(a);
+    req += "]}\n";
+    status = 1;
+    if (!send_all(fd, req)) {
+        close(fd);
+        return false;
+    }
+    std::string pending;
+    char buf[4096];
+    bool finished = false;
+    while (!finished) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.append(buf, (size_t)n);
+        for (size_t nl; !finished && (nl = pending.find('\n')) != std::string::npos; pending.erase(0, nl + 1)) {
+            std::string text = nl >= 2 ? pending.substr(2, nl - 2) : "";
+            switch (pending[0]) {
+            case '1': std::cout << text << "\n"; break;
+            case '2': std::cerr << text << "\n"; break;
+            case '#': if (detach) std::cerr << "Agent: " << text << "\n"; break;
+            case '=': status = atoi(text.c_str()); finished = true; break;
+            }
+        }
     }
+    close(fd);
+    std::cout << std::flush;
+    if (!finished) std::cerr << "Lost the connection to the agent; the job keeps running there\n";
+    return true;
+}
 
-    curl_easy_cleanup(curl);
+// `netserve jobs`: the agent's queue, one job per line
+static bool agent_list() {
+    int fd = agent_connect();
+    if (fd < 0) {
+        std::cerr << "No agent is running\n";
+        return false;
+    }
+    bool ok = send_all(fd, "{\"op\":\"list\"}\n");
+    std::string reply;
+    char buf[4096];
+    for (ssize_t n; ok && (n = recv(fd, buf, sizeof(buf), 0)) > 0;) reply.append(buf, (size_t)n);
+    close(fd);
+    std::istringstream lines(reply);
+    std::cout << "ID      State    Priority  Command\n";
+    for (std::string line; std::getline(lines, line);) {
+        if (line.size() < 2 || line[0] != '1') continue;
+        std::istringstream f(line.substr(2));
+        std::string id, state, priority, rest;
+        f >> id >> state >> priority;
+        std::getline(f, rest);
+        std::cout << std::left << std::setw(8) << id << std::setw(9) << state << std::setw(9) << priority << rest << "\n";
+    }
     return ok;
 }
 
-// ---------------- CLI ----------------
 int main(int argc, char** argv) {
+    // --metrics-json FILE applies to every command
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) != "--metrics-json") continue;
+        g_metrics.json_path = argv[i + 1];
+        std::copy(argv + i + 2, argv + argc + 1, argv + i);
+        argc -= 2;
+        break;
+    }
+
     if (argc < 2) {
         std::cout << "Usage:\n"
                   << "  server [url]                               # show or set server URL           \n"
                   << "  create <username> <password>               # creates an account on the server \n"
-                  << "  login <username> <password>                # save credentials locally         \n"
+                  << "  login <username> <password>                # log in and save a session token  \n"
                   << "  logout                                     # clear saved credentials          \n"
                   << "  user                                       # show saved username              \n"
-                  << "  upload <filepath>                          # uploads the specified file       \n"
-                  << "  list                                       # lists the files owned by user    \n"
-                  << "  share <file_id_or_filename> <user>         # shares ownership of the file     \n"
-                  << "  delete <file_id_or_filename>               # deletes the specified file       \n"
-                  << "  download <filename>                        # downloads the specified file     \n";
+                  << "  upload <filepath> [--jobs N] [--resume]    # uploads the specified file       \n"
+                  << "         [--cdc]                             # dedupe content-defined chunks    \n"
+                  << "         [--compress]                        # deflate chunks that shrink       \n"
+                  << "         [--name NAME]                       # store under another name         \n"
+                  << "         [--update FILE]                     # replace FILE, sending the changes\n"
+                  << "  upload - --name NAME [--jobs N]            # uploads standard input           \n"
+                  << "  upload -r <dir> [--jobs N] [--compress]    # uploads every file under dir     \n"
+                  << "  sync <dir> [--jobs N] [--compress]         # uploads new and changed files    \n"
+                  << "  list [--prefix P]                          # lists the files owned by user    \n"
+                  << "  share <file>... --to <user>                # shares the files with user       \n"
+                  << "  delete <file>...                           # deletes the specified files      \n"
+                  << "  download <filename> [--jobs N]             # downloads the specified file     \n"
+                  << "           [-o FILE | -o -]                  # save to FILE or write to stdout  \n"
+                  << "           [--no-cache | --cache-size SIZE]  # skip or bound the download cache \n"
+                  << "  cat <filename> [--offset N] [--length N]   # prints bytes of a stored file    \n"
+                  << "  head|tail <filename> [-n LINES | -c BYTES] # prints its first or last lines   \n"
+                  << "  upload/download ... [--priority P]         # queue on the agent, P first      \n"
+                  << "                  [--detach | --no-agent]    # return once queued, or run here  \n"
+                  << "  agent [--workers N]                        # run queued transfers (default 2) \n"
+                  << "  jobs                                       # list the agent's queue           \n"
+                  << "  serve [--host H] [--port P] [--dir D]      # run the native server            \n"
+                  << "        [--loops N]                          # event loops (default: cores)     \n"
+                  << "  bench [--sizes 64M] [--jobs 1,4] ...       # benchmark a local server.py      \n"
+                  << "  any command [--metrics-json FILE]          # write request timings as JSON    \n";
         return 1;
     }
 
     std::string configured_url;
     if (load_server_url(configured_url)) g_base_url = configured_url;
 
+    std::string cmd = argv[1];
+    g_metrics.command = cmd;
+    if (cmd == "upload" || cmd == "download") {
+        // a running agent takes the job unless it is told not to or the job
+        // needs this process's stdin, stdout or metrics
+        std::vector<std::string> args(argv + 2, argv + argc);
+        bool local = take_flag(args, "--no-agent");
+        bool detach = take_flag(args, "--detach");
+        std::string priority_arg;
+        long long priority = 0;
+        if (take_option(args, "--priority", priority_arg)) {
+            char* end = nullptr;
+            priority = strtoll(priority_arg.c_str(), &end, 10);
+            if (priority_arg.empty() || *end != '\0') {
+                std::cerr << "--priority takes an integer; higher runs first\n";
+                return 1;
+            }
+        }
+        bool stdio = std::find(args.begin(), args.end(), "-") != args.end();
+        int status = 1;
+        if (!local && !stdio && g_metrics.json_path.empty() && agent_submit(cmd, args, priority, detach, status))
+            return status;
+        if (detach) {
+            std::cerr << "--detach needs a running agent and a saved login; start one with `netserve agent` and run the "
+                         "job without a username and password\n";
+            return 1;
+        }
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        session_begin();
+        status = cmd == "upload" ? upload_command(args) : download_command(args);
+        client_cleanup();
+        return status;
+    }
+
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    session_begin();
 
-    std::string cmd = argv[1];
     if (cmd == "server") {
         if (argc == 2) {
             std::cout << "Current server: " << g_base_url << "\n";
-            curl_global_cleanup();
+            client_cleanup();
             return 0;
         } else if (argc == 3) {
             std::string url = argv[2];
             if (!save_server_url(url)) {
                 std::cerr << "Failed to save server URL\n";
-                curl_global_cleanup();
+                client_cleanup();
                 return 1;
             }
             g_base_url = url;
             std::cout << "Server set to: " << g_base_url << "\n";
-            curl_global_cleanup();
+            client_cleanup();
             return 0;
         } else {
             std::cerr << "serve takes zero or one argument: serve [url]\n";
-            curl_global_cleanup();
+            client_cleanup();
             return 1;
         }
     } else if (cmd == "create") {
-        if (argc != 4) { std::cerr << "create_user requires username and password\n"; curl_global_cleanup(); return 1; }
+        if (argc != 4) { std::cerr << "create_user requires username and password\n"; client_cleanup(); return 1; }
         bool ok = create_user(argv[2], argv[3]);
-        curl_global_cleanup();
+        client_cleanup();
         return ok ? 0 : 1;
     } else if (cmd == "login") {
-        if (argc != 4) { std::cerr << "login requires username and password\n"; curl_global_cleanup(); return 1; }
-        bool ok = save_credentials(argv[2], argv[3]);
-        std::cout << (ok ? "Credentials saved\n" : "Failed to save credentials\n");
-        curl_global_cleanup();
+        if (argc != 4) { std::cerr << "login requires username and password\n"; client_cleanup(); return 1; }
+        std::string token;
+        long long expires = 0;
+        long status = 0;
+        bool ok;
+        if (create_session(argv[2], argv[3], token, expires, status)) {
+            ok = save_credentials(argv[2], "", token);
+            if (ok) std::cout << "Logged in; session expires " << format_time(expires) << "\n";
+        } else if (status == 404) {
+            // server predates sessions: keep the password as before
+            ok = save_credentials(argv[2], argv[3]);
+            if (ok) std::cout << "Server has no sessions; credentials saved\n";
+        } else {
+            client_cleanup();
+            return 1;
+        }
+        if (!ok) std::cout << "Failed to save credentials\n";
+        client_cleanup();
         return ok ? 0 : 1;
     } else if (cmd == "logout") {
         bool ok = clear_credentials();
         std::cout << (ok ? "Logged out\n" : "No credentials found or failed to delete\n");
-        curl_global_cleanup();
+        client_cleanup();
         return ok ? 0 : 1;
     } else if (cmd == "user") {
         std::string user, pass;
         if (load_credentials(user, pass)) {
             std::cout << "Saved username: " << user << "\n";
-            curl_global_cleanup();
+            if (!g_session_token.empty()) {
+                size_t dot = g_session_token.find('.');
+                long long expires = dot == std::string::npos ? 0 : atoll(g_session_token.c_str() + dot + 1);
+                std::cout << "Session " << (expires < (long long)time(nullptr) ? "expired " : "expires ")
+                          << format_time(expires) << "\n";
+            }
+            client_cleanup();
             return 0;
         } else {
             std::cout << "No saved credentials\n";
-            curl_global_cleanup();
+            client_cleanup();
             return 1;
         }
-    } else if (cmd == "upload") {
-        std::string filepath, user, pass;
-        if (argc == 3) {
-            filepath = argv[2];
-            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; curl_global_cleanup(); return 1; }
-        } else if (argc == 5) {
-            filepath = argv[2];
-            user = argv[3]; pass = argv[4];
+    } else if (cmd == "sync") {
+        std::vector<std::string> args(argv + 2, argv + argc);
+        std::string dir, user, pass, jobs_arg;
+        int jobs = 1;
+        if (take_option(args, "--jobs", jobs_arg) && !parse_jobs(jobs_arg, jobs)) { client_cleanup(); return 1; }
+        bool compress = take_flag(args, "--compress");
+        if (args.size() == 1) {
+            dir = args[0];
+            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; client_cleanup(); return 1; }
+        } else if (args.size() == 3) {
+            dir = args[0];
+            user = args[1]; pass = args[2];
         } else {
-            std::cerr << "upload requires filepath [username password]\n";
-            curl_global_cleanup();
+            std::cerr << "sync requires <dir> [--jobs N] [--compress] [username password]\n";
+            client_cleanup();
             return 1;
         }
-        bool ok = upload_file(filepath, user, pass);
-        curl_global_cleanup();
+        bool ok = sync_tree(dir, user, pass, jobs, compress);
+        client_cleanup();
         return ok ? 0 : 1;
     } else if (cmd == "list") {
-        std::string user, pass;
-        if (argc == 2) {
-            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; curl_global_cleanup(); return 1; }
-        } else if (argc == 4) {
-            user = argv[2]; pass = argv[3];
+        std::vector<std::string> args(argv + 2, argv + argc);
+        std::string user, pass, prefix;
+        take_option(args, "--prefix", prefix);
+        if (args.empty()) {
+            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; client_cleanup(); return 1; }
+        } else if (args.size() == 2) {
+            user = args[0]; pass = args[1];
         } else {
-            std::cerr << "list requires [username password]\n";
-            curl_global_cleanup();
+            std::cerr << "list requires [--prefix P] [username password]\n";
+            client_cleanup();
             return 1;
         }
-        bool ok = list_files(user, pass);
-        curl_global_cleanup();
+        bool ok = list_files(user, pass, prefix);
+        client_cleanup();
         return ok ? 0 : 1;
     } else if (cmd == "share") {
-        if (!(argc == 4 || argc == 6)) { std::cerr << "Usage: share <file_id_or_filename> <target_user> [username password]\n"; curl_global_cleanup(); return 1; }
-        std::string target = argv[2], share_with = argv[3], user, pass;
-        if (argc == 4) {
-            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; curl_global_cleanup(); return 1; }
-        } else { user = argv[4]; pass = argv[5]; }
-        bool ok = client_share(target, share_with, user, pass);
-        curl_global_cleanup();
+        std::vector<std::string> args(argv + 2, argv + argc);
+        std::string share_with, user, pass;
+        if (take_option(args, "--to", share_with)) {
+            if (args.empty()) { std::cerr << "Usage: share <file>... --to <target_user>\n"; client_cleanup(); return 1; }
+        } else if (args.size() == 2 || args.size() == 4) {
+            share_with = args[1];
+            if (args.size() == 4) { user = args[2]; pass = args[3]; }
+            args.resize(1);
+        } else {
+            std::cerr << "Usage: share <file>... --to <target_user>\n"
+                      << "       share <file_id_or_filename> <target_user> [username password]\n";
+            client_cleanup();
+            return 1;
+        }
+        if (user.empty() && !load_credentials(user, pass)) {
+            std::cerr << "No saved credentials; provide username and password\n";
+            client_cleanup();
+            return 1;
+        }
+        bool ok = client_share(args, share_with, user, pass);
+        client_cleanup();
         return ok ? 0 : 1;
     } else if (cmd == "delete") {
-        if (!(argc == 3 || argc == 5)) { std::cerr << "Usage: delete <file_id_or_filename> [username password]\n"; curl_global_cleanup(); return 1; }
-        std::string id = argv[2], user, pass;
-        if (argc == 3) {
-            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; curl_global_cleanup(); return 1; }
-        } else { user = argv[3]; pass = argv[4]; }
-        bool ok = client_delete(id, user, pass);
-        curl_global_cleanup();
+        // three arguments are the single-file form with credentials
+        std::vector<std::string> args(argv + 2, argv + argc), targets = args;
+        std::string user, pass;
+        if (args.empty()) {
+            std::cerr << "Usage: delete <file>...\n       delete <file_id_or_filename> <username> <password>\n";
+            client_cleanup();
+            return 1;
+        }
+        if (args.size() == 3) {
+            targets.resize(1);
+            user = args[1]; pass = args[2];
+        } else if (!load_credentials(user, pass)) {
+            std::cerr << "No saved credentials; provide username and password\n";
+            client_cleanup();
+            return 1;
+        }
+        bool ok = client_delete(targets, user, pass);
+        client_cleanup();
         return ok ? 0 : 1;
-    } else if (cmd == "download") {
-        std::string filename, user, pass;
-        if (argc == 3) {
-            filename = argv[2];
-            if (!load_credentials(user, pass)) { std::cerr << "No saved credentials; provide username and password\n"; curl_global_cleanup(); return 1; }
-        } else if (argc == 5) {
-            filename = argv[2]; user = argv[3]; pass = argv[4];
-        } else {
-            std::cerr << "download requires filename [username password]\n";
-            curl_global_cleanup();
+    } else if (cmd == "cat" || cmd == "head" || cmd == "tail") {
+        int status = read_command(cmd, std::vector<std::string>(argv + 2, argv + argc));
+        client_cleanup();
+        return status;
+    } else if (cmd == "agent") {
+        std::vector<std::string> args(argv + 2, argv + argc);
+        std::string workers_arg;
+        long workers = AGENT_DEFAULT_WORKERS;
+        if (take_option(args, "--workers", workers_arg)) {
+            char* end = nullptr;
+            workers = strtol(workers_arg.c_str(), &end, 10);
+            if (workers_arg.empty() || *end != '\0' || workers < 1 || workers > 64) args.push_back(workers_arg);
+        }
+        if (!args.empty()) {
+            std::cerr << "agent takes [--workers N] with N between 1 and 64\n";
+            client_cleanup();
+            return 1;
+        }
+        bool ok = run_agent((int)workers);
+        client_cleanup();
+        return ok ? 0 : 1;
+    } else if (cmd == "jobs") {
+        bool ok = agent_list();
+        client_cleanup();
+        return ok ? 0 : 1;
+    } else if (cmd == "serve") {
+        std::vector<std::string> args(argv + 2, argv + argc);
+        std::string host = "0.0.0.0", dir = "uploads", v;
+        long long port = 5000, loops = std::max(1u, std::thread::hardware_concurrency());
+        bool ok = true;
+        take_option(args, "--host", host);
+        take_option(args, "--dir", dir);
+        if (take_option(args, "--port", v)) ok = parse_long(v, port) && port > 0 && port < 65536;
+        if (take_option(args, "--loops", v)) ok = ok && parse_long(v, loops) && loops > 0 && loops <= 1024;
+        if (!ok || !args.empty()) {
+            std::cerr << "serve takes [--host 0.0.0.0] [--port 5000] [--dir uploads] [--loops N]\n";
+            client_cleanup();
             return 1;
         }
-        bool ok = download_file(filename, user, pass);
-        curl_global_cleanup();
+        ok = serve(host, (int)port, dir, (unsigned)loops);
+        client_cleanup();
+        return ok ? 0 : 1;
+    } else if (cmd == "bench") {
+        std::vector<std::string> args(argv + 2, argv + argc);
+        BenchOptions opt;
+        std::string v, out_path;
+        auto sizes = [](const std::string &s, std::vector<long> &out) { return parse_list<long>(s, out, parse_size); };
+        auto ints = [](const std::string &s, std::vector<int> &out) {
+            return parse_list<int>(s, out, [](const std::string &item, int &n) {
+                char* end = nullptr;
+                n = (int)strtol(item.c_str(), &end, 10);
+                return end != item.c_str() && *end == '\0' && n > 0;
+            });
+        };
+        bool ok = true;
+        take_option(args, "--server", opt.server_py);
+        take_option(args, "--python", opt.python);
+        take_option(args, "--out", out_path);
+        if (take_option(args, "--sizes", v)) ok = ok && sizes(v, opt.sizes);
+        if (take_option(args, "--chunk-sizes", v)) ok = ok && sizes(v, opt.chunk_sizes);
+        if (take_option(args, "--jobs", v)) ok = ok && ints(v, opt.jobs);
+        if (take_option(args, "--files", v)) ok = ok && ints(v, opt.file_counts);
+        if (take_option(args, "--clients", v)) ok = ok && ints(v, opt.clients);
+        if (take_option(args, "--entropy", v)) {
+            ok = ok && parse_list<double>(v, opt.entropies, [](const std::string &item, double &e) {
+                char* end = nullptr;
+                e = strtod(item.c_str(), &end);
+                return end != item.c_str() && *end == '\0' && e >= 0 && e <= 1;
+            });
+        }
+        if (take_option(args, "--file-size", v)) ok = ok && parse_size(v, opt.small_size);
+        if (take_option(args, "--client-files", v)) {
+            std::vector<int> n;
+            ok = ok && ints(v, n) && n.size() == 1;
+            if (ok) opt.client_files = n[0];
+        }
+        opt.compress = take_flag(args, "--compress");
+        opt.native = take_flag(args, "--native");
+        if (!ok || !args.empty() || opt.jobs.empty()) {
+            std::cerr << "bench takes [--server server.py] [--python python3] [--native] [--sizes 64M,...] [--entropy 1.0,...]\n"
+                      << "            [--chunk-sizes 4M,16M,64M] [--jobs 1,4] [--files 1000,...] [--file-size 4K]\n"
+                      << "            [--clients 8,...] [--client-files 20] [--compress] [--out FILE]\n"
+                      << "lists are comma-separated; \"none\" skips that part of the sweep\n";
+            client_cleanup();
+            return 1;
+        }
+        if (opt.server_py.empty()) {
+            // ./server.py, else the one next to this executable
+            opt.server_py = "server.py";
+            char exe[4096];
+            ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+            struct stat st;
+            if (stat(opt.server_py.c_str(), &st) != 0 && n > 0) {
+                std::string self(exe, (size_t)n);
+                opt.server_py = self.substr(0, self.find_last_of('/') + 1) + "server.py";
+            }
+        }
+        std::ofstream file;
+        if (!out_path.empty()) {
+            file.open(out_path, std::ios::trunc);
+            if (!file) { std::cerr << "Cannot write " << out_path << "\n"; client_cleanup(); return 1; }
+        }
+        ok = run_bench(opt, out_path.empty() ? std::cout : file);
+        client_cleanup();
         return ok ? 0 : 1;
     } else {
         std::cerr << "Unknown command\n";
-        curl_global_cleanup();
+        client_cleanup();
         return 1;
     }
 }
@@ -1,5 +1,5 @@
 # server.py  (full server file with delete endpoint added)
-from flask import Flask, jsonify, request, send_from_directory, g
+from flask import Flask, Response, jsonify, request, send_from_directory, stream_with_context, g
 from werkzeug.utils import secure_filename
 from werkzeug.security import generate_password_hash, check_password_hash
 import os
@@ -8,19 +8,46 @@ import uuid
 import threading
 import json
 import base64
+import hashlib
+import hmac
+import time
+import re
+import zlib
+import bisect
+import struct
+import shutil
+import argparse
 
 app = Flask(__name__)
 
 # configuration
-CHUNK_SIZE = 90 * 1024 * 1024  # 90 MB
+CHUNK_SIZE = 90 * 1024 * 1024  # 90 MB, for clients that do not pick a size
+MIN_CHUNK_SIZE = 1024 * 1024
+MAX_CHUNK_SIZE = 512 * 1024 * 1024
+# no upload is written past this offset, well inside the filesystems' limits
+MAX_UPLOAD_SIZE = 1 << 40
 BASE_UPLOAD_DIR = os.path.join(os.getcwd(), "uploads")
 INCOMPLETE_DIR = os.path.join(BASE_UPLOAD_DIR, "incomplete")
 COMPLETE_DIR = os.path.join(BASE_UPLOAD_DIR, "complete")
 USERS_FILE = os.path.join(BASE_UPLOAD_DIR, "users.json")
 METADATA_FILE = os.path.join(BASE_UPLOAD_DIR, "metadata.json")
+# deduplicated chunk store for content-defined uploads: chunks/<aa>/<sha256>,
+# files made of them are recorded as manifests/<file_id>.json
+CHUNK_STORE_DIR = os.path.join(BASE_UPLOAD_DIR, "chunks")
+MANIFEST_DIR = os.path.join(BASE_UPLOAD_DIR, "manifests")
+CHUNK_REFS_FILE = os.path.join(BASE_UPLOAD_DIR, "chunk_refs.json")
+MAX_STORE_CHUNK = 16 * 1024 * 1024  # client cuts at most 8 MB
+MAX_QUERY_HASHES = 10000
+MAX_BATCH_FILES = 5000
+MAX_LIST_PAGE = 10000
+# block sizes a client may ask signatures for when it updates a file with a delta
+DELTA_MIN_BLOCK = 1024
+DELTA_MAX_BLOCK = 8 * 1024 * 1024
 
 os.makedirs(INCOMPLETE_DIR, exist_ok=True)
 os.makedirs(COMPLETE_DIR, exist_ok=True)
+os.makedirs(CHUNK_STORE_DIR, exist_ok=True)
+os.makedirs(MANIFEST_DIR, exist_ok=True)
 
 # persistent storage helpers (very simple file-backed JSON)
 _storage_lock = threading.Lock()
@@ -40,21 +67,372 @@ def _save_json(path, data):
         json.dump(data, f)
     os.replace(tmp, path)
 
+# users.json as last read, with the (inode, mtime, size) it had; an edit made
+# behind the server's back is picked up on the next request
+_users_cache = (None, {})
+
+def _cached_users():
+    global _users_cache
+    try:
+        st = os.stat(USERS_FILE)
+        stamp = (st.st_ino, st.st_mtime_ns, st.st_size)
+    except OSError:
+        stamp = None
+    if stamp is None or stamp != _users_cache[0]:
+        _users_cache = (stamp, _load_json(USERS_FILE))
+    return _users_cache[1]
+
 def load_users():
     with _storage_lock:
-        return _load_json(USERS_FILE)
+        return dict(_cached_users())
 
 def save_users(users):
     with _storage_lock:
         _save_json(USERS_FILE, users)
 
-def load_metadata():
+_users_update_lock = threading.Lock()
+
+# the stored record for username, or None; read-only
+def get_user(username):
     with _storage_lock:
-        return _load_json(METADATA_FILE)
+        return _cached_users().get(username)
+
+# File metadata lives in memory, indexed by file_id, owner and final
+# filename. Each change is appended to METADATA_LOG as one JSON line,
+# [file_id, entry] or [file_id, null] for a removal, so a request costs one
+# short write instead of a rewrite of every entry. metadata.json is the
+# snapshot the log applies to; compaction writes a new snapshot and starts an
+# empty log. Entries are replaced, never changed in place, so callers may keep
+# the dicts they are handed.
+METADATA_LOG = os.path.join(BASE_UPLOAD_DIR, "metadata.log")
+METADATA_COMPACT_MIN = 10000  # log lines before compaction is considered
+
+class MetadataStore:
+    def __init__(self, snapshot, log):
+        self._snapshot = snapshot
+        self._log_path = log
+        self._old_log = log + ".old"
+        self._lock = threading.Lock()
+        self._compact_lock = threading.Lock()
+        self._by_id = {}
+        self._by_owner = {}   # owner -> {file_id: None}
+        self._by_name = {}    # final filename -> {file_id: None}, oldest first
+        self._shared = {}     # user -> {file_id: None} shared with them
+        # every change bumps the generation; listing ETags are built from it
+        # and a per-process epoch, so a restart (or an edit made while the
+        # server was down) can never revalidate a stale client cache
+        self._epoch = uuid.uuid4().hex[:12]
+        self._generation = 0
+        for file_id, info in _load_json(snapshot).items():
+            self._apply(file_id, info)
+        # a log left behind by an interrupted compaction comes first
+        for path in (self._old_log, log):
+            self._replay(path)
+        self._log_lines = 0
+        self._log = None
+        # starts from a clean snapshot, so a line torn by a crash is never
+        # followed by new ones
+        self._rotate()
+        self._write_snapshot(dict(self._by_id))
+
+    def _replay(self, path):
+        if not os.path.exists(path):
+            return
+        with open(path, "r", encoding="utf-8") as f:
+            for line in f:
+                try:
+                    file_id, info = json.loads(line)
+                except (ValueError, TypeError):
+                    continue  # torn by a crash mid-append
+                self._apply(file_id, info)
+
+    @staticmethod
+    def _name_key(info):
+        return info.get("final_filename", info.get("filename"))
+
+    @staticmethod
+    def _drop(index, key, file_id):
+        ids = index.get(key)
+        if ids is not None:
+            ids.pop(file_id, None)
+            if not ids:
+                del index[key]
+
+    # drops file_id from the indexes whose key differs in new (all of them
+    # if new is None); entries that keep their key keep their position
+    def _unindex(self, file_id, old, new):
+        if new is None or new.get("owner") != old.get("owner"):
+            self._drop(self._by_owner, old.get("owner"), file_id)
+        if new is None or self._name_key(new) != self._name_key(old):
+            self._drop(self._by_name, self._name_key(old), file_id)
+        keep = new.get("shared_with", []) if new is not None else []
+        for user in old.get("shared_with", []):
+            if user not in keep:
+                self._drop(self._shared, user, file_id)
+
+    # caller holds _lock (or is the constructor)
+    def _apply(self, file_id, info):
+        old = self._by_id.get(file_id)
+        if old is not None:
+            self._unindex(file_id, old, info)
+        if info is None:
+            self._by_id.pop(file_id, None)
+            return
+        self._by_id[file_id] = info
+        self._by_owner.setdefault(info.get("owner"), {})[file_id] = None
+        self._by_name.setdefault(self._name_key(info), {})[file_id] = None
+        for user in info.get("shared_with", []):
+            self._shared.setdefault(user, {})[file_id] = None
+
+    # caller holds _lock; moves the live log aside and opens an empty one. A
+    # log still set aside means the last snapshot failed, so this one is
+    # added to it rather than replacing it
+    def _rotate(self):
+        if self._log:
+            self._log.close()
+        if os.path.exists(self._log_path):
+            if not os.path.exists(self._old_log):
+                os.replace(self._log_path, self._old_log)
+            else:
+                with open(self._log_path, "rb") as src, open(self._old_log, "ab") as dst:
+                    shutil.copyfileobj(src, dst)
+                os.remove(self._log_path)
+        self._log = open(self._log_path, "ab", buffering=0)
+        self._log_lines = 0
+
+    def _write_snapshot(self, entries):
+        _save_json(self._snapshot, entries)
+        try:
+            os.remove(self._old_log)
+        except OSError:
+            pass
+
+    # caller holds _lock; True once the log is due for compaction. The lines
+    # are synced before the changes apply, so a commit that raises OSError
+    # has changed nothing
+    def _commit_locked(self, changes):
+        data = memoryview("".join(json.dumps([file_id, info]) + "\n" for file_id, info in changes).encode("utf-8"))
+        end = os.fstat(self._log.fileno()).st_size
+        try:
+            while data:
+                data = data[self._log.write(data):]
+            os.fsync(self._log.fileno())
+        except OSError:
+            # a torn line would hide the ones appended after it from replay
+            try:
+                os.ftruncate(self._log.fileno(), end)
+            except OSError:
+                pass
+            raise
+        for file_id, info in changes:
+            self._apply(file_id, info)
+        self._log_lines += len(changes)
+        self._generation += 1
+        return self._log_lines >= max(METADATA_COMPACT_MIN, 2 * len(self._by_id))
+
+    def _commit(self, changes):
+        with self._lock:
+            due = self._commit_locked(changes)
+        if due:
+            self.compact()
+
+    # writes a fresh snapshot; writers only wait for the log swap and a
+    # shallow copy, not for the snapshot itself
+    def compact(self):
+        if not self._compact_lock.acquire(blocking=False):
+            return  # another thread is at it
+        try:
+            with self._lock:
+                self._rotate()
+                entries = dict(self._by_id)
+            try:
+                self._write_snapshot(entries)
+            except OSError:
+                pass  # the set-aside log stays and the next compaction retries
+        finally:
+            self._compact_lock.release()
+
+    def get(self, file_id):
+        with self._lock:
+            return self._by_id.get(file_id)
+
+    def put(self, file_id, info):
+        self._commit([(file_id, info)])
+
+    def put_many(self, entries):
+        self._commit(list(entries))
+
+    # replaces the entry with a copy that has fields changed; returns the new
+    # entry, or None if there is no such file_id
+    def update(self, file_id, **fields):
+        with self._lock:
+            info = self._by_id.get(file_id)
+            if info is None:
+                return None
+            info = dict(info, **fields)
+            due = self._commit_locked([(file_id, info)])
+        if due:
+            self.compact()
+        return info
+
+    # update() for many entries at once; missing file_ids are skipped
+    def update_many(self, updates):
+        with self._lock:
+            changes = [(file_id, dict(self._by_id[file_id], **fields))
+                       for file_id, fields in updates if file_id in self._by_id]
+            due = self._commit_locked(changes) if changes else False
+        if due:
+            self.compact()
+
+    def remove(self, file_id):
+        self._commit([(file_id, None)])
+
+    def remove_many(self, file_ids):
+        self._commit([(file_id, None) for file_id in file_ids])
 
-def save_metadata(meta):
+    # the entry that name resolves to, as (file_id, entry): the newest
+    # assembled one, which is the current owner of the path, since each
+    # upload under a name takes the path over from the ones before it
+    def find_by_name(self, name):
+        with self._lock:
+            for file_id in reversed(self._by_name.get(name, {})):
+                if self._by_id[file_id].get("assembled"):
+                    return file_id, self._by_id[file_id]
+        return None
+
+    # whether an entry still names a stored file at name; an upload under a
+    # name takes over its path, so removing an older entry for that name must
+    # leave the file to the newer one. Callers remove their entries first.
+    def path_in_use(self, name):
+        with self._lock:
+            return any(not self._by_id[file_id].get("manifest") for file_id in self._by_name.get(name, ()))
+
+    # (file_id, entry) pairs owned by user, plus those shared with them
+    def visible_to(self, user, shared=False):
+        with self._lock:
+            ids = dict(self._by_owner.get(user, {}))
+            if shared:
+                ids.update(self._shared.get(user, {}))
+            return [(file_id, self._by_id[file_id]) for file_id in ids]
+
+    def etag(self):
+        with self._lock:
+            return f'"{self._epoch}-{self._generation}"'
+
+metadata = MetadataStore(METADATA_FILE, METADATA_LOG)
+
+# held around checks that must see the entry they then replace, so
+# concurrent requests do not overwrite each other's changes
+_meta_update_lock = threading.Lock()
+
+# chunk reference counts; _refs_lock covers each read-modify-write together
+# with the chunk existence checks and removals that depend on it
+_refs_lock = threading.Lock()
+
+def load_chunk_refs():
+    with _storage_lock:
+        return _load_json(CHUNK_REFS_FILE)
+
+def save_chunk_refs(refs):
     with _storage_lock:
-        _save_json(METADATA_FILE, meta)
+        _save_json(CHUNK_REFS_FILE, refs)
+
+_HASH_RE = re.compile(r"^[0-9a-f]{64}$")
+
+# copies an upload stream to path while hashing it; stops once more than
+# limit bytes arrived. With inflate the stream is zlib data and is stored,
+# hashed and limited decompressed; raises zlib.error if it is corrupt.
+# With an offset the data is written into path at that offset rather than
+# replacing the file. returns (bytes stored, sha256 hex, bytes read)
+def _save_hashed(stream, path, limit, inflate=False, offset=None):
+    hasher = hashlib.sha256()
+    inflater = zlib.decompressobj() if inflate else None
+    size = 0
+    wire = 0
+    if offset is None:
+        fout = open(path, "wb")
+    else:
+        fout = os.fdopen(os.open(path, os.O_WRONLY | os.O_CREAT, 0o644), "wb")
+        fout.seek(offset)
+    with fout:
+        while size <= limit:
+            data = stream.read(1024 * 1024)
+            if not data:
+                break
+            wire += len(data)
+            if inflater:
+                # never inflate more than one byte past the limit
+                data = inflater.decompress(data, limit + 1 - size)
+            size += len(data)
+            if size > limit:
+                break
+            hasher.update(data)
+            fout.write(data)
+    if inflater and size <= limit and not inflater.eof:
+        raise zlib.error("truncated deflate stream")
+    return size, hasher.hexdigest(), wire
+
+def _chunk_path(chunk_hash):
+    return os.path.join(CHUNK_STORE_DIR, chunk_hash[:2], chunk_hash)
+
+# who has sent a stored chunk, one user per line beside it. Dedup only counts
+# a chunk as present for a user listed there, so knowing a hash is not
+# enough to reference someone else's data.
+def _chunk_users_path(chunk_hash):
+    return _chunk_path(chunk_hash) + ".users"
+
+def _chunk_possessed(chunk_hash, user):
+    if not os.path.isfile(_chunk_path(chunk_hash)):
+        return False
+    try:
+        with open(_chunk_users_path(chunk_hash)) as f:
+            return user in f.read().splitlines()
+    except OSError:
+        return False
+
+# notes that user sent the chunk and restarts its grace period; caller holds
+# _refs_lock
+def _record_possession(chunk_hash, user):
+    os.utime(_chunk_path(chunk_hash))
+    if not _chunk_possessed(chunk_hash, user):
+        with open(_chunk_users_path(chunk_hash), "a") as f:
+            f.write(user + "\n")
+
+CHUNK_SWEEP_GRACE = 24 * 3600  # how long an unreferenced chunk waits for its manifest
+CHUNK_SWEEP_INTERVAL = 3600
+_chunks_swept = 0
+
+# Removes what no manifest will claim: chunks sent for uploads that never
+# committed once their grace period is over, and the temporaries of
+# interrupted writes. Caller holds _refs_lock.
+def _sweep_chunk_store(refs):
+    cutoff = time.time() - CHUNK_SWEEP_GRACE
+    for sub in os.listdir(CHUNK_STORE_DIR) if os.path.isdir(CHUNK_STORE_DIR) else []:
+        folder = os.path.join(CHUNK_STORE_DIR, sub)
+        if sub.startswith(".") or not os.path.isdir(folder):
+            continue
+        for name in os.listdir(folder):
+            path = os.path.join(folder, name)
+            try:
+                if name.startswith(".") or not os.path.isfile(path) or os.path.getmtime(path) >= cutoff:
+                    continue
+                chunk_hash = name[:64]
+                if name.endswith(".tmp"):
+                    os.remove(path)
+                elif name == chunk_hash and _HASH_RE.match(chunk_hash) and chunk_hash not in refs:
+                    os.remove(path)
+                    if os.path.exists(_chunk_users_path(chunk_hash)):
+                        os.remove(_chunk_users_path(chunk_hash))
+                elif name == chunk_hash + ".users" and not os.path.isfile(_chunk_path(chunk_hash)):
+                    os.remove(path)
+            except OSError:
+                pass
+
+def _manifest_path(file_id):
+    return os.path.join(MANIFEST_DIR, f"{file_id}.json")
+
+def _load_manifest(file_id):
+    return _load_json(_manifest_path(file_id)).get("chunks", [])
 
 # simple in-memory locks for per-file assembly
 _locks = {}
@@ -66,6 +444,249 @@ def _get_lock(file_id):
             _locks[file_id] = threading.Lock()
         return _locks[file_id]
 
+# An in-progress upload lives in incomplete/<file_id>/: each chunk is written
+# straight to offset index * chunk_size of `data`, which init preallocates as
+# a sparse file when the size is known. `received` is a bitmap with one bit
+# per stored chunk and `chunks.log` has one JSON line [index, info] per
+# stored chunk, so completing an upload is a rename into complete/. A bit is
+# only set once the chunk's data and log line are on disk. `netserve serve`
+# also keeps its running digest in `digest`; hashlib's cannot be saved, so
+# this server drops that file whenever it rewrites a stored chunk.
+UPLOAD_DATA = "data"
+UPLOAD_BITMAP = "received"
+UPLOAD_CHUNK_LOG = "chunks.log"
+UPLOAD_DIGEST = "digest"
+
+class _Upload:
+    def __init__(self):
+        # covers the fields up to the digest, and the folder's bitmap and log
+        self.lock = threading.Lock()
+        self.loaded = False
+        self.bitmap = bytearray()
+        self.count = 0
+        self.chunks = {}  # index -> info, as logged
+        self.writing = set()  # chunks a request is writing into the data file
+        # whole-file digest of chunks 0..hashed-1, advanced as they arrive
+        # so the last chunk does not have to wait for the whole file; goes
+        # with the upload's assembly lock
+        self.hasher = hashlib.sha256()
+        self.hashed = 0
+
+    # reads the folder; the caller holds self.lock
+    def load(self, folder):
+        self.loaded = True
+        try:
+            with open(os.path.join(folder, UPLOAD_BITMAP), "rb") as f:
+                self.bitmap = bytearray(f.read())
+        except OSError:
+            pass
+        try:
+            with open(os.path.join(folder, UPLOAD_CHUNK_LOG), "r", encoding="utf-8") as f:
+                for line in f:
+                    try:
+                        index, info = json.loads(line)
+                        self.chunks[int(index)] = info
+                    except (ValueError, TypeError):
+                        pass  # cut short by a crash; its bit was never set
+        except OSError:
+            pass
+        self.count = sum(bin(b).count("1") for b in self.bitmap)
+
+    def has(self, index):
+        return index // 8 < len(self.bitmap) and self.bitmap[index // 8] >> (index % 8) & 1
+
+    def received(self):
+        return [i for i in range(len(self.bitmap) * 8) if self.has(i)]
+
+_uploads = {}
+_uploads_lock = threading.Lock()
+
+def _upload_state(file_id, folder):
+    with _uploads_lock:
+        state = _uploads.get(file_id)
+        if state is None:
+            state = _uploads[file_id] = _Upload()
+    with state.lock:
+        if not state.loaded:
+            state.load(folder)
+    return state
+
+def _sync_file(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fdatasync(fd)
+    finally:
+        os.close(fd)
+
+# records a chunk already written to the data file; returns how many
+# distinct chunks the upload now has. The data and the log line reach the
+# disk before the bit does, so a bit that survives a crash always stands for
+# a whole chunk.
+def _mark_received(file_id, folder, index, chunk_info):
+    state = _upload_state(file_id, folder)
+    _sync_file(os.path.join(folder, UPLOAD_DATA))
+    with state.lock:
+        with open(os.path.join(folder, UPLOAD_CHUNK_LOG), "a", encoding="utf-8") as f:
+            f.write(json.dumps([index, chunk_info]) + "\n")
+            f.flush()
+            os.fdatasync(f.fileno())
+        state.chunks[index] = chunk_info
+        if not state.has(index):
+            byte = index // 8
+            if byte >= len(state.bitmap):
+                state.bitmap.extend(bytes(byte + 1 - len(state.bitmap)))
+            state.bitmap[byte] |= 1 << (index % 8)
+            fd = os.open(os.path.join(folder, UPLOAD_BITMAP), os.O_WRONLY | os.O_CREAT, 0o644)
+            try:
+                os.pwrite(fd, state.bitmap[byte:byte + 1], byte)
+            finally:
+                os.close(fd)
+            state.count += 1
+        return state.count
+
+# copies a verified chunk that was staged beside the data file into its
+# place there. The chunk stops counting as received while it is copied, and
+# the digest starts over if it covered the chunk. On success the caller holds
+# the chunk in state.writing until it is recorded again; otherwise returns
+# the reply.
+def _place_chunk(file_id, folder, state, index, offset, staged):
+    with _get_lock(file_id):
+        info = metadata.get(file_id)
+        if info is None or info.get("assembled", False):
+            return jsonify({"error": "upload already complete"}), 409
+        with state.lock:
+            if index in state.writing:
+                return jsonify({"error": f"chunk {index} is being written by another request"}), 409
+            state.writing.add(index)
+        try:
+            if state.has(index):
+                with state.lock:
+                    byte = index // 8
+                    state.bitmap[byte] &= ~(1 << (index % 8)) & 0xff
+                    state.count -= 1
+                    fd = os.open(os.path.join(folder, UPLOAD_BITMAP), os.O_WRONLY)
+                    try:
+                        os.pwrite(fd, state.bitmap[byte:byte + 1], byte)
+                        os.fdatasync(fd)
+                    finally:
+                        os.close(fd)
+            if index < state.hashed:
+                state.hasher = hashlib.sha256()
+                state.hashed = 0
+            try:
+                os.unlink(os.path.join(folder, UPLOAD_DIGEST))
+            except OSError:
+                pass
+            fd = os.open(os.path.join(folder, UPLOAD_DATA), os.O_WRONLY | os.O_CREAT, 0o644)
+            try:
+                with open(staged, "rb") as src:
+                    pos = offset
+                    while True:
+                        data = src.read(1024 * 1024)
+                        if not data:
+                            break
+                        os.pwrite(fd, data, pos)
+                        pos += len(data)
+            finally:
+                os.close(fd)
+        except BaseException:
+            with state.lock:
+                state.writing.discard(index)
+            raise
+    return None
+
+# feeds the chunks that now follow on from the hashed prefix into the
+# upload's digest, reading them back from the data file
+def _advance_digest(state, folder, chunk_size):
+    with open(os.path.join(folder, UPLOAD_DATA), "rb") as f:
+        while state.has(state.hashed):
+            f.seek(state.hashed * chunk_size)
+            left = state.chunks.get(state.hashed, {}).get("size", chunk_size)
+            while left > 0:
+                data = f.read(min(left, 4 * 1024 * 1024))
+                if not data:
+                    break
+                state.hasher.update(data)
+                left -= len(data)
+            state.hashed += 1
+
+# Session tokens: `netserve login` trades the password for one of these once,
+# so later requests are checked with an HMAC instead of the password KDF.
+# A token is <hex username>.<expiry>.<hex mac>. The MAC covers the stored
+# password hash too, so changing a password revokes the user's tokens. The
+# key is kept in the upload directory so tokens survive restarts and are
+# honored by `netserve serve` on the same directory.
+SESSION_KEY_FILE = os.path.join(BASE_UPLOAD_DIR, "session.key")
+SESSION_TTL = 24 * 3600
+
+# a fresh session key written beside SESSION_KEY_FILE and moved into place:
+# linked, so a key another server created meanwhile is kept, or renamed over
+# a damaged one
+def _new_session_key(replace):
+    key = os.urandom(32)
+    tmp_path = f"{SESSION_KEY_FILE}.{uuid.uuid4().hex}.tmp"
+    fd = os.open(tmp_path, os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0o600)
+    try:
+        with os.fdopen(fd, "w", encoding="utf-8") as f:
+            f.write(key.hex() + "\n")
+            f.flush()
+            os.fsync(f.fileno())
+        if replace:
+            os.replace(tmp_path, SESSION_KEY_FILE)
+        else:
+            os.link(tmp_path, SESSION_KEY_FILE)
+    finally:
+        if os.path.exists(tmp_path):
+            os.remove(tmp_path)
+    return key
+
+# A key shorter than 32 bytes, as a crash while it was written leaves it, is
+# replaced, which ends the sessions signed with it.
+def _load_session_key():
+    for _ in range(3):
+        try:
+            with open(SESSION_KEY_FILE, "r", encoding="utf-8") as f:
+                text = f.read().strip()
+        except FileNotFoundError:
+            try:
+                return _new_session_key(replace=False)
+            except FileExistsError:
+                continue  # another server created it first
+        try:
+            key = bytes.fromhex(text)
+        except ValueError:
+            key = b""
+        if len(key) >= 32:
+            return key
+        return _new_session_key(replace=True)
+    raise RuntimeError(f"cannot use {SESSION_KEY_FILE}")
+
+_session_key = _load_session_key()
+
+def _session_mac(user_hex, expires, password_hash):
+    msg = f"{user_hex}.{expires}.{password_hash}".encode("utf-8")
+    return hmac.new(_session_key, msg, hashlib.sha256).hexdigest()
+
+def make_session_token(username, password_hash):
+    expires = int(time.time()) + SESSION_TTL
+    user_hex = username.encode("utf-8").hex()
+    return f"{user_hex}.{expires}.{_session_mac(user_hex, expires, password_hash)}", expires
+
+# the user a token was issued to, or None if it is forged, expired or revoked
+def check_session_token(token):
+    try:
+        user_hex, expires, mac = token.split(".")
+        username = bytes.fromhex(user_hex).decode("utf-8")
+        expires = int(expires)
+    except ValueError:
+        return None
+    if expires < time.time():
+        return None
+    user = get_user(username)
+    if not user or not hmac.compare_digest(mac, _session_mac(user_hex, expires, user["password_hash"])):
+        return None
+    return username
+
 # Basic auth helper
 def _parse_basic_auth(auth_header):
     if not auth_header or not auth_header.lower().startswith("basic "):
@@ -81,13 +702,19 @@ def _parse_basic_auth(auth_header):
 def require_auth(f):
     def wrapper(*args, **kwargs):
         auth = request.headers.get("Authorization")
+        if auth and auth.lower().startswith("bearer "):
+            username = check_session_token(auth[len("bearer "):].strip())
+            if not username:
+                return jsonify({"error": "session expired or invalid; log in again"}), 401
+            g.current_user = username
+            return f(*args, **kwargs)
         username, password = _parse_basic_auth(auth)
         if not username:
             return jsonify({"error": "Authorization required (Basic)"}), 401
-        users = load_users()
-        if username not in users:
+        user = get_user(username)
+        if not user:
             return jsonify({"error": "Invalid credentials"}), 403
-        if not check_password_hash(users[username]["password_hash"], password):
+        if not check_password_hash(user["password_hash"], password):
             return jsonify({"error": "Invalid credentials"}), 403
         g.current_user = username
         return f(*args, **kwargs)
@@ -99,6 +726,18 @@ def require_auth(f):
 def greet():
     return jsonify({"message": "Hello from Python!"})
 
+# Limits a client needs to plan its requests (no auth required)
+@app.route('/api/capabilities', methods=['GET'])
+def capabilities():
+    return jsonify({
+        "default_chunk_size": CHUNK_SIZE,
+        "min_chunk_size": MIN_CHUNK_SIZE,
+        "max_chunk_size": MAX_CHUNK_SIZE,
+        "chunk_encodings": ["identity", "deflate"],
+        "max_batch_files": MAX_BATCH_FILES,
+        "max_list_page": MAX_LIST_PAGE
+    })
+
 # Create user endpoint (no auth required)
 @app.route('/api/user/create', methods=['POST'])
 def create_user():
@@ -107,47 +746,142 @@ def create_user():
     password = data.get("password")
     if not username or not password:
         return jsonify({"error": "username and password required"}), 400
-    users = load_users()
-    if username in users:
+    if get_user(username):
         return jsonify({"error": "user exists"}), 409
-    users[username] = {"password_hash": generate_password_hash(password)}
-    save_users(users)
+    password_hash = generate_password_hash(password)
+    # concurrent sign-ups must not drop each other from users.json
+    with _users_update_lock:
+        users = load_users()
+        if username in users:
+            return jsonify({"error": "user exists"}), 409
+        users[username] = {"password_hash": password_hash}
+        save_users(users)
     return jsonify({"status": "created", "username": username}), 201
 
-# Initialize a new upload, returns a file_id and expected number of chunks (if total_size provided)
+# Trade Basic credentials (or a token about to expire) for a session token
+# a token only ever comes from the password, so a stolen one lapses with its
+# expiry rather than renewing itself
+@app.route('/api/session', methods=['POST'])
+@require_auth
+def create_session():
+    if request.headers.get("Authorization", "").lower().startswith("bearer "):
+        return jsonify({"error": "a new session needs the password"}), 403
+    token, expires = make_session_token(g.current_user, get_user(g.current_user)["password_hash"])
+    return jsonify({"token": token, "username": g.current_user, "expires_at": expires}), 201
+
+# Initialize a new upload, returns a file_id and expected number of chunks (if total_size provided).
+# chunk_size (optional) is the size of every chunk but the last, within the
+# advertised limits
 @app.route('/api/upload/init', methods=['POST'])
 @require_auth
 def init_upload():
     data = request.get_json(force=True)
     filename = data.get("filename")
     total_size = data.get("total_size")  # optional, in bytes
+    chunk_size = data.get("chunk_size", CHUNK_SIZE)
 
     if not filename:
         return jsonify({"error": "filename is required"}), 400
+    if type(chunk_size) is not int or not MIN_CHUNK_SIZE <= chunk_size <= MAX_CHUNK_SIZE:
+        return jsonify({"error": f"chunk_size must be between {MIN_CHUNK_SIZE} and {MAX_CHUNK_SIZE}"}), 400
+    if isinstance(total_size, int) and total_size > MAX_UPLOAD_SIZE:
+        return jsonify({"error": f"total_size must be at most {MAX_UPLOAD_SIZE}"}), 400
 
     safe_name = secure_filename(filename)
     file_id = str(uuid.uuid4())
     folder = os.path.join(INCOMPLETE_DIR, file_id)
     os.makedirs(folder, exist_ok=True)
+    if isinstance(total_size, int) and total_size > 0:
+        # sparse: no blocks are allocated until the chunks land
+        with open(os.path.join(folder, UPLOAD_DATA), "wb") as f:
+            f.truncate(total_size)
 
     expected_chunks = None
     if isinstance(total_size, int) and total_size > 0:
-        expected_chunks = math.ceil(total_size / CHUNK_SIZE)
+        expected_chunks = math.ceil(total_size / chunk_size)
 
     # store ownership metadata
-    meta = load_metadata()
-    meta[file_id] = {
+    try:
+        metadata.put(file_id, {
+            "owner": g.current_user,
+            "filename": safe_name,
+            "expected_chunks": expected_chunks,
+            "chunk_size": chunk_size,
+            "assembled": False
+        })
+    except OSError as e:
+        shutil.rmtree(folder, ignore_errors=True)
+        return jsonify({"error": f"failed to update metadata: {e}"}), 500
+
+    return jsonify({"file_id": file_id, "filename": safe_name, "expected_chunks": expected_chunks,
+                    "chunk_size": chunk_size}), 201
+
+# Register many uploads in one request:
+# JSON {"files": [{"filename": ..., "total_size": ..., "chunk_size": ...}, ...]}
+# with chunk_size optional per file, as for a single init
+# returns the new file_ids in request order
+@app.route('/api/upload/init_batch', methods=['POST'])
+@require_auth
+def init_upload_batch():
+    data = request.get_json(force=True)
+    files = data.get("files")
+    if not isinstance(files, list) or not files:
+        return jsonify({"error": "files must be a non-empty list"}), 400
+    if len(files) > MAX_BATCH_FILES:
+        return jsonify({"error": f"at most {MAX_BATCH_FILES} files per request"}), 413
+
+    entries = []
+    for f in files:
+        filename = f.get("filename") if isinstance(f, dict) else None
+        if not isinstance(filename, str) or not filename:
+            return jsonify({"error": "each file needs a filename"}), 400
+        total_size = f.get("total_size")
+        if isinstance(total_size, int) and total_size > MAX_UPLOAD_SIZE:
+            return jsonify({"error": f"total_size must be at most {MAX_UPLOAD_SIZE}"}), 400
+        chunk_size = f.get("chunk_size", CHUNK_SIZE)
+        if type(chunk_size) is not int or not MIN_CHUNK_SIZE <= chunk_size <= MAX_CHUNK_SIZE:
+            return jsonify({"error": f"chunk_size must be between {MIN_CHUNK_SIZE} and {MAX_CHUNK_SIZE}"}), 400
+        expected_chunks = None
+        if isinstance(total_size, int) and total_size > 0:
+            expected_chunks = math.ceil(total_size / chunk_size)
+        entries.append((str(uuid.uuid4()), secure_filename(filename), expected_chunks, chunk_size))
+
+    metadata.put_many((file_id, {
         "owner": g.current_user,
         "filename": safe_name,
         "expected_chunks": expected_chunks,
+        "chunk_size": chunk_size,
         "assembled": False
-    }
-    save_metadata(meta)
+    }) for file_id, safe_name, expected_chunks, chunk_size in entries)
 
-    return jsonify({"file_id": file_id, "filename": safe_name, "expected_chunks": expected_chunks}), 201
+    return jsonify({"file_ids": [e[0] for e in entries], "filenames": [e[1] for e in entries]}), 201
+
+# Report which chunks of an in-progress upload are already stored, so an
+# interrupted client can resume by sending only the missing ones
+@app.route('/api/upload/status/<file_id>', methods=['GET'])
+@require_auth
+def upload_status(file_id):
+    info = metadata.get(file_id)
+    if info is None:
+        return jsonify({"error": "invalid file_id"}), 404
+    if info["owner"] != g.current_user:
+        return jsonify({"error": "not authorized for this file_id"}), 403
+
+    received = []
+    folder = os.path.join(INCOMPLETE_DIR, file_id)
+    if not info.get("assembled") and os.path.isdir(folder):
+        received = _upload_state(file_id, folder).received()
+    return jsonify({
+        "file_id": file_id,
+        "expected_chunks": info.get("expected_chunks"),
+        "chunk_size": info.get("chunk_size", CHUNK_SIZE),
+        "assembled": bool(info.get("assembled")),
+        "received": received
+    }), 200
 
 # Upload a single chunk as multipart/form-data:
-# fields: file_id, chunk_index (0-based), total_chunks (optional), filename
+# fields: file_id, chunk_index (0-based), total_chunks (optional), filename,
+# chunk_sha256 (optional), chunk_encoding ("identity" or "deflate", optional)
 # file field name: chunk
 @app.route('/api/upload/chunk', methods=['POST'])
 @require_auth
@@ -161,10 +895,10 @@ def upload_chunk():
         return jsonify({"error": "file_id, chunk_index and chunk file are required"}), 400
 
     # verify ownership exists and belongs to current user
-    meta = load_metadata()
-    if file_id not in meta:
+    info = metadata.get(file_id)
+    if info is None:
         return jsonify({"error": "invalid file_id"}), 404
-    if meta[file_id]["owner"] != g.current_user:
+    if info["owner"] != g.current_user:
         return jsonify({"error": "not authorized for this file_id"}), 403
 
     try:
@@ -177,73 +911,606 @@ def upload_chunk():
     except ValueError:
         total_chunks = None
 
-    safe_name = secure_filename(filename) if filename else meta[file_id].get("filename")
+    safe_name = secure_filename(filename) if filename else info.get("filename")
     dest_folder = os.path.join(INCOMPLETE_DIR, file_id)
     os.makedirs(dest_folder, exist_ok=True)
 
-    chunk_file = request.files['chunk']
-    chunk_filename = f"{chunk_index}.chunk"
-    chunk_path = os.path.join(dest_folder, chunk_filename)
+    encoding = request.form.get("chunk_encoding", "identity")
+    if encoding not in ("identity", "deflate"):
+        return jsonify({"error": f"unsupported chunk_encoding {encoding}"}), 400
 
-    # Save chunk to disk first
-    chunk_file.save(chunk_path)
+    # prefer provided total_chunks, otherwise check metadata; without either
+    # only MAX_UPLOAD_SIZE bounds the offset the chunk is written at
+    max_size = info.get("chunk_size", CHUNK_SIZE)
+    expect = total_chunks if total_chunks is not None else info.get("expected_chunks")
+    if chunk_index < 0 or (expect is not None and chunk_index >= expect) or chunk_index >= MAX_UPLOAD_SIZE // max_size:
+        return jsonify({"error": f"chunk_index {chunk_index} is out of range"}), 400
 
-    # Enforce max chunk size
-    size = os.path.getsize(chunk_path)
-    if size > CHUNK_SIZE:
-        os.remove(chunk_path)
-        return jsonify({"error": f"Chunk too large ({size} bytes). Max allowed is {CHUNK_SIZE} bytes."}), 413
+    # Write the chunk into its place in the data file, decompressing and
+    # hashing it on the way; it only counts as received once it is complete
+    # and verified, since chunks arrive concurrently. A chunk that is stored
+    # already or being written by another request is staged instead and
+    # only copied into place once verified, so a bad resend cannot overwrite
+    # good data.
+    data_path = os.path.join(dest_folder, UPLOAD_DATA)
+    state = _upload_state(file_id, dest_folder)
+    with state.lock:
+        claimed = not state.has(chunk_index) and chunk_index not in state.writing
+        if claimed:
+            state.writing.add(chunk_index)
+    staged = None if claimed else os.path.join(dest_folder, f"chunk-{uuid.uuid4()}.tmp")
+    try:
+        try:
+            if claimed:
+                size, digest, wire_size = _save_hashed(request.files['chunk'].stream, data_path, max_size,
+                                                       encoding == "deflate", offset=chunk_index * max_size)
+            else:
+                size, digest, wire_size = _save_hashed(request.files['chunk'].stream, staged, max_size,
+                                                       encoding == "deflate")
+        except zlib.error:
+            return jsonify({"error": f"chunk {chunk_index} is not valid deflate data"}), 400
 
-    # If total_chunks provided, check whether we have all chunks -> assemble
+        # Enforce the upload's chunk size; all but the last chunk fill their slot
+        if size > max_size:
+            return jsonify({"error": f"Chunk too large ({size} bytes). Max allowed is {max_size} bytes."}), 413
+        if expect is not None and chunk_index < expect - 1 and size != max_size:
+            return jsonify({"error": f"chunk {chunk_index} must be {max_size} bytes, got {size}"}), 400
+        expected_digest = request.form.get("chunk_sha256")
+        if expected_digest and expected_digest.lower() != digest:
+            return jsonify({"error": f"chunk {chunk_index} failed integrity check", "sha256": digest}), 400
+        if not claimed:
+            rejected = _place_chunk(file_id, dest_folder, state, chunk_index, chunk_index * max_size, staged)
+            if rejected:
+                return rejected
+            claimed = True
+        # how the chunk travelled; collected into the file's metadata on completion
+        received = _mark_received(file_id, dest_folder, chunk_index,
+                                  {"encoding": encoding, "size": size, "wire_size": wire_size})
+    finally:
+        if claimed:
+            with state.lock:
+                state.writing.discard(chunk_index)
+        if staged:
+            try:
+                os.unlink(staged)
+            except OSError:
+                pass
+
+    lock = _get_lock(file_id)
     assembled = False
-    # prefer provided total_chunks, otherwise check metadata
-    expect = total_chunks if total_chunks is not None else meta[file_id].get("expected_chunks")
-    if expect is not None:
-        present = [name for name in os.listdir(dest_folder) if name.endswith(".chunk")]
-        if len(present) == expect:
-            lock = _get_lock(file_id)
-            with lock:
-                # double-check presence inside lock
-                present = [name for name in os.listdir(dest_folder) if name.endswith(".chunk")]
-                if len(present) == expect and not meta[file_id].get("assembled", False):
-                    # assemble
-                    final_name = safe_name if safe_name else f"{file_id}.bin"
-                    final_path = os.path.join(COMPLETE_DIR, final_name)
-                    with open(final_path, "wb") as fout:
-                        for i in range(expect):
-                            part = os.path.join(dest_folder, f"{i}.chunk")
-                            if not os.path.exists(part):
-                                return jsonify({"error": f"Missing chunk {i} during assembly"}), 500
-                            with open(part, "rb") as fin:
-                                while True:
-                                    data = fin.read(4 * 1024 * 1024)
-                                    if not data:
-                                        break
-                                    fout.write(data)
-                    # cleanup chunk folder
-                    for f in os.listdir(dest_folder):
-                        try:
-                            os.remove(os.path.join(dest_folder, f))
-                        except Exception:
-                            pass
-                    try:
-                        os.rmdir(dest_folder)
-                    except Exception:
-                        pass
-                    assembled = True
-                    # update metadata
-                    meta[file_id]["assembled"] = True
-                    meta[file_id]["final_filename"] = final_name
-                    save_metadata(meta)
+    if expect is not None and received == expect:
+        with lock:
+            # double-check the assembly state inside the lock; another
+            # request may have completed the upload since we looked it up
+            info = metadata.get(file_id)
+            if info is not None and not info.get("assembled", False) and all(state.has(i) for i in range(expect)):
+                _advance_digest(state, dest_folder, max_size)
+                final_name = safe_name if safe_name else f"{file_id}.bin"
+                final_path = os.path.join(COMPLETE_DIR, final_name)
+                os.truncate(data_path, (expect - 1) * max_size + state.chunks[expect - 1]["size"])
+                os.replace(data_path, final_path)
+                chunks_info = [state.chunks[i] for i in range(expect)]
+                try:
+                    info = metadata.update(file_id, assembled=True, final_filename=final_name,
+                                           sha256=state.hasher.hexdigest(), chunks=chunks_info) or info
+                except OSError as e:
+                    # still an upload in progress, so the last chunk can be sent again
+                    os.replace(final_path, data_path)
+                    return jsonify({"error": f"failed to update metadata: {e}"}), 500
+                shutil.rmtree(dest_folder, ignore_errors=True)
+                with _uploads_lock:
+                    _uploads.pop(file_id, None)
+                assembled = True
+    elif lock.acquire(blocking=False):
+        # whoever holds the lock is already hashing; chunks it misses are
+        # picked up by the next one or on completion
+        try:
+            _advance_digest(state, dest_folder, max_size)
+        finally:
+            lock.release()
 
     resp = {"status": "uploaded", "file_id": file_id, "chunk_index": chunk_index}
     if assembled:
         resp["assembled"] = True
-        resp["filename"] = meta[file_id].get("final_filename", safe_name if safe_name else f"{file_id}.bin")
+        resp["filename"] = info.get("final_filename", safe_name if safe_name else f"{file_id}.bin")
+        resp["sha256"] = info.get("sha256")
 
     return jsonify(resp), 200
 
 
+# Upload several small registered files in one request as multipart/form-data:
+# fields: files (JSON list of {"file_id", "size"} in body order),
+# chunk_sha256 (optional), chunk_encoding (optional)
+# file field name: bundle, the files' contents back to back
+@app.route('/api/upload/bundle', methods=['POST'])
+@require_auth
+def upload_bundle():
+    try:
+        files = json.loads(request.form.get("files") or "")
+    except ValueError:
+        return jsonify({"error": "files must be a JSON list"}), 400
+    if not isinstance(files, list) or not files or 'bundle' not in request.files:
+        return jsonify({"error": "files and bundle file are required"}), 400
+    if len(files) > MAX_BATCH_FILES:
+        return jsonify({"error": f"at most {MAX_BATCH_FILES} files per bundle"}), 413
+    for f in files:
+        if not isinstance(f, dict) or not isinstance(f.get("file_id"), str) \
+                or not isinstance(f.get("size"), int) or f["size"] < 0:
+            return jsonify({"error": "each file needs a file_id and a size"}), 400
+    encoding = request.form.get("chunk_encoding", "identity")
+    if encoding not in ("identity", "deflate"):
+        return jsonify({"error": f"unsupported chunk_encoding {encoding}"}), 400
+
+    infos = {}
+    for f in files:
+        info = infos[f["file_id"]] = metadata.get(f["file_id"])
+        if info is None:
+            return jsonify({"error": f"invalid file_id {f['file_id']}"}), 404
+        if info["owner"] != g.current_user:
+            return jsonify({"error": f"not authorized for file_id {f['file_id']}"}), 403
+        if info.get("assembled"):
+            return jsonify({"error": f"upload {f['file_id']} already complete"}), 409
+
+    # from here on a failed bundle takes its files' registrations with it,
+    # so a client that gives up leaves no entries that never complete
+    def reject(reply, status):
+        pending = []
+        for file_id in infos:
+            info = metadata.get(file_id)
+            if info is not None and not info.get("assembled"):
+                pending.append(file_id)
+        try:
+            if pending:
+                metadata.remove_many(pending)
+        except OSError as e:
+            return jsonify({"error": f"failed to update metadata: {e}"}), 500
+        return jsonify(reply), status
+
+    names = [infos[f["file_id"]].get("filename") or f"{f['file_id']}.bin" for f in files]
+    if len(set(names)) != len(names) or len(infos) != len(files):
+        return reject({"error": "files in a bundle need distinct file_ids and names"}, 400)
+    total = sum(f["size"] for f in files)
+    if total > CHUNK_SIZE:
+        return reject({"error": f"Bundle too large ({total} bytes). Max allowed is {CHUNK_SIZE} bytes."}, 413)
+
+    tmp_path = os.path.join(INCOMPLETE_DIR, f"bundle-{uuid.uuid4()}.tmp")
+    try:
+        size, digest, _ = _save_hashed(request.files['bundle'].stream, tmp_path, CHUNK_SIZE, encoding == "deflate")
+    except zlib.error:
+        os.remove(tmp_path)
+        return reject({"error": "bundle is not valid deflate data"}, 400)
+    if size != total:
+        os.remove(tmp_path)
+        return reject({"error": f"bundle holds {size} bytes but its files add up to {total}"}, 400)
+    expected_digest = request.form.get("chunk_sha256")
+    if expected_digest and expected_digest.lower() != digest:
+        os.remove(tmp_path)
+        return reject({"error": "bundle failed integrity check", "sha256": digest}, 400)
+
+    # split the bundle into the files, hashing each on the way; each goes to
+    # a temporary file first and all are renamed into place once written
+    done, temps, placed = [], [], 0
+    try:
+        with open(tmp_path, "rb") as fin:
+            for f, final_name in zip(files, names):
+                temps.append(os.path.join(COMPLETE_DIR, f".{final_name}.{uuid.uuid4()}.tmp"))
+                file_hasher = hashlib.sha256()
+                left = f["size"]
+                with open(temps[-1], "xb") as fout:
+                    while left > 0:
+                        data = fin.read(min(left, 4 * 1024 * 1024))
+                        if not data:
+                            raise OSError("bundle ended early")
+                        file_hasher.update(data)
+                        fout.write(data)
+                        left -= len(data)
+                done.append((f["file_id"], final_name, file_hasher.hexdigest()))
+        for path, final_name in zip(temps, names):
+            os.replace(path, os.path.join(COMPLETE_DIR, final_name))
+            placed += 1
+    except OSError as e:
+        for path in temps[placed:]:
+            try:
+                os.remove(path)
+            except OSError:
+                pass
+        return reject({"error": f"failed to write bundle files: {e}"}, 500)
+    finally:
+        os.remove(tmp_path)
+
+    try:
+        metadata.update_many((file_id, {"assembled": True, "final_filename": final_name, "sha256": file_digest})
+                             for file_id, final_name, file_digest in done)
+    except OSError as e:
+        return reject({"error": f"failed to update metadata: {e}"}, 500)
+
+    return jsonify({"status": "assembled", "files": [
+        {"file_id": file_id, "filename": final_name, "sha256": file_digest}
+        for file_id, final_name, file_digest in done]}), 200
+
+
+# Report which of the given chunk hashes the store does not have yet for
+# this user; a chunk they never sent counts as missing even when stored
+@app.route('/api/chunks/query', methods=['POST'])
+@require_auth
+def query_chunks():
+    data = request.get_json(force=True)
+    hashes = data.get("hashes")
+    if not isinstance(hashes, list):
+        return jsonify({"error": "hashes must be a list"}), 400
+    if len(hashes) > MAX_QUERY_HASHES:
+        return jsonify({"error": f"at most {MAX_QUERY_HASHES} hashes per query"}), 413
+    if not all(isinstance(h, str) and _HASH_RE.match(h) for h in hashes):
+        return jsonify({"error": "hashes must be lowercase hex sha256"}), 400
+    missing = [h for h in hashes if not _chunk_possessed(h, g.current_user)]
+    return jsonify({"missing": missing}), 200
+
+# Store one content-addressed chunk as multipart/form-data:
+# fields: hash (sha256 of the chunk), file field name: chunk
+@app.route('/api/chunks/upload', methods=['POST'])
+@require_auth
+def upload_store_chunk():
+    chunk_hash = request.form.get("hash")
+    if not chunk_hash or not _HASH_RE.match(chunk_hash) or 'chunk' not in request.files:
+        return jsonify({"error": "hash and chunk file are required"}), 400
+
+    path = _chunk_path(chunk_hash)
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+
+    # the store is addressed by content, so verify it while writing; one
+    # already stored is only hashed, as the sender's proof that they have it
+    tmp_path = os.devnull if os.path.isfile(path) else f"{path}.{uuid.uuid4().hex}.tmp"
+    try:
+        size, digest, _ = _save_hashed(request.files['chunk'].stream, tmp_path, MAX_STORE_CHUNK)
+        if size > MAX_STORE_CHUNK:
+            return jsonify({"error": f"Chunk too large. Max allowed is {MAX_STORE_CHUNK} bytes."}), 413
+        if digest != chunk_hash:
+            return jsonify({"error": "chunk content does not match hash"}), 400
+        with _refs_lock:
+            stored = False
+            if not os.path.isfile(path):
+                if tmp_path == os.devnull:
+                    # swept since the check above
+                    return jsonify({"error": "chunk no longer stored; send it again"}), 409
+                os.replace(tmp_path, path)
+                stored = True
+            _record_possession(chunk_hash, g.current_user)
+    finally:
+        if tmp_path != os.devnull and os.path.exists(tmp_path):
+            os.remove(tmp_path)
+    if not stored:
+        return jsonify({"status": "exists", "hash": chunk_hash}), 200
+    return jsonify({"status": "stored", "hash": chunk_hash, "size": size}), 201
+
+# Complete an upload as a manifest of stored chunks instead of an assembled
+# blob. body: {"file_id": ..., "chunks": [{"hash": ..., "size": ...}, ...]},
+# optionally with the client's "sha256", which must match the chunks.
+# Answers 409 with "missing" if any chunk is not (or no longer) in the store
+# or was never sent by this user.
+@app.route('/api/upload/manifest', methods=['POST'])
+@require_auth
+def commit_manifest():
+    data = request.get_json(force=True)
+    file_id = data.get("file_id")
+    chunks = data.get("chunks")
+    file_digest = data.get("sha256")
+    if not file_id or not isinstance(chunks, list):
+        return jsonify({"error": "file_id and chunks are required"}), 400
+    if file_digest is not None and (not isinstance(file_digest, str) or not _HASH_RE.match(file_digest)):
+        return jsonify({"error": "sha256 must be lowercase hex"}), 400
+
+    info = metadata.get(file_id)
+    if info is None:
+        return jsonify({"error": "invalid file_id"}), 404
+    if info["owner"] != g.current_user:
+        return jsonify({"error": "not authorized for this file_id"}), 403
+    if info.get("assembled"):
+        return jsonify({"error": "upload already complete"}), 409
+
+    entries = []
+    for c in chunks:
+        h = c.get("hash") if isinstance(c, dict) else None
+        size = c.get("size") if isinstance(c, dict) else None
+        if not isinstance(h, str) or not _HASH_RE.match(h) or not isinstance(size, int) or size < 0:
+            return jsonify({"error": "each chunk needs a sha256 hash and a size"}), 400
+        entries.append([h, size])
+
+    with _refs_lock:
+        # again under the lock: a commit for this upload that got here first
+        # has saved its manifest and referenced the chunks already
+        info = metadata.get(file_id)
+        if info is None:
+            return jsonify({"error": "invalid file_id"}), 404
+        if info.get("assembled") or os.path.exists(_manifest_path(file_id)):
+            return jsonify({"error": "upload already complete"}), 409
+        missing = sorted({h for h, _ in entries if not _chunk_possessed(h, g.current_user)})
+        if missing:
+            return jsonify({"error": "chunks missing from store", "missing": missing}), 409
+        for h, size in entries:
+            if os.path.getsize(_chunk_path(h)) != size:
+                return jsonify({"error": f"size mismatch for chunk {h}"}), 400
+        _save_json(_manifest_path(file_id), {"chunks": entries})
+        refs = load_chunk_refs()
+        for h in {h for h, _ in entries}:
+            refs[h] = refs.get(h, 0) + 1
+        save_chunk_refs(refs)
+        global _chunks_swept
+        now = time.time()
+        if now - _chunks_swept >= CHUNK_SWEEP_INTERVAL:
+            _chunks_swept = now
+            _sweep_chunk_store(refs)
+
+    # the chunks are referenced now, so they stay while they are read back
+    digest = _manifest_digest(entries)
+    if digest is None or (file_digest and file_digest != digest):
+        _release_manifest(file_id)
+        if digest is None:
+            return jsonify({"error": "failed to read stored chunks"}), 500
+        return jsonify({"error": "sha256 does not match the chunks"}), 400
+
+    total = sum(size for _, size in entries)
+    fields = {"assembled": True, "manifest": True, "size": total, "sha256": digest,
+              "final_filename": info.get("filename") or f"{file_id}.bin"}
+    try:
+        info = metadata.update(file_id, **fields) or dict(info, **fields)
+    except OSError as e:
+        _release_manifest(file_id)
+        return jsonify({"error": f"failed to update metadata: {e}"}), 500
+
+    # the folder init made, with its preallocated data file
+    shutil.rmtree(os.path.join(INCOMPLETE_DIR, file_id), ignore_errors=True)
+
+    return jsonify({"status": "assembled", "file_id": file_id, "filename": info["final_filename"],
+                    "size": total, "chunks": len(entries), "sha256": info.get("sha256")}), 200
+
+# the digest of a manifest's chunks read back from the store in order; None
+# if one cannot be read in full
+def _manifest_digest(entries):
+    hasher = hashlib.sha256()
+    try:
+        for h, size in entries:
+            with open(_chunk_path(h), "rb") as f:
+                left = size
+                while left > 0:
+                    data = f.read(min(1024 * 1024, left))
+                    if not data:
+                        return None
+                    hasher.update(data)
+                    left -= len(data)
+    except OSError:
+        return None
+    return hasher.hexdigest()
+
+# drops a manifest and the stored chunks no other manifest references
+def _release_manifest(file_id):
+    with _refs_lock:
+        entries = _load_manifest(file_id)
+        refs = load_chunk_refs()
+        for h in {h for h, _ in entries}:
+            count = refs.get(h, 0) - 1
+            if count > 0:
+                refs[h] = count
+                continue
+            refs.pop(h, None)
+            for path in (_chunk_path(h), _chunk_users_path(h)):
+                try:
+                    os.remove(path)
+                except OSError:
+                    pass
+        save_chunk_refs(refs)
+        try:
+            os.remove(_manifest_path(file_id))
+        except OSError:
+            pass
+
+# streams a manifest-backed file, honoring a single "bytes=" Range like
+# send_from_directory does for assembled files
+def _send_manifest(file_id, filename):
+    entries = _load_manifest(file_id)
+    total = sum(size for _, size in entries)
+    start, end, status = 0, total - 1, 200
+    headers = {
+        "Accept-Ranges": "bytes",
+        "Content-Disposition": f"attachment; filename={filename}",
+    }
+    rng = request.headers.get("Range")
+    m = re.match(r"^bytes=(\d*)-(\d*)$", rng.strip()) if rng else None
+    if m and (m.group(1) or m.group(2)):
+        if m.group(1):
+            start = int(m.group(1))
+            end = min(int(m.group(2)), total - 1) if m.group(2) else total - 1
+        else:
+            start = max(0, total - int(m.group(2)))
+        if start >= total or start > end:
+            return Response(status=416, headers={"Content-Range": f"bytes */{total}"})
+        status = 206
+        headers["Content-Range"] = f"bytes {start}-{end}/{total}"
+    headers["Content-Length"] = str(max(0, end - start + 1))
+
+    def generate():
+        offset = 0
+        for h, size in entries:
+            if offset + size <= start:
+                offset += size
+                continue
+            if offset > end:
+                break
+            with open(_chunk_path(h), "rb") as fin:
+                skip = max(0, start - offset)
+                fin.seek(skip)
+                remaining = min(size, end - offset + 1) - skip
+                while remaining > 0:
+                    data = fin.read(min(remaining, 4 * 1024 * 1024))
+                    if not data:
+                        break
+                    remaining -= len(data)
+                    yield data
+            offset += size
+
+    return Response(stream_with_context(generate()), status=status, headers=headers,
+                    mimetype="application/octet-stream")
+
+# rsync-style updates: a client fetches a signature per block of a stored
+# file and sends back only what it could not match, as a delta of records
+# b"C" + offset + length (big-endian u64s), copying that range of the stored
+# file, and b"L" + length followed by that many new bytes
+DELTA_COPY = b"C"
+DELTA_DATA = b"L"
+
+def _read_exact(stream, n):
+    data = b""
+    while len(data) < n:
+        more = stream.read(n - len(data))
+        if not more:
+            raise ValueError("delta ends inside a record")
+        data += more
+    return data
+
+# writes the file a delta describes to out_path, copying from base_path;
+# returns its sha256 hex. Raises ValueError for a malformed delta.
+def _apply_delta(stream, base_path, out_path, size):
+    hasher = hashlib.sha256()
+    written = 0
+    with open(base_path, "rb") as base, open(out_path, "wb") as out:
+        base_size = os.fstat(base.fileno()).st_size
+        while True:
+            tag = stream.read(1)
+            if not tag:
+                break
+            if tag == DELTA_COPY:
+                offset, length = struct.unpack(">QQ", _read_exact(stream, 16))
+                if offset + length > base_size:
+                    raise ValueError("copy past the end of the stored file")
+                base.seek(offset)
+                src = base
+            elif tag == DELTA_DATA:
+                length, = struct.unpack(">Q", _read_exact(stream, 8))
+                src = stream
+            else:
+                raise ValueError("unknown delta record")
+            if length == 0 or written + length > size:
+                raise ValueError("delta records do not add up to the new size")
+            left = length
+            while left > 0:
+                data = src.read(min(left, 4 * 1024 * 1024))
+                if not data:
+                    raise ValueError("delta ends inside a record")
+                hasher.update(data)
+                out.write(data)
+                left -= len(data)
+            written += length
+    if written != size:
+        raise ValueError("delta records do not add up to the new size")
+    return hasher.hexdigest()
+
+# the stored file a delta may apply to, as (info, path), or an error response
+def _delta_target(file_id):
+    info = metadata.get(file_id)
+    if info is None:
+        return None, (jsonify({"error": "invalid file_id"}), 404)
+    if info["owner"] != g.current_user:
+        return None, (jsonify({"error": "not authorized for this file_id"}), 403)
+    if not info.get("assembled"):
+        return None, (jsonify({"error": "upload not complete"}), 409)
+    if info.get("manifest"):
+        return None, (jsonify({"error": "file is stored as content-defined chunks; upload it again with --cdc"}), 409)
+    path = os.path.join(COMPLETE_DIR, info.get("final_filename", info.get("filename", f"{file_id}.bin")))
+    if not os.path.isfile(path):
+        return None, (jsonify({"error": "file not found"}), 404)
+    return (info, path), None
+
+# Block signatures of a completed file (owner only): ?block_size=N.
+# The body has one 36-byte record per block, the last block possibly short:
+# its Adler-32 (big-endian) then its SHA-256
+@app.route('/api/file/signatures/<file_id>', methods=['GET'])
+@require_auth
+def file_signatures(file_id):
+    try:
+        block_size = int(request.args.get("block_size", ""))
+    except ValueError:
+        block_size = 0
+    if not DELTA_MIN_BLOCK <= block_size <= DELTA_MAX_BLOCK:
+        return jsonify({"error": f"block_size must be between {DELTA_MIN_BLOCK} and {DELTA_MAX_BLOCK}"}), 400
+    target, error = _delta_target(file_id)
+    if error:
+        return error
+    info, path = target
+    # opened now so the records describe one version even if it is replaced
+    fin = open(path, "rb")
+
+    def generate():
+        with fin:
+            while True:
+                records = []
+                for _ in range(256):
+                    block = fin.read(block_size)
+                    if not block:
+                        break
+                    records.append(struct.pack(">I", zlib.adler32(block)) + hashlib.sha256(block).digest())
+                if not records:
+                    break
+                yield b"".join(records)
+
+    headers = {"X-Block-Size": str(block_size), "X-File-Size": str(os.fstat(fin.fileno()).st_size)}
+    if info.get("sha256"):
+        headers["X-Content-SHA256"] = info["sha256"]
+    return Response(stream_with_context(generate()), 200, headers, mimetype="application/octet-stream")
+
+# Replace a completed file from a delta as multipart/form-data:
+# fields: file_id, base_sha256 (digest of the version the signatures came
+# from), size and sha256 of the new version; file field name: delta.
+# The new version is built beside the old one and renamed over it, and
+# keeps the file_id.
+@app.route('/api/upload/delta', methods=['POST'])
+@require_auth
+def upload_delta():
+    file_id = request.form.get("file_id")
+    base_digest = request.form.get("base_sha256", "")
+    file_digest = request.form.get("sha256", "")
+    try:
+        size = int(request.form.get("size", ""))
+    except ValueError:
+        size = -1
+    if not file_id or size < 0 or not _HASH_RE.match(base_digest) or not _HASH_RE.match(file_digest) \
+            or 'delta' not in request.files:
+        return jsonify({"error": "file_id, base_sha256, size, sha256 and delta file are required"}), 400
+    target, error = _delta_target(file_id)
+    if error:
+        return error
+    info, path = target
+
+    if info.get("sha256") != base_digest:
+        return jsonify({"error": "file changed since its signatures were fetched"}), 409
+    # the new version is built without the lock; the base is checked again
+    # under it before the new version replaces it
+    tmp_path = os.path.join(COMPLETE_DIR, f".{os.path.basename(path)}.{uuid.uuid4().hex}.delta")
+    try:
+        digest = _apply_delta(request.files['delta'].stream, path, tmp_path, size)
+    except ValueError as e:
+        os.remove(tmp_path)
+        return jsonify({"error": f"bad delta: {e}"}), 400
+    except OSError as e:
+        if os.path.exists(tmp_path):
+            os.remove(tmp_path)
+        return jsonify({"error": f"failed to apply delta: {e}"}), 500
+    if digest != file_digest:
+        os.remove(tmp_path)
+        return jsonify({"error": "updated file failed integrity check", "sha256": digest}), 400
+    with _get_lock(file_id):
+        info = metadata.get(file_id)
+        if info is None or info.get("sha256") != base_digest:
+            os.remove(tmp_path)
+            if info is None:
+                return jsonify({"error": "invalid file_id"}), 404
+            return jsonify({"error": "file changed since its signatures were fetched"}), 409
+        os.replace(tmp_path, path)
+        # how the first version's chunks travelled says nothing about this one
+        if metadata.update(file_id, sha256=digest, chunks=None) is None:
+            os.remove(path)  # deleted meanwhile
+            return jsonify({"error": "invalid file_id"}), 404
+    return jsonify({"status": "updated", "file_id": file_id, "filename": os.path.basename(path),
+                    "size": size, "sha256": digest}), 200
+
 # Share a file with another user (owner only)
 @app.route('/api/file/share', methods=['POST'])
 @require_auth
@@ -254,72 +1521,168 @@ def share_file():
     if not file_id or not share_with:
         return jsonify({"error": "file_id and share_with are required"}), 400
 
-    users = load_users()
-    if share_with not in users:
+    if not get_user(share_with):
         return jsonify({"error": "target user not found"}), 404
 
-    meta = load_metadata()
-    if file_id not in meta:
-        return jsonify({"error": "invalid file_id"}), 404
+    with _meta_update_lock:
+        info = metadata.get(file_id)
+        if info is None:
+            return jsonify({"error": "invalid file_id"}), 404
 
-    if meta[file_id].get("owner") != g.current_user:
-        return jsonify({"error": "only owner can share the file"}), 403
+        if info.get("owner") != g.current_user:
+            return jsonify({"error": "only owner can share the file"}), 403
 
-    shared = meta[file_id].setdefault("shared_with", [])
-    if share_with in shared:
-        return jsonify({"status": "already_shared", "file_id": file_id, "shared_with": shared}), 200
+        shared = info.get("shared_with", [])
+        if share_with in shared:
+            return jsonify({"status": "already_shared", "file_id": file_id, "shared_with": shared}), 200
 
-    shared.append(share_with)
-    save_metadata(meta)
+        shared = shared + [share_with]
+        metadata.update(file_id, shared_with=shared)
     return jsonify({"status": "shared", "file_id": file_id, "shared_with": shared}), 200
 
 
+# Share many files with one user in one request:
+# JSON {"file_ids": [...], "share_with": ...}
+# every change lands in one metadata write; returns a result per file_id in
+# request order, with an "error" for the ones that could not be shared
+@app.route('/api/file/share_batch', methods=['POST'])
+@require_auth
+def share_files_batch():
+    data = request.get_json(force=True)
+    file_ids = data.get("file_ids")
+    share_with = data.get("share_with")
+    if not isinstance(file_ids, list) or not file_ids or not all(isinstance(f, str) for f in file_ids) \
+            or not share_with:
+        return jsonify({"error": "file_ids (a non-empty list) and share_with are required"}), 400
+    if len(file_ids) > MAX_BATCH_FILES:
+        return jsonify({"error": f"at most {MAX_BATCH_FILES} files per request"}), 413
+
+    if not get_user(share_with):
+        return jsonify({"error": "target user not found"}), 404
+
+    results = []
+    changes = {}
+    with _meta_update_lock:
+        for file_id in file_ids:
+            info = metadata.get(file_id)
+            if info is None:
+                results.append({"file_id": file_id, "error": "invalid file_id"})
+                continue
+            if info.get("owner") != g.current_user:
+                results.append({"file_id": file_id, "error": "only owner can share the file"})
+                continue
+            shared = changes.get(file_id, info.get("shared_with", []))
+            if share_with in shared:
+                results.append({"status": "already_shared", "file_id": file_id, "shared_with": shared})
+                continue
+            shared = changes[file_id] = shared + [share_with]
+            results.append({"status": "shared", "file_id": file_id, "shared_with": shared})
+        metadata.update_many((file_id, {"shared_with": shared}) for file_id, shared in changes.items())
+    return jsonify({"results": results}), 200
+
+
+# size of a completed file, or None if its data is gone
+def _stored_size(fid, info, final_name):
+    if info.get("manifest"):
+        return info.get("size", 0) if os.path.isfile(_manifest_path(fid)) else None
+    path = os.path.join(COMPLETE_DIR, final_name)
+    if os.path.isfile(path):
+        return os.stat(path).st_size
+    return None
+
 # List files visible to the caller: owned files + files shared with them
 @app.route('/api/files/shared', methods=['GET'])
 @require_auth
 def list_shared_files():
     files = []
-    meta = load_metadata()
-    for fid, info in meta.items():
+    for fid, info in metadata.visible_to(g.current_user, shared=True):
         if info.get("assembled"):
             final_name = info.get("final_filename", info.get("filename", f"{fid}.bin"))
-            path = os.path.join(COMPLETE_DIR, final_name)
-            if os.path.isfile(path):
-                owner = info.get("owner")
-                shared_with = info.get("shared_with", [])
-                if owner == g.current_user or g.current_user in shared_with:
-                    stat = os.stat(path)
-                    files.append({"file_id": fid, "filename": final_name, "size": stat.st_size, "owner": owner, "shared_with": shared_with})
+            size = _stored_size(fid, info, final_name)
+            if size is not None:
+                files.append({"file_id": fid, "filename": final_name, "size": size, "owner": info.get("owner"),
+                              "shared_with": info.get("shared_with", []), "sha256": info.get("sha256")})
     return jsonify({"files": files})
 
 # List completed files (only show files owned by caller)
 @app.route('/api/files', methods=['GET'])
 @require_auth
 def list_files():
-    files = []
-    meta = load_metadata()
-    for fid, info in meta.items():
-        if info.get("assembled") and info.get("owner") == g.current_user:
+    # optional paging: ?limit=N returns at most N files ordered by name and
+    # a next_cursor to pass back as ?cursor= for the rest; ?prefix= keeps
+    # only names starting with it
+    prefix = request.args.get("prefix", "")
+    limit = request.args.get("limit")
+    cursor = request.args.get("cursor")
+    try:
+        limit = min(max(int(limit), 1), MAX_LIST_PAGE) if limit else None
+        after = tuple(json.loads(base64.urlsafe_b64decode(cursor.encode()).decode())) if cursor else None
+        if after is not None and (len(after) != 2 or not all(isinstance(v, str) for v in after)):
+            raise ValueError(cursor)
+    except (ValueError, TypeError):
+        return jsonify({"error": "bad limit or cursor"}), 400
+
+    # taken before reading so a concurrent change can only make it stale
+    etag = metadata.etag()
+    if etag in [t.strip() for t in request.headers.get("If-None-Match", "").split(",")]:
+        return Response(status=304, headers={"ETag": etag})
+
+    entries = dict(metadata.visible_to(g.current_user))
+    owned = []
+    for fid, info in entries.items():
+        if info.get("assembled"):
             final_name = info.get("final_filename", info.get("filename", f"{fid}.bin"))
-            path = os.path.join(COMPLETE_DIR, final_name)
-            if os.path.isfile(path):
-                stat = os.stat(path)
-                files.append({"file_id": fid, "filename": final_name, "size": stat.st_size})
-    return jsonify({"files": files})
+            if final_name.startswith(prefix):
+                owned.append((final_name, fid))
+    owned.sort()
+    start = bisect.bisect_right(owned, after) if after else 0
+    end = len(owned) if limit is None else min(len(owned), start + limit)
+
+    files = []
+    for final_name, fid in owned[start:end]:
+        info = entries[fid]
+        size = _stored_size(fid, info, final_name)
+        if size is not None:
+            files.append({"file_id": fid, "filename": final_name, "size": size, "sha256": info.get("sha256")})
+    next_cursor = None
+    if end < len(owned):
+        next_cursor = base64.urlsafe_b64encode(json.dumps(list(owned[end - 1])).encode()).decode()
+    resp = jsonify({"files": files, "next_cursor": next_cursor})
+    resp.headers["ETag"] = etag
+    return resp
+
+# True if the file's chunks arrived at least 10% smaller compressed, i.e. a
+# compressed download is worth the server's CPU
+def _compresses_well(info):
+    chunks = info.get("chunks") or []
+    raw = sum(c.get("size", 0) for c in chunks)
+    wire = sum(c.get("wire_size", 0) for c in chunks)
+    return raw > 0 and wire * 10 <= raw * 9
+
+def _send_gzip(path, filename):
+    def generate():
+        encoder = zlib.compressobj(1, zlib.DEFLATED, 31)  # gzip framing
+        with open(path, "rb") as f:
+            while True:
+                data = f.read(1024 * 1024)
+                if not data:
+                    break
+                out = encoder.compress(data)
+                if out:
+                    yield out
+        yield encoder.flush()
+    headers = {
+        "Content-Encoding": "gzip",
+        "Content-Disposition": f"attachment; filename={filename}",
+    }
+    return Response(stream_with_context(generate()), 200, headers, mimetype="application/octet-stream")
 
 # Download a completed file (owner or shared users)
 @app.route('/api/download/<path:filename>', methods=['GET'])
 @require_auth
 def download_file(filename):
     safe_name = secure_filename(filename)
-    meta = load_metadata()
-    # find matching metadata entry
-    found = None
-    for fid, info in meta.items():
-        final = info.get("final_filename", info.get("filename"))
-        if final == safe_name:
-            found = (fid, info)
-            break
+    found = metadata.find_by_name(safe_name)
     if not found:
         return jsonify({"error": "file not found"}), 404
     fid, info = found
@@ -327,35 +1690,114 @@ def download_file(filename):
     shared_with = info.get("shared_with", [])
     if info.get("owner") != g.current_user and g.current_user not in shared_with:
         return jsonify({"error": "not authorized to download this file"}), 403
-    return send_from_directory(COMPLETE_DIR, safe_name, as_attachment=True)
+    # the upload showed this file compresses; ranges stay uncompressed
+    gzip = (not info.get("manifest") and "gzip" in request.headers.get("Accept-Encoding", "")
+            and "Range" not in request.headers and _compresses_well(info))
+    # the file_id and digest name these exact bytes, so a client that cached
+    # them revalidates with If-None-Match and gets a 304 instead of the body.
+    # The gzip encoding is other bytes, so it gets a tag of its own.
+    etag = f'"{fid}.{info["sha256"]}{"-gzip" if gzip else ""}"' if info.get("sha256") else None
+    if etag and etag in [t.strip() for t in request.headers.get("If-None-Match", "").split(",")]:
+        return Response(status=304, headers={"ETag": etag, "X-Content-SHA256": info["sha256"],
+                                             "Vary": "Accept-Encoding"})
+    if info.get("manifest"):
+        resp = _send_manifest(fid, safe_name)
+    elif gzip:
+        resp = _send_gzip(os.path.join(COMPLETE_DIR, safe_name), safe_name)
+    else:
+        # conditional=True answers Range requests with 206 partial content,
+        # which the client uses for parallel ranged downloads
+        resp = send_from_directory(COMPLETE_DIR, safe_name, as_attachment=True, conditional=True,
+                                   etag=etag.strip('"') if etag else True)
+    resp.headers["Vary"] = "Accept-Encoding"
+    # whole-file digest, so clients can verify while they stream
+    if info.get("sha256"):
+        resp.headers["X-Content-SHA256"] = info["sha256"]
+        resp.headers["ETag"] = etag
+    return resp
 
 # Delete a file by file_id (owner only)
 @app.route('/api/file/<file_id>', methods=['DELETE'])
 @require_auth
 def delete_file(file_id):
-    meta = load_metadata()
-    if file_id not in meta:
+    info = metadata.get(file_id)
+    if info is None:
         return jsonify({"error": "invalid file_id"}), 404
-    info = meta[file_id]
     if info.get("owner") != g.current_user:
         return jsonify({"error": "not authorized to delete this file"}), 403
 
+    # the entry goes first: once it is logged nothing names the bytes, and a
+    # failed append leaves the file as it was
+    try:
+        metadata.remove(file_id)
+    except Exception as e:
+        return jsonify({"error": f"failed to update metadata: {str(e)}"}), 500
+
     final_name = info.get("final_filename", info.get("filename", f"{file_id}.bin"))
     path = os.path.join(COMPLETE_DIR, final_name)
     try:
-        if os.path.isfile(path):
+        if info.get("manifest"):
+            _release_manifest(file_id)
+        elif not metadata.path_in_use(final_name) and os.path.isfile(path):
             os.remove(path)
     except Exception as e:
         return jsonify({"error": f"failed to remove file: {str(e)}"}), 500
+    # an upload given up on takes its received chunks with it
+    if not info.get("assembled"):
+        shutil.rmtree(os.path.join(INCOMPLETE_DIR, file_id), ignore_errors=True)
 
-    # remove metadata entry
+    return jsonify({"status": "deleted", "file_id": file_id}), 200
+
+# Delete many files in one request: JSON {"file_ids": [...]}
+# the removals land in one metadata write; returns a result per file_id in
+# request order, with an "error" for the ones that could not be deleted
+@app.route('/api/file/delete_batch', methods=['POST'])
+@require_auth
+def delete_files_batch():
+    data = request.get_json(force=True)
+    file_ids = data.get("file_ids")
+    if not isinstance(file_ids, list) or not file_ids or not all(isinstance(f, str) for f in file_ids):
+        return jsonify({"error": "file_ids must be a non-empty list"}), 400
+    if len(file_ids) > MAX_BATCH_FILES:
+        return jsonify({"error": f"at most {MAX_BATCH_FILES} files per request"}), 413
+
+    results = []
+    removed = {}  # file_id -> (entry, index of its result)
+    for file_id in file_ids:
+        info = metadata.get(file_id)
+        if info is None or file_id in removed:
+            results.append({"file_id": file_id, "error": "invalid file_id"})
+            continue
+        if info.get("owner") != g.current_user:
+            results.append({"file_id": file_id, "error": "not authorized to delete this file"})
+            continue
+        removed[file_id] = (info, len(results))
+        results.append({"status": "deleted", "file_id": file_id})
+
+    # the entries go first, in one log append: once it is logged nothing
+    # names the bytes, and a failed append leaves every file as it was
     try:
-        del meta[file_id]
-        save_metadata(meta)
+        if removed:
+            metadata.remove_many(removed)
     except Exception as e:
         return jsonify({"error": f"failed to update metadata: {str(e)}"}), 500
-
-    return jsonify({"status": "deleted", "file_id": file_id}), 200
+    for file_id, (info, at) in removed.items():
+        final_name = info.get("final_filename", info.get("filename", f"{file_id}.bin"))
+        path = os.path.join(COMPLETE_DIR, final_name)
+        try:
+            if info.get("manifest"):
+                _release_manifest(file_id)
+            elif not metadata.path_in_use(final_name) and os.path.isfile(path):
+                os.remove(path)
+        except Exception as e:
+            results[at] = {"file_id": file_id, "error": f"failed to remove file: {str(e)}"}
+        if not info.get("assembled"):
+            shutil.rmtree(os.path.join(INCOMPLETE_DIR, file_id), ignore_errors=True)
+    return jsonify({"results": results}), 200
 
 if __name__ == '__main__':
-    app.run(host='0.0.0.0', port=5000)
+    parser = argparse.ArgumentParser(description="netserve file server; stores data under ./uploads")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5000)
+    args = parser.parse_args()
+    app.run(host=args.host, port=args.port)
@@ -0,0 +1,1302 @@
+// Behavior tests for netserve.cpp. Build and run from the repository root:
+//
+//   g++ -std=c++17 -O2 tests/netserve_test.cpp -o netserve_test -lcurl -lz -pthread
+//   ./netserve_test [--server server.py] [--native-only] [test name...]
+//
+// Every test runs against `netserve serve` and then against server.py, each
+// started on a free loopback port in a scratch directory with HOME moved
+// there, the same way `netserve bench` does it.
+#define main netserve_main
+#include "../netserve.cpp"
+#undef main
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                                                 \
+    do {                                                                                            \
+        if (!(cond)) {                                                                              \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl;     \
+            g_failures++;                                                                           \
+        }                                                                                           \
+    } while (0)
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+static std::vector<TestCase> &test_cases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+#define TEST(name)                                                                                  \
+    static void name();                                                                             \
+    static const bool name##_registered = (test_cases().push_back({#name, name}), true);            \
+    static void name()
+
+// scratch state of the current run
+struct TestEnv {
+    std::string dir;        // scratch directory, also HOME
+    std::string server_dir; // the server's uploads directory
+    bool native = true;
+    std::string user = "tester", pass = "secret";
+    int seq = 0;
+};
+static TestEnv g_env;
+
+// a fresh path under the scratch directory
+static std::string scratch_path(const std::string &name) {
+    return g_env.dir + "/" + std::to_string(++g_env.seq) + "-" + name;
+}
+
+// a file of `size` pseudo-random bytes, different for each seed
+static std::string make_file(const std::string &name, long size, uint64_t seed = 1) {
+    std::string path = scratch_path(name);
+    bench_file(path, size, 1.0, seed);
+    return path;
+}
+
+static std::string file_bytes(const std::string &path) {
+    std::string out;
+    read_whole_file(path, out);
+    return out;
+}
+
+// the stored copy of `name`, fetched without the download cache
+static std::string fetch(const std::string &name) {
+    std::string out = scratch_path("fetch");
+    if (!download_file(name, g_env.user, g_env.pass, 1, out, 0)) return "";
+    return file_bytes(out);
+}
+
+// the listed entries whose name ends in `suffix`
+static std::vector<FileEntry> listed_ending(const std::string &suffix) {
+    std::vector<FileEntry> all, out;
+    CHECK(get_files_meta(g_env.user, g_env.pass, all));
+    for (const FileEntry &e : all)
+        if (e.filename.size() >= suffix.size() &&
+            e.filename.compare(e.filename.size() - suffix.size(), suffix.size(), suffix) == 0)
+            out.push_back(e);
+    return out;
+}
+
+// status of a bodyless request on a handle of its own, or 0 if it failed
+static long request_status(const char* method, const std::string &path, const std::string &user,
+                           const std::string &pass) {
+    CURL* curl = curl_easy_init();
+    std::string url = g_base_url + path, body;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    if (!user.empty()) {
+        curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+        curl_easy_setopt(curl, CURLOPT_USERNAME, user.c_str());
+        curl_easy_setopt(curl, CURLOPT_PASSWORD, pass.c_str());
+    }
+    long status = 0;
+    if (curl_easy_perform(curl) == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_cleanup(curl);
+    return status;
+}
+
+// the response headers of a GET of `path` sent with `extra` request headers;
+// its status goes to `status` and its body to `body`
+static std::string get_response(const std::string &path, const std::vector<std::string> &extra, long &status,
+                                std::string &body) {
+    CURL* curl = curl_easy_init();
+    std::string url = g_base_url + path, headers;
+    body.clear();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+    curl_easy_setopt(curl, CURLOPT_USERNAME, g_env.user.c_str());
+    curl_easy_setopt(curl, CURLOPT_PASSWORD, g_env.pass.c_str());
+    struct curl_slist* list = nullptr;
+    for (const std::string &h : extra) list = curl_slist_append(list, h.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+    status = 0;
+    if (curl_easy_perform(curl) == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_slist_free_all(list);
+    curl_easy_cleanup(curl);
+    return headers;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// ---------------- Streaming JSON ----------------
+// the events `text` parses to, fed one byte at a time, as "kind:text"
+// strings, with "error" last if the parser rejected it
+static std::vector<std::string> json_events(const std::string &text) {
+    static const char* kinds[] = {"{", "}", "[", "]", "key", "string", "number", "literal"};
+    std::vector<std::string> out;
+    JsonParser parser([&out](JsonEvent ev, const std::string &t) { out.push_back(kinds[(int)ev] + (":" + t)); });
+    bool ok = true;
+    for (size_t i = 0; ok && i < text.size(); ++i) ok = parser.feed(text.data() + i, 1);
+    if (!ok || !parser.finish()) out.push_back("error");
+    return out;
+}
+
+TEST(json_numbers_follow_the_grammar) {
+    if (!g_env.native) return;
+    for (const char* good : {"0", "-0", "12", "-3.25", "1e9", "2.5E-3", "6e+2"})
+        CHECK(json_events(good) == std::vector<std::string>{std::string("number:") + good});
+    CHECK((json_events("[1,-2.5e3]") == std::vector<std::string>{"[:", "number:1", "number:-2.5e3", "]:"}));
+    for (const char* bad : {"-", "1-2", "01", "1e", "1.", ".5", "1.e3", "--1", "1e+", "[01]"})
+        CHECK(json_events(bad).back() == "error");
+}
+
+TEST(json_strings_decode_escapes_and_surrogate_pairs) {
+    if (!g_env.native) return;
+    CHECK(json_events(R"("a\"\\\/\b\f\n\r\tz")") == std::vector<std::string>{"string:a\"\\/\b\f\n\r\tz"});
+    CHECK(json_events(R"("A\u00e9\u20AC")") == std::vector<std::string>{"string:A\xC3\xA9\xE2\x82\xAC"});
+    CHECK(json_events(R"("\ud83d\ude00")") == std::vector<std::string>{"string:\xF0\x9F\x98\x80"});
+    CHECK((json_events(R"({"\ud83dkey":"\ud83d"})") ==
+           std::vector<std::string>{"{:", "key:\xEF\xBF\xBDkey", "string:\xEF\xBF\xBD", "}:"}));
+    CHECK(json_events(R"("\ud83d\ud83d\ude00")") ==
+          std::vector<std::string>{"string:\xEF\xBF\xBD\xF0\x9F\x98\x80"});
+    CHECK(json_events(R"("\ud83d\n")") == std::vector<std::string>{"string:\xEF\xBF\xBD\n"});
+    for (const char* bad : {R"("\x")", R"("\u12g4")", "\"tab\there\"", R"("\U0041")"})
+        CHECK(json_events(bad).back() == "error");
+}
+
+TEST(truncated_json_is_rejected) {
+    if (!g_env.native) return;
+    for (const char* cut : {"", "{", "{\"a\"", "{\"a\":", "{\"a\":1", "{\"a\":1,", "[1,2", "[", "\"abc",
+                            "\"ab\\", "\"\\u12", "tru", "{\"files\":[{\"size\":1}"})
+        CHECK(json_events(cut).back() == "error");
+    for (const char* extra : {"{}{}", "1 2", "[1]]", "{\"a\":1}}", "[1,]", "{\"a\":1,}"})
+        CHECK(json_events(extra).back() == "error");
+    CHECK((json_events(" {\"a\":[true,null]} ") ==
+           std::vector<std::string>{"{:", "key:a", "[:", "literal:true", "literal:null", "]:", "}:"}));
+}
+
+// ---------------- Authentication ----------------
+TEST(password_checks_do_not_stall_other_requests) {
+    // server.py gives every request a thread of its own
+    if (!g_env.native) return;
+    auto start = std::chrono::steady_clock::now();
+    CHECK(request_status("GET", "/api/files", g_env.user, "wrong-0") == 403);
+    double kdf = seconds_since(start);
+
+    // every password is new, so each request runs the KDF
+    std::vector<std::thread> checks;
+    std::atomic<int> denied{0};
+    for (int i = 1; i <= 4; ++i)
+        checks.emplace_back([&denied, i] {
+            if (request_status("GET", "/api/files", g_env.user, "wrong-" + std::to_string(i)) == 403) denied++;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    start = std::chrono::steady_clock::now();
+    CHECK(request_status("GET", "/api/greet", "", "") == 200);
+    double greet = seconds_since(start);
+    for (auto &t : checks) t.join();
+    CHECK(denied == 4);
+    CHECK(greet < kdf / 2);
+    CHECK(request_status("GET", "/api/files", g_env.user, g_env.pass) == 200);
+}
+
+TEST(sessions_are_renewed_only_with_the_password) {
+    std::string token, saved = g_session_token;
+    long long expires = 0;
+    long status = 0;
+    CHECK(create_session(g_env.user, g_env.pass, token, expires, status) && status == 201);
+    CHECK(expires > time(nullptr) && expires <= time(nullptr) + 24 * 3600 + 60);
+    // the token works for requests but cannot mint a successor
+    g_session_token = token;
+    std::vector<FileEntry> files;
+    CHECK(get_files_meta(g_env.user, "", files));
+    std::string renewed;
+    CHECK(!create_session(g_env.user, "", renewed, expires, status) && status == 403);
+    g_session_token = saved;
+}
+
+TEST(users_added_to_the_file_can_log_in) {
+    // the other server, or an admin, writes users.json while this one runs
+    std::string name = "added-" + std::to_string(g_env.seq++), users_file = g_env.server_dir + "/users.json";
+    CHECK(request_status("GET", "/api/files", name, "added-secret") == 403);
+    std::map<std::string, Json> users = load_json_map(users_file);
+    CHECK(users.count(g_env.user));
+    Json user = Json::object();
+    user.set("password_hash", Json::of(generate_password_hash("added-secret")));
+    users[name] = user;
+    CHECK(save_json_map(users_file, users));
+    CHECK(request_status("GET", "/api/files", name, "added-secret") == 200);
+    CHECK(request_status("GET", "/api/files", g_env.user, g_env.pass) == 200);
+}
+
+TEST(damaged_session_key_is_replaced) {
+    // loads a key the way the native server does, in a directory of its own
+    if (!g_env.native) return;
+    std::string saved = g_store.base;
+    g_store.base = scratch_path("keys");
+    CHECK(mkdir(g_store.base.c_str(), S_IRWXU) == 0);
+    std::string path = g_store.base + "/session.key";
+    CHECK(write_file_atomic(path, "0123abcd\n"));
+    CHECK(store_session_key());
+    CHECK(g_store.session_key.size() == 32);
+    std::string hex = file_bytes(path);
+    CHECK(hex == hex_of((const unsigned char*)g_store.session_key.data(), 32) + "\n");
+    // a sound key is kept
+    std::string key = g_store.session_key;
+    CHECK(store_session_key() && g_store.session_key == key);
+    g_store.base = saved;
+}
+
+// posts a multipart form of `fields` and a file part; returns the status
+// and the reply in `reply`
+static long post_form(const std::string &path, const std::vector<std::pair<std::string, std::string>> &fields,
+                      const std::string &part_name, const std::string &data, std::string &reply,
+                      const std::string &user = g_env.user, const std::string &pass = g_env.pass) {
+    CURL* curl = curl_easy_init();
+    std::string url = g_base_url + path;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+    curl_easy_setopt(curl, CURLOPT_USERNAME, user.c_str());
+    curl_easy_setopt(curl, CURLOPT_PASSWORD, pass.c_str());
+    curl_mime* form = curl_mime_init(curl);
+    for (const auto &f : fields) {
+        curl_mimepart* part = curl_mime_addpart(form);
+        curl_mime_name(part, f.first.c_str());
+        curl_mime_data(part, f.second.c_str(), CURL_ZERO_TERMINATED);
+    }
+    curl_mimepart* part = curl_mime_addpart(form);
+    curl_mime_name(part, part_name.c_str());
+    curl_mime_filename(part, "blob");
+    curl_mime_data(part, data.data(), data.size());
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &reply);
+    long status = 0;
+    if (curl_easy_perform(curl) == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_mime_free(form);
+    curl_easy_cleanup(curl);
+    return status;
+}
+
+// posts one chunk of an upload
+static long post_chunk(const std::string &file_id, long index, long total, const std::string &data,
+                       const std::string &sha256, std::string &reply) {
+    return post_form("/api/upload/chunk",
+                     {{"file_id", file_id}, {"chunk_index", std::to_string(index)},
+                      {"total_chunks", std::to_string(total)}, {"chunk_sha256", sha256}},
+                     "chunk", data, reply);
+}
+
+// ---------------- Chunked uploads ----------------
+TEST(rejected_resend_keeps_the_stored_chunk) {
+    const long chunk = 1024 * 1024;
+    std::string path = make_file("resend.bin", 2 * chunk + 100, 7);
+    std::string name = "resend-" + std::to_string(g_env.seq) + ".bin";
+    std::string data = file_bytes(path), reply;
+    std::string id = init_upload(name, (long)data.size(), g_env.user, g_env.pass, chunk);
+    CHECK(!id.empty());
+    std::string first = data.substr(0, chunk), second = data.substr(chunk, chunk), last = data.substr(2 * chunk);
+    CHECK(post_chunk(id, 0, 3, first, sha256_hex(first.data(), first.size()), reply) == 200);
+    CHECK(post_chunk(id, 1, 3, second, sha256_hex(second.data(), second.size()), reply) == 200);
+    // a resend of both that fails its check must not touch what is stored
+    std::string garbage(chunk, 'x');
+    CHECK(post_chunk(id, 0, 3, garbage, sha256_hex(first.data(), first.size()), reply) == 400);
+    CHECK(post_chunk(id, 1, 3, garbage, sha256_hex(second.data(), second.size()), reply) == 400);
+    // and one that passes replaces it
+    CHECK(post_chunk(id, 1, 3, second, sha256_hex(second.data(), second.size()), reply) == 200);
+    reply.clear();
+    CHECK(post_chunk(id, 2, 3, last, sha256_hex(last.data(), last.size()), reply) == 200);
+    Json doc;
+    CHECK(json_parse(reply, doc) && doc.flag_of("assembled"));
+    CHECK(doc.str("sha256") == sha256_hex(data.data(), data.size()));
+    CHECK(fetch(name) == data);
+}
+
+TEST(deleting_an_unfinished_upload_drops_its_chunks) {
+    const long chunk = 1024 * 1024;
+    std::string data(chunk, 'u'), reply, response;
+    std::string id = init_upload("unfinished.bin", 2 * chunk, g_env.user, g_env.pass, chunk);
+    CHECK(post_chunk(id, 0, 2, data, sha256_hex(data.data(), data.size()), reply) == 200);
+    struct stat st;
+    std::string folder = g_env.server_dir + "/incomplete/" + id;
+    CHECK(stat(folder.c_str(), &st) == 0);
+    long status = 0;
+    CHECK(delete_file_id(id, g_env.user, g_env.pass, response, status) && status == 200);
+    CHECK(stat(folder.c_str(), &st) != 0);
+}
+
+TEST(chunk_offsets_stay_below_the_upload_limit) {
+    const long chunk = 1024 * 1024;
+    const long long limit = 1ll << 40;
+    std::string data(1000, 'o'), reply, response;
+    long status = 0;
+    CHECK(post_json("/api/upload/init", "{\"filename\":\"huge.bin\",\"total_size\":" + std::to_string(limit + 1) + "}",
+                    g_env.user, g_env.pass, response, status) && status == 400);
+    // a streamed upload declares no size, and total_chunks comes from the client
+    std::string id = init_upload("unsized.bin", 0, g_env.user, g_env.pass, chunk);
+    long last = (long)(limit / chunk);
+    CHECK(post_chunk(id, last, last + 1, data, "", reply) == 400);
+    CHECK(post_chunk(id, 1ll << 50, (1ll << 50) + 1, data, "", reply) == 400);
+    struct stat st;
+    std::string folder = g_env.server_dir + "/incomplete/" + id;
+    CHECK(stat((folder + "/" + UPLOAD_DATA).c_str(), &st) != 0 || st.st_size == 0);
+    CHECK(post_chunk(id, 0, 1, data, "", reply) == 200);
+    CHECK(delete_file_id(id, g_env.user, g_env.pass, response, status) && status == 200);
+}
+
+TEST(file_hasher_digests_chunks_in_the_same_pass) {
+    const long chunk = 300 * 1024;
+    std::string path = make_file("prefix.bin", 3 * chunk + 777, 55), data = file_bytes(path);
+    int fd = open(path.c_str(), O_RDONLY);
+    std::vector<std::string> digests(4);
+    std::string whole;
+    {
+        PrefixHasher hasher(fd, (curl_off_t)data.size(), chunk,
+                            [&digests](int index, const std::string &hex) { digests[index] = hex; });
+        hasher.advance((curl_off_t)data.size());
+        whole = hasher.finish();
+    }
+    close(fd);
+    CHECK(whole == sha256_hex(data.data(), data.size()));
+    for (size_t i = 0; i < digests.size(); ++i) {
+        std::string part = data.substr(i * chunk, chunk);
+        CHECK(digests[i] == sha256_hex(part.data(), part.size()));
+    }
+}
+
+TEST(upload_digest_is_kept_with_the_bitmap) {
+    // server.py's hashlib state cannot be saved
+    if (!g_env.native) return;
+    const long chunk = 1024 * 1024;
+    std::string data(2 * chunk, 'd'), reply;
+    std::string id = init_upload("digest.bin", (long)data.size(), g_env.user, g_env.pass, chunk);
+    std::string first = data.substr(0, chunk);
+    CHECK(post_chunk(id, 0, 2, first, "", reply) == 200);
+    std::string saved = file_bytes(g_env.server_dir + "/incomplete/" + id + "/digest");
+    CHECK(saved.compare(0, 2, "1 ") == 0);
+}
+
+TEST(stream_chunks_stay_within_the_cap) {
+    // a server without /api/capabilities would otherwise get CHUNK_SIZE chunks
+    CHECK(stream_chunk_size(ServerLimits(), 4, false) == STREAM_MAX_CHUNK);
+    CHECK(stream_chunk_size(server_limits(), 64, false) <= STREAM_MAX_CHUNK);
+}
+
+TEST(chunk_sizes_stay_within_the_advertised_limits) {
+    long status = 0;
+    std::string body, response;
+    get_response("/api/capabilities", {}, status, body);
+    CHECK(status == 200);
+    const ServerLimits &limits = server_limits();
+    CHECK(limits.adaptive);
+    CHECK((long long)limits.min_chunk == json_int_field(body, "min_chunk_size"));
+    CHECK((long long)limits.max_chunk == json_int_field(body, "max_chunk_size"));
+    for (long total : {0L, 1000L, 50L * 1024 * 1024, 1L << 40})
+        for (int jobs : {1, 4, 64})
+            for (bool compress : {false, true}) {
+                size_t size = choose_chunk_size(total, jobs, compress);
+                CHECK(size >= limits.min_chunk && size <= limits.max_chunk);
+                if (compress) CHECK(size <= std::max(COMPRESS_MAX_BODY, limits.min_chunk));
+            }
+    g_forced_chunk_size = 1;
+    CHECK(choose_chunk_size(1L << 30, 4, false) == limits.min_chunk);
+    g_forced_chunk_size = 0;
+
+    // the server holds uploads to the same bounds
+    for (long long chunk : {1LL, (long long)limits.max_chunk + 1})
+        CHECK(post_json("/api/upload/init", "{\"filename\":\"sized.bin\",\"total_size\":10,\"chunk_size\":" +
+                        std::to_string(chunk) + "}", g_env.user, g_env.pass, response, status) && status == 400);
+    CHECK(post_json("/api/upload/init", "{\"filename\":\"sized.bin\",\"total_size\":10,\"chunk_size\":" +
+                    std::to_string(limits.min_chunk) + "}", g_env.user, g_env.pass, response, status) && status == 201);
+}
+
+// ---------------- Parallel transfers ----------------
+// requests of `kind` recorded so far
+static size_t recorded(const std::string &kind) {
+    std::lock_guard<std::mutex> lk(g_metrics.lock);
+    return (size_t)std::count_if(g_metrics.requests.begin(), g_metrics.requests.end(),
+                                 [&](const RequestMetric &m) { return m.kind == kind; });
+}
+
+TEST(chunk_bodies_are_read_from_their_window_of_the_file) {
+    if (!g_env.native) return;
+    std::string path = make_file("window.bin", 20000, 51), data = file_bytes(path);
+    int fd = open(path.c_str(), O_RDONLY);
+    CHECK(fd >= 0);
+    ChunkSource src;
+    src.fd = fd;
+    src.offset = 3000;
+    src.size = 9000;
+    std::string sent;
+    char buf[777];
+    for (size_t n; (n = chunk_read_cb(buf, 1, sizeof(buf), &src)) > 0;) sent.append(buf, n);
+    CHECK(sent == data.substr(3000, 9000));
+
+    // a resend after a redirect or auth retry starts the window again
+    CHECK(chunk_seek_cb(&src, 100, SEEK_SET) == CURL_SEEKFUNC_OK);
+    CHECK(chunk_read_cb(buf, 1, 10, &src) == 10 && std::string(buf, 10) == data.substr(3100, 10));
+    CHECK(chunk_seek_cb(&src, 9001, SEEK_SET) == CURL_SEEKFUNC_CANTSEEK);
+    CHECK(chunk_seek_cb(&src, 0, SEEK_END) == CURL_SEEKFUNC_CANTSEEK);
+
+    // a file that shrank under the upload aborts it instead of sending short
+    close(fd);
+    CHECK(truncate(path.c_str(), 5000) == 0);
+    fd = open(path.c_str(), O_RDONLY);
+    src.fd = fd;
+    src.pos = 0;
+    sent.clear();
+    size_t n = 0;
+    while ((n = chunk_read_cb(buf, 1, sizeof(buf), &src)) > 0 && n != CURL_READFUNC_ABORT) sent.append(buf, n);
+    CHECK(n == CURL_READFUNC_ABORT && sent == data.substr(3000, 2000));
+    close(fd);
+}
+
+TEST(parallel_upload_stores_one_copy_of_the_whole_file) {
+    std::string path = make_file("parallel.bin", 3 * 1024 * 1024 + 12345, 52);
+    std::string name = "parallel-" + std::to_string(g_env.seq) + ".bin";
+    size_t chunks = recorded("chunk");
+    g_forced_chunk_size = 1024 * 1024;
+    CHECK(upload_file(path, g_env.user, g_env.pass, 4, false, false, name, nullptr));
+    g_forced_chunk_size = 0;
+    CHECK(recorded("chunk") - chunks == 4);
+    CHECK(listed_ending(name).size() == 1);
+    CHECK(fetch(name) == file_bytes(path));
+}
+
+TEST(ranged_download_fetches_the_file_in_parts) {
+    std::string path = make_file("ranged.bin", 10 * 1024 * 1024 + 12345, 53), data = file_bytes(path);
+    std::string name = "ranged-" + std::to_string(g_env.seq) + ".bin";
+    CHECK(upload_file(path, g_env.user, g_env.pass, 2, false, false, name, nullptr));
+    size_t ranges = recorded("range");
+    std::string out = scratch_path(name);
+    CHECK(download_file(name, g_env.user, g_env.pass, 4, out, 0));
+    CHECK(recorded("range") - ranges == 3);
+    CHECK(file_bytes(out) == data);
+    CHECK(access((out + ".part").c_str(), F_OK) != 0);
+
+    long status = 0;
+    std::string body;
+    std::string headers = get_response("/api/download/" + name, {"Range: bytes=100-199"}, status, body);
+    CHECK(status == 206);
+    CHECK(header_value(headers, "content-range") == "bytes 100-199/" + std::to_string(data.size()));
+    CHECK(body == data.substr(100, 100));
+}
+
+// server.py's development server closes the connection after every reply
+TEST(sequential_requests_share_one_connection) {
+    if (!g_env.native) return;
+    long connects = -1;
+    std::string url = endpoint("/api/capabilities"), body;
+    for (int i = 0; i < 2; ++i) {
+        CURL* curl = session_handle();
+        CHECK(curl == session_handle());
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+        CHECK(curl_easy_perform(curl) == CURLE_OK);
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    }
+    CHECK(connects == 0);
+
+    // a handle of its own still draws on the shared connection cache
+    CURL* curl = session_new_handle();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    CHECK(curl_easy_perform(curl) == CURLE_OK);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    CHECK(connects == 0);
+    curl_easy_cleanup(curl);
+}
+
+// ---------------- Compression ----------------
+TEST(compressed_chunks_stay_within_the_memory_cap) {
+    CHECK(choose_chunk_size(1ll << 40, 4, true) <= COMPRESS_MAX_BODY);
+    CHECK(deflate_limit((curl_off_t)CHUNK_SIZE) <= COMPRESS_MAX_BODY);
+
+    // a chunk within the cap is still deflated and comes back whole
+    std::string text;
+    for (int i = 0; text.size() < 3 * 1024 * 1024; ++i) text += "row " + std::to_string(i) + ",ok,compressible\n";
+    PendingChunk small;
+    std::string path = scratch_path("compressible.csv");
+    CHECK(write_file_atomic(path, text));
+    int fd = open(path.c_str(), O_RDONLY);
+    digest_chunk(fd, 0, (curl_off_t)text.size(), true, small);
+    close(fd);
+    CHECK(!small.body.empty() && small.body.size() < text.size() / 2);
+    std::string name = "compressed-" + std::to_string(g_env.seq) + ".csv";
+    CHECK(upload_file(path, g_env.user, g_env.pass, 2, false, true, name, nullptr));
+    CHECK(fetch(name) == text);
+}
+
+// ---------------- Chunk store ----------------
+TEST(stored_chunks_count_only_for_users_who_sent_them) {
+    std::string chunk = file_bytes(make_file("owned.bin", 100000, 51));
+    std::string hash = sha256_hex(chunk.data(), chunk.size()), reply, response;
+    CHECK(post_form("/api/chunks/upload", {{"hash", hash}}, "chunk", chunk, reply) == 201);
+
+    std::string other = "other-" + std::to_string(g_env.seq), other_pass = "other-secret";
+    CHECK(create_user(other, other_pass));
+    long status = 0;
+    CHECK(post_json("/api/chunks/query", "{\"hashes\":[\"" + hash + "\"]}", other, other_pass, response, status));
+    CHECK(status == 200 && json_string_list(response, "missing") == std::vector<std::string>{hash});
+    // naming the hash in a manifest does not borrow the chunk either
+    std::string id = init_upload("borrowed.bin", (long)chunk.size(), other, other_pass);
+    std::string manifest = "{\"file_id\":\"" + id + "\",\"chunks\":[{\"hash\":\"" + hash +
+                           "\",\"size\":" + std::to_string(chunk.size()) + "}]}";
+    CHECK(post_json("/api/upload/manifest", manifest, other, other_pass, response, status) && status == 409);
+    // the bytes are checked even though the store has them
+    CHECK(post_form("/api/chunks/upload", {{"hash", hash}}, "chunk", std::string(chunk.size(), 'z'), reply, other,
+                    other_pass) == 400);
+    CHECK(post_form("/api/chunks/upload", {{"hash", hash}}, "chunk", chunk, reply, other, other_pass) == 200);
+    CHECK(post_json("/api/upload/manifest", manifest, other, other_pass, response, status) && status == 200);
+}
+
+TEST(manifest_digest_is_taken_from_the_chunks) {
+    std::string chunk = file_bytes(make_file("digested.bin", 70000, 56)), reply, response;
+    std::string hash = sha256_hex(chunk.data(), chunk.size());
+    CHECK(post_form("/api/chunks/upload", {{"hash", hash}}, "chunk", chunk, reply) == 201);
+    std::string chunks = "\"chunks\":[{\"hash\":\"" + hash + "\",\"size\":" + std::to_string(chunk.size()) + "}]}";
+    long status = 0;
+    std::string id = init_upload("digested.bin", (long)chunk.size(), g_env.user, g_env.pass);
+    CHECK(post_json("/api/upload/manifest", "{\"file_id\":\"" + id + "\"," + chunks, g_env.user, g_env.pass,
+                    response, status));
+    CHECK(status == 200 && json_string_field(response, "sha256") == hash);
+    // a digest the chunks do not add up to is refused
+    std::string other = init_upload("misdigested.bin", (long)chunk.size(), g_env.user, g_env.pass);
+    std::string wrong = "{\"file_id\":\"" + other + "\",\"sha256\":\"" + std::string(64, '0') + "\"," + chunks;
+    CHECK(post_json("/api/upload/manifest", wrong, g_env.user, g_env.pass, response, status) && status == 400);
+}
+
+TEST(racing_manifest_commits_reference_the_chunks_once) {
+    std::string chunk = file_bytes(make_file("racing.bin", 60000, 57)), reply;
+    std::string hash = sha256_hex(chunk.data(), chunk.size());
+    CHECK(post_form("/api/chunks/upload", {{"hash", hash}}, "chunk", chunk, reply) == 201);
+    std::string id = init_upload("racing.bin", (long)chunk.size(), g_env.user, g_env.pass);
+    std::string manifest = "{\"file_id\":\"" + id + "\",\"chunks\":[{\"hash\":\"" + hash +
+                           "\",\"size\":" + std::to_string(chunk.size()) + "}]}";
+    std::vector<long> statuses(4);
+    std::vector<std::thread> commits;
+    for (size_t i = 0; i < statuses.size(); ++i)
+        commits.emplace_back([&manifest, &statuses, i] {
+            std::string response;
+            post_json("/api/upload/manifest", manifest, g_env.user, g_env.pass, response, statuses[i]);
+        });
+    for (auto &t : commits) t.join();
+    CHECK(std::count(statuses.begin(), statuses.end(), 200) == 1);
+    CHECK(std::count(statuses.begin(), statuses.end(), 409) == 3);
+    Json refs = load_json_file(g_env.server_dir + "/chunk_refs.json");
+    CHECK(refs.get(hash) && refs.get(hash)->as_int() == 1);
+}
+
+TEST(sweep_removes_chunks_no_manifest_claims) {
+    // calls the native server's sweep on its store directly
+    if (!g_env.native) return;
+    std::string orphan = file_bytes(make_file("orphan.bin", 5000, 52)), reply;
+    std::string orphan_hash = sha256_hex(orphan.data(), orphan.size());
+    CHECK(post_form("/api/chunks/upload", {{"hash", orphan_hash}}, "chunk", orphan, reply) == 201);
+    std::string kept_path = make_file("kept.bin", 5000, 53), kept = file_bytes(kept_path);
+    std::string kept_hash = sha256_hex(kept.data(), kept.size());
+    CHECK(upload_file_cdc(kept_path, g_env.user, g_env.pass, 1));
+    std::string fresh = file_bytes(make_file("fresh.bin", 5000, 54));
+    std::string fresh_hash = sha256_hex(fresh.data(), fresh.size());
+    CHECK(post_form("/api/chunks/upload", {{"hash", fresh_hash}}, "chunk", fresh, reply) == 201);
+
+    g_store.chunks = g_env.server_dir + "/chunks";
+    std::string stale_tmp = store_chunk_path(orphan_hash) + ".0.tmp";
+    CHECK(write_file_atomic(stale_tmp, "partial"));
+    time_t old = time(nullptr) - CHUNK_SWEEP_GRACE - 60;
+    struct timespec old_times[2] = {{old, 0}, {old, 0}};
+    for (const std::string &path : {store_chunk_path(orphan_hash), store_chunk_path(kept_hash), stale_tmp})
+        CHECK(utimensat(AT_FDCWD, path.c_str(), old_times, 0) == 0);
+    sweep_chunk_store_locked(load_json_map(g_env.server_dir + "/chunk_refs.json"));
+
+    CHECK(!is_regular_file(store_chunk_path(orphan_hash)));
+    CHECK(!is_regular_file(store_chunk_users_path(orphan_hash)));
+    CHECK(!is_regular_file(stale_tmp));
+    CHECK(is_regular_file(store_chunk_path(kept_hash)));
+    CHECK(is_regular_file(store_chunk_path(fresh_hash)));
+}
+
+// ---------------- Delta updates ----------------
+// the response headers of a download of `name` sent with `extra` request
+// headers, and its status in `status`
+static std::string download_headers(const std::string &name, const std::vector<std::string> &extra, long &status) {
+    std::string body;
+    return get_response("/api/download/" + name, extra, status, body);
+}
+
+// the Content-Encoding a download of `name` comes back with when gzip is offered
+static std::string download_encoding(const std::string &name) {
+    long status;
+    return header_value(download_headers(name, {"Accept-Encoding: gzip"}, status), "content-encoding");
+}
+
+TEST(delta_update_replaces_the_file_and_its_chunk_records) {
+    std::string name = "delta-" + std::to_string(g_env.seq) + ".txt";
+    std::string path = scratch_path(name), text;
+    for (int i = 0; text.size() < 3 * 1024 * 1024; ++i) text += "line " + std::to_string(i) + " of the old version\n";
+    CHECK(write_file_atomic(path, text));
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, true, name, nullptr));
+    CHECK(download_encoding(name) == "gzip");
+
+    // random blocks in the middle of the text: most of it is copied from
+    // the stored version, and the result no longer compresses
+    std::string noise = file_bytes(make_file("noise.bin", 2 * 1024 * 1024, 11));
+    std::string updated = text.substr(0, 512 * 1024) + noise + text.substr(2 * 1024 * 1024);
+    std::string update_path = scratch_path(name);
+    CHECK(write_file_atomic(update_path, updated));
+    CHECK(upload_update(update_path, name, g_env.user, g_env.pass));
+    CHECK(fetch(name) == updated);
+    CHECK(download_encoding(name) == "");
+}
+
+TEST(gzip_downloads_carry_their_own_etag) {
+    std::string name = "tagged-" + std::to_string(g_env.seq) + ".txt";
+    std::string path = scratch_path(name), text;
+    for (int i = 0; text.size() < 1024 * 1024; ++i) text += "entry " + std::to_string(i) + " compresses well\n";
+    CHECK(write_file_atomic(path, text));
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, true, name, nullptr));
+    long status = 0;
+    std::string plain = download_headers(name, {}, status);
+    CHECK(status == 200 && header_value(plain, "content-encoding").empty());
+    std::string zipped = download_headers(name, {"Accept-Encoding: gzip"}, status);
+    CHECK(status == 200 && header_value(zipped, "content-encoding") == "gzip");
+    std::string plain_tag = header_value(plain, "etag"), zipped_tag = header_value(zipped, "etag");
+    CHECK(!plain_tag.empty() && !zipped_tag.empty() && plain_tag != zipped_tag);
+    CHECK(header_value(plain, "vary") == "Accept-Encoding" && header_value(zipped, "vary") == "Accept-Encoding");
+    // each tag revalidates only its own encoding
+    download_headers(name, {"Accept-Encoding: gzip", "If-None-Match: " + zipped_tag}, status);
+    CHECK(status == 304);
+    download_headers(name, {"Accept-Encoding: gzip", "If-None-Match: " + plain_tag}, status);
+    CHECK(status == 200);
+    download_headers(name, {"If-None-Match: " + plain_tag}, status);
+    CHECK(status == 304);
+    CHECK(fetch(name) == text);
+}
+
+TEST(signatures_of_large_blocks_match_the_file) {
+    const size_t block = 4 * 1024 * 1024;
+    std::string path = make_file("signed.bin", 2 * block + 12345, 5);
+    std::string name = "signed-" + std::to_string(g_env.seq) + ".bin", id;
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, name, &id));
+    BlockSignatures sigs;
+    std::string response;
+    long status;
+    CHECK(fetch_signatures(id, block, g_env.user, g_env.pass, sigs, response, status));
+    std::string data = file_bytes(path);
+    CHECK(sigs.count() == 3);
+    for (size_t i = 0; i < sigs.count() && i * block < data.size(); ++i) {
+        size_t n = std::min(block, data.size() - i * block);
+        const unsigned char* p = (const unsigned char*)data.data() + i * block;
+        CHECK(sigs.weak(i) == (uint32_t)adler32(1, p, (uInt)n));
+        CHECK(sha256_hex(p, n) == hex_of(sigs.strong(i), 32));
+    }
+}
+
+// ---------------- Tree sync ----------------
+TEST(deleting_an_older_entry_keeps_the_newer_file) {
+    std::string name = "renewed-" + std::to_string(g_env.seq) + ".bin", old_id, new_id;
+    std::string first = make_file("renewed.bin", 10000, 41), second = make_file("renewed.bin", 12000, 42);
+    CHECK(upload_file(first, g_env.user, g_env.pass, 1, false, false, name, &old_id));
+    CHECK(upload_file(second, g_env.user, g_env.pass, 1, false, false, name, &new_id));
+    std::string response;
+    long status = 0;
+    CHECK(delete_file_id(old_id, g_env.user, g_env.pass, response, status) && status == 200);
+    CHECK(fetch(name) == file_bytes(second));
+}
+
+TEST(sync_replaces_changed_files_after_uploading) {
+    std::string dir = scratch_path("synced");
+    CHECK(mkdir(dir.c_str(), S_IRWXU) == 0);
+    std::string path = dir + "/notes.txt";
+    CHECK(write_file_atomic(path, "first version\n"));
+    CHECK(sync_tree(dir, g_env.user, g_env.pass, 1, false));
+    CHECK(write_file_atomic(path, "second, longer version\n"));
+    CHECK(sync_tree(dir, g_env.user, g_env.pass, 1, false));
+    std::vector<FileEntry> entries = listed_ending("notes.txt");
+    CHECK(entries.size() == 1);
+    if (!entries.empty()) CHECK(fetch(entries[0].filename) == "second, longer version\n");
+}
+
+TEST(tree_members_keep_distinct_names) {
+    std::string dir = scratch_path("tree");
+    CHECK(mkdir(dir.c_str(), S_IRWXU) == 0);
+    CHECK(mkdir((dir + "/a").c_str(), S_IRWXU) == 0 && mkdir((dir + "/a_b").c_str(), S_IRWXU) == 0);
+    CHECK(write_file_atomic(dir + "/a/b_c", "under a\n") && write_file_atomic(dir + "/a_b/c", "under a_b\n"));
+    CHECK(upload_tree(dir, g_env.user, g_env.pass, 2, false));
+    CHECK(tree_member_name("a/b_c") != tree_member_name("a_b/c"));
+    CHECK(tree_member_name("src/main.cpp") == "src_main.cpp");
+    CHECK(fetch(tree_member_name("a/b_c")) == "under a\n");
+    CHECK(fetch(tree_member_name("a_b/c")) == "under a_b\n");
+}
+
+TEST(batch_registrations_keep_their_chunk_size) {
+    const long chunk = 1024 * 1024;
+    std::string data = file_bytes(make_file("batched.bin", 2 * chunk + chunk / 2, 43)), response, reply;
+    std::string name = "batched-" + std::to_string(g_env.seq) + ".bin";
+    long status = 0;
+    CHECK(post_json("/api/upload/init_batch", "{\"files\":[{\"filename\":\"small.bin\",\"total_size\":10,"
+                    "\"chunk_size\":1}]}", g_env.user, g_env.pass, response, status) && status == 400);
+    CHECK(post_json("/api/upload/init_batch", "{\"files\":[{\"filename\":\"" + name + "\",\"total_size\":" +
+                    std::to_string(data.size()) + ",\"chunk_size\":" + std::to_string(chunk) + "}]}",
+                    g_env.user, g_env.pass, response, status) && status == 201);
+    std::vector<std::string> ids = json_string_list(response, "file_ids");
+    CHECK(ids.size() == 1);
+    if (ids.size() != 1) return;
+    for (long i = 0; i < 3; ++i) {
+        std::string part = data.substr(i * chunk, chunk);
+        CHECK(post_chunk(ids[0], i, 3, part, sha256_hex(part.data(), part.size()), reply) == 200);
+    }
+    CHECK(fetch(name) == data);
+}
+
+TEST(rejected_bundle_drops_its_registrations) {
+    std::string dir = scratch_path("bundled");
+    CHECK(mkdir(dir.c_str(), S_IRWXU) == 0);
+    std::vector<TreeFile> files(2);
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i].rel = "bundled-" + std::to_string(g_env.seq) + "-" + std::to_string(i);
+        files[i].size = 5;
+    }
+    std::vector<const TreeFile*> list{&files[0], &files[1]};
+    std::vector<std::string> ids;
+    CHECK(init_upload_batch(list, g_env.user, g_env.pass, ids) && ids.size() == 2);
+    if (ids.size() != 2) return;
+    std::string members = "[{\"file_id\":\"" + ids[0] + "\",\"size\":5},{\"file_id\":\"" + ids[1] +
+                          "\",\"size\":5}]";
+    std::string reply;
+    CHECK(post_form("/api/upload/bundle", {{"files", members}, {"chunk_sha256", std::string(64, '0')}}, "bundle",
+                    "helloworld", reply) == 400);
+    for (const std::string &id : ids)
+        CHECK(request_status("GET", "/api/upload/status/" + id, g_env.user, g_env.pass) == 404);
+}
+
+// ---------------- Listing ----------------
+TEST(listing_pages_follow_the_cursor) {
+    std::string prefix = "paged-" + std::to_string(g_env.seq) + "-";
+    std::string path = scratch_path("paged.txt");
+    CHECK(write_file_atomic(path, "one of three\n"));
+    for (const char* suffix : {"c", "a", "b"})
+        CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, prefix + suffix, nullptr));
+
+    std::vector<std::string> names;
+    std::string cursor;
+    for (int page = 0; page < 5; ++page) {
+        char* p = curl_easy_escape(nullptr, prefix.c_str(), (int)prefix.size());
+        char* c = curl_easy_escape(nullptr, cursor.c_str(), (int)cursor.size());
+        long status = 0;
+        std::string body;
+        get_response(std::string("/api/files?limit=1&prefix=") + p + "&cursor=" + c, {}, status, body);
+        curl_free(p);
+        curl_free(c);
+        Json reply;
+        CHECK(status == 200 && json_parse(body, reply));
+        const Json* files = reply.get("files");
+        CHECK(files && files->items.size() == 1);
+        if (files && files->items.size() == 1) names.push_back(files->items[0].str("filename"));
+        cursor = reply.str("next_cursor");
+        if (cursor.empty()) {
+            const Json* next = reply.get("next_cursor");
+            CHECK(next && next->type == Json::Type::Null);
+            break;
+        }
+    }
+    CHECK((names == std::vector<std::string>{prefix + "a", prefix + "b", prefix + "c"}));
+
+    std::vector<std::string> streamed;
+    CHECK(for_each_file(g_env.user, g_env.pass, prefix, [&](const FileEntry &e) { streamed.push_back(e.filename); },
+                        nullptr));
+    CHECK(streamed == names);
+}
+
+TEST(unchanged_listing_is_revalidated_with_304) {
+    Validator v;
+    size_t entries = 0;
+    auto count = [&](const FileEntry &) { entries++; };
+    CHECK(for_each_file(g_env.user, g_env.pass, "", count, &v));
+    CHECK(!v.not_modified && !v.etag.empty());
+    std::string etag = v.etag;
+
+    long status = 0;
+    std::string body;
+    get_response("/api/files", {"If-None-Match: " + etag}, status, body);
+    CHECK(status == 304 && body.empty());
+    Validator same;
+    same.if_none_match = etag;
+    entries = 0;
+    CHECK(for_each_file(g_env.user, g_env.pass, "", count, &same));
+    CHECK(same.not_modified && entries == 0);
+
+    // any change to the account's files gives the listing a new ETag
+    std::string path = scratch_path("revalidated.txt");
+    CHECK(write_file_atomic(path, "changes the listing\n"));
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, "", nullptr));
+    Validator changed;
+    changed.if_none_match = etag;
+    CHECK(for_each_file(g_env.user, g_env.pass, "", count, &changed));
+    CHECK(!changed.not_modified && entries > 0 && !changed.etag.empty() && changed.etag != etag);
+    get_response("/api/files", {"If-None-Match: " + etag}, status, body);
+    CHECK(status == 200);
+}
+
+// ---------------- Batch operations ----------------
+TEST(batch_results_follow_the_request_order) {
+    const std::string other = "batcher", other_pass = "batcher-secret";
+    CHECK(create_user(other, other_pass));
+    std::string path = scratch_path("batched.txt");
+    CHECK(write_file_atomic(path, "batch member\n"));
+    std::string mine, kept, theirs, response;
+    std::string base = "batch-" + std::to_string(g_env.seq);
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, base + "-mine", &mine));
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, base + "-kept", &kept));
+    CHECK(upload_file(path, other, other_pass, 1, false, false, base + "-theirs", &theirs));
+    long status = 0;
+
+    std::vector<BatchResult> results;
+    CHECK(post_json("/api/file/share_batch", "{\"file_ids\":[\"" + mine + "\",\"no-such-id\",\"" + theirs + "\",\"" +
+                    mine + "\"],\"share_with\":\"" + other + "\"}", g_env.user, g_env.pass, response, status));
+    CHECK(status == 200 && parse_batch_results(response, results));
+    CHECK(results.size() == 4);
+    if (results.size() == 4) {
+        CHECK(results[0].file_id == mine && results[0].status == "shared" && results[0].error.empty());
+        CHECK(results[1].file_id == "no-such-id" && results[1].status.empty() && !results[1].error.empty());
+        CHECK(results[2].file_id == theirs && results[2].status.empty() && !results[2].error.empty());
+        CHECK(results[3].file_id == mine && results[3].status == "already_shared");
+    }
+    CHECK(post_json("/api/file/share_batch", "{\"file_ids\":[\"" + mine + "\"],\"share_with\":\"nobody-" + base +
+                    "\"}", g_env.user, g_env.pass, response, status) && status == 404);
+
+    results.clear();
+    CHECK(post_json("/api/file/delete_batch", "{\"file_ids\":[\"" + kept + "\",\"no-such-id\",\"" + theirs + "\",\"" +
+                    kept + "\",\"" + mine + "\"]}", g_env.user, g_env.pass, response, status));
+    CHECK(status == 200 && parse_batch_results(response, results));
+    CHECK(results.size() == 5);
+    if (results.size() == 5) {
+        CHECK(results[0].file_id == kept && results[0].status == "deleted");
+        CHECK(results[1].file_id == "no-such-id" && !results[1].error.empty());
+        CHECK(results[2].file_id == theirs && !results[2].error.empty());
+        CHECK(results[3].file_id == kept && !results[3].error.empty());
+        CHECK(results[4].file_id == mine && results[4].status == "deleted");
+    }
+    CHECK(listed_ending(base + "-mine").empty() && listed_ending(base + "-kept").empty());
+    std::vector<FileEntry> left;
+    CHECK(get_files_meta(other, other_pass, left));
+    CHECK(std::count_if(left.begin(), left.end(), [&](const FileEntry &e) { return e.file_id == theirs; }) == 1);
+    CHECK(post_json("/api/file/delete_batch", "{\"file_ids\":[]}", g_env.user, g_env.pass, response, status) &&
+          status == 400);
+}
+
+// ---------------- Download cache ----------------
+// the cached blobs and refs under HOME
+static size_t cache_entries(const std::string &sub, const std::string &suffix) {
+    size_t n = 0;
+    if (DIR* d = opendir((download_cache_dir() + sub).c_str())) {
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name[0] != '.' && name.size() >= suffix.size() &&
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+                ++n;
+        }
+        closedir(d);
+    }
+    return n;
+}
+
+TEST(cached_downloads_are_copies_of_their_blob) {
+    std::string path = make_file("cached.bin", 300 * 1024, 21);
+    std::string name = "cached-" + std::to_string(g_env.seq) + ".bin";
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, name, nullptr));
+    std::string first = scratch_path(name), second = scratch_path(name);
+    CHECK(download_file(name, g_env.user, g_env.pass, 1, first));
+    CachedDownload cached;
+    CHECK(cache_lookup(g_env.user, name, cached));
+    struct stat blob, out;
+    CHECK(stat(blob_path(cached.sha256).c_str(), &blob) == 0 && stat(first.c_str(), &out) == 0);
+    CHECK(blob.st_ino != out.st_ino);
+
+    // editing a download leaves the cached copy the next hit restores intact
+    int fd = open(first.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, "edited", 6) == 6);
+    if (fd >= 0) close(fd);
+    CHECK(download_file(name, g_env.user, g_env.pass, 1, second));
+    CHECK(stat(second.c_str(), &out) == 0 && blob.st_ino != out.st_ino);
+    CHECK(file_bytes(second) == file_bytes(path));
+}
+
+TEST(reuploaded_name_downloads_the_newest_copy) {
+    std::string name = "reuploaded-" + std::to_string(g_env.seq) + ".txt";
+    std::string first = scratch_path(name), second = scratch_path(name);
+    CHECK(write_file_atomic(first, "the first upload\n") && write_file_atomic(second, "the second, changed upload\n"));
+    CHECK(upload_file(first, g_env.user, g_env.pass, 1, false, false, name, nullptr));
+    std::string out = scratch_path(name);
+    CHECK(download_file(name, g_env.user, g_env.pass, 1, out));
+    CHECK(file_bytes(out) == "the first upload\n");
+    // both entries stay listed; the name belongs to the newer one
+    CHECK(upload_file(second, g_env.user, g_env.pass, 1, false, false, name, nullptr));
+    CHECK(fetch(name) == "the second, changed upload\n");
+    out = scratch_path(name);
+    CHECK(download_file(name, g_env.user, g_env.pass, 1, out));
+    CHECK(file_bytes(out) == "the second, changed upload\n");
+}
+
+TEST(damaged_blob_is_fetched_again) {
+    std::string path = make_file("damaged.bin", 200 * 1024, 22);
+    std::string name = "damaged-" + std::to_string(g_env.seq) + ".bin";
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, name, nullptr));
+    CHECK(download_file(name, g_env.user, g_env.pass, 1, scratch_path(name)));
+    CachedDownload cached;
+    CHECK(cache_lookup(g_env.user, name, cached));
+    std::string blob = blob_path(cached.sha256);
+    chmod(blob.c_str(), S_IRUSR | S_IWUSR);
+    int fd = open(blob.c_str(), O_WRONLY);
+    CHECK(fd >= 0 && pwrite(fd, "XXXX", 4, 1000) == 4);
+    if (fd >= 0) close(fd);
+
+    std::string out = scratch_path(name);
+    CHECK(download_file(name, g_env.user, g_env.pass, 1, out));
+    CHECK(file_bytes(out) == file_bytes(path));
+    CHECK(file_bytes(blob) == file_bytes(path));
+}
+
+TEST(refs_are_evicted_with_their_blob) {
+    const long size = 256 * 1024;
+    for (int i = 0; i < 3; ++i) {
+        std::string path = make_file("evicted.bin", size, 30 + i);
+        std::string name = "evicted-" + std::to_string(g_env.seq) + ".bin";
+        CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, name, nullptr));
+        CHECK(download_file(name, g_env.user, g_env.pass, 1, scratch_path(name), size + size / 2));
+    }
+    CHECK(cache_entries("/blobs", "") == 1);
+    CHECK(cache_entries("", ".download") == 1);
+}
+
+// ---------------- Remote reads ----------------
+// what `run` writes to stdout; `ok` is what it returned
+static std::string stdout_of(const std::function<bool()> &run, bool &ok) {
+    std::cout.flush();
+    std::string path = scratch_path("stdout");
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600), saved = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    ok = run();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return file_bytes(path);
+}
+
+TEST(remote_reads_return_the_requested_ranges) {
+    std::string data;
+    for (int i = 0; i < 30000; ++i) data += "line " + std::to_string(i) + "\n";
+    std::string path = scratch_path("remote.txt"), name = "remote-" + std::to_string(g_env.seq) + ".txt";
+    CHECK(write_file_atomic(path, data));
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, false, false, name, nullptr));
+    long long size = (long long)data.size();
+
+    RemoteFile file;
+    CHECK(file.open(name, g_env.user, g_env.pass));
+    CHECK(file.size() == size);
+    std::vector<char> buf(200000);
+    // across a block boundary, then sequential reads that grow the readahead
+    CHECK(file.read(REMOTE_BLOCK - 10, buf.data(), 20) == 20);
+    CHECK(std::string(buf.data(), 20) == data.substr(REMOTE_BLOCK - 10, 20));
+    std::string whole;
+    for (long long pos = 0, n; pos < size; pos += n) {
+        n = file.read(pos, buf.data(), 30000);
+        CHECK(n > 0);
+        if (n <= 0) break;
+        whole.append(buf.data(), (size_t)n);
+    }
+    CHECK(whole == data);
+    CHECK(file.read(size - 10, buf.data(), 100) == 10 && std::string(buf.data(), 10) == data.substr(size - 10));
+    CHECK(file.read(size, buf.data(), 100) == 0);
+
+    bool ok = false;
+    CHECK(stdout_of([&] { return remote_cat(file, 1000, 5000); }, ok) == data.substr(1000, 5000) && ok);
+    CHECK(stdout_of([&] { return remote_cat(file, size - 7, -1); }, ok) == data.substr(size - 7) && ok);
+    CHECK(stdout_of([&] { return remote_head_lines(file, 3); }, ok) == "line 0\nline 1\nline 2\n" && ok);
+
+    RemoteFile tail;
+    CHECK(tail.open(name, g_env.user, g_env.pass, -1));
+    long long start = remote_tail_start(tail, 2);
+    CHECK(start >= 0 && data.substr((size_t)start) == "line 29998\nline 29999\n");
+    CHECK(remote_tail_start(tail, 0) == size);
+    CHECK(remote_tail_start(tail, 1000000) == 0);
+}
+
+// ---------------- Upload journal ----------------
+TEST(resume_resends_chunks_the_server_lost) {
+    std::string path = make_file("resume.bin", 3 * 1024 * 1024 + 17);
+    std::string name = "resume-" + std::to_string(g_env.seq) + ".bin";
+    struct stat st;
+    CHECK(stat(path.c_str(), &st) == 0);
+    // a journal that acked every chunk of an upload the server holds nothing of
+    UploadJournal j;
+    j.file_id = init_upload(name, (long)st.st_size, g_env.user, g_env.pass, 1024 * 1024);
+    CHECK(!j.file_id.empty());
+    char* real = realpath(path.c_str(), nullptr);
+    j.source = real;
+    free(real);
+    j.name = name;
+    j.size = (long)st.st_size;
+    j.mtime_ns = mtime_ns_of(st);
+    j.chunk_size = 1024 * 1024;
+    j.total_chunks = 4;
+    CHECK(journal_create(j));
+    for (int i = 0; i < j.total_chunks; ++i) journal_ack(j, i);
+    close(j.fd);
+
+    std::string id;
+    CHECK(upload_file(path, g_env.user, g_env.pass, 1, true, false, name, &id));
+    CHECK(id == j.file_id);
+    CHECK(fetch(name) == file_bytes(path));
+}
+
+TEST(journal_find_picks_the_newest_journal) {
+    std::string path = make_file("journals.bin", 4096);
+    struct stat st;
+    CHECK(stat(path.c_str(), &st) == 0);
+    std::vector<std::string> ids{"older-journal", "newest-journal", "middle-journal"};
+    long long stamps[] = {1000, 3000, 2000};
+    for (size_t i = 0; i < ids.size(); ++i) {
+        UploadJournal j;
+        j.file_id = ids[i];
+        j.source = path;
+        j.name = "journals.bin";
+        j.size = (long)st.st_size;
+        j.mtime_ns = mtime_ns_of(st);
+        j.chunk_size = 1024 * 1024;
+        j.total_chunks = 1;
+        CHECK(journal_create(j));
+        close(j.fd);
+        struct timespec times[2] = {{stamps[i], 0}, {stamps[i], 0}};
+        utimensat(AT_FDCWD, j.journal_path.c_str(), times, 0);
+    }
+    UploadJournal found;
+    CHECK(journal_find(path, "journals.bin", st, found));
+    CHECK(found.file_id == "newest-journal");
+    if (found.fd >= 0) close(found.fd);
+    for (const std::string &id : ids) unlink((journal_dir() + "/" + id + ".journal").c_str());
+}
+
+// ---------------- Agent ----------------
+TEST(agent_queue_is_private_and_holds_no_credentials) {
+    // a queue from before jobs were held to the saved login
+    g_agent.queue_file = scratch_path("queue.json");
+    CHECK(write_file_atomic(g_agent.queue_file, "{\"next_id\":2,\"jobs\":[{\"id\":1,\"argv\":[\"download\","
+                                                "\"report.pdf\",\"--jobs\",\"4\",\"alice\",\"hunter2\"]}]}"));
+    agent_load();
+    CHECK(g_agent.jobs.size() == 1);
+    if (!g_agent.jobs.empty())
+        CHECK((g_agent.jobs[0]->argv == std::vector<std::string>{"download", "report.pdf", "--jobs", "4"}));
+    agent_save_locked();
+    struct stat st;
+    CHECK(stat(g_agent.queue_file.c_str(), &st) == 0 && (st.st_mode & 0777) == 0600);
+    CHECK(file_bytes(g_agent.queue_file).find("hunter2") == std::string::npos);
+    g_agent.jobs.clear();
+
+    CHECK(job_operands({"-r", "dir", "--name", "x", "-o", "out"}).size() == 1);
+    CHECK(job_operands({"file", "--jobs", "2", "user", "pass"}).size() == 3);
+}
+
+// ---------------- Metadata ----------------
+TEST(failed_log_append_changes_nothing) {
+    // commits against this process's own store, not the server's
+    if (!g_env.native) return;
+    std::lock_guard<std::mutex> lk(g_store.lock);
+    int saved_fd = g_store.log_fd;
+    std::string saved_file = g_store.log_file;
+    g_store.log_file = scratch_path("metadata.log");
+    g_store.log_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    Json info = Json::object();
+    info.set("owner", Json::of(g_env.user));
+    info.set("filename", Json::of("unlogged.bin"));
+    unsigned long long generation = g_store.generation;
+    bool ok = true;
+    meta_commit_locked({{"unlogged", &info}}, &ok);
+    CHECK(!ok && !g_store.meta.count("unlogged") && g_store.generation == generation);
+    close(g_store.log_fd);
+
+    g_store.log_fd = open(g_store.log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    meta_commit_locked({{"logged", &info}}, &ok);
+    CHECK(ok && g_store.meta.count("logged") && g_store.generation == generation + 1);
+    CHECK(file_bytes(g_store.log_file).find("\"logged\"") != std::string::npos);
+    meta_commit_locked({{"logged", nullptr}}, &ok);
+    close(g_store.log_fd);
+    g_store.log_fd = saved_fd;
+    g_store.log_file = saved_file;
+}
+
+TEST(failed_delete_log_append_keeps_the_files) {
+    // deletes from this process's own store, whose log can be made to fail
+    if (!g_env.native) return;
+    std::string saved_complete = g_store.complete, saved_file = g_store.log_file;
+    int saved_fd = g_store.log_fd;
+    g_store.complete = scratch_path("complete");
+    CHECK(mkdir(g_store.complete.c_str(), S_IRWXU) == 0);
+    g_store.log_file = scratch_path("metadata.log");
+    g_store.log_fd = open(g_store.log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    Json info = Json::object();
+    info.set("owner", Json::of(g_env.user));
+    info.set("filename", Json::of("kept.bin"));
+    info.set("final_filename", Json::of("kept.bin"));
+    info.set("assembled", Json::of(true));
+    bool ok = true;
+    {
+        std::lock_guard<std::mutex> lk(g_store.lock);
+        meta_commit_locked({{"kept", &info}}, &ok);
+    }
+    std::string kept = g_store.complete + "/kept.bin";
+    CHECK(ok && write_file_atomic(kept, "still here"));
+
+    HttpRequest req;
+    req.user = g_env.user;
+    req.body = "{\"file_ids\":[\"kept\"]}";
+    close(g_store.log_fd);
+    g_store.log_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    CHECK(api_delete_batch(req).status == 500);
+    CHECK(file_bytes(kept) == "still here" && meta_get("kept", info));
+    req.param = "kept";
+    CHECK(api_delete(req).status == 500);
+    CHECK(file_bytes(kept) == "still here" && meta_get("kept", info));
+    close(g_store.log_fd);
+
+    g_store.log_fd = open(g_store.log_file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    CHECK(api_delete_batch(req).status == 200);
+    CHECK(!is_regular_file(kept) && !meta_get("kept", info));
+    close(g_store.log_fd);
+    g_store.log_fd = saved_fd;
+    g_store.log_file = saved_file;
+    g_store.complete = saved_complete;
+}
+
+// ---------------- Metrics ----------------
+TEST(metrics_json_has_percentiles_for_each_kind) {
+    if (!g_env.native) return;
+    std::vector<RequestMetric> saved;
+    {
+        std::lock_guard<std::mutex> lk(g_metrics.lock);
+        saved.swap(g_metrics.requests);
+    }
+    std::vector<FileEntry> entries;
+    CHECK(get_files_meta(g_env.user, g_env.pass, entries));
+    {
+        std::lock_guard<std::mutex> lk(g_metrics.lock);
+        CHECK(g_metrics.requests.size() == 1);
+        if (!g_metrics.requests.empty()) {
+            const RequestMetric &m = g_metrics.requests[0];
+            CHECK(m.kind == "list" && m.ok && (m.status == 200 || m.status == 304) && m.total > 0);
+        }
+        g_metrics.requests.clear();
+        for (int i = 1; i <= 100; ++i) {
+            RequestMetric m;
+            m.kind = "chunk";
+            m.tag = i - 1;
+            m.ok = i != 100;
+            m.status = 200;
+            m.ttfb = i / 1000.0;
+            m.total = i / 100.0;
+            m.sent = 1000;
+            g_metrics.requests.push_back(m);
+        }
+    }
+
+    std::string path = scratch_path("metrics.json");
+    CHECK(write_metrics_json(path));
+    Json report;
+    CHECK(json_parse(file_bytes(path), report));
+    const Json* kinds = report.get("kinds");
+    const Json* chunk = kinds ? kinds->get("chunk") : nullptr;
+    CHECK(chunk != nullptr);
+    if (chunk) {
+        CHECK(chunk->get("count")->as_int() == 100 && chunk->get("failed")->as_int() == 1);
+        CHECK(chunk->get("bytes_sent")->as_int() == 100000);
+        const Json* total = chunk->get("total");
+        const Json* ttfb = chunk->get("ttfb");
+        CHECK(total && strtod(total->get("p50")->text.c_str(), nullptr) == 0.5);
+        CHECK(total && strtod(total->get("p99")->text.c_str(), nullptr) == 0.99);
+        CHECK(total && strtod(total->get("max")->text.c_str(), nullptr) == 1.0);
+        CHECK(ttfb && strtod(ttfb->get("p50")->text.c_str(), nullptr) == 0.05);
+        long long counted = 0;
+        if (const Json* histogram = chunk->get("histogram"))
+            for (const Json &b : histogram->items) counted += b.get("count")->as_int();
+        CHECK(counted == 100);
+    }
+    const Json* log = report.get("log");
+    CHECK(log && log->items.size() == 100 && report.get("requests")->as_int() == 100);
+
+    std::lock_guard<std::mutex> lk(g_metrics.lock);
+    g_metrics.requests.swap(saved);
+}
+
+// ---------------- Benchmark ----------------
+TEST(failed_bench_cases_are_reported_as_failures) {
+    if (!g_env.native) return;
+    std::vector<std::string> cases;
+    CHECK(bench_case(cases, "\"op\":\"pass\"", 1, [] { return true; }));
+    CHECK(!bench_case(cases, "\"op\":\"fail\"", 1, [] { return false; }));
+    CHECK(cases.size() == 2);
+    CHECK(cases[0].find("\"ok\":true") != std::string::npos);
+    CHECK(cases[1].find("\"ok\":false") != std::string::npos);
+}
+
+// ---------------- Runner ----------------
+static bool run_server_tests(const BenchOptions &opt, const std::vector<std::string> &only) {
+    g_env.native = opt.native;
+    g_env.dir = scratch_path(opt.native ? "native" : "python");
+    if (mkdir(g_env.dir.c_str(), S_IRWXU) != 0) return false;
+    g_env.server_dir = g_env.dir + "/server/uploads";
+    setenv("HOME", g_env.dir.c_str(), 1);
+    int port = free_loopback_port();
+    g_base_url = "http://127.0.0.1:" + std::to_string(port);
+    pid_t pid = bench_start_server(opt, g_env.dir, port);
+    if (pid < 0) return false;
+    CHECK(create_user(g_env.user, g_env.pass));
+
+    for (const TestCase &t : test_cases()) {
+        if (!only.empty() && std::find(only.begin(), only.end(), t.name) == only.end()) continue;
+        int before = g_failures;
+        t.run();
+        std::cout << (g_failures == before ? "PASS " : "FAIL ") << (opt.native ? "native  " : "server.py ") << t.name
+                  << std::endl;
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // bench_start_server runs this binary as the native server
+    if (argc > 1 && std::string(argv[1]) == "serve") return netserve_main(argc, argv);
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    BenchOptions opt;
+    opt.server_py = "server.py";
+    take_option(args, "--server", opt.server_py);
+    bool native_only = take_flag(args, "--native-only");
+
+    char tmpl[] = "/tmp/netserve-test-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        std::cerr << "Cannot create a scratch directory" << std::endl;
+        return 1;
+    }
+    std::string root = tmpl;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    session_begin();
+    bool ok = true;
+    for (bool native : {true, false}) {
+        if (!native && native_only) continue;
+        opt.native = native;
+        g_env.dir = root;
+        if (!run_server_tests(opt, args)) {
+            std::cerr << "Cannot start " << (native ? "netserve serve" : opt.server_py) << std::endl;
+            ok = false;
+        }
+    }
+    client_cleanup();
+    nftw(root.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (g_failures) std::cerr << g_failures << " check(s) failed" << std::endl;
+    return ok && g_failures == 0 ? 0 : 1;
+}